@@ -15,13 +15,30 @@ LOCAL_SRC_FILES := \
 	CameraHardware.cpp \
 	CameraSpec.cpp \
 	Converter.cpp \
+	ConverterSimd.cpp \
+	DeviceWatcher.cpp \
+	Exif.cpp \
+	FormatCache.cpp \
+	FormatTraits.cpp \
+	FrameFile.cpp \
+	FrameReplay.cpp \
+	FrameRing.cpp \
+	GlPreview.cpp \
+	HeapPool.cpp \
+	LatencyHistogram.cpp \
 	Metadata.cpp \
+	MjpegDecoder.cpp \
+	PictureEncoder.cpp \
+	StreamCapture.cpp \
 	SurfaceDesc.cpp \
 	SurfaceSize.cpp \
 	Utils.cpp \
 	V4L2Camera.cpp \
+	WorkerPool.cpp \
 
 LOCAL_SHARED_LIBRARIES := \
+	libEGL \
+	libGLESv2 \
 	libcamera_client \
 	libcamera_metadata \
 	libcutils \
@@ -45,4 +62,48 @@ LOCAL_MODULE_RELATIVE_PATH := hw
 
 include $(BUILD_SHARED_LIBRARY)
 
+# camera_converter_bench times the converters, the JPEG encoder and the MJPEG
+# decoder on every SIMD backend and thread count, and checks them against the
+# C converters, on synthetic frames or on those of a capture file. See
+# bench/ConverterBench.cpp. It is built for the device and, on linux, for
+# the host, where the x86 backends can be tried out
+CONVERTER_BENCH_SRC_FILES := \
+	bench/ConverterBench.cpp \
+	Converter.cpp \
+	ConverterSimd.cpp \
+	FormatTraits.cpp \
+	FrameFile.cpp \
+	Utils.cpp \
+	WorkerPool.cpp \
+
+CONVERTER_BENCH_SHARED_LIBRARIES := \
+	libcutils \
+	libjpeg \
+	liblog \
+	libutils \
+
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -fno-short-enums -DHAVE_CONFIG_H
+LOCAL_C_INCLUDES := $(LOCAL_PATH) external/jpeg
+LOCAL_SRC_FILES := $(CONVERTER_BENCH_SRC_FILES)
+LOCAL_SHARED_LIBRARIES := $(CONVERTER_BENCH_SHARED_LIBRARIES)
+LOCAL_MODULE := camera_converter_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+
+LOCAL_CFLAGS := -fno-short-enums -DHAVE_CONFIG_H
+LOCAL_C_INCLUDES := $(LOCAL_PATH) external/jpeg
+LOCAL_SRC_FILES := $(CONVERTER_BENCH_SRC_FILES)
+LOCAL_SHARED_LIBRARIES := $(CONVERTER_BENCH_SHARED_LIBRARIES)
+LOCAL_MODULE := camera_converter_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+endif
+
 endif
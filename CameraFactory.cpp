@@ -44,13 +44,18 @@ CameraFactory::CameraFactory()
         camera device is opened.  It doesn't cope with the suite of cameras changing
         after it starts.  We must pretend to already have the CameraHardware object.
 
-        However if the configuration file cannot be read then we pretend to have no cameras.
+        There is a camera for each camera the configuration file describes,
+        and one if it describes none. However if the configuration file cannot
+        be read then we pretend to have no cameras.
     */
-    CameraSpec spec;
+    std::vector<CameraSpec> specs;
 
-    if (spec.loadFromFile(CONFIG_FILE) == NO_ERROR) {
-        mCamera.push_back(mkRef<CameraHardware>(spec));
+    if (CameraSpec::loadCameras(CONFIG_FILE, specs) == NO_ERROR) {
+        for (auto& spec : specs) {
+            mCamera.push_back(mkRef<CameraHardware>(spec));
+        }
     }
+    ALOGD("CameraFactory: %zu cameras", mCamera.size());
 }
 
 
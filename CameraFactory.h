@@ -26,7 +26,9 @@
 namespace android {
 //======================================================================
 
-/*  This simplified HAL only supports one camera using the uvcvideo driver.
+/*  This simplified HAL supports the cameras using the uvcvideo driver that
+    the configuration file lists, each with its own camera id, V4L2 device
+    and capture threads. They share the converter and decoder threads.
 
     Instance of this class is also used as the entry point for the camera HAL API,
     including:
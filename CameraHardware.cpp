@@ -35,7 +35,9 @@
 #include <ui/GraphicBufferMapper.h>
 #include "CameraHardware.h"
 #include "Converter.h"
+#include "FormatTraits.h"
 #include "Metadata.h"
+#include "v4l2_formats.h"
 
 using namespace std;
 
@@ -48,7 +50,10 @@ using namespace std;
 
     * the hotplug thread that waits for the camera;
 
-    * the thread that is driving the camera.
+    * the thread that is driving the camera;
+
+    * the display, callback and record threads that consume the frames
+      the camera thread puts in the FrameRing.
 
     We don't want the camera thread to block forever while waiting
     for a frame. The camera might have gone bad.
@@ -58,19 +63,26 @@ using namespace std;
 
     The thread system is based around calling a function e.g.
     previewThread() periodically with a check for an exit flag
-    between calls.  So GrabRawFrame() must be polled with a time-out.
+    between calls.  So AcquireFrame() must be polled with a time-out.
     The camera thread don't hold a mutex on while running.  If
     Android sends a command that changes the behaviour then the
     camera thread must be stopped first e.g. see stopPreview().
     This will release all buffers so that they can be reallocated.
 
+    The camera thread never waits for the consumers. A consumer that is
+    too slow misses frames, which are counted in its FrameRing::Reader,
+    without holding up the camera or the other consumers. The consumers
+    are stopped after the camera thread, in stopPreview(). A picture
+    thread may take a frame from the ring too, while it holds the mutex.
+
     We don't have much need for a mutex at all as long as there is
     only one Android thread sending commands. We'll keep one just
     in case.
 
-    The hotplug thread terminates as soon as it sees the camera.
-    The mutex allows it to communicate the ready status to the
-    Android thread.
+    The hotplug thread sleeps on an inotify watch of /dev. It opens
+    the camera when one appears, and stops the preview and closes
+    the camera when that one is unplugged. The mutex allows it to
+    communicate the ready status to the Android thread.
 
     The hotplug thread doesn't start doing stuff until the camera.enable
     property is set.  This allows an AppOS service to trigger the
@@ -87,115 +99,105 @@ using namespace std;
 // If we get this number of successive frame timeouts we will give up.
 #define LOST_FRAME_LIMIT    100
 
-#ifndef PIXEL_FORMAT_RGB_888
-#define PIXEL_FORMAT_RGB_888 3 /* */
-#endif
-
-#ifndef PIXEL_FORMAT_RGBA_8888
-#define PIXEL_FORMAT_RGBA_8888 1 /* [ov] */
-#endif
-
-#ifndef PIXEL_FORMAT_RGBX_8888
-#define PIXEL_FORMAT_RGBX_8888 2
-#endif
-
-#ifndef PIXEL_FORMAT_BGRA_8888
-#define PIXEL_FORMAT_BGRA_8888 5 /* [ov] */
-#endif
-
-#ifndef PIXEL_FORMAT_RGB_565
-#define PIXEL_FORMAT_RGB_565  4 /* [ov] */
-#endif
-
-// We need this format to allow special preview modes
-#ifndef PIXEL_FORMAT_YCrCb_422_I
-#define PIXEL_FORMAT_YCrCb_422_I 100
-#endif
-
-#ifndef PIXEL_FORMAT_YCbCr_422_SP
-#define PIXEL_FORMAT_YCbCr_422_SP 0x10    /* NV16  [ov] */
-#endif
 
-#ifndef PIXEL_FORMAT_YCbCr_420_SP
-#define PIXEL_FORMAT_YCbCr_420_SP 0x21    /* NV12 */
-#endif
+namespace android {
+//======================================================================
 
-#ifndef PIXEL_FORMAT_UNKNOWN
-#define PIXEL_FORMAT_UNKNOWN 0
-#endif
+static const size_t     HotPlugCheckInterval    = 1;    // in seconds
+static const size_t     HotPlugComplainInterval = 30;   // in seconds
 
-    /*
-     * Android YUV format:
-     *
-     * This format is exposed outside of the HAL to software
-     * decoders and applications.
-     * EGLImageKHR must support it in conjunction with the
-     * OES_EGL_image_external extension.
-     *
-     * YV12 is 4:2:0 YCrCb planar format comprised of a WxH Y plane followed
-     * by (W/2) x (H/2) Cr and Cb planes.
-     *
-     * This format assumes
-     * - an even width
-     * - an even height
-     * - a horizontal stride multiple of 16 pixels
-     * - a vertical stride equal to the height
-     *
-     *   y_size = stride * height
-     *   c_size = ALIGN(stride/2, 16) * height/2
-     *   size = y_size + c_size * 2
-     *   cr_offset = y_size
-     *   cb_offset = y_size + c_size
-     *
-     */
-#ifndef PIXEL_FORMAT_YV12
-#define PIXEL_FORMAT_YV12  0x32315659 /* YCrCb 4:2:0 Planar */
-#endif
+// The values of video-passthrough, besides "off"
+static const struct {
+    const char* name;
+    uint32_t    fourcc;
+} kStreamFormats[] = {
+    { "h264",   V4L2_PIX_FMT_H264 },
+    { "hevc",   V4L2_PIX_FMT_HEVC },
+};
 
-#ifndef PIXEL_FORMAT_YV16
-#define PIXEL_FORMAT_YV16  0x36315659 /* YCrCb 4:2:2 Planar */
-#endif
+// The largest analytics frame, it is meant to be small
+static const int        kMaxAnalyticsSize       = 640;
 
 
-namespace android {
-//======================================================================
+// The size in analytics-size, or 0 x 0 if it is "off" or not set.
+// Returns false if it isn't a size we can make.
+static bool parseAnalyticsSize(const char* value, int& width, int& height)
+{
+    width = height = 0;
+    if (value == NULL || !strcmp(value, "off")) {
+        return true;
+    }
 
-static const size_t     HotPlugCheckInterval    = 1;    // in seconds
-static const size_t     HotPlugComplainInterval = 30;   // in seconds
+    if (sscanf(value, "%dx%d", &width, &height) != 2 ||
+        width <= 0 || width > kMaxAnalyticsSize || height <= 0 || height > kMaxAnalyticsSize) {
+        width = height = 0;
+        return false;
+    }
+    return true;
+}
 
 
 CameraHardware::CameraHardware(const CameraSpec& spec)
   :     mReady(false),
         mWin(0),
-        mPreviewWinFmt(PIXEL_FORMAT_UNKNOWN),
+        mPreviewWinFmt(NULL),
         mPreviewWinWidth(0),
         mPreviewWinHeight(0),
+        mZeroCopy(false),
+        mGpuPreview(spec.gpuPreview != CameraSpec::GPU_PREVIEW_OFF),
+        mGpuDirect(false),
 
         mParameters(),
+        mHaveParameters(false),
         mSpec(spec),
+        mWarmWidth(0),
+        mWarmHeight(0),
+        mWarmFps(0),
 
         mRawPreviewHeap(0),
         mRawPreviewFrameSize(0),
 
         mRawPreviewWidth(0),
         mRawPreviewHeight(0),
+        mCaptureWidth(0),
+        mCaptureHeight(0),
 
         mPreviewHeap(0),
         mPreviewFrameSize(0),
-        mPreviewFmt(PIXEL_FORMAT_UNKNOWN),
+        mPreviewFmt(NULL),
+        mAnalyticsHeap(0),
+        mAnalyticsWidth(0),
+        mAnalyticsHeight(0),
+        mAnalyticsFrameSize(0),
+        mAnalyticsInterval(1),
 
         mRawPictureHeap(0),
         mRawPictureBufferSize(0),
 
         mRecordingHeap(0),
         mRecordingFrameSize(0),
-        mRecFmt(PIXEL_FORMAT_UNKNOWN),
+        mRecFmt(NULL),
+        mRecordingMetadata(false),
+        mRecordingMetaHeap(0),
+        mRecFree(0),
+        mRecBase(NULL),
+        mRecSlotSize(0),
+        mRecDropped(0),
+        mStreamHeap(0),
+        mStreamSlotSize(0),
+        mStreamFree(0),
+        mPassthrough(false),
 
-        mJpegPictureHeap(0),
         mJpegPictureBufferSize(0),
+        mJpegHeapIndex(0),
+        mPictureEncoder(kBurstThreads, kBurstBuffers),
+        mBurstCancelled(false),
 
         mRecordingEnabled(0),
 
+        mPictureTime(0),
+        mStillWanted(false),
+
         mNotifyCb(0),
         mDataCb(0),
         mDataCbTimestamp(0),
@@ -204,9 +206,14 @@ CameraHardware::CameraHardware(const CameraSpec& spec)
 
         mMsgEnabled(0),
         mCurrentPreviewFrame(0),
-        mCurrentRecordingFrame(0),
+        mAnalyticsCount(0),
         mTimeoutCount(0),
         mTimeoutLimit(LOST_FRAME_LIMIT),
+        mLastFrameTime(0),
+        mStatsSince(0),
+        mFramesCaptured(0),
+        mFramesEmpty(0),
+        mTimeouts(0),
         mCameraPowerFile(0),
         mCameraMetadata(0)
 {
@@ -222,15 +229,14 @@ CameraHardware::CameraHardware(const CameraSpec& spec)
     ops = &mDeviceOps;
     priv = this;
 
-    // Load some initial default parmeters
-    // We can skip the lock in the constructor.
-    FromCamera fc;
-    fc.set(*this);
+    memset(mZeroCopyBufs, 0, sizeof(mZeroCopyBufs));
+    memset(mScalers, 0, sizeof(mScalers));
+    memset(mJpegPictures, 0, sizeof(mJpegPictures));
 
+    // The parameters and the static metadata are only made once they are
+    // asked for, so that loading the module does nothing but start the
+    // hotplug thread
     mHotPlugThread = new HotPlugThread(this);
-
-    // REVISIT no longer used
-    initStaticCameraMetadata();
 }
 
 
@@ -243,34 +249,50 @@ CameraHardware::~CameraHardware()
     }
 
     if (mHotPlugThread != 0) {
-        mHotPlugThread->requestExitAndWait();
+        mHotPlugThread->stop();
         mHotPlugThread.clear();
     }
 
+    {
+        Mutex::Autolock lock(mLock);
+        coolLocked();
+    }
+
     // Release all memory heaps
     if (mRawPreviewHeap) {
-        mRawPreviewHeap->release(mRawPreviewHeap);
+        mHeapPool.put(mRawPreviewHeap);
         mRawPreviewHeap = NULL;
     }
 
     if (mPreviewHeap) {
-        mPreviewHeap->release(mPreviewHeap);
+        mHeapPool.put(mPreviewHeap);
         mPreviewHeap = NULL;
     }
 
+    if (mAnalyticsHeap) {
+        mHeapPool.put(mAnalyticsHeap);
+        mAnalyticsHeap = NULL;
+    }
+
     if (mRawPictureHeap) {
-        mRawPictureHeap->release(mRawPictureHeap);
+        mHeapPool.put(mRawPictureHeap);
         mRawPictureHeap = NULL;
     }
 
-    if (mRecordingHeap) {
-        mRecordingHeap->release(mRecordingHeap);
-        mRecordingHeap = NULL;
+    stopPassthroughLocked();
+    freeRecordingBuffersLocked();
+
+    for (int i = 0; i < kJpegHeapCount; i++) {
+        if (mJpegPictures[i]) {
+            mJpegPictures[i]->release(mJpegPictures[i]);
+            mJpegPictures[i] = NULL;
+        }
     }
 
-    if (mJpegPictureHeap) {
-        mJpegPictureHeap->release(mJpegPictureHeap);
-        mJpegPictureHeap = NULL;
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        yuyv_scaler_destroy(mScalers[i]);
+        mScalers[i] = NULL;
     }
 
     if (mCameraMetadata) {
@@ -281,31 +303,28 @@ CameraHardware::~CameraHardware()
 
 
 
-bool CameraHardware::NegotiatePreviewFormat(struct preview_stream_ops* win)
+bool CameraHardware::NegotiatePreviewFormat(struct preview_stream_ops* win, int fmt)
 {
     ALOGD("NegotiatePreviewFormat");
 
-    // Get the preview size... If we are recording, use the recording video size instead of the preview size
+    // The frames are scaled to the preview size, whatever is captured
     int pw, ph;
-    if (mRecordingEnabled && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-        mParameters.getVideoSize(&pw, &ph);
-    } else {
-        mParameters.getPreviewSize(&pw, &ph);
-    }
+    mParameters.getPreviewSize(&pw, &ph);
 
     ALOGD("Trying to set preview window geometry to %dx%d",pw,ph);
-    mPreviewWinFmt = PIXEL_FORMAT_UNKNOWN;
+    mGl.forgetBuffers();
+    mPreviewWinFmt = NULL;
     mPreviewWinWidth = 0;
     mPreviewWinHeight = 0;
 
-    // Set the buffer geometry of the surface and YV12 as the preview format
-    if (win->set_buffers_geometry(win,pw,ph,PIXEL_FORMAT_RGBA_8888) != NO_ERROR) {
+    // Set the buffer geometry of the surface and the preview format
+    if (win->set_buffers_geometry(win,pw,ph,fmt) != NO_ERROR) {
         ALOGE("Unable to set buffer geometry");
         return false;
     }
 
     // Store the preview window format
-    mPreviewWinFmt = PIXEL_FORMAT_RGBA_8888;
+    mPreviewWinFmt = findHalFormat(fmt);
     mPreviewWinWidth = pw;
     mPreviewWinHeight = ph;
 
@@ -317,7 +336,8 @@ bool CameraHardware::NegotiatePreviewFormat(struct preview_stream_ops* win)
 CameraHardware::HotPlugThread::HotPlugThread(CameraHardware* hw)
   : mHardware   (hw),
     mCheckCount (0),
-    mStarted    (false)
+    mStarted    (false),
+    mOpened     (false)
 {
 }
 
@@ -332,28 +352,48 @@ void CameraHardware::HotPlugThread::onFirstRef()
 
 bool CameraHardware::HotPlugThread::threadLoop()
 {
-    /*  The thread will be terminated after the camera has been opened.
+    /*  The thread runs until the camera is destroyed. While there is no
+        camera it tries to open one each time a video device changes, and
+        once there is one it looks for it having gone.
     */
     if (!mStarted) {
         mStarted = property_get_bool("camera.enable", false);
 
         if (!mStarted) {
             // Try again later
-            ::usleep(HotPlugCheckInterval * 1000 * 1000);
+            mWatcher.wait(s2ns(HotPlugCheckInterval));
             return true;
         }
     }
 
-    auto ok = mHardware->tryOpenCamera();
+    if (!mOpened) {
+        mOpened = mHardware->tryOpenCamera();
 
-    if (!ok) {
-        if (mCheckCount++ % HotPlugComplainInterval == 0) {
+        // We only come here on a change when watching, so each one is news
+        size_t complain = mWatcher.isWatching() ? 1 : HotPlugComplainInterval;
+        if (!mOpened && mCheckCount++ % complain == 0) {
             ALOGI("did not open any camera");
         }
-        ::usleep(HotPlugCheckInterval * 1000 * 1000);
+    } else if (mHardware->checkCameraUnplugged()) {
+        // Another camera may be there already
+        mOpened = false;
+        return true;
     }
 
-    return !ok;
+    /*  Sleep until a video device comes or goes, or poll if they can't be
+        watched. The time-out when watching is only a safety net.
+    */
+    mWatcher.wait(s2ns(mWatcher.isWatching() ? HotPlugComplainInterval : HotPlugCheckInterval));
+    return true;
+}
+
+
+
+void CameraHardware::HotPlugThread::stop()
+{
+    requestExit();
+    mWatcher.wake();
+    requestExitAndWait();
 }
 
 
@@ -388,6 +428,11 @@ status_t CameraHardware::getCameraInfo(struct camera_info* info)
     info->facing = mSpec.facing;
     info->orientation = mSpec.orientation;
     info->device_version = CAMERA_DEVICE_API_VERSION_1_0;
+
+    Mutex::Autolock lock(mLock);
+    if (mCameraMetadata == NULL) {
+        initStaticCameraMetadata();
+    }
     info->static_camera_characteristics = mCameraMetadata;      // REVISIT not used?
 
     return NO_ERROR;
@@ -399,11 +444,11 @@ status_t CameraHardware::setPreviewWindow(struct preview_stream_ops* window)
 {
     Mutex::Autolock lock(mLock);
 
-    if (window != NULL) {
-        /* The CPU will write each frame to the preview window buffer.
+    if (window != NULL && !(mZeroCopy && window == mWin)) {
+        /* The CPU or the GPU will write each frame to the preview window buffer.
          * Note that we delay setting preview window buffer geometry until
          * frames start to come in. */
-        status_t res = window->set_usage(window, GRALLOC_USAGE_SW_WRITE_OFTEN);
+        status_t res = window->set_usage(window, previewWindowUsage());
         if (res != NO_ERROR) {
             res = -res; // set_usage returns a negative errno.
             ALOGE("setPreviewWindow: Error setting preview window usage %d -> %s", res, strerror(res));
@@ -411,12 +456,24 @@ status_t CameraHardware::setPreviewWindow(struct preview_stream_ops* window)
         }
     }
 
+    /*  With zero copy the camera may be capturing into the old window
+        buffers, and the new window can only be used from the start. So
+        start the preview again.
+    */
+    if (mPreviewThread != 0 && window != mWin && mSpec.zeroCopy != CameraSpec::ZEROCOPY_OFF) {
+        ALOGD("setPreviewWindow - Restarting the zero copy preview");
+        stopPreviewLocked();
+        mWin = window;
+        return startPreviewLocked();
+    }
+
     mWin = window;
 
     // setup the preview window geometry to be able to use the full preview window
-    if (mPreviewThread != 0 && mWin != 0) {
+    if (mPreviewThread != 0 && mWin != 0 && !mZeroCopy) {
         ALOGD("setPreviewWindow - Negotiating preview format");
-        NegotiatePreviewFormat(mWin);
+        NegotiatePreviewFormat(mWin, PIXEL_FORMAT_RGBA_8888);
+        mGpuDirect = mGpuPreview && mGpuFrames.frameSize() != 0 && camera.hasExportedBuffers();
     }
 
     return NO_ERROR;
@@ -577,6 +634,35 @@ bool CameraHardware::PreviewThread::threadLoop()
 
 
 
+CameraHardware::ConsumerThread::ConsumerThread(CameraHardware* hw, int stage) :
+        Thread(false),
+        mHardware(hw),
+        mStage(stage)
+{
+}
+
+
+
+void CameraHardware::ConsumerThread::onFirstRef()
+{
+    static const char* names[STAGE_COUNT] = {
+        "CameraDisplayThread",
+        "CameraCallbackThread",
+        "CameraRecordThread",
+    };
+
+    run(names[mStage], (mStage == STAGE_DISPLAY) ? PRIORITY_URGENT_DISPLAY : PRIORITY_DISPLAY);
+}
+
+
+
+bool CameraHardware::ConsumerThread::threadLoop()
+{
+    return mHardware->consumerThread(mStage);
+}
+
+
+
 status_t CameraHardware::startPreviewLocked()
 {
     //ALOGD("startPreviewLocked");
@@ -596,26 +682,31 @@ status_t CameraHardware::startPreviewLocked()
     }
 
     int width, height;
-
-    // If we are recording, use the recording video size instead of the preview size
-    if (mRecordingEnabled && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-        mParameters.getVideoSize(&width, &height);
-    } else {
-        mParameters.getPreviewSize(&width, &height);
-    }
+    getCaptureSizeLocked(width, height);
+    mCaptureWidth = width;
+    mCaptureHeight = height;
 
     int fps = mParameters.getPreviewFrameRate();
+    status_t ret;
 
-    status_t ret = camera.Open(mSpec);
-    if (ret != NO_ERROR) {
-        ALOGE("startPreviewLocked: Failed to initialize Camera");
-        return ret;
-    }
+    // A camera pre-warmed for this capture only has to start streaming
+    if (mWarmWidth == width && mWarmHeight == height && mWarmFps == fps) {
+        ALOGD("startPreviewLocked: the camera is already set up");
+        mWarmWidth = mWarmHeight = mWarmFps = 0;
+    } else {
+        coolLocked();
 
-    ret = camera.Init(width, height, fps);
-    if (ret != NO_ERROR) {
-        ALOGE("startPreviewLocked: Failed to setup streaming");
-        return ret;
+        ret = camera.Open(mSpec);
+        if (ret != NO_ERROR) {
+            ALOGE("startPreviewLocked: Failed to initialize Camera");
+            return ret;
+        }
+
+        ret = camera.Init(width, height, fps, gpuHeldFrames());
+        if (ret != NO_ERROR) {
+            ALOGE("startPreviewLocked: Failed to setup streaming");
+            return ret;
+        }
     }
 
     /* Retrieve the real size being used */
@@ -623,33 +714,62 @@ status_t CameraHardware::startPreviewLocked()
 
     ALOGD("startPreviewLocked: effective size: %dx%d", width, height);
 
-    // If we are recording, use the recording video size instead of the preview size
-    if (mRecordingEnabled && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-        /* Store it as the video size to use */
-        mParameters.setVideoSize(width, height);
-    } else {
-        /* Store it as the preview size to use */
-        mParameters.setPreviewSize(width, height);
-    }
-
-    /* And reinit the memory heaps to reflect the real used size if needed */
+    /* The consumers scale from it to the sizes they were asked for, so
+       only the raw preview heap has to follow it */
+    mRawPreviewWidth = width;
+    mRawPreviewHeight = height;
     initHeapLocked();
 
+    /* Capture straight into the preview window buffers if we can */
+    ret = startZeroCopyLocked(width, height, fps);
+    if (ret != NO_ERROR) {
+        ALOGE("startPreviewLocked: Failed to setup streaming");
+        return ret;
+    }
+
     ALOGD("startPreviewLocked: start streaming");
     ret = camera.StartStreaming();
     if (ret != NO_ERROR) {
         ALOGE("startPreviewLocked: Failed to start streaming");
+        releaseZeroCopyBuffers();
         return ret;
     }
 
     // setup the preview window geometry in order to use it to zoom the image
-    if (mWin != 0) {
+    if (mWin != 0 && !mZeroCopy) {
         ALOGD("CameraHardware::setPreviewWindow - Negotiating preview format");
-        NegotiatePreviewFormat(mWin);
+        NegotiatePreviewFormat(mWin, PIXEL_FORMAT_RGBA_8888);
     }
 
+    // The GPU reads the captured frames where they are if it can
+    mGpuDirect = mGpuPreview && mWin != 0 && !mZeroCopy && camera.hasExportedBuffers();
+
     // Starting from scratch
     mTimeoutCount = 0;
+    mAnalyticsCount = 0;
+    resetStats();
+
+    // One frame for each consumer and a picture to hold, the newest one,
+    // one to write and the ZSL history
+    if (!mFrames.init(STAGE_COUNT + 3 + mSpec.zslFrames, mRawPreviewFrameSize + mAnalyticsFrameSize)) {
+        ALOGE("startPreviewLocked: Failed to allocate the frame ring");
+        camera.StopStreaming();
+        releaseZeroCopyBuffers();
+        return NO_MEMORY;
+    }
+
+    // The frame the display draws, the newest one and one to write
+    mGpuReader = FrameRing::Reader();
+    if (mGpuPreview && !mGpuFrames.init(kGpuFrames, sizeof(GpuFrame))) {
+        ALOGW("startPreviewLocked: no ring for the GPU, it uploads the frames");
+        mGpuDirect = false;
+    }
+
+    ALOGD("startPreviewLocked: starting the consumer threads");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        mReaders[i] = FrameRing::Reader();
+        mConsumers[i] = new ConsumerThread(this, i);
+    }
 
     ALOGD("startPreviewLocked: starting the preview thread");
     mPreviewThread = new PreviewThread(this);
@@ -675,13 +795,184 @@ void CameraHardware::stopPreviewLocked()
     //ALOGD("stopPreviewLocked");
 
     if (mPreviewThread != 0) {
+        // Don't wait for the frame it may be waiting for
+        mPreviewThread->requestExit();
+        camera.Interrupt();
         mPreviewThread->requestExitAndWait();
         mPreviewThread.clear();
 
+        // Now nothing more is captured, stop the consumers
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            mConsumers[i]->requestExit();
+        }
+        mFrames.wakeAll();
+        mGpuFrames.wakeAll();
+
+        static const char* names[STAGE_COUNT] = { "display", "callback", "record" };
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            mConsumers[i]->requestExitAndWait();
+            mConsumers[i].clear();
+
+            ALOGD("stopPreviewLocked: %s took %llu frames, dropped %llu", names[i],
+                (unsigned long long)mReaders[i].frames, (unsigned long long)mReaders[i].dropped);
+        }
+        ALOGD("stopPreviewLocked: capture dropped %llu frames", (unsigned long long)mFrames.dropped());
+        ALOGD_IF(mGpuReader.frames != 0, "stopPreviewLocked: the GPU drew %llu captured frames, dropped %llu",
+                 (unsigned long long)mGpuReader.frames, (unsigned long long)mGpuReader.dropped);
+
+        // This takes back the frames mGpuFrames still holds
         camera.StopStreaming();
+
+        // Stopping gave us back all the window buffers
+        releaseZeroCopyBuffers();
+
+        // Uninit() closes the dma-bufs the GPU may have imported
+        mGl.forgetFrames();
+        mGpuDirect = false;
+
         camera.Uninit();
         camera.Close();
+
+        mFrames.clear();
+        mGpuFrames.clear();
+    }
+}
+
+
+
+status_t CameraHardware::startZeroCopyLocked(int width, int height, int fps)
+{
+    mZeroCopy = false;
+
+    if (mSpec.zeroCopy == CameraSpec::ZEROCOPY_OFF || mWin == 0) {
+        return NO_ERROR;
+    }
+
+    /*  The window buffers will be YUYV at the size of the preview, which
+        is the capture size by now. The camera must write exactly that.
+    */
+    if (!camera.isPlainYUYV()) {
+        ALOGD("startZeroCopyLocked: the camera does not capture plain YUYV, not using zero copy");
+        return NO_ERROR;
+    }
+
+    if (!NegotiatePreviewFormat(mWin, PIXEL_FORMAT_YCrCb_422_I) ||
+        mPreviewWinWidth != width || mPreviewWinHeight != height) {
+        ALOGD("startZeroCopyLocked: the preview window does not match the capture, not using zero copy");
+        return NO_ERROR;
+    }
+
+    // We keep a buffer dequeued for each camera buffer all the time
+    int undequeued = 0;
+    mWin->get_min_undequeued_buffer_count(mWin, &undequeued);
+
+    if (mWin->set_buffer_count(mWin, camera.getBufferCount() + undequeued) != NO_ERROR ||
+        mWin->set_usage(mWin, GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN) != NO_ERROR) {
+        ALOGD("startZeroCopyLocked: cannot setup the preview window buffers, not using zero copy");
+        mWin->set_usage(mWin, previewWindowUsage());
+        return NO_ERROR;
+    }
+
+    int memory = (mSpec.zeroCopy == CameraSpec::ZEROCOPY_DMABUF) ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_USERPTR;
+
+    mZeroCopy = (camera.UseUserBuffers(memory) == NO_ERROR);
+
+    for (int i = 0; mZeroCopy && i < camera.getBufferCount(); i++) {
+        mZeroCopy = queueZeroCopyBuffer(i);
+    }
+
+    if (mZeroCopy) {
+        ALOGD("startZeroCopyLocked: capturing into the preview window buffers");
+        return NO_ERROR;
+    }
+
+    // Go back to the mmapped camera buffers
+    ALOGW("startZeroCopyLocked: zero copy failed, copying the frames instead");
+    releaseZeroCopyBuffers();
+    mWin->set_usage(mWin, previewWindowUsage());
+
+    // The GPU may draw the window after all
+    camera.Uninit();
+    return camera.Init(width, height, fps, mGpuPreview ? kGpuFrames : 0);
+}
+
+
+
+bool CameraHardware::queueZeroCopyBuffer(int index)
+{
+    int stride = 0;
+    buffer_handle_t* buf = dequeuePreviewBuffer(stride);
+    if (buf == NULL) {
+        return false;
+    }
+
+    // The camera writes lines with no padding
+    if (stride != mPreviewWinWidth) {
+        ALOGE("%s: the preview window stride %d is not the width %d",
+             __FUNCTION__, stride, mPreviewWinWidth);
+        mWin->cancel_buffer(mWin, buf);
+        return false;
+    }
+
+    // The consumers read the frame, so we need the CPU address even for dma-bufs
+    void* vaddr = NULL;
+
+    const Rect bounds(mPreviewWinWidth, mPreviewWinHeight);
+    GraphicBufferMapper& grbuffer_mapper(GraphicBufferMapper::get());
+    status_t res = grbuffer_mapper.lock(*buf, GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN, bounds, &vaddr);
+    if (res != NO_ERROR || vaddr == NULL) {
+        ALOGE("%s: grbuffer_mapper.lock failure: %d -> %s",
+             __FUNCTION__, res, strerror(res));
+        mWin->cancel_buffer(mWin, buf);
+        return false;
+    }
+
+    int fd = ((*buf)->numFds > 0) ? (*buf)->data[0] : -1;
+    size_t length = (size_t)mPreviewWinWidth * mPreviewWinHeight * 2;
+
+    if (camera.QueueUserBuffer(index, vaddr, fd, length) != NO_ERROR) {
+        grbuffer_mapper.unlock(*buf);
+        mWin->cancel_buffer(mWin, buf);
+        return false;
+    }
+
+    mZeroCopyBufs[index] = buf;
+    return true;
+}
+
+
+
+void CameraHardware::displayZeroCopyFrame()
+{
+    // The frame is already in the window buffer. Show it
+    int index = camera.getFrameIndex();
+    buffer_handle_t* buf = mZeroCopyBufs[index];
+    mZeroCopyBufs[index] = NULL;
+
+    if (buf != NULL) {
+        GraphicBufferMapper::get().unlock(*buf);
+        ScopedLatency timer(mWinEnqueueTime);
+        mWin->enqueue_buffer(mWin, buf);
+    }
+
+    // And give the camera another one in its place
+    queueZeroCopyBuffer(index);
+}
+
+
+
+void CameraHardware::releaseZeroCopyBuffers()
+{
+    // Only valid when the camera is not using the buffers
+    for (int i = 0; i < MAX_BUFFERS; i++) {
+        if (mZeroCopyBufs[i] != NULL) {
+            GraphicBufferMapper::get().unlock(*mZeroCopyBufs[i]);
+            mWin->cancel_buffer(mWin, mZeroCopyBufs[i]);
+            mZeroCopyBufs[i] = NULL;
+        }
     }
+
+    mZeroCopy = false;
 }
 
 
@@ -714,11 +1005,25 @@ status_t CameraHardware::storeMetaDataInBuffers(int value)
 {
     ALOGD("storeMetaDataInBuffers: %d", value);
 
-    // Do not accept to store metadata in buffers - We will always store
-    //  YUV data on video buffers. Metadata, in the case of Nvidia Tegra2
-    //  is a descriptor of an OpenMax endpoint that was filled with the
-    //  data.
-    return (value) ? INVALID_OPERATION : NO_ERROR;
+    Mutex::Autolock lock(mLock);
+
+    /*  In metadata mode each frame is written once into a gralloc buffer,
+        and the encoder is given a kMetadataBufferTypeGrallocSource buffer
+        with its handle, so it reads the frame where we wrote it.
+    */
+    if (mRecordingEnabled) {
+        return INVALID_OPERATION;
+    }
+
+    if ((value != 0) != mRecordingMetadata) {
+        mRecordingMetadata = value != 0;
+
+        // Remake the recording buffers for the new mode
+        mRecordingFrameSize = 0;
+        initHeapLocked();
+    }
+
+    return NO_ERROR;
 }
 
 
@@ -732,12 +1037,26 @@ status_t CameraHardware::startRecording()
     if (!mRecordingEnabled) {
         mRecordingEnabled = true;
 
+        {
+            // The encoder starts with all the buffers
+            Mutex::Autolock recLock(mRecLock);
+            mRecFree = (1u << kBufferCount) - 1;
+            mRecDropped = 0;
+        }
+
+        // The camera's own stream, if the app asked for it. Else, or if
+        //  it can't be had, the preview frames are converted as usual.
+        const char* passthrough = mParameters.get("video-passthrough");
+        if (passthrough != NULL && strcmp(passthrough, "off") && !startPassthroughLocked()) {
+            ALOGW("startRecording: no %s passthrough, recording the preview frames", passthrough);
+        }
+
         // If something changed related to the starting or stopping of
         //  the recording process...
         if (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
 
-            // Recreate the heaps if toggling recording changes the raw preview size
-            //  and also restart the preview so we use the new size if needed
+            // This only restarts the preview if the capture is too small for
+            //  the video, which the recording hint avoids
             initHeapLocked();
         }
     }
@@ -756,12 +1075,18 @@ void CameraHardware::stopRecording()
     if (mRecordingEnabled) {
         mRecordingEnabled = false;
 
+        stopPassthroughLocked();
+
+        {
+            Mutex::Autolock recLock(mRecLock);
+            ALOGD("stopRecording: dropped %llu frames for want of a free buffer", (unsigned long long)mRecDropped);
+        }
+
         // If something changed related to the starting or stopping of
         //  the recording process...
         if (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
 
-            // Recreate the heaps if toggling recording changes the raw preview size
-            //  and also restart the preview so we use the new size if needed
+            // The capture stays as it is until the preview is restarted
             initHeapLocked();
         }
     }
@@ -784,8 +1109,34 @@ int CameraHardware::isRecordingEnabled()
 
 void CameraHardware::releaseRecordingFrame(const void* mem)
 {
-    UNUSED(mem);
     //ALOGD("releaseRecordingFrame");
+
+    // mem is where the frame, or its metadata, is in the heap we gave
+    Mutex::Autolock lock(mRecLock);
+
+    // An access unit in passthrough mode
+    if (mStreamHeap != NULL) {
+        const uint8_t* base = (const uint8_t*)mStreamHeap->data;
+
+        if (mem >= base && (const uint8_t*)mem < base + kBufferCount * mStreamSlotSize) {
+            mStreamFree |= 1u << (((const uint8_t*)mem - base) / mStreamSlotSize);
+            return;
+        }
+    }
+
+    if (mRecBase == NULL || mem < mRecBase) {
+        return;
+    }
+
+    size_t offset = (const uint8_t*)mem - mRecBase;
+    size_t index = offset / mRecSlotSize;
+
+    if (index >= (size_t)kBufferCount || offset % mRecSlotSize != 0) {
+        ALOGW("releaseRecordingFrame: %p is not one of our buffers", mem);
+        return;
+    }
+
+    mRecFree |= 1u << index;
 }
 
 
@@ -816,6 +1167,10 @@ status_t CameraHardware::takePicture()
     ALOGD("takePicture");
     Mutex::Autolock lock(mLock);
 
+    // The moment of the shutter press, for ZSL
+    mPictureTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    mBurstCancelled = false;
+
     if (createThread(beginPictureThread, this) == false)
         return UNKNOWN_ERROR;
 
@@ -827,6 +1182,11 @@ status_t CameraHardware::takePicture()
 status_t CameraHardware::cancelPicture()
 {
     ALOGD("cancelPicture");
+
+    // A picture taken with the camera restarted gives up on its frame,
+    // and a burst takes no more pictures
+    mBurstCancelled = true;
+    camera.Interrupt();
     return NO_ERROR;
 }
 
@@ -837,11 +1197,25 @@ status_t CameraHardware::setParameters(const char* parms)
     ALOGD("setParameters");
 
     Mutex::Autolock lock(mLock);
+    initParametersLocked();
     return setParametersLocked(parms);
 }
 
 
 
+/*  Until a camera has been found the parameters are the defaults of
+    FromCamera, made the first time the app asks for them
+*/
+void CameraHardware::initParametersLocked()
+{
+    if (!mHaveParameters) {
+        FromCamera fc;
+        fc.set(*this);
+    }
+}
+
+
+
 status_t CameraHardware::setParametersLocked(const char* parms)
 {
     //ALOGD("setParametersLocked");
@@ -877,6 +1251,42 @@ status_t CameraHardware::setParametersLocked(const char* parms)
         return BAD_VALUE;
     }
 
+    const char* passthrough = params.get("video-passthrough");
+    if (passthrough != NULL && strcmp(passthrough, "off")) {
+        size_t i = 0;
+        while (i < ARRAY_SIZE(kStreamFormats) && strcmp(passthrough, kStreamFormats[i].name)) {
+            i++;
+        }
+        if (i == ARRAY_SIZE(kStreamFormats)) {
+            ALOGE("setParameters: Unsupported video passthrough '%s'", passthrough);
+            return BAD_VALUE;
+        }
+    }
+
+    int analyticsWidth, analyticsHeight;
+    if (!parseAnalyticsSize(params.get("analytics-size"), analyticsWidth, analyticsHeight)) {
+        ALOGE("setParameters: Unsupported analytics size '%s'", params.get("analytics-size"));
+        return BAD_VALUE;
+    }
+
+    const char* interval = params.get("analytics-frame-interval");
+    if (interval != NULL && atoi(interval) < 1) {
+        ALOGE("setParameters: Unsupported analytics frame interval '%s'", interval);
+        return BAD_VALUE;
+    }
+
+    const char* snaps = params.get("num-snaps-per-shutter");
+    if (snaps != NULL && (atoi(snaps) < 1 || atoi(snaps) > kMaxBurstCount)) {
+        ALOGE("setParameters: Unsupported burst of '%s' pictures", snaps);
+        return BAD_VALUE;
+    }
+
+    const char* burstInterval = params.get("burst-interval");
+    if (burstInterval != NULL && atoi(burstInterval) < 0) {
+        ALOGE("setParameters: Unsupported burst interval '%s'", burstInterval);
+        return BAD_VALUE;
+    }
+
 #if 0
     {
         // For debugging
@@ -920,6 +1330,7 @@ char* CameraHardware::getParameters()
     String8 params;
     {
         Mutex::Autolock lock(mLock);
+        initParametersLocked();
         params = mParameters.flatten();
     }
 
@@ -969,6 +1380,17 @@ void CameraHardware::releaseCamera()
     if (mPreviewThread != 0) {
         stopPreview();
     }
+
+    // No GPU context while the camera is closed
+    mGl.release();
+
+    // Leave it set up for whoever opens it next
+    if (mSpec.prewarm) {
+        Mutex::Autolock lock(mLock);
+        if (mReady && mPreviewThread == 0 && mWarmWidth == 0 && camera.Open(mSpec) == NO_ERROR) {
+            prewarmLocked();
+        }
+    }
 }
 
 
@@ -983,11 +1405,103 @@ CameraHardware::reportError(int code)
 
 
 
+void CameraHardware::resetStats()
+{
+    mLastFrameTime = 0;
+    mStatsSince = systemTime(SYSTEM_TIME_MONOTONIC);
+    mFramesCaptured = 0;
+    mFramesEmpty = 0;
+    mTimeouts = 0;
+
+    mFrameInterval.reset();
+    mCopyTime.reset();
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        mScaleTime[i].reset();
+    }
+    mPreviewCallbackTime.reset();
+    mVideoCallbackTime.reset();
+    mWinDequeueTime.reset();
+    mWinLockTime.reset();
+    mWinEnqueueTime.reset();
+    mJpegTime.reset();
+
+    camera.resetStats();
+}
+
+
+
 status_t CameraHardware::dumpCamera(int fd)
 {
-    UNUSED(fd);
     ALOGD("dump");
-    return -EINVAL;
+
+    static const char* names[STAGE_COUNT] = { "display", "callback", "record" };
+    String8 out;
+
+    {
+        Mutex::Autolock lock(mLock);
+
+        out.appendFormat("V4L2 camera %s: %s\n", camera.getDevice().c_str(),
+                         !mReady ? "not ready" : mPreviewThread != 0 ? "previewing" : "idle");
+        mHeapPool.dump(out);
+
+        if (mStatsSince == 0) {
+            out.append("  No preview yet\n");
+        } else {
+            double seconds = (systemTime(SYSTEM_TIME_MONOTONIC) - mStatsSince) / 1e9;
+            uint64_t frames = mFramesCaptured;
+
+            out.appendFormat("  Capturing %dx%d for %dx%d into %d buffers%s%s, for %.1f s\n",
+                             mRawPreviewWidth, mRawPreviewHeight, mCaptureWidth, mCaptureHeight,
+                             camera.getBufferCount(), mZeroCopy ? " with zero copy" : "",
+                             camera.isLowLatency() ? " in low latency mode" : "", seconds);
+            if (mGpuPreview && mWin != 0 && !mZeroCopy) {
+                out.appendFormat("  Preview window drawn by the GPU from %s\n",
+                                 mGpuDirect ? "the captured dma-bufs" : "the YUYV frames");
+            }
+            if (mAnalyticsWidth > 0) {
+                out.appendFormat("  Analytics: %dx%d luma of every %d frames\n",
+                                 mAnalyticsWidth, mAnalyticsHeight, mAnalyticsInterval);
+            }
+            out.appendFormat("  Frames: %llu captured, %.2f fps, %llu dropped by the driver, %llu stale skipped, %llu empty, %llu timeouts, %llu with no free ring slot\n",
+                             (unsigned long long)frames, seconds > 0 ? frames / seconds : 0.0,
+                             (unsigned long long)camera.getDroppedFrames(),
+                             (unsigned long long)camera.getStaleFrames(),
+                             (unsigned long long)mFramesEmpty, (unsigned long long)mTimeouts,
+                             (unsigned long long)mFrames.dropped());
+
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                out.appendFormat("  %-8s: took %llu frames, dropped %llu\n", names[i],
+                                 (unsigned long long)mReaders[i].frames, (unsigned long long)mReaders[i].dropped);
+            }
+
+            {
+                Mutex::Autolock recLock(mRecLock);
+                out.appendFormat("  Recording: %llu frames dropped with no free buffer\n",
+                                 (unsigned long long)mRecDropped);
+            }
+            mStream.dumpStats(out);
+
+            out.append("  Times in ms:\n");
+            mFrameInterval.dump(out, "frame interval");
+            camera.dumpStats(out);
+            mCopyTime.dump(out, "copy yuyv");
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                mScaleTime[i].dump(out, String8::format("convert for %s", names[i]).string());
+            }
+            mPreviewCallbackTime.dump(out, "preview callback");
+            mVideoCallbackTime.dump(out, "video callback");
+            mWinDequeueTime.dump(out, "window dequeue");
+            mWinLockTime.dump(out, "window lock");
+            mWinEnqueueTime.dump(out, "window enqueue");
+        }
+
+        mJpegTime.dump(out, "jpeg encode");
+    }
+
+    if (write(fd, out.string(), out.size()) < 0) {
+        return -errno;
+    }
+    return NO_ERROR;
 }
 
 
@@ -1005,6 +1519,7 @@ bool CameraHardware::tryOpenCamera()
     //ALOGD("tryOpenCamera");
 
     FromCamera fc;
+    string devices[kStreamFormatCount];
 
     if (camera.Open(mSpec) == NO_ERROR) {
         // Get the default preview format
@@ -1022,12 +1537,25 @@ bool CameraHardware::tryOpenCamera()
         // Get all the available Fps
         fc.avFps = camera.getAvailableFps();
 
+        // The compressed streams the camera has on another node
+        for (int i = 0; i < kStreamFormatCount; i++) {
+            devices[i] = StreamCapture::findDevice(camera.getDevice(), camera.getBusInfo(),
+                                                   kStreamFormats[i].fourcc);
+            if (!devices[i].empty()) {
+                fc.passthrough.appendFormat(",%s", kStreamFormats[i].name);
+            }
+        }
+
     } else {
         return false;
     }
 
     Mutex::Autolock lock(mLock);
 
+    for (int i = 0; i < kStreamFormatCount; i++) {
+        mStreamDevices[i] = devices[i];
+    }
+
     // Allow the preview thread to start
     mReady = true;
 
@@ -1036,6 +1564,10 @@ bool CameraHardware::tryOpenCamera()
     */
     bool ok = fc.set(*this);
 
+    if (ok && mSpec.prewarm) {
+        prewarmLocked();
+    }
+
     // Signal that the camera is ready.
     mReadyCond.broadcast();
 
@@ -1045,6 +1577,37 @@ bool CameraHardware::tryOpenCamera()
 
 
 
+bool CameraHardware::checkCameraUnplugged()
+{
+    /*  This will be called from the hotplug thread once the camera is open.
+        If its device node has gone the preview is stopped and the camera
+        closed, until tryOpenCamera() finds one again. The app is told that
+        it has lost the camera, as when the camera service dies.
+
+        This returns true if the camera has gone.
+    */
+    {
+        Mutex::Autolock lock(mLock);
+
+        if (!mReady || access(camera.getDevice().c_str(), F_OK) == 0) {
+            return false;
+        }
+
+        ALOGI("checkCameraUnplugged: %s has gone", camera.getDevice().c_str());
+
+        stopPreviewLocked();
+        coolLocked();
+        camera.Close();
+        mReady = false;
+    }
+
+    // Outside the lock, the app may call us back
+    reportError(CAMERA_ERROR_SERVER_DIED);
+    return true;
+}
+
+
+
 CameraHardware::FromCamera::FromCamera()
 {
     pw = MIN_WIDTH;
@@ -1056,6 +1619,7 @@ CameraHardware::FromCamera::FromCamera()
     // We need something in lieu of real camera parameters
     avSizes.add(SurfaceSize(640,480)); // VGA
     avFps.add(30);
+    passthrough = "off";
 }
 
 
@@ -1147,6 +1711,23 @@ bool CameraHardware::FromCamera::set(CameraHardware& ch)
     p.set(CameraParameters::KEY_VIDEO_FRAME_FORMAT, CameraParameters::PIXEL_FORMAT_YUV420SP);
     p.set("preferred-preview-size-for-video", "640x480");
 
+    // The camera's own H.264 or HEVC stream instead of the video frames
+    p.set("video-passthrough-values", passthrough);
+    p.set("video-passthrough", "off");
+
+    // A small grey picture, the luma of every Nth frame, in the preview
+    // callbacks instead of the preview frames, for apps that only look for
+    // motion. It is decimated straight from the captured frames.
+    p.set("analytics-size-values", "off,160x120,320x240,640x480");
+    p.set("analytics-size", "off");
+    p.set("analytics-frame-interval", 1);
+
+    // Several pictures for each takePicture(), the frames of the running
+    // preview burst-interval ms apart, or one after the other if it is 0
+    p.set("max-num-snaps-per-shutter", kMaxBurstCount);
+    p.set("num-snaps-per-shutter", 1);
+    p.set("burst-interval", 0);
+
     // supported rotations
     p.set("rotation-values","0");
     p.set(CameraParameters::KEY_ROTATION,"0");
@@ -1174,10 +1755,11 @@ bool CameraHardware::FromCamera::set(CameraHardware& ch)
     p.set(CameraParameters::KEY_EXPOSURE_COMPENSATION, "6");
     p.set(CameraParameters::KEY_EXPOSURE_COMPENSATION_STEP, "1.5");
 
-    p.set(CameraParameters::KEY_SUPPORTED_JPEG_THUMBNAIL_SIZES, "640x480");
-    p.set(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT,640);
+    // As android.jpeg.availableThumbnailSizes, 0x0 for none
+    p.set(CameraParameters::KEY_SUPPORTED_JPEG_THUMBNAIL_SIZES, "128x96,0x0");
+    p.set(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH,128);
+    p.set(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT,96);
     p.set(CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY,75);
-    p.set(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH,480);
 
     /* Set exposure compensation. */
     p.set(CameraParameters::KEY_MAX_EXPOSURE_COMPENSATION, "6");
@@ -1190,6 +1772,7 @@ bool CameraHardware::FromCamera::set(CameraHardware& ch)
         return false;
     }
 
+    ch.mHaveParameters = true;
     return true;
 }
 
@@ -1328,7 +1911,7 @@ void CameraHardware::initStaticCameraMetadata()
 
     /* End of static camera characteristics */
 
-    mCameraMetadata = clone_camera_metadata(m.get());
+    mCameraMetadata = m.release();
 }
 
 
@@ -1356,47 +1939,35 @@ void CameraHardware::initHeapLocked()
     ALOGD("initHeapLocked: picture size %dx%d", picture_width, picture_height);
     ALOGD("initHeapLocked: video size %dx%d", video_width, video_height);
 
-    int how_raw_preview_big = 0;
-
-    // If we are recording, use the recording video size instead of the preview size
-    if (mRecordingEnabled && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-        how_raw_preview_big = video_width * video_height << 1;      // Raw preview heap always in YUYV
+    // The camera captures at one size, and each consumer scales the frames
+    //  to its own. So the preview is only restarted if it needs a bigger
+    //  capture; a smaller one waits for the next time it is started.
+    int capture_width, capture_height;
+    getCaptureSizeLocked(capture_width, capture_height);
 
-        // If something changed ...
-        if (mRawPreviewWidth != video_width || mRawPreviewHeight != video_height) {
+    bool capture_changed = (mPreviewThread == 0) ?
+        (mCaptureWidth != capture_width || mCaptureHeight != capture_height) :
+        (mCaptureWidth < capture_width || mCaptureHeight < capture_height);
 
-            // Stop the preview thread if needed
-            if (mPreviewThread != 0) {
-                restart_preview = true;
-                stopPreviewLocked();
-                ALOGD("Stopping preview to allow changes");
-            }
+    if (capture_changed) {
 
-            // Store the new effective size
-            mRawPreviewWidth = video_width;
-            mRawPreviewHeight = video_height;
+        // Stop the preview thread if needed
+        if (mPreviewThread != 0) {
+            restart_preview = true;
+            stopPreviewLocked();
+            ALOGD("Stopping preview to allow changes");
         }
 
-    } else {
-        how_raw_preview_big = (preview_width * preview_height) << 1;  // Raw preview heap always in YUYV
-
-        // If something changed ...
-        if (mRawPreviewWidth != preview_width ||
-            mRawPreviewHeight != preview_height) {
-
-            // Stop the preview thread if needed
-            if (mPreviewThread != 0) {
-                restart_preview = true;
-                stopPreviewLocked();
-                ALOGD("Stopping preview to allow changes");
-            }
+        mCaptureWidth = capture_width;
+        mCaptureHeight = capture_height;
 
-            // Store the effective size
-            mRawPreviewWidth = preview_width;
-            mRawPreviewHeight = preview_height;
-        }
+        // Until the camera tells what it really captures
+        mRawPreviewWidth = capture_width;
+        mRawPreviewHeight = capture_height;
     }
 
+    int how_raw_preview_big = (mRawPreviewWidth * mRawPreviewHeight) << 1;  // Raw preview heap always in YUYV
+
     if (how_raw_preview_big != mRawPreviewFrameSize) {
 
         // Stop the preview thread if needed
@@ -1410,12 +1981,12 @@ void CameraHardware::initHeapLocked()
 
         // Create raw picture heap.
         if (mRawPreviewHeap) {
-            mRawPreviewHeap->release(mRawPreviewHeap);
+            mHeapPool.put(mRawPreviewHeap);
             mRawPreviewHeap = NULL;
         }
         mRawPreviewBuffer = NULL;
 
-        mRawPreviewHeap = mRequestMemory(-1,mRawPreviewFrameSize,1,mCallbackCookie);
+        mRawPreviewHeap = mHeapPool.get(mRawPreviewFrameSize, 1, mRequestMemory, mCallbackCookie);
 
         if (mRawPreviewHeap) {
             ALOGD("initHeapLocked: Raw preview heap allocated");
@@ -1427,16 +1998,16 @@ void CameraHardware::initHeapLocked()
 
     int how_preview_big = 0;
     if (!strcmp(mParameters.getPreviewFormat(),"yuv422i-yuyv")) {
-        mPreviewFmt = PIXEL_FORMAT_YCrCb_422_I;
+        mPreviewFmt = findHalFormat(PIXEL_FORMAT_YCrCb_422_I);
         how_preview_big = (preview_width * preview_height) << 1; // 2 bytes per pixel
     } else if (!strcmp(mParameters.getPreviewFormat(),"yuv422sp")) {
-        mPreviewFmt = PIXEL_FORMAT_YCbCr_422_SP;
+        mPreviewFmt = findHalFormat(PIXEL_FORMAT_YCbCr_422_SP);
         how_preview_big = (preview_width * preview_height * 3) >> 1; // 1.5 bytes per pixel
     } else if (!strcmp(mParameters.getPreviewFormat(),"yuv420sp")) {
-        mPreviewFmt = PIXEL_FORMAT_YCbCr_420_SP;
+        mPreviewFmt = findHalFormat(PIXEL_FORMAT_YCbCr_420_SP);
         how_preview_big = (preview_width * preview_height * 3) >> 1; // 1.5 bytes per pixel
     } else if (!strcmp(mParameters.getPreviewFormat(),"yuv420p")) {
-        mPreviewFmt = PIXEL_FORMAT_YV12;
+        mPreviewFmt = findHalFormat(PIXEL_FORMAT_YV12);
 
         /*
          * This format assumes
@@ -1477,12 +2048,12 @@ void CameraHardware::initHeapLocked()
         // Make a new mmap'ed heap that can be shared across processes.
         // use code below to test with pmem
         if (mPreviewHeap) {
-            mPreviewHeap->release(mPreviewHeap);
+            mHeapPool.put(mPreviewHeap);
             mPreviewHeap = NULL;
         }
         memset(mPreviewBuffer,0,sizeof(mPreviewBuffer));
 
-        mPreviewHeap = mRequestMemory(-1,mPreviewFrameSize,kBufferCount,mCallbackCookie);
+        mPreviewHeap = mHeapPool.get(mPreviewFrameSize, kBufferCount, mRequestMemory, mCallbackCookie);
         if (mPreviewHeap) {
             // Make an IMemory for each frame so that we can reuse them in callbacks.
             for (int i = 0; i < kBufferCount; i++) {
@@ -1494,18 +2065,55 @@ void CameraHardware::initHeapLocked()
         }
     }
 
+    // The analytics luma rides in the frame ring after each YUYV frame
+    int analytics_width = 0, analytics_height = 0;
+    parseAnalyticsSize(mParameters.get("analytics-size"), analytics_width, analytics_height);
+    mAnalyticsInterval = mParameters.getInt("analytics-frame-interval");
+    if (mAnalyticsInterval < 1) {
+        mAnalyticsInterval = 1;
+    }
+
+    if (analytics_width != mAnalyticsWidth || analytics_height != mAnalyticsHeight) {
+
+        // Stop the preview thread if needed
+        if (!restart_preview && mPreviewThread != 0) {
+            restart_preview = true;
+            stopPreviewLocked();
+            ALOGD("Stopping preview to allow changes");
+        }
+
+        mAnalyticsWidth = analytics_width;
+        mAnalyticsHeight = analytics_height;
+        mAnalyticsFrameSize = analytics_width * analytics_height;
+
+        if (mAnalyticsHeap) {
+            mHeapPool.put(mAnalyticsHeap);
+            mAnalyticsHeap = NULL;
+        }
+
+        if (mAnalyticsFrameSize > 0) {
+            mAnalyticsHeap = mHeapPool.get(mAnalyticsFrameSize, kBufferCount, mRequestMemory, mCallbackCookie);
+            if (mAnalyticsHeap) {
+                ALOGD("initHeapLocked: analytics heap allocated");
+            } else {
+                ALOGE("Unable to allocate memory for the analytics frames");
+                mAnalyticsWidth = mAnalyticsHeight = mAnalyticsFrameSize = 0;
+            }
+        }
+    }
+
     int how_recording_big = 0;
     if (!strcmp(mParameters.get(CameraParameters::KEY_VIDEO_FRAME_FORMAT),"yuv422i-yuyv")) {
-        mRecFmt = PIXEL_FORMAT_YCrCb_422_I;
+        mRecFmt = findHalFormat(PIXEL_FORMAT_YCrCb_422_I);
         how_recording_big = (video_width * video_height) << 1; // 2 bytes per pixel
     } else if (!strcmp(mParameters.get(CameraParameters::KEY_VIDEO_FRAME_FORMAT),"yuv422sp")) {
-        mRecFmt = PIXEL_FORMAT_YCbCr_422_SP;
+        mRecFmt = findHalFormat(PIXEL_FORMAT_YCbCr_422_SP);
         how_recording_big = (video_width * video_height * 3) >> 1; // 1.5 bytes per pixel
     } else if (!strcmp(mParameters.get(CameraParameters::KEY_VIDEO_FRAME_FORMAT),"yuv420sp")) {
-        mRecFmt = PIXEL_FORMAT_YCbCr_420_SP;
+        mRecFmt = findHalFormat(PIXEL_FORMAT_YCbCr_420_SP);
         how_recording_big = (video_width * video_height * 3) >> 1; // 1.5 bytes per pixel
     } else if (!strcmp(mParameters.get(CameraParameters::KEY_VIDEO_FRAME_FORMAT),"yuv420p")) {
-        mRecFmt = PIXEL_FORMAT_YV12;
+        mRecFmt = findHalFormat(PIXEL_FORMAT_YV12);
 
         /*
          * This format assumes
@@ -1543,22 +2151,8 @@ void CameraHardware::initHeapLocked()
 
         mRecordingFrameSize = how_recording_big;
 
-        if (mRecordingHeap) {
-            mRecordingHeap->release(mRecordingHeap);
-            mRecordingHeap = NULL;
-        }
-        memset(mRecBuffers,0,sizeof(mRecBuffers));
-
-        mRecordingHeap = mRequestMemory(-1,mRecordingFrameSize,kBufferCount,mCallbackCookie);
-        if (mRecordingHeap) {
-            // Make an IMemory for each frame so that we can reuse them in callbacks.
-            for (int i = 0; i < kBufferCount; i++) {
-                mRecBuffers[i] = (char*)mRecordingHeap->data + (i * mRecordingFrameSize);
-            }
-            ALOGD("initHeapLocked: recording heap allocated");
-        } else {
-            ALOGE("Unable to allocate memory for Recording");
-        }
+        freeRecordingBuffersLocked();
+        allocRecordingBuffersLocked(video_width, video_height);
     }
 
     int how_picture_big = (picture_width * picture_height) << 1; // Raw picture heap always in YUYV
@@ -1572,12 +2166,12 @@ void CameraHardware::initHeapLocked()
 
         // Create raw picture heap.
         if (mRawPictureHeap) {
-            mRawPictureHeap->release(mRawPictureHeap);
+            mHeapPool.put(mRawPictureHeap);
             mRawPictureHeap = NULL;
         }
         mRawBuffer = NULL;
 
-        mRawPictureHeap = mRequestMemory(-1,mRawPictureBufferSize,1,mCallbackCookie);
+        mRawPictureHeap = mHeapPool.get(mRawPictureBufferSize, 1, mRequestMemory, mCallbackCookie);
         if (mRawPictureHeap) {
             mRawBuffer = mRawPictureHeap->data;
             ALOGD("initHeapLocked: Raw picture heap allocated");
@@ -1586,28 +2180,9 @@ void CameraHardware::initHeapLocked()
         }
     }
 
-    int how_jpeg_big = picture_width * picture_height << 1; // jpeg maximum size
-    if (how_jpeg_big != mJpegPictureBufferSize) {
-
-        // Picture does not need to stop the preview, as the mutex ensures
-        //  the picture memory pool is not being used, and the camera is not
-        //  capturing pictures right now
-
-        mJpegPictureBufferSize = how_jpeg_big;
-
-        // Create Jpeg picture heap.
-        if (mJpegPictureHeap) {
-            mJpegPictureHeap->release(mJpegPictureHeap);
-            mJpegPictureHeap = NULL;
-        }
-        mJpegPictureHeap = mRequestMemory(-1,how_jpeg_big,1,mCallbackCookie);
-
-        if (mJpegPictureHeap) {
-            ALOGD("initHeapLocked: Jpeg picture heap allocated");
-        } else {
-            ALOGE("Unable to allocate memory for JpegPicture");
-        }
-    }
+    // jpeg maximum size, with the EXIF. The heaps are only made when a
+    // picture is taken
+    mJpegPictureBufferSize = (picture_width * picture_height << 1) + kExifMaxApp1Size;
 
     // Don't forget to restart the preview if it was stopped...
     if (restart_preview) {
@@ -1620,18 +2195,81 @@ void CameraHardware::initHeapLocked()
 
 
 
+
+void CameraHardware::getCaptureSizeLocked(int& width, int& height)
+{
+    mParameters.getPreviewSize(&width, &height);
+
+    // With the recording hint the capture is made big enough for the video
+    //  from the start, so that starting to record does not restart it
+    const char* hint = mParameters.get(CameraParameters::KEY_RECORDING_HINT);
+    bool recording = (mRecordingEnabled && !mPassthrough && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) ||
+                     (hint != NULL && !strcmp(hint, CameraParameters::TRUE));
+
+    if (recording) {
+        int video_width, video_height;
+        mParameters.getVideoSize(&video_width, &video_height);
+
+        if (video_width > width)
+            width = video_width;
+        if (video_height > height)
+            height = video_height;
+    }
+}
+
+
+
+/*  Sets the open camera up for the preview the parameters ask for, with
+    its buffers mapped and queued, so that the next startPreviewLocked()
+    at that size only has to start streaming. The camera stays open.
+*/
+void CameraHardware::prewarmLocked()
+{
+    int width, height;
+    getCaptureSizeLocked(width, height);
+    int fps = mParameters.getPreviewFrameRate();
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (camera.Init(width, height, fps, gpuHeldFrames()) != NO_ERROR) {
+        ALOGW("prewarmLocked: cannot set the camera up for %dx%d@%d", width, height, fps);
+        camera.Uninit();
+        return;
+    }
+
+    mWarmWidth = width;
+    mWarmHeight = height;
+    mWarmFps = fps;
+    ALOGI("prewarmLocked: %dx%d@%d set up in %lld ms", width, height, fps,
+          (long long)ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - start));
+}
+
+
+
+/*  Frees the buffers of a pre-warmed camera, before it is set up in some
+    other way or closed
+*/
+void CameraHardware::coolLocked()
+{
+    if (mWarmWidth != 0) {
+        camera.Uninit();
+        mWarmWidth = mWarmHeight = mWarmFps = 0;
+    }
+}
+
+
 bool CameraHardware::previewThread()
 {
     /*  We return true to continue the thread. 
 
 	We don't hold the mutex while doing this. The other threads
 	are expected to stop this thread before changing anything.
+
+        This is the capture stage. It only takes the frame from the
+        camera, converts it to YUYV into the frame ring and gives the
+        buffer back. The consumers run on their own threads.
     */
     //ALOGD("previewThread: this=%p",this);
 
-    // Buffers to send messages
-    int previewBufferIdx = 0;
-
     // If no raw preview buffer, we can't do anything...
     if (mRawPreviewBuffer == 0) {
         ALOGE("No Raw preview buffer!");
@@ -1639,310 +2277,678 @@ bool CameraHardware::previewThread()
         return false;
     }
 
-    // Get the preview buffer for the current frame
-    // This is always valid, even if the client died -- the memory
-    // is still mapped in our process.
-    uint8_t *frame = (uint8_t *)mPreviewBuffer[mCurrentPreviewFrame];
+    // Give the camera the window buffers that could not be replaced before
+    if (mZeroCopy) {
+        int queued = 0;
+        for (int i = 0; i < camera.getBufferCount(); i++) {
+            if (mZeroCopyBufs[i] != NULL || queueZeroCopyBuffer(i)) {
+                queued++;
+            }
+        }
 
-    // If no preview buffer, we cant do anything...
-    if (frame == 0) {
-        ALOGE("No preview buffer!");
-        reportError(CAMERA_ERROR_UNKNOWN);
-        return false;
+        if (queued == 0) {
+            // Nothing to capture into until the display gives a buffer back
+            usleep(frameTimeout() / 1000);
+            return true;
+        }
     }
 
-    //  Get a pointer to the memory area to use... In case of previewing in YUV422I, we
-    // can save a buffer copy by directly using the output buffer. But ONLY if NOT recording
-    // or, in case of recording, when size matches
-    uint8_t* rawBase = (mPreviewFmt == PIXEL_FORMAT_YCrCb_422_I &&
-                        (!mRecordingEnabled || mRawPreviewFrameSize == mPreviewFrameSize))
-                        ? frame : (uint8_t*)mRawPreviewBuffer;
-
-    // Grab a frame in the raw format YUYV
-    auto status = camera.GrabRawFrame(rawBase, mRawPreviewFrameSize, frameTimeout());
+    // Wait for a frame
+    FrameInfo info;
+    auto status = camera.AcquireFrame(frameTimeout(), &info);
 
     if (status == TIMED_OUT) {
+        mTimeouts.fetch_add(1, std::memory_order_relaxed);
         if (mTimeoutLimit > 0 && ++mTimeoutCount == mTimeoutLimit) {
             reportError(1001);   // report the timeout
         }
         return true;
     }
 
-    if (!(status == NO_ERROR || status == NOT_ENOUGH_DATA)) {
+    if (status == NOT_ENOUGH_DATA) {
+        // The empty frame was already given back
+        mFramesEmpty.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (status == WOULD_BLOCK) {
+        // Interrupted, most likely because the preview is stopping
+        return true;
+    }
+
+    if (status == DEAD_OBJECT) {
+        // The hotplug thread will stop the preview
+        ALOGI("The camera has been unplugged");
+        return false;
+    }
+
+    if (status != NO_ERROR) {
         // Give up
         ALOGE("The camera has failed");
         reportError(1000);
         return false;
     }
 
-    // We've got a frame
+    // We've got a frame, stamped with when it was captured
     mTimeoutCount = 0;
+    nsecs_t timestamp = info.timestamp;
+
+    mFramesCaptured.fetch_add(1, std::memory_order_relaxed);
+    if (mLastFrameTime != 0) {
+        mFrameInterval.add(timestamp - mLastFrameTime);
+    }
+    mLastFrameTime = timestamp;
+
+    // With zero copy the display doesn't need the ring, nor when the GPU
+    // reads the captured frames. The pictures do when they come from the
+    // preview. With an analytics stream the preview
+    // callback only wants its luma, so if nothing else wants the frames
+    // they are never converted to YUYV.
+    bool analytics = mAnalyticsWidth > 0 && (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME);
+    bool wanted = (mWin != 0 && !mZeroCopy && !mGpuDirect) ||
+                  (!analytics && (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME)) ||
+                  (mRecordingEnabled && !mPassthrough && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) ||
+                  mSpec.zslFrames > 0 || mStillWanted;
+
+    if (analytics) {
+        analytics = (mAnalyticsCount == 0);
+        mAnalyticsCount = (mAnalyticsCount + 1) % mAnalyticsInterval;
+    }
+
+    if (wanted || analytics) {
+        FrameRing::Frame* slot = mFrames.beginWrite();
+
+        // If all the frames are held by the consumers this frame is dropped
+        if (slot != NULL) {
+            if (captureFrame(slot, wanted, analytics)) {
+                mFrames.endWrite(slot, timestamp);
+            } else {
+                mFrames.cancelWrite(slot);
+            }
+        }
+    }
 
-    // If the recording is enabled...
-    if (mRecordingEnabled && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-        //ALOGD("CameraHardware::previewThread: posting video frame...");
+    if (mZeroCopy) {
+        // This also gives the camera a new buffer instead of this one
+        displayZeroCopyFrame();
+    } else if (mGpuDirect && mWin != 0) {
+        // The display thread gives it back once it has drawn it
+        queueGpuFrame(timestamp);
+    } else {
+        camera.ReleaseFrame();
+    }
 
-        // Get the video size. We are warrantied here that the current capture
-        // size IS exacty equal to the video size, as this condition is enforced
-        // by this driver, that priorizes recording size over preview size requirements
+    return true;
+}
 
-        uint8_t *recFrame = (uint8_t *) mRecBuffers[mCurrentRecordingFrame];
-        if (recFrame != 0) {
 
-            // Convert from our raw frame to the one the Record requires
-            switch (mRecFmt) {
 
-            // Note: Apparently, Android's "YCbCr_422_SP" is merely an arbitrary label
-            // The preview data comes in a YUV 4:2:0 format, with Y plane, then VU plane
-            case PIXEL_FORMAT_YCbCr_422_SP:
-                yuyv_to_yvu420sp(recFrame, mRawPreviewWidth, mRawPreviewHeight, rawBase, (mRawPreviewWidth<<1), mRawPreviewWidth, mRawPreviewHeight);
-                break;
+/*  Fills a frame of the ring with what the consumers want of the acquired
+    frame, and sets its flags to what it got. The luma is decimated from the
+    captured frame itself when its format allows, else from the YUYV, that
+    then has to be made even if it isn't wanted.
+*/
+bool CameraHardware::captureFrame(FrameRing::Frame* slot, bool yuyv, bool luma)
+{
+    slot->flags = 0;
 
-            case PIXEL_FORMAT_YCbCr_420_SP:
-                yuyv_to_yvu420sp(recFrame, mRawPreviewWidth, mRawPreviewHeight, rawBase, (mRawPreviewWidth<<1), mRawPreviewWidth, mRawPreviewHeight);
-                break;
+    if (yuyv) {
+        uint8_t* frame = camera.getYUYVFrame();
+        status_t status;
 
-            case PIXEL_FORMAT_YV12:
-                /* OMX recorder needs YUV */
-                yuyv_to_yuv420p(recFrame, mRawPreviewWidth, mRawPreviewHeight, rawBase, (mRawPreviewWidth<<1), mRawPreviewWidth, mRawPreviewHeight);
-                break;
+        if (frame != 0) {
+            ScopedLatency timer(mCopyTime);
+            memcpy(slot->data, frame, mRawPreviewFrameSize);
+            status = NO_ERROR;
+        } else {
+            status = camera.ConvertFrame(slot->data, mRawPreviewFrameSize);
+        }
 
-            case PIXEL_FORMAT_YCrCb_422_I:
-                memcpy(recFrame, rawBase, mRecordingFrameSize);
-                break;
-            }
+        if (status == NO_ERROR) {
+            slot->flags |= FRAME_YUYV;
+        }
+    }
 
-            // Advance the buffer pointer.
-            auto recBufferIdx = mCurrentRecordingFrame;
-            mCurrentRecordingFrame = (mCurrentRecordingFrame + 1) % kBufferCount;
+    if (luma) {
+        uint8_t* dst = slot->data + mRawPreviewFrameSize;
+
+        if (camera.ConvertLuma(dst, mAnalyticsWidth, mAnalyticsWidth, mAnalyticsHeight) == NO_ERROR) {
+            slot->flags |= FRAME_LUMA;
+        } else {
+            if (!(slot->flags & FRAME_YUYV) && camera.ConvertFrame(slot->data, mRawPreviewFrameSize) == NO_ERROR) {
+                slot->flags |= FRAME_YUYV;
+            }
 
-            // Record callback uses a timestamped frame
-            nsecs_t timestamp = systemTime(SYSTEM_TIME_MONOTONIC);
-            mDataCbTimestamp(timestamp, CAMERA_MSG_VIDEO_FRAME, mRecordingHeap, recBufferIdx, mCallbackCookie);
+            if (slot->flags & FRAME_YUYV) {
+                luma_decimate(dst, mAnalyticsWidth, mAnalyticsWidth, mAnalyticsHeight,
+                              slot->data, mRawPreviewWidth << 1, mRawPreviewWidth, mRawPreviewHeight, 2);
+                slot->flags |= FRAME_LUMA;
+            }
         }
     }
 
-    if (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME) {
-        //ALOGD("CameraHardware::previewThread: posting preview frame...");
+    return slot->flags != 0;
+}
 
-        // Here we could eventually have a problem: If we are recording, the recording size
-        //  takes precedence over the preview size. So, the rawBase buffer could be of a
-        //  different size than the preview buffer. Handle this situation by centering/cropping
-        //  if needed.
 
-        // Get the preview size
-        int width = 0, height = 0;
-        mParameters.getPreviewSize(&width,&height);
 
-        // Assume we will be able to copy at least those pixels
-        int cwidth = width;
-        int cheight = height;
+bool CameraHardware::consumerThread(int stage)
+{
+    // The stages may be disabled. They still take the frames so that
+    // their drop counts only show frames they were too slow for.
+    // The GPU reads the captured frames where they are instead
+    if (stage == STAGE_DISPLAY && mGpuDirect) {
+        FrameRing::Frame* held = mGpuFrames.acquire(mGpuReader, frameTimeout());
 
-        // If we are trying to display a preview larger than the effective capture, truncate to it
-        if (cwidth > mRawPreviewWidth)
-            cwidth = mRawPreviewWidth;
-        if (cheight > mRawPreviewHeight)
-            cheight = mRawPreviewHeight;
+        if (held != NULL) {
+            displayGpuFrame(held);
+            mGpuFrames.release(held);
+        }
+        return true;
+    }
 
-        // Convert from our raw frame to the one the Preview requires
-        switch (mPreviewFmt) {
+    FrameRing::Frame* frame = mFrames.acquire(mReaders[stage], frameTimeout());
 
-            // Note: Apparently, Android's "YCbCr_422_SP" is merely an arbitrary label
-            // The preview data comes in a YUV 4:2:0 format, with Y plane, then VU plane
-        case PIXEL_FORMAT_YCbCr_422_SP: // This is misused by android...
-            yuyv_to_yvu420sp(frame, width, height, rawBase, (mRawPreviewWidth<<1), cwidth, cheight);
-            break;
+    if (frame == NULL) {
+        return true;
+    }
 
-        case PIXEL_FORMAT_YCbCr_420_SP:
-            yuyv_to_yvu420sp(frame, width, height, rawBase, (mRawPreviewWidth<<1), cwidth, cheight);
-            break;
+    switch (stage) {
+    case STAGE_DISPLAY:
+        if (mWin != 0 && !mZeroCopy && !mGpuDirect && (frame->flags & FRAME_YUYV)) {
+            fillPreviewWindow(frame->data);
+        }
+        break;
 
-        case PIXEL_FORMAT_YV12:
-            yuyv_to_yvu420p(frame, width, height, rawBase, (mRawPreviewWidth<<1), cwidth, cheight);
+    case STAGE_CALLBACK:
+        if (!(mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME)) {
             break;
-
-        case PIXEL_FORMAT_YCrCb_422_I:
-            // Nothing to do here. Is is handled as a special case without buffer copies...
-            //  but ONLY in special cases... Otherwise, handle the copy!
-            if (mRecordingEnabled && mRawPreviewFrameSize != mPreviewFrameSize) {
-                // We need to copy ... do it
-                uint8_t* dst = frame;
-                uint8_t* src = rawBase;
-                int h;
-                for (h = 0; h < cheight; h++) {
-                    memcpy(dst,src,cwidth<<1);
-                    dst += width << 1;
-                    src += mRawPreviewWidth<<1;
-                }
+        }
+        if (mAnalyticsWidth > 0) {
+            if (frame->flags & FRAME_LUMA) {
+                postAnalyticsFrame(frame->data + mRawPreviewFrameSize);
             }
-            break;
-
-        default:
-            ALOGE("Unhandled pixel format");
-
+        } else if (frame->flags & FRAME_YUYV) {
+            postPreviewFrame(frame->data);
         }
+        break;
 
-        // Advance the buffer pointer.
-        auto previewBufferIdx = mCurrentPreviewFrame;
-        mCurrentPreviewFrame = (mCurrentPreviewFrame + 1) % kBufferCount;
-
-        mDataCb(CAMERA_MSG_PREVIEW_FRAME, mPreviewHeap, previewBufferIdx, NULL, mCallbackCookie);
+    case STAGE_RECORD:
+        if (mRecordingEnabled && !mPassthrough && mMsgEnabled & CAMERA_MSG_VIDEO_FRAME &&
+            (frame->flags & FRAME_YUYV)) {
+            postRecordingFrame(frame->data, frame->timestamp);
+        }
+        break;
     }
 
-    // Display the preview image
-    fillPreviewWindow(rawBase, mRawPreviewWidth, mRawPreviewHeight);
-
+    mFrames.release(frame);
     return true;
 }
 
 
 
-void CameraHardware::fillPreviewWindow(uint8_t* yuyv, int srcWidth, int srcHeight)
+void CameraHardware::allocRecordingBuffersLocked(int width, int height)
 {
-    // Preview to a preview window...
-    if (mWin == 0) {
-        ALOGE("%s: No preview window",__FUNCTION__);
-        return;
+    {
+        Mutex::Autolock lock(mRecLock);
+        mRecFree = (1u << kBufferCount) - 1;
+        mRecBase = NULL;
+        mRecSlotSize = 0;
     }
 
-    // Get a videobuffer
-    buffer_handle_t* buf = NULL;
-    int stride = 0;
-    status_t res = mWin->dequeue_buffer(mWin, &buf, &stride);
-    if (res != NO_ERROR || buf == NULL) {
-        ALOGE("%s: Unable to dequeue preview window buffer: %d -> %s",
-            __FUNCTION__, -res, strerror(-res));
-        return;
-    }
+    if (!mRecordingMetadata) {
+        mRecordingHeap = mHeapPool.get(mRecordingFrameSize, kBufferCount, mRequestMemory, mCallbackCookie);
+        if (mRecordingHeap) {
+            // Make an IMemory for each frame so that we can reuse them in callbacks.
+            for (int i = 0; i < kBufferCount; i++) {
+                mRecBuffers[i] = (char*)mRecordingHeap->data + (i * mRecordingFrameSize);
+            }
 
-    /* Let the preview window to lock the buffer. */
-    res = mWin->lock_buffer(mWin, buf);
-    if (res != NO_ERROR) {
-        ALOGE("%s: Unable to lock preview window buffer: %d -> %s",
-             __FUNCTION__, -res, strerror(-res));
-        mWin->cancel_buffer(mWin, buf);
+            Mutex::Autolock lock(mRecLock);
+            mRecBase = (uint8_t*)mRecordingHeap->data;
+            mRecSlotSize = mRecordingFrameSize;
+            ALOGD("initHeapLocked: recording heap allocated");
+        } else {
+            ALOGE("Unable to allocate memory for Recording");
+        }
         return;
     }
 
-    /* Now let the graphics framework to lock the buffer, and provide
-     * us with the framebuffer data address. */
-    void* vaddr = NULL;
+    // The gralloc format of what convertRecordingFrame() writes
+    int format = mRecFmt != NULL ? mRecFmt->grallocFormat : HAL_PIXEL_FORMAT_YCbCr_422_I;
 
-    const Rect bounds(srcWidth, srcHeight);
-    GraphicBufferMapper& grbuffer_mapper(GraphicBufferMapper::get());
-    res = grbuffer_mapper.lock(*buf, GRALLOC_USAGE_SW_WRITE_OFTEN, bounds, &vaddr);
-    if (res != NO_ERROR || vaddr == NULL) {
-        ALOGE("%s: grbuffer_mapper.lock failure: %d -> %s",
-             __FUNCTION__, res, strerror(res));
-        mWin->cancel_buffer(mWin, buf);
+    mRecordingMetaHeap = mHeapPool.get(sizeof(VideoMetadata), kBufferCount, mRequestMemory, mCallbackCookie);
+    if (!mRecordingMetaHeap) {
+        ALOGE("Unable to allocate memory for the recording metadata");
         return;
     }
 
-    // Calculate the source stride...
-    int srcStride = srcWidth<<1;
-    uint8_t* src  = (uint8_t*)yuyv;
-
-    // Center into the preview surface if needed
-    int xStart = (mPreviewWinWidth   - srcWidth ) >> 1;
-    int yStart = (mPreviewWinHeight  - srcHeight) >> 1;
-
-    // Make sure not to overflow the preview surface
-    if (xStart < 0 || yStart < 0) {
-        ALOGE("Preview window is smaller than video preview size - Cropping image.");
-
-        if (xStart < 0) {
-            srcWidth += xStart;
-            src += ((-xStart) >> 1) << 1;       // Center the crop rectangle
-            xStart = 0;
+    for (int i = 0; i < kBufferCount; i++) {
+        sp<GraphicBuffer> buf = new GraphicBuffer(width, height, format,
+                                    GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_VIDEO_ENCODER);
+        if (buf->initCheck() != NO_ERROR) {
+            ALOGE("Unable to allocate the recording gralloc buffers");
+            freeRecordingBuffersLocked();
+            return;
         }
+        mRecGraphicBuffers[i] = buf;
 
-        if (yStart < 0) {
-            srcHeight += yStart;
-            src += ((-yStart) >> 1) * srcStride; // Center the crop rectangle
-            yStart = 0;
-        }
+        // Each metadata buffer always points at the same gralloc buffer
+        VideoMetadata* meta = (VideoMetadata*)mRecordingMetaHeap->data + i;
+        meta->eType = kMetadataBufferTypeGrallocSource;
+        meta->pHandle = buf->handle;
     }
 
-    // Calculate the bytes per pixel
-    int bytesPerPixel = 2;
-    if (mPreviewWinFmt == PIXEL_FORMAT_YCbCr_422_SP ||
-        mPreviewWinFmt == PIXEL_FORMAT_YCbCr_420_SP ||
-        mPreviewWinFmt == PIXEL_FORMAT_YV12 ||
-        mPreviewWinFmt == PIXEL_FORMAT_YV16 ) {
-        bytesPerPixel = 1; // Planar Y
-    } else if (mPreviewWinFmt == PIXEL_FORMAT_RGB_888) {
-        bytesPerPixel = 3;
-    } else if (mPreviewWinFmt == PIXEL_FORMAT_RGBA_8888 ||
-        mPreviewWinFmt == PIXEL_FORMAT_RGBX_8888 ||
-        mPreviewWinFmt == PIXEL_FORMAT_BGRA_8888) {
-        bytesPerPixel = 4;
-    } else if (mPreviewWinFmt == PIXEL_FORMAT_YCrCb_422_I) {
-        bytesPerPixel = 2;
-    }
+    Mutex::Autolock lock(mRecLock);
+    mRecBase = (uint8_t*)mRecordingMetaHeap->data;
+    mRecSlotSize = sizeof(VideoMetadata);
+    ALOGD("initHeapLocked: %d recording gralloc buffers allocated", kBufferCount);
+}
 
-    LOG_FRAME("ANativeWindow: bits:%p, stride in pixels:%d, w:%d, h: %d, format: %d",vaddr,stride,mPreviewWinWidth,mPreviewWinHeight,mPreviewWinFmt);
 
-    // Based on the destination pixel type, we must convert from YUYV to it
-    int dstStride = bytesPerPixel * stride;
-    uint8_t* dst  = ((uint8_t*)vaddr) + (xStart * bytesPerPixel) + (dstStride * yStart);
 
-    switch (mPreviewWinFmt) {
-    case PIXEL_FORMAT_YCbCr_422_SP: // This is misused by android...
-        yuyv_to_yvu420sp( dst, dstStride, mPreviewWinHeight, src, srcStride, srcWidth, srcHeight);
-        break;
+void CameraHardware::freeRecordingBuffersLocked()
+{
+    bool inUse;
+    {
+        Mutex::Autolock lock(mRecLock);
+        inUse = mRecFree != (1u << kBufferCount) - 1;
+        mRecBase = NULL;
+        mRecSlotSize = 0;
+    }
 
-    case PIXEL_FORMAT_YCbCr_420_SP:
-        yuyv_to_yvu420sp( dst, dstStride, mPreviewWinHeight,src, srcStride, srcWidth, srcHeight);
-        break;
+    // Nor are the frames the encoder still holds to be written over
+    if (mRecordingHeap) {
+        if (inUse) {
+            mHeapPool.drop(mRecordingHeap);
+        } else {
+            mHeapPool.put(mRecordingHeap);
+        }
+        mRecordingHeap = NULL;
+    }
+    memset(mRecBuffers,0,sizeof(mRecBuffers));
 
-    case PIXEL_FORMAT_YV12:
-        yuyv_to_yvu420p( dst, dstStride, mPreviewWinHeight, src, srcStride, srcWidth, srcHeight);
-        break;
+    if (mRecordingMetaHeap) {
+        if (inUse) {
+            mHeapPool.drop(mRecordingMetaHeap);
+        } else {
+            mHeapPool.put(mRecordingMetaHeap);
+        }
+        mRecordingMetaHeap = NULL;
+    }
+    for (int i = 0; i < kBufferCount; i++) {
+        mRecGraphicBuffers[i].clear();
+    }
+}
+
+
+
+void CameraHardware::convertRecordingFrame(uint8_t* dst, int stride, uint8_t* yuyv)
+{
+    // The frame is scaled to the video size if it was captured at another one
+    int width, height;
+    mParameters.getVideoSize(&width, &height);
+
+    // Convert from our raw frame to the one the Record requires
+    if (mRecFmt == NULL) {
+        return;
+    }
+
+    /* A gralloc YV12 buffer is what it says, the OMX recorder needs YUV */
+    int dstFmt = mRecFmt->scaleDst;
+    if (dstFmt == SCALE_DST_YVU420P && !mRecordingMetadata) {
+        dstFmt = SCALE_DST_YUV420P;
+    }
+
+    scaleFrame(STAGE_RECORD, dstFmt, dst, stride * mRecFmt->bytesPerPixel, height, width, height, yuyv);
+}
 
-    case PIXEL_FORMAT_YV16:
-        yuyv_to_yvu422p( dst, dstStride, mPreviewWinHeight, src, srcStride, srcWidth, srcHeight);
-        break;
 
-    case PIXEL_FORMAT_YCrCb_422_I:
+
+// With auto the matrix follows the capture size, which changes when the
+// camera is set up again
+bool CameraHardware::isBt709() const
+{
+    return mSpec.colorMatrix == CameraSpec::COLOR_BT709 ||
+           (mSpec.colorMatrix == CameraSpec::COLOR_AUTO && mRawPreviewHeight >= 720);
+}
+
+
+
+void CameraHardware::scaleFrame(int stage, int dstFmt, uint8_t* dst, int dstStride, int dstHeight,
+                                int width, int height, uint8_t* yuyv)
+{
+    // Each consumer has its own scaler, so it keeps its buffers
+    if (mScalers[stage] == NULL) {
+        mScalers[stage] = yuyv_scaler_create();
+        if (mScalers[stage] == NULL) {
+            ALOGE("scaleFrame: no memory for the scaler");
+            return;
+        }
+    }
+
+    // Only the rgb formats use the colour space
+    yuyv_scaler_set_colorspace(mScalers[stage], isBt709() ? YUV_MATRIX_BT709 : YUV_MATRIX_BT601,
+                               mSpec.limitedRange ? YUV_RANGE_LIMITED : YUV_RANGE_FULL);
+
+    // Scale the centered part of the frame that has the aspect ratio of
+    // the destination, so nothing is stretched
+    int srcWidth, srcHeight;
+    uint8_t* src = cropToAspect(yuyv, mRawPreviewWidth, mRawPreviewHeight, width, height, srcWidth, srcHeight);
+
+    ScopedLatency timer(mScaleTime[stage]);
+    if (yuyv_scaler_run(mScalers[stage], dstFmt, dst, dstStride, dstHeight, width, height,
+                        src, mRawPreviewWidth << 1, srcWidth, srcHeight) < 0) {
+        ALOGE("scaleFrame: cannot scale %dx%d to %dx%d", srcWidth, srcHeight, width, height);
+    }
+}
+
+
+
+void CameraHardware::postRecordingFrame(uint8_t* yuyv, nsecs_t timestamp)
+{
+    //ALOGD("CameraHardware::postRecordingFrame: posting video frame...");
+
+    // Take a buffer the encoder is not holding, or drop the frame
+    int index = -1;
     {
-        // We need to copy ... do it
-        uint8_t* pdst = dst;
-        uint8_t* psrc = src;
-        int h;
-        for (h = 0; h < srcHeight; h++) {
-            memcpy(pdst,psrc,srcWidth<<1);
-            pdst += dstStride;
-            psrc += srcStride;
+        Mutex::Autolock lock(mRecLock);
+
+        if (mRecBase == NULL) {
+            return;
         }
-        break;
+
+        if (mRecFree == 0) {
+            mRecDropped++;
+            return;
+        }
+
+        index = __builtin_ctz(mRecFree);
+        mRecFree &= ~(1u << index);
     }
 
-    case PIXEL_FORMAT_RGB_888:
-        yuyv_to_rgb24(src, srcStride, dst, dstStride, srcWidth, srcHeight);
-        break;
+    if (mRecordingMetadata) {
+        sp<GraphicBuffer>& buf = mRecGraphicBuffers[index];
+        void* vaddr = NULL;
 
-    case PIXEL_FORMAT_RGBA_8888:
-        yuyv_to_rgb32(src, srcStride, dst, dstStride, srcWidth, srcHeight);
-        break;
+        if (buf->lock(GRALLOC_USAGE_SW_WRITE_OFTEN, &vaddr) != NO_ERROR) {
+            ALOGE("postRecordingFrame: cannot lock recording buffer %d", index);
+            releaseRecordingFrame((VideoMetadata*)mRecordingMetaHeap->data + index);
+            return;
+        }
+        convertRecordingFrame((uint8_t*)vaddr, buf->getStride(), yuyv);
+        buf->unlock();
 
-    case PIXEL_FORMAT_RGBX_8888:
-        yuyv_to_rgb32(src, srcStride, dst, dstStride, srcWidth, srcHeight);
-        break;
+        // Record callback uses a timestamped frame
+        ScopedLatency timer(mVideoCallbackTime);
+        mDataCbTimestamp(timestamp, CAMERA_MSG_VIDEO_FRAME, mRecordingMetaHeap, index, mCallbackCookie);
+    } else {
+        int width, height;
+        mParameters.getVideoSize(&width, &height);
+        convertRecordingFrame((uint8_t*)mRecBuffers[index], width, yuyv);
 
-    case PIXEL_FORMAT_BGRA_8888:
-        yuyv_to_bgr32(src, srcStride, dst, dstStride, srcWidth, srcHeight);
-        break;
+        // Record callback uses a timestamped frame
+        ScopedLatency timer(mVideoCallbackTime);
+        mDataCbTimestamp(timestamp, CAMERA_MSG_VIDEO_FRAME, mRecordingHeap, index, mCallbackCookie);
+    }
+}
 
-    case PIXEL_FORMAT_RGB_565:
-        yuyv_to_rgb565(src, srcStride, dst, dstStride, srcWidth, srcHeight);
-        break;
 
-    default:
+
+bool CameraHardware::startPassthroughLocked()
+{
+    /*  The encoder has no gralloc buffer to take an access unit in, so
+        metadata mode always records the preview frames.
+    */
+    if (mRecordingMetadata) {
+        ALOGW("startPassthroughLocked: not with metadata in the buffers");
+        return false;
+    }
+
+    const char* name = mParameters.get("video-passthrough");
+    int i = 0;
+    while (i < kStreamFormatCount && strcmp(name, kStreamFormats[i].name)) {
+        i++;
+    }
+
+    if (i == kStreamFormatCount || mStreamDevices[i].empty()) {
+        ALOGE("startPassthroughLocked: the camera has no %s stream", name);
+        return false;
+    }
+
+    int width, height;
+    mParameters.getVideoSize(&width, &height);
+
+    if (mStream.open(mStreamDevices[i], kStreamFormats[i].fourcc, width, height,
+                     mParameters.getPreviewFrameRate()) != NO_ERROR) {
+        return false;
+    }
+
+    // Each buffer has room for the biggest access unit the driver can give
+    size_t slotSize = (sizeof(StreamFrameHeader) + mStream.getMaxFrameSize() + 63) & ~63;
+    camera_memory_t* heap = mHeapPool.get(slotSize, kBufferCount, mRequestMemory, mCallbackCookie);
+
+    if (heap == NULL) {
+        ALOGE("startPassthroughLocked: unable to allocate memory for the stream");
+        mStream.stop();
+        return false;
+    }
+
+    {
+        Mutex::Autolock recLock(mRecLock);
+        mStreamHeap = heap;
+        mStreamSlotSize = slotSize;
+        mStreamFree = (1u << kBufferCount) - 1;
+    }
+
+    mPassthrough = true;
+
+    if (mStream.start(streamCallback, this) != NO_ERROR) {
+        stopPassthroughLocked();
+        return false;
+    }
+
+    ALOGI("startPassthroughLocked: recording the %s stream of %s", name, mStreamDevices[i].c_str());
+    return true;
+}
+
+
+
+void CameraHardware::stopPassthroughLocked()
+{
+    // No more access units come once the stream has stopped
+    mStream.stop();
+    mPassthrough = false;
+
+    camera_memory_t* heap;
+    bool inUse;
+    {
+        Mutex::Autolock recLock(mRecLock);
+        heap = mStreamHeap;
+        inUse = mStreamFree != (1u << kBufferCount) - 1;
+        mStreamHeap = NULL;
+        mStreamSlotSize = 0;
+        mStreamFree = 0;
+    }
+
+    // The access units the encoder still holds are in the heap, so it is
+    //  only kept for another use once they have all come back
+    if (inUse) {
+        mHeapPool.drop(heap);
+    } else {
+        mHeapPool.put(heap);
+    }
+}
+
+
+
+void CameraHardware::streamCallback(void* cookie, const uint8_t* data, size_t size,
+                                    nsecs_t timestamp, bool keyframe)
+{
+    static_cast<CameraHardware*>(cookie)->postStreamFrame(data, size, timestamp, keyframe);
+}
+
+
+
+void CameraHardware::postStreamFrame(const uint8_t* data, size_t size, nsecs_t timestamp, bool keyframe)
+{
+    // This is on the StreamCapture thread, which must never take mLock
+    if (!(mMsgEnabled & CAMERA_MSG_VIDEO_FRAME)) {
+        return;
+    }
+
+    int index;
+    uint8_t* slot;
+    {
+        Mutex::Autolock lock(mRecLock);
+
+        if (mStreamHeap == NULL) {
+            return;
+        }
+
+        // Dropping an access unit spoils the frames up to the next
+        //  keyframe, but the encoder must give the buffers back anyway
+        if (mStreamFree == 0) {
+            mRecDropped++;
+            return;
+        }
+
+        index = __builtin_ctz(mStreamFree);
+        mStreamFree &= ~(1u << index);
+        slot = (uint8_t*)mStreamHeap->data + index * mStreamSlotSize;
+    }
+
+    if (size > mStreamSlotSize - sizeof(StreamFrameHeader)) {
+        size = mStreamSlotSize - sizeof(StreamFrameHeader);
+    }
+
+    StreamFrameHeader* header = (StreamFrameHeader*)slot;
+    header->size = size;
+    header->flags = keyframe ? STREAM_FRAME_KEYFRAME : 0;
+    memcpy(slot + sizeof(StreamFrameHeader), data, size);
+
+    ScopedLatency timer(mVideoCallbackTime);
+    mDataCbTimestamp(timestamp, CAMERA_MSG_VIDEO_FRAME, mStreamHeap, index, mCallbackCookie);
+}
+
+
+
+void CameraHardware::postPreviewFrame(uint8_t* yuyv)
+{
+    //ALOGD("CameraHardware::postPreviewFrame: posting preview frame...");
+
+    // Get the preview buffer for the current frame
+    // This is always valid, even if the client died -- the memory
+    // is still mapped in our process.
+    uint8_t *frame = (uint8_t *)mPreviewBuffer[mCurrentPreviewFrame];
+
+    // If no preview buffer, we cant do anything...
+    if (frame == 0) {
+        ALOGE("No preview buffer!");
+        return;
+    }
+
+    // The callback gets the preview size, whatever the capture size is
+    int width = 0, height = 0;
+    mParameters.getPreviewSize(&width,&height);
+
+    // Convert from our raw frame to the one the Preview requires
+    if (mPreviewFmt != NULL) {
+        scaleFrame(STAGE_CALLBACK, mPreviewFmt->scaleDst, frame, width * mPreviewFmt->bytesPerPixel, height,
+                   width, height, yuyv);
+    } else {
+        ALOGE("Unhandled pixel format");
+    }
+
+    // Advance the buffer pointer.
+    auto previewBufferIdx = mCurrentPreviewFrame;
+    mCurrentPreviewFrame = (mCurrentPreviewFrame + 1) % kBufferCount;
+
+    ScopedLatency timer(mPreviewCallbackTime);
+    mDataCb(CAMERA_MSG_PREVIEW_FRAME, mPreviewHeap, previewBufferIdx, NULL, mCallbackCookie);
+}
+
+
+
+void CameraHardware::postAnalyticsFrame(uint8_t* luma)
+{
+    if (mAnalyticsHeap == NULL) {
+        ALOGE("No analytics buffer!");
+        return;
+    }
+
+    // The ring frame is given back after this, the app needs its own copy
+    auto index = mCurrentPreviewFrame;
+    memcpy((uint8_t*)mAnalyticsHeap->data + index * mAnalyticsFrameSize, luma, mAnalyticsFrameSize);
+    mCurrentPreviewFrame = (mCurrentPreviewFrame + 1) % kBufferCount;
+
+    ScopedLatency timer(mPreviewCallbackTime);
+    mDataCb(CAMERA_MSG_PREVIEW_FRAME, mAnalyticsHeap, index, NULL, mCallbackCookie);
+}
+
+
+
+void CameraHardware::fillPreviewWindow(uint8_t* yuyv)
+{
+    // Preview to a preview window...
+    if (mWin == 0) {
+        ALOGE("%s: No preview window",__FUNCTION__);
+        return;
+    }
+
+    // The GPU uploads the frame, unless it just turned out it can't
+    if (mGpuPreview) {
+        GlPreview::Source src;
+        memset(&src, 0, sizeof(src));
+        src.width = mRawPreviewWidth;
+        src.height = mRawPreviewHeight;
+        src.yuyv = yuyv;
+        src.yuyvStride = mRawPreviewWidth << 1;
+
+        drawPreviewWindow(src);
+        if (mGpuPreview) {
+            return;
+        }
+    }
+
+    // Get a videobuffer
+    int stride = 0;
+    buffer_handle_t* buf = dequeuePreviewBuffer(stride);
+    if (buf == NULL) {
+        return;
+    }
+
+    /* Now let the graphics framework to lock the buffer, and provide
+     * us with the framebuffer data address. */
+    void* vaddr = NULL;
+
+    const Rect bounds(mPreviewWinWidth, mPreviewWinHeight);
+    GraphicBufferMapper& grbuffer_mapper(GraphicBufferMapper::get());
+    status_t res = grbuffer_mapper.lock(*buf, GRALLOC_USAGE_SW_WRITE_OFTEN, bounds, &vaddr);
+    if (res != NO_ERROR || vaddr == NULL) {
+        ALOGE("%s: grbuffer_mapper.lock failure: %d -> %s",
+             __FUNCTION__, res, strerror(res));
+        mWin->cancel_buffer(mWin, buf);
+        return;
+    }
+
+    LOG_FRAME("ANativeWindow: bits:%p, stride in pixels:%d, w:%d, h: %d, format: %d",vaddr,stride,mPreviewWinWidth,mPreviewWinHeight,
+              mPreviewWinFmt != NULL ? mPreviewWinFmt->format : PIXEL_FORMAT_UNKNOWN);
+
+    // Based on the destination pixel type, we must convert from YUYV to it,
+    // scaling the frame to the window if it was captured at another size
+    if (mPreviewWinFmt != NULL) {
+        scaleFrame(STAGE_DISPLAY, mPreviewWinFmt->scaleDst, (uint8_t*)vaddr, stride * mPreviewWinFmt->bytesPerPixel,
+                   mPreviewWinHeight, mPreviewWinWidth, mPreviewWinHeight, yuyv);
+    } else {
         ALOGE("Unhandled pixel format");
     }
 
     /* Show it. */
-    mWin->enqueue_buffer(mWin, buf);
+    {
+        ScopedLatency timer(mWinEnqueueTime);
+        mWin->enqueue_buffer(mWin, buf);
+    }
 
     // Post the filled buffer!
     grbuffer_mapper.unlock(*buf);
@@ -1950,6 +2956,162 @@ void CameraHardware::fillPreviewWindow(uint8_t* yuyv, int srcWidth, int srcHeigh
 
 
 
+/*  A buffer of the preview window to fill, dequeued and locked by the
+    window, or NULL
+*/
+buffer_handle_t* CameraHardware::dequeuePreviewBuffer(int& stride)
+{
+    buffer_handle_t* buf = NULL;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    status_t res = mWin->dequeue_buffer(mWin, &buf, &stride);
+    nsecs_t dequeued = systemTime(SYSTEM_TIME_MONOTONIC);
+    mWinDequeueTime.add(dequeued - start);
+    if (res != NO_ERROR || buf == NULL) {
+        ALOGE("%s: Unable to dequeue preview window buffer: %d -> %s",
+            __FUNCTION__, -res, strerror(-res));
+        return NULL;
+    }
+
+    /* Let the preview window to lock the buffer. */
+    res = mWin->lock_buffer(mWin, buf);
+    mWinLockTime.add(systemTime(SYSTEM_TIME_MONOTONIC) - dequeued);
+    if (res != NO_ERROR) {
+        ALOGE("%s: Unable to lock preview window buffer: %d -> %s",
+             __FUNCTION__, -res, strerror(-res));
+        mWin->cancel_buffer(mWin, buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+
+
+int CameraHardware::previewWindowUsage() const
+{
+    // Only the GPU and the display touch the buffers the GPU draws
+    return mGpuPreview ? GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE : GRALLOC_USAGE_SW_WRITE_OFTEN;
+}
+
+
+
+/*  Has the GPU draw src into a window buffer and shows it. Returns what
+    GlPreview::draw() did, and NO_ERROR if there was no buffer to draw
+    into. The GPU preview is off for good if it can't draw at all.
+*/
+status_t CameraHardware::drawPreviewWindow(const GlPreview::Source& src)
+{
+    int stride = 0;
+    buffer_handle_t* buf = dequeuePreviewBuffer(stride);
+    if (buf == NULL) {
+        return NO_ERROR;
+    }
+
+    GlPreview::Params params;
+    params.rotation = (mSpec.gpuPreview == CameraSpec::GPU_PREVIEW_ROTATE) ? mSpec.orientation : 0;
+    params.bt709 = isBt709();
+    params.limitedRange = mSpec.limitedRange;
+
+    status_t res;
+    {
+        ScopedLatency timer(mScaleTime[STAGE_DISPLAY]);
+        res = mGl.draw(*buf, stride, mPreviewWinWidth, mPreviewWinHeight,
+                       mPreviewWinFmt != NULL ? mPreviewWinFmt->format : PIXEL_FORMAT_UNKNOWN, src, params);
+    }
+
+    if (res != NO_ERROR) {
+        mWin->cancel_buffer(mWin, buf);
+        if (res == INVALID_OPERATION) {
+            disableGpuPreview();
+        }
+        return res;
+    }
+
+    /* Show it. */
+    ScopedLatency timer(mWinEnqueueTime);
+    mWin->enqueue_buffer(mWin, buf);
+    return NO_ERROR;
+}
+
+
+
+int CameraHardware::gpuHeldFrames() const
+{
+    // Zero copy, that is tried first, has no use for them
+    return mGpuPreview && mSpec.zeroCopy == CameraSpec::ZEROCOPY_OFF ? kGpuFrames : 0;
+}
+
+
+
+// Called by the preview thread with the frame still acquired
+void CameraHardware::queueGpuFrame(nsecs_t timestamp)
+{
+    // If the display holds all the others this frame is dropped
+    FrameRing::Frame* slot = mGpuFrames.beginWrite();
+    if (slot == NULL) {
+        camera.ReleaseFrame();
+        return;
+    }
+
+    GpuFrame* frame = (GpuFrame*)slot->data;
+
+    // The frame that was in it was never drawn
+    if ((slot->flags & FRAME_HELD) && frame->buffer >= 0) {
+        camera.ReturnFrame(frame->buffer);
+    }
+
+    FramePlane planes[VIDEO_MAX_PLANES];
+    int count = camera.getFramePlanes(planes);
+
+    GlPreview::Source& src = frame->src;
+    memset(&src, 0, sizeof(src));
+    camera.getSize(src.width, src.height);
+    src.fourcc = camera.getPixelFormat();
+    src.planeCount = (count < GlPreview::MAX_PLANES) ? count : (int)GlPreview::MAX_PLANES;
+
+    for (int p = 0; p < src.planeCount; p++) {
+        src.fd[p] = planes[p].fd;
+        src.offset[p] = planes[p].offset;
+        src.stride[p] = planes[p].stride;
+    }
+
+    frame->buffer = camera.HoldFrame();
+    slot->flags = FRAME_HELD;
+    mGpuFrames.endWrite(slot, timestamp);
+}
+
+
+
+// Called by the display thread, which gives the frame back to the camera
+void CameraHardware::displayGpuFrame(FrameRing::Frame* held)
+{
+    GpuFrame* frame = (GpuFrame*)held->data;
+    status_t res = (mWin != 0) ? drawPreviewWindow(frame->src) : NO_ERROR;
+
+    camera.ReturnFrame(frame->buffer);
+    frame->buffer = -1;
+
+    // The next frames go through the YUYV ring instead
+    if (res == BAD_VALUE) {
+        ALOGW("displayGpuFrame: the GPU can't read the captured frames, uploading them instead");
+        mGpuDirect = false;
+    }
+}
+
+
+
+void CameraHardware::disableGpuPreview()
+{
+    ALOGW("disableGpuPreview: the GPU can't draw the preview window, the CPU does instead");
+    mGpuPreview = false;
+    mGpuDirect = false;
+
+    // The buffers the window makes from now on can be written by the CPU
+    mWin->set_usage(mWin, previewWindowUsage());
+}
+
+
+
 nsecs_t CameraHardware::frameTimeout()
 {
     // Calculate how long to wait between frames and add 20%.
@@ -1968,6 +3130,148 @@ int CameraHardware::beginAutoFocusThread(void *cookie)
 
 
 
+/*  All the cameras share a compressor for the single pictures, so more
+    cameras don't mean more line buffers. The encoding itself is split
+    over the converter threads.
+*/
+static Mutex                gJpegLock;
+static PictureCompressor    gJpegCompressor;    // protected by gJpegLock
+
+
+
+/*  How a picture of width x height is to be compressed, with the EXIF as
+    the parameters are now
+*/
+void CameraHardware::pictureSettingsLocked(PictureSettings& settings, int width, int height)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    settings.quality = mParameters.getInt(CameraParameters::KEY_JPEG_QUALITY);
+    settings.thumbWidth = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH);
+    settings.thumbHeight = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT);
+    settings.thumbQuality = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY);
+    if (settings.thumbQuality < 1 || settings.thumbQuality > 100) {
+        settings.thumbQuality = 75;
+    }
+
+    ExifInfo& exif = settings.exif;
+
+    property_get("ro.product.manufacturer", value, "");
+    exif.make = value;
+    property_get("ro.product.model", value, "");
+    exif.model = value;
+
+    exif.width = width;
+    exif.height = height;
+    exif.rotation = mParameters.getInt(CameraParameters::KEY_ROTATION);
+    exif.time = time(NULL);
+    exif.focalLength = mParameters.getFloat(CameraParameters::KEY_FOCAL_LENGTH);
+
+    // The app sets the GPS keys when it knows where it is
+    const char* latitude = mParameters.get(CameraParameters::KEY_GPS_LATITUDE);
+    const char* longitude = mParameters.get(CameraParameters::KEY_GPS_LONGITUDE);
+    if (latitude != NULL && longitude != NULL) {
+        const char* altitude = mParameters.get(CameraParameters::KEY_GPS_ALTITUDE);
+        const char* timestamp = mParameters.get(CameraParameters::KEY_GPS_TIMESTAMP);
+        const char* method = mParameters.get(CameraParameters::KEY_GPS_PROCESSING_METHOD);
+
+        exif.hasGps = true;
+        exif.latitude = strtod(latitude, NULL);
+        exif.longitude = strtod(longitude, NULL);
+        exif.altitude = altitude != NULL ? strtod(altitude, NULL) : 0;
+        exif.gpsTime = timestamp != NULL ? (time_t)strtoll(timestamp, NULL, 10) : exif.time;
+        if (method != NULL) {
+            exif.gpsMethod = method;
+        }
+    }
+}
+
+
+
+/*  The next of the jpeg heaps, made if it is too small for a picture,
+    with the picture it held before let go. Returns its index in index.
+*/
+sp<MemoryHeapBase> CameraHardware::nextJpegHeapLocked(int& index)
+{
+    index = mJpegHeapIndex;
+    mJpegHeapIndex = (mJpegHeapIndex + 1) % kJpegHeapCount;
+
+    if (mJpegPictures[index]) {
+        mJpegPictures[index]->release(mJpegPictures[index]);
+        mJpegPictures[index] = NULL;
+    }
+
+    sp<MemoryHeapBase>& heap = mJpegHeaps[index];
+
+    if (heap == 0 || heap->getSize() < (size_t)mJpegPictureBufferSize) {
+        heap = new MemoryHeapBase(mJpegPictureBufferSize, 0, "CameraJpegPicture");
+        if (heap->getHeapID() < 0) {
+            ALOGE("Unable to allocate memory for JpegPicture");
+            heap.clear();
+            return NULL;
+        }
+        ALOGD("nextJpegHeapLocked: jpeg heap %d allocated", index);
+    }
+
+    return heap;
+}
+
+
+
+/*  A camera_memory_t of exactly the size of the picture in jpeg heap
+    index, to be given to mDataCb
+*/
+camera_memory_t* CameraHardware::mapJpegPicture(int index, int size)
+{
+    camera_memory_t* mem = mRequestMemory(mJpegHeaps[index]->getHeapID(), size, 1, mCallbackCookie);
+    if (mem == NULL) {
+        ALOGE("Unable to map the jpeg picture");
+        return NULL;
+    }
+
+    mJpegPictures[index] = mem;
+    return mem;
+}
+
+
+
+/*  Compresses a YUYV picture, with its EXIF and thumbnail, straight into
+    the next of the jpeg heaps, and returns a camera_memory_t on that heap
+    of exactly the compressed size, to be given to mDataCb. So there is no
+    copy and no allocation beyond the first pictures. The heaps are as big
+    as the raw picture, but ashmem only uses memory for the pages that are
+    written.
+*/
+camera_memory_t* CameraHardware::compressPictureLocked(uint8_t* yuyv, int stride, int width, int height)
+{
+    PictureSettings settings;
+    pictureSettingsLocked(settings, width, height);
+
+    int index;
+    sp<MemoryHeapBase> heap = nextJpegHeapLocked(index);
+    if (heap == 0) {
+        return NULL;
+    }
+
+    int fileSize;
+    {
+        Mutex::Autolock lock(gJpegLock);
+
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        fileSize = gJpegCompressor.compress(settings, yuyv, stride, (uint8_t*)heap->getBase(),
+                                            heap->getSize());
+        mJpegTime.add(systemTime(SYSTEM_TIME_MONOTONIC) - start);
+    }
+    if (fileSize < 0) {
+        ALOGE("Unable to compress the picture");
+        return NULL;
+    }
+
+    return mapJpegPicture(index, fileSize);
+}
+
+
+
 int CameraHardware::autoFocusThread()
 {
     ALOGD("autoFocusThread");
@@ -1987,14 +3291,225 @@ int CameraHardware::beginPictureThread(void *cookie)
 
 
 
+/*  The first YUYV frame of the preview captured from time on or, if
+    closest, the frame kept for ZSL that was captured closest to it
+*/
+FrameRing::Frame* CameraHardware::acquireStillLocked(nsecs_t time, bool closest)
+{
+    FrameRing::Frame* frame = NULL;
+
+    if (closest) {
+        frame = mFrames.acquireClosest(time);
+    }
+
+    if (frame == NULL) {
+        // The first frame we get may be from before the shutter press
+        FrameRing::Reader reader;
+        mStillWanted = true;
+
+        for (int tries = 0; tries < 10; tries++) {
+            frame = mFrames.acquire(reader, 10 * frameTimeout());
+            if (frame == NULL || (frame->timestamp >= time && (frame->flags & FRAME_YUYV))) {
+                break;
+            }
+            mFrames.release(frame);
+            frame = NULL;
+        }
+
+        mStillWanted = false;
+    }
+
+    return frame;
+}
+
+
+
+/*  Copies a preview frame into dst as a width x height picture. A smaller
+    picture is cropped to its aspect ratio and scaled down.
+*/
+void CameraHardware::copyStillLocked(uint8_t* dst, FrameRing::Frame* frame, int width, int height)
+{
+    int stride = mRawPreviewWidth << 1;
+
+    if (width != mRawPreviewWidth || height != mRawPreviewHeight) {
+        int cropWidth, cropHeight;
+        uint8_t* src = cropToAspect(frame->data, mRawPreviewWidth, mRawPreviewHeight, width, height, cropWidth, cropHeight);
+
+        yuyv_scale(dst, width << 1, width, height, src, stride, cropWidth, cropHeight);
+    } else {
+        memcpy(dst, frame->data, height * stride);
+    }
+}
+
+
+
+/*  Takes the picture from the running preview instead of restarting the
+    camera at the picture size, so the preview never stops and there is no
+    wait for the exposure to settle. With ZSL it is the frame captured
+    closest to takePicture(), else the first one captured after it.
+*/
+status_t CameraHardware::takePictureFromPreviewLocked(int width, int height, bool& raw, camera_memory_t*& jpeg)
+{
+    if (mRawBuffer == NULL) {
+        ALOGE("takePictureFromPreviewLocked: no raw picture heap");
+        return NO_MEMORY;
+    }
+
+    FrameRing::Frame* frame = acquireStillLocked(mPictureTime, mSpec.zslFrames > 0);
+
+    if (frame == NULL) {
+        ALOGE("takePictureFromPreviewLocked: no frame from the preview");
+        return TIMED_OUT;
+    }
+
+    ALOGD("takePictureFromPreviewLocked: frame %llu, %lld us from the shutter",
+        (unsigned long long)frame->seq, (long long)ns2us(frame->timestamp - mPictureTime));
+
+    uint8_t* yuyv = frame->data;
+    int stride = mRawPreviewWidth << 1;
+
+    // The frame itself is compressed if it is the picture and no raw one
+    // is wanted
+    if (width != mRawPreviewWidth || height != mRawPreviewHeight ||
+        (mMsgEnabled & CAMERA_MSG_RAW_IMAGE)) {
+        copyStillLocked((uint8_t*)mRawBuffer, frame, width, height);
+
+        yuyv = (uint8_t*)mRawBuffer;
+        stride = width << 1;
+    }
+
+    if (mMsgEnabled & CAMERA_MSG_RAW_IMAGE) {
+        ALOGD("takePictureFromPreviewLocked: took raw picture");
+        raw = true;
+    }
+
+    if (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
+        jpeg = compressPictureLocked(yuyv, stride, width, height);
+        if (jpeg) {
+            ALOGD("takePictureFromPreviewLocked: took jpeg picture compressed to %d bytes", (int)jpeg->size);
+        }
+    }
+
+    mFrames.release(frame);
+    return NO_ERROR;
+}
+
+
+
+/*  Takes count pictures from the running preview: the first as a single
+    picture is, then each from the first frame interval ms after the one
+    before, or the next frame if it is 0. mLock is only held while a frame
+    is taken, and mPictureEncoder compresses the pictures meanwhile, so a
+    picture only waits for the others if all the buffers are in flight.
+    The encoder threads deliver them in order, and we wait for the last
+    one so that none comes once the picture thread is gone.
+*/
+status_t CameraHardware::takeBurst(int width, int height, int count, int interval, nsecs_t start)
+{
+    ALOGD("takeBurst: %d pictures of %dx%d, %d ms apart", count, width, height, interval);
+
+    status_t status = NO_ERROR;
+    nsecs_t due = start;
+    int taken = 0;
+
+    while (taken < count && !mBurstCancelled) {
+        uint8_t* yuyv = mPictureEncoder.acquire(width * height * 2, s2ns(10));
+        if (yuyv == NULL) {
+            ALOGE("takeBurst: the pictures are not being compressed");
+            status = TIMED_OUT;
+            break;
+        }
+
+        // The frame is waited for with the lock held, so not before it is due
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (due > now) {
+            usleep(ns2us(due - now));
+        }
+
+        PictureSettings settings;
+        sp<MemoryHeapBase> heap;
+        int index = 0;
+        bool shutter;
+        {
+            Mutex::Autolock lock(mLock);
+
+            FrameRing::Frame* frame = NULL;
+            if (mPreviewThread == 0 || width > mRawPreviewWidth || height > mRawPreviewHeight) {
+                ALOGE("takeBurst: the preview was stopped or made smaller");
+                status = INVALID_OPERATION;
+            } else if ((frame = acquireStillLocked(due, taken == 0 && mSpec.zslFrames > 0)) == NULL) {
+                ALOGE("takeBurst: no frame from the preview");
+                status = TIMED_OUT;
+            } else {
+                ALOGD("takeBurst: picture %d from frame %llu", taken, (unsigned long long)frame->seq);
+
+                copyStillLocked(yuyv, frame, width, height);
+                due = frame->timestamp + (interval > 0 ? ms2ns(interval) : 1);
+                mFrames.release(frame);
+
+                pictureSettingsLocked(settings, width, height);
+                heap = nextJpegHeapLocked(index);
+                if (heap == 0) {
+                    status = NO_MEMORY;
+                }
+            }
+
+            shutter = (mMsgEnabled & CAMERA_MSG_SHUTTER) != 0;
+        }
+
+        if (status != NO_ERROR) {
+            mPictureEncoder.cancel(yuyv);
+            break;
+        }
+
+        if (shutter) {
+            mNotifyCb(CAMERA_MSG_SHUTTER, 0, 0, mCallbackCookie);
+        }
+
+        mPictureEncoder.queue(yuyv, width << 1, settings, (uint8_t*)heap->getBase(), heap->getSize(),
+                              index, [this](int index, int size) { deliverBurstPicture(index, size); });
+        taken++;
+    }
+
+    mPictureEncoder.flush();
+
+    ALOGD("takeBurst: %d of %d pictures taken", taken, count);
+    return status;
+}
+
+
+
+/*  Called on an encoder thread with each picture of a burst, in order */
+void CameraHardware::deliverBurstPicture(int index, int size)
+{
+    camera_memory_t* mem = size >= 0 ? mapJpegPicture(index, size) : NULL;
+
+    if (mem == NULL) {
+        ALOGE("deliverBurstPicture: a picture could not be compressed");
+        reportError(CAMERA_ERROR_UNKNOWN);
+        return;
+    }
+
+    if (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
+        ALOGD("deliverBurstPicture: %d bytes", size);
+        mDataCb(CAMERA_MSG_COMPRESSED_IMAGE, mem, 0, NULL, mCallbackCookie);
+    }
+}
+
+
+
 int CameraHardware::pictureThread()
 {
     ALOGD("pictureThread");
 
     bool raw = false;
-    bool jpeg = false;
+    camera_memory_t* jpeg = NULL;
     bool shutter = false;
     status_t status = NO_ERROR;
+    int w, h;
+    int burst = 1;
+    int burstInterval = 0;
+    nsecs_t burstStart = 0;
 
     {
         Mutex::Autolock lock(mLock);
@@ -2004,7 +3519,6 @@ int CameraHardware::pictureThread()
             return NO_INIT;
         }
 
-        int w, h;
         mParameters.getPictureSize(&w, &h);
         ALOGD("pictureThread: taking picture of %dx%d", w, h);
 
@@ -2013,134 +3527,148 @@ int CameraHardware::pictureThread()
             shutter = true;
         }
 
-        /* The camera application will restart preview ... */
-        if (mPreviewThread != 0) {
-            stopPreviewLocked();
-        }
+        /* Take it from the preview if it's running and big enough */
+        if (mPreviewThread != 0 && mSpec.stillCapture == CameraSpec::STILL_PREVIEW &&
+            w <= mRawPreviewWidth && h <= mRawPreviewHeight) {
+            burst = mParameters.getInt("num-snaps-per-shutter");
+
+            if (burst > 1 && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
+                // Taken below without the lock, with a shutter for each
+                burstInterval = mParameters.getInt("burst-interval");
+                burstStart = mPictureTime;
+                shutter = false;
+            } else {
+                burst = 1;
+                status = takePictureFromPreviewLocked(w, h, raw, jpeg);
+            }
+        } else {
+            /* The camera application will restart preview ... */
+            if (mPreviewThread != 0) {
+                stopPreviewLocked();
+            }
 
-        ALOGD("pictureThread: taking picture (%d x %d)", w, h);
+            ALOGD("pictureThread: taking picture (%d x %d)", w, h);
 
-        if (camera.Open(mSpec) == NO_ERROR) {
-            camera.Init(w, h, 1);
+            coolLocked();
+            if (camera.Open(mSpec) == NO_ERROR) {
+                camera.Init(w, h, 1);
 
-            /* Retrieve the real size being used */
-            camera.getSize(w,h);
+                /* Retrieve the real size being used */
+                camera.getSize(w,h);
 
-            ALOGD("pictureThread: effective size: %dx%d",w, h);
+                ALOGD("pictureThread: effective size: %dx%d",w, h);
 
-            /* Store it as the picture size to use */
-            mParameters.setPictureSize(w, h);
+                /* Store it as the picture size to use */
+                mParameters.setPictureSize(w, h);
 
-            /* And reinit the capture heap to reflect the real used size if needed */
-            initHeapLocked();
+                /* And reinit the capture heap to reflect the real used size if needed */
+                initHeapLocked();
 
-            camera.StartStreaming();
+                camera.StartStreaming();
 
-            ALOGD("pictureThread: waiting until camera picture stabilizes...");
+                ALOGD("pictureThread: waiting until camera picture stabilizes...");
 
-            int maxFramesToWait = 8;
-            int luminanceStableFor = 0;
-            int prevLuminance = 0;
-            int prevDif = -1;
-            int stride = w << 1;
-            int thresh = (w >> 4) * (h >> 4) * 12; // 5% of full range
+                int maxFramesToWait = 8;
+                int luminanceStableFor = 0;
+                int prevLuminance = 0;
+                int size = (w * h) << 1;
 
-            while (status == NO_ERROR && maxFramesToWait > 0 && luminanceStableFor < 4) {
-                uint8_t* ptr = (uint8_t *)mRawBuffer;
+                // The luminance is metered on a grey picture with a point
+                // for each 16 x 16 pixels, so only the frame that is kept is
+                // converted to YUYV
+                int mw = (w >> 4) > 0 ? (w >> 4) : 1;
+                int mh = (h >> 4) > 0 ? (h >> 4) : 1;
+                int thresh = mw * mh * 12; // 5% of full range
+                std::vector<uint8_t> meter(mw * mh);
 
-                /*  Get the image. It takes several frame times for the first one to come
-                    through. Until the frame comes through the luminance will measure as 
-                    zero and the picture will appear to be stable. A longer time-out helps too.
-                */
-                for (int dead = 0; dead < 10; ++dead) {
-                    status = camera.GrabRawFrame(ptr, (w * h) << 1, 10 * frameTimeout()); // Always YUYV
+                while (status == NO_ERROR && maxFramesToWait > 0 && luminanceStableFor < 4) {
+                    uint8_t* ptr = (uint8_t *)mRawBuffer;
 
-                    if (!(status == TIMED_OUT || status == NOT_ENOUGH_DATA)) {
-                        break;
-                    }
-                }
+                    /*  Get the image. It takes several frame times for the first one to come
+                        through. Until the frame comes through the luminance will measure as 
+                        zero and the picture will appear to be stable. A longer time-out helps too.
+                    */
+                    for (int dead = 0; dead < 10; ++dead) {
+                        status = camera.AcquireFrame(10 * frameTimeout());
 
-                if (status != NO_ERROR) {
-                    // Give up
-                    ALOGE("failed to get a frame: status=%d", status);
-                    break;
-                }
-
-                // luminance metering points
-                int luminance = 0;
-                for (int x = 0; x < (w<<1); x += 32) {
-                    for (int y = 0; y < h*stride; y += 16*stride) {
-                        luminance += ptr[y + x];
+                        if (!(status == TIMED_OUT || status == NOT_ENOUGH_DATA)) {
+                            break;
+                        }
                     }
-                }
 
-                // Calculate variation of luminance
-                int dif = prevLuminance - luminance;
-                if (dif < 0) dif = -dif;
-                prevLuminance = luminance;
+                    if (status != NO_ERROR) {
+                        // Give up
+                        ALOGE("failed to get a frame: status=%d", status);
+                        break;
+                    }
 
-                // Wait until variation is less than 5%
-                if (dif > thresh) {
-                    luminanceStableFor = 1;
-                } else {
-                    luminanceStableFor++;
-                }
+                    // luminance metering points, from the YUYV if the
+                    // capture format has no luma to sample
+                    bool converted = false;
+                    if (camera.ConvertLuma(&meter[0], mw, mw, mh) != NO_ERROR) {
+                        status = camera.ConvertFrame(ptr, size); // Always YUYV
+                        luma_decimate(&meter[0], mw, mw, mh, ptr, w << 1, w, h, 2);
+                        converted = true;
+                    }
 
-                maxFramesToWait--;
+                    int luminance = 0;
+                    for (size_t i = 0; i < meter.size(); i++) {
+                        luminance += meter[i];
+                    }
 
-                ALOGD("luminance: %4d, dif: %4d, thresh: %d, stableFor: %d, maxWait: %d", luminance, dif, thresh, luminanceStableFor, maxFramesToWait);
-            }
+                    // Calculate variation of luminance
+                    int dif = prevLuminance - luminance;
+                    if (dif < 0) dif = -dif;
+                    prevLuminance = luminance;
 
-            ALOGD("pictureThread: picture taken");
+                    // Wait until variation is less than 5%
+                    if (dif > thresh) {
+                        luminanceStableFor = 1;
+                    } else {
+                        luminanceStableFor++;
+                    }
 
-            if (status == NO_ERROR && mMsgEnabled & CAMERA_MSG_RAW_IMAGE) {
+                    maxFramesToWait--;
 
-                ALOGD("pictureThread: took raw picture");
-                raw = true;
-            }
+                    // The last frame is the picture
+                    if (!converted && (maxFramesToWait == 0 || luminanceStableFor >= 4)) {
+                        status = camera.ConvertFrame(ptr, size); // Always YUYV
+                    }
+                    camera.ReleaseFrame();
 
-            if (status == NO_ERROR && mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
+                    ALOGD("luminance: %4d, dif: %4d, thresh: %d, stableFor: %d, maxWait: %d", luminance, dif, thresh, luminanceStableFor, maxFramesToWait);
+                }
 
-                int quality = mParameters.getInt(CameraParameters::KEY_JPEG_QUALITY);
+                ALOGD("pictureThread: picture taken");
 
-                uint8_t* jpegBuff = (uint8_t*) malloc(mJpegPictureBufferSize);
-                if (jpegBuff) {
+                if (status == NO_ERROR && mMsgEnabled & CAMERA_MSG_RAW_IMAGE) {
 
-                    // Compress the raw captured image to our buffer
-                    int fileSize = yuyv_to_jpeg((uint8_t *)mRawBuffer, jpegBuff, mJpegPictureBufferSize, w, h, w << 1,quality);
+                    ALOGD("pictureThread: took raw picture");
+                    raw = true;
+                }
 
-                    // Create a buffer with the exact compressed size
-                    if (mJpegPictureHeap) {
-                        mJpegPictureHeap->release(mJpegPictureHeap);
-                        mJpegPictureHeap = NULL;
-                    }
+                if (status == NO_ERROR && mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
 
-                    mJpegPictureHeap = mRequestMemory(-1,fileSize,1,mCallbackCookie);
-                    if (mJpegPictureHeap) {
-                        memcpy(mJpegPictureHeap->data,jpegBuff,fileSize);
-                        ALOGD("pictureThread: took jpeg picture compressed to %d bytes, q=%d", fileSize, quality);
-                        jpeg = true;
-                    } else {
-                        ALOGE("Unable to allocate memory for RawPicture");
+                    jpeg = compressPictureLocked((uint8_t*)mRawBuffer, w << 1, w, h);
+                    if (jpeg) {
+                        ALOGD("pictureThread: took jpeg picture compressed to %d bytes", (int)jpeg->size);
                     }
-                    free(jpegBuff);
-
-                } else {
-
-                    ALOGE("Unable to allocate temporary memory for Jpeg compression");
                 }
 
-            }
-
-            camera.StopStreaming();
-            camera.Uninit();
-            camera.Close();
+                camera.StopStreaming();
+                camera.Uninit();
+                camera.Close();
 
-        } else {
-            ALOGE("pictureThread: failed to grab image");
+            } else {
+                ALOGE("pictureThread: failed to grab image");
+            }
         }
     }
 
+    if (burst > 1) {
+        status = takeBurst(w, h, burst, burstInterval, burstStart);
+    }
+
     /* All this callbacks can potentially call one of our methods.
     Make sure to dispatch them OUTSIDE the lock! */
     if (shutter) {
@@ -2155,7 +3683,7 @@ int CameraHardware::pictureThread()
 
     if (jpeg) {
         ALOGD("Sending the jpeg message");
-        mDataCb(CAMERA_MSG_COMPRESSED_IMAGE, mJpegPictureHeap, 0, NULL, mCallbackCookie);
+        mDataCb(CAMERA_MSG_COMPRESSED_IMAGE, jpeg, 0, NULL, mCallbackCookie);
     }
 
     ALOGD("pictureThread OK");
@@ -21,13 +21,26 @@
 #include <camera/CameraParameters.h>
 #include <system/camera_metadata.h>
 #include <hardware/camera.h>
+#include <media/hardware/MetadataBufferType.h>
+#include <ui/GraphicBuffer.h>
 #include <utils/threads.h>
 
 #include "Utils.h"
 #include "CameraSpec.h"
+#include "FormatTraits.h"
+#include "FrameRing.h"
+#include "GlPreview.h"
+#include "HeapPool.h"
+#include "LatencyHistogram.h"
+#include "PictureEncoder.h"
+#include "DeviceWatcher.h"
+#include "StreamCapture.h"
 #include "SurfaceSize.h"
 #include "V4L2Camera.h"
 
+struct jpeg_encoder;
+struct yuyv_scaler;
+
 namespace android {
 
 class CameraHardware : public camera_device {
@@ -192,7 +205,7 @@ public:
 
 private:
 
-    bool NegotiatePreviewFormat(struct preview_stream_ops* win);
+    bool NegotiatePreviewFormat(struct preview_stream_ops* win, int fmt);
     nsecs_t frameTimeout();
 
 public:
@@ -247,16 +260,28 @@ private:
         int fh;
         SortedVector<SurfaceSize> avSizes;
         SortedVector<int> avFps;
+        String8 passthrough;                    // video-passthrough-values
 
         bool set(CameraHardware& ch);
     };
 
 
     static const int kBufferCount = 4;
+    static const int kBurstBuffers = 3;         // pictures of a burst in flight
+    static const int kBurstThreads = 2;
+    static const int kMaxBurstCount = 30;
+    static const int kJpegHeapCount = kBurstBuffers + 2;
+    static const int kStreamFormatCount = 2;    // H.264 and HEVC
+    static const int kGpuFrames = 3;            // captured frames held for the GPU preview
 
     bool tryOpenCamera();
+    bool checkCameraUnplugged();
     void initStaticCameraMetadata();
+    void initParametersLocked();
+    void prewarmLocked();
+    void coolLocked();
     void initHeapLocked();
+    void getCaptureSizeLocked(int& width, int& height);
 
     class PreviewThread : public Thread
     {
@@ -268,20 +293,72 @@ private:
         virtual bool threadLoop();
     };
 
+    /*  The stages that consume the captured frames, each on its own thread */
+    enum { STAGE_DISPLAY, STAGE_CALLBACK, STAGE_RECORD, STAGE_COUNT };
+
+    /*  What the preview thread put in a frame of the ring. The analytics
+        luma is after the YUYV frame, and a frame may have it alone when
+        only the preview callback wants the frames. The frames of mGpuFrames
+        are GpuFrames, FRAME_HELD once one has been written.
+    */
+    enum { FRAME_YUYV = 1, FRAME_LUMA = 2, FRAME_HELD = 4 };
+
+    class ConsumerThread : public Thread
+    {
+        CameraHardware* mHardware;
+        int             mStage;
+
+    public:
+        ConsumerThread(CameraHardware* hw, int stage);
+        virtual void onFirstRef();
+        virtual bool threadLoop();
+    };
+
     status_t startPreviewLocked();
     void     stopPreviewLocked();
     bool     previewThread();
+    bool     consumerThread(int stage);
+    bool     captureFrame(FrameRing::Frame* slot, bool yuyv, bool luma);
+    void     postPreviewFrame(uint8_t* yuyv);
+    void     postAnalyticsFrame(uint8_t* luma);
+    void     postRecordingFrame(uint8_t* yuyv, nsecs_t timestamp);
+    void     convertRecordingFrame(uint8_t* dst, int stride, uint8_t* yuyv);
+    void     scaleFrame(int stage, int dstFmt, uint8_t* dst, int dstStride, int dstHeight,
+                        int width, int height, uint8_t* yuyv);
+
+    /*  The recording buffers, either frames in mRecordingHeap or gralloc
+        buffers that the metadata buffers in mRecordingMetaHeap point at
+    */
+    void     allocRecordingBuffersLocked(int width, int height);
+    void     freeRecordingBuffersLocked();
 
+    /*  Passthrough recording. The camera's own H.264 or HEVC stream is
+        given to the encoder as it is, one access unit in each buffer,
+        instead of YUV frames from the preview.
+    */
+    bool     startPassthroughLocked();
+    void     stopPassthroughLocked();
+    static void streamCallback(void* cookie, const uint8_t* data, size_t size,
+                               nsecs_t timestamp, bool keyframe);
+    void     postStreamFrame(const uint8_t* data, size_t size, nsecs_t timestamp, bool keyframe);
+
+    /*  Opens the camera when it is plugged in and closes it when it is
+        unplugged. It sleeps until a video device comes or goes.
+    */
     class HotPlugThread : public Thread
     {
         CameraHardware* mHardware;
         size_t          mCheckCount;
         bool            mStarted;
+        bool            mOpened;
+        DeviceWatcher   mWatcher;
 
     public:
         HotPlugThread(CameraHardware* hw);
         virtual void onFirstRef();
         virtual bool threadLoop();
+
+        void stop();                // wakes it up and waits for it to exit
     };
 
     static int beginAutoFocusThread(void *cookie);
@@ -290,7 +367,52 @@ private:
     static int beginPictureThread(void *cookie);
     int pictureThread();
 
-    void fillPreviewWindow(uint8_t* yuyv, int srcWidth, int srcHeight);
+    void fillPreviewWindow(uint8_t* yuyv);
+    buffer_handle_t* dequeuePreviewBuffer(int& stride);
+    void pictureSettingsLocked(PictureSettings& settings, int width, int height);
+    sp<MemoryHeapBase> nextJpegHeapLocked(int& index);
+    camera_memory_t* mapJpegPicture(int index, int size);
+    camera_memory_t* compressPictureLocked(uint8_t* yuyv, int stride, int width, int height);
+    FrameRing::Frame* acquireStillLocked(nsecs_t time, bool closest);
+    void copyStillLocked(uint8_t* dst, FrameRing::Frame* frame, int width, int height);
+    status_t takePictureFromPreviewLocked(int width, int height, bool& raw, camera_memory_t*& jpeg);
+    status_t takeBurst(int width, int height, int count, int interval, nsecs_t start);
+    void deliverBurstPicture(int index, int size);
+
+    /*  Zero copy preview. The camera captures into a preview window buffer
+        for each of its buffers, that we keep dequeued and locked. Each filled
+        one is posted and replaced by a fresh one.
+    */
+    status_t startZeroCopyLocked(int width, int height, int fps);
+    bool queueZeroCopyBuffer(int index);
+    void displayZeroCopyFrame();
+    void releaseZeroCopyBuffers();
+
+    /*  GPU preview. mGl draws the window buffers on the display thread,
+        from the captured dma-bufs if it can read them, else from the YUYV
+        frames of the ring. If the GPU can't draw them at all the CPU does
+        from then on.
+
+        The preview thread hands each captured frame it reads over to the
+        display thread through mGpuFrames, with its V4L2 buffer held, so a
+        slow window never keeps the capture waiting. The buffer goes back to
+        the camera once it has been drawn, or when the slot is written again
+        if it never was. The camera has kGpuFrames more buffers for them.
+    */
+    struct GpuFrame {
+        int                 buffer;         // the V4L2 buffer held, or -1
+        GlPreview::Source   src;
+    };
+
+    int      previewWindowUsage() const;
+    int      gpuHeldFrames() const;
+    status_t drawPreviewWindow(const GlPreview::Source& src);
+    void     queueGpuFrame(nsecs_t timestamp);
+    void     displayGpuFrame(FrameRing::Frame* frame);
+    void     disableGpuPreview();
+    bool     isBt709() const;
+
+    void resetStats();
 
     mutable Mutex       mLock;
 
@@ -303,23 +425,52 @@ private:
     Condition           mReadyCond;
 
     preview_stream_ops* mWin;
-    int                 mPreviewWinFmt;
+    const HalFormat*    mPreviewWinFmt;             // NULL until the window takes a format
     int                 mPreviewWinWidth;
     int                 mPreviewWinHeight;
 
+    bool                mZeroCopy;                  // capturing into the window buffers
+    buffer_handle_t*    mZeroCopyBufs[MAX_BUFFERS]; // window buffer held by each camera buffer
+
+    GlPreview           mGl;
+    std::atomic<bool>   mGpuPreview;                // the GPU draws the window, until it fails
+    std::atomic<bool>   mGpuDirect;                 // from the captured dma-bufs, through mGpuFrames
+
     CameraParameters    mParameters;
+    bool                mHaveParameters;            // mParameters has been set
     CameraSpec          mSpec;
 
+    // The capture the camera was left set up for by prewarmLocked(), all 0
+    // if it wasn't. Protected by mLock.
+    int                 mWarmWidth;
+    int                 mWarmHeight;
+    int                 mWarmFps;
+
+    // Where the heaps below come from, so that remaking them for new sizes
+    // reuses the memory of the old ones
+    HeapPool            mHeapPool;
+
     camera_memory_t*    mRawPreviewHeap;
     int                 mRawPreviewFrameSize;
     void*               mRawPreviewBuffer;
-    int                 mRawPreviewWidth;
+    int                 mRawPreviewWidth;           // what the camera captures
     int                 mRawPreviewHeight;
+    int                 mCaptureWidth;              // what it was asked to capture
+    int                 mCaptureHeight;
 
     camera_memory_t*    mPreviewHeap;
     int                 mPreviewFrameSize;
     void*               mPreviewBuffer[kBufferCount];
-    int                 mPreviewFmt;
+    const HalFormat*    mPreviewFmt;
+
+    // The analytics stream: the luma of every mAnalyticsInterval-th frame,
+    // decimated to mAnalyticsWidth x mAnalyticsHeight, given to the preview
+    // callback instead of the preview frames. The width is 0 when it is off.
+    camera_memory_t*    mAnalyticsHeap;
+    int                 mAnalyticsWidth;
+    int                 mAnalyticsHeight;
+    int                 mAnalyticsFrameSize;
+    int                 mAnalyticsInterval;
 
     camera_memory_t*    mRawPictureHeap;
     void*               mRawBuffer;
@@ -328,16 +479,70 @@ private:
     camera_memory_t*    mRecordingHeap;
     void*               mRecBuffers[kBufferCount];
     int                 mRecordingFrameSize;
-    int                 mRecFmt;
+    const HalFormat*    mRecFmt;
+
+    // What the metadata buffers hold, as VideoGrallocMetadata in
+    // media/hardware/HardwareAPI.h
+    struct VideoMetadata {
+        MetadataBufferType  eType;
+        buffer_handle_t     pHandle;
+    };
+
+    bool                mRecordingMetadata;         // storeMetaDataInBuffers()
+    camera_memory_t*    mRecordingMetaHeap;         // kBufferCount VideoMetadata
+    sp<GraphicBuffer>   mRecGraphicBuffers[kBufferCount];
+
+    // The recording buffers not held by the encoder. Protected by mRecLock
+    // and not mLock, as releaseRecordingFrame() must never wait long.
+    Mutex               mRecLock;
+    uint32_t            mRecFree;                   // a bit for each buffer
+    uint8_t*            mRecBase;                   // what the encoder gives back
+    size_t              mRecSlotSize;
+    uint64_t            mRecDropped;                // frames with no free buffer
+
+    // The StreamFrameHeader and access unit buffers of passthrough mode.
+    // Protected by mRecLock, but only made and freed with mLock held too.
+    camera_memory_t*    mStreamHeap;
+    size_t              mStreamSlotSize;
+    uint32_t            mStreamFree;                // a bit for each buffer
+
+    StreamCapture       mStream;
+    std::string         mStreamDevices[kStreamFormatCount]; // the nodes with each format, if any
+    bool                mPassthrough;               // recording from mStream, set under mLock
 
-    camera_memory_t*    mJpegPictureHeap;
     int                 mJpegPictureBufferSize;
 
+    // The heaps the pictures are compressed into, kept between pictures,
+    // and the picture given to the app from each. Used in turn, as the app
+    // may still be reading one and a burst has several in flight. The
+    // pictures of a burst are mapped by the encoder threads, each only
+    // once the heap has been handed to it by the picture thread.
+    sp<MemoryHeapBase>  mJpegHeaps[kJpegHeapCount];
+    camera_memory_t*    mJpegPictures[kJpegHeapCount];
+    int                 mJpegHeapIndex;             // protected by mLock
+
+    // Compresses the pictures of a burst while the next are taken
+    PictureEncoder      mPictureEncoder;
+    std::atomic<bool>   mBurstCancelled;            // by cancelPicture()
+
     V4L2Camera          camera;
     bool                mRecordingEnabled;
 
+    nsecs_t             mPictureTime;               // when takePicture() was called
+    std::atomic<bool>   mStillWanted;               // a picture is waiting for the next frame
+
     // protected by mLock
     sp<PreviewThread>   mPreviewThread;
+    sp<ConsumerThread>  mConsumers[STAGE_COUNT];
+
+    // The YUYV frames from the preview thread to the consumers
+    FrameRing           mFrames;
+    FrameRing::Reader   mReaders[STAGE_COUNT];      // each used by its consumer only
+    struct yuyv_scaler* mScalers[STAGE_COUNT];      // the same
+
+    // The held frames from the preview thread to the display, GpuFrames
+    FrameRing           mGpuFrames;
+    FrameRing::Reader   mGpuReader;                 // used by the display only
     sp<HotPlugThread>   mHotPlugThread;
 
     camera_notify_callback      mNotifyCb;
@@ -348,15 +553,34 @@ private:
 
     int32_t             mMsgEnabled;
 
-    // only used from PreviewThread
+    // only used from the callback consumer
     int                 mCurrentPreviewFrame;
-    int                 mCurrentRecordingFrame;
+
+    // only used from PreviewThread
+    unsigned int        mAnalyticsCount;            // frames since the last analytics one
     int                 mTimeoutCount;
     int                 mTimeoutLimit;
+    nsecs_t             mLastFrameTime;
+
+    // What dumpCamera() shows, since the preview started. They are updated
+    // with no lock by the threads doing the work.
+    nsecs_t             mStatsSince;                // protected by mLock
+    std::atomic<uint64_t> mFramesCaptured;
+    std::atomic<uint64_t> mFramesEmpty;
+    std::atomic<uint64_t> mTimeouts;
+    LatencyHistogram    mFrameInterval;             // between captured frames
+    LatencyHistogram    mCopyTime;                  // plain YUYV frames into the ring
+    LatencyHistogram    mScaleTime[STAGE_COUNT];    // converting for each consumer
+    LatencyHistogram    mPreviewCallbackTime;
+    LatencyHistogram    mVideoCallbackTime;
+    LatencyHistogram    mWinDequeueTime;            // the preview window calls
+    LatencyHistogram    mWinLockTime;
+    LatencyHistogram    mWinEnqueueTime;
+    LatencyHistogram    mJpegTime;
 
     char*               mCameraPowerFile;
 
-    // This is constructed once and never changed
+    // This is made by the first getCameraInfo() and never changed
     camera_metadata_t*  mCameraMetadata;
 
     /****************************************************************************
@@ -19,10 +19,88 @@ namespace android {
     device PATH
     resolution 1920x1080      : the default resolution to use
     role [front|back|other]   : defaults to other for the USB camera
+    orientation [0|90|180|270]
+    zerocopy [off|userptr|dmabuf] : let the camera write YUYV frames straight
+                                into the preview window buffers. Defaults to off
+    mjpeg-decoder [builtin|libjpeg|hw] : what decodes the frames of MJPEG cameras.
+                                builtin is our own decoder and the default, libjpeg
+                                uses libjpeg(-turbo) and hw a V4L2 mem2mem JPEG
+                                decoder, or builtin if there is none
+    still-capture [preview|restart] : preview takes the pictures that are no
+                                bigger than the preview from the running preview.
+                                restart always stops the preview and restarts the
+                                camera at the picture size. Defaults to preview
+    zsl N                     : keep the last N preview frames, 0 to 32, so that a
+                                picture is the frame captured closest to the
+                                shutter press. Defaults to 0, the next frame
+    format-cache PATH         : keep the modes of the cameras in this file, so they
+                                are not enumerated again after a restart. The
+                                modes are always kept in memory
+    converter-threads N       : split the conversion of each frame between N
+                                threads, 1 to 8. Defaults to one per CPU, up to 4
+    buffers N                 : capture into N V4L2 buffers, 2 to 8. More absorb
+                                the jitter of high frame rates, fewer keep the
+                                frames fresher. Defaults to 4
+    low-latency [on|off]      : always take the newest captured frame and give the
+                                older ones straight back, so that a slow consumer
+                                never works through a backlog. Defaults to off
+    prewarm [on|off]          : once the camera is found, and each time the app lets
+                                go of it, leave it open with its buffers made at the
+                                capture size of the parameters, so that a preview of
+                                that size only has to start streaming. The buffers
+                                stay allocated while the camera is not used.
+                                Defaults to off
+    color-matrix [bt601|bt709|auto] : the colour matrix the camera encodes with,
+                                for the preview windows that take RGB. auto is
+                                bt709 for the captures with 720 lines or more
+                                and bt601 for the smaller ones. Defaults to bt601
+    color-range [full|limited] : whether the camera uses all of 0 to 255, or
+                                16 to 235 for luma and 16 to 240 for chroma.
+                                Defaults to full
+    gpu-preview [off|on|rotate] : draw the preview window with the GPU instead
+                                of the CPU, from the captured dma-bufs when the
+                                GPU can read them. rotate also turns the preview
+                                by the orientation, for the apps that never call
+                                setDisplayOrientation(). The CPU draws it if the
+                                GPU can't. Defaults to off
+    record PATH [MB]          : write every frame the camera gives into the
+                                capture file PATH, as it was captured, up to MB
+                                megabytes, 1 to 1024, 256 by default. Each
+                                stream replaces the file. Frames with a buffer
+                                for each plane are not recorded
+    replay PATH [realtime|max] : take the frames from a recorded capture file
+                                instead of a camera, looping over them, at the
+                                pace they were captured or as fast as they are
+                                taken. The camera only has the mode of the
+                                recording. Defaults to realtime
+    camera                    : starts the settings of another camera. With no
+                                camera line there is one camera. The lines before
+                                the first one are for all the cameras, and each
+                                camera line starts a camera with those settings.
+                                Every camera takes a device of its own, so the
+                                device and nodevice lines can tell them apart:
+                                a camera with device lines of its own only
+                                searches those, in the order given, less its
+                                nodevice ones, and not the /dev/video* devices.
+                                The converter-threads of the camera opened last
+                                applies to all of them
 */
 int CameraSpec::loadFromFile(const char* configFile)
 {
-    ALOGD("loadFromFile: configFile = %s", configFile);
+    std::vector<CameraSpec> cameras;
+    int status = loadCameras(configFile, cameras);
+
+    if (status == NO_ERROR) {
+        *this = cameras[0];
+    }
+    return status;
+}
+
+
+
+int CameraSpec::loadCameras(const char* configFile, std::vector<CameraSpec>& cameras)
+{
+    ALOGD("loadCameras: configFile = %s", configFile);
 
     auto text = utils::readFile(configFile);
 
@@ -31,6 +109,10 @@ int CameraSpec::loadFromFile(const char* configFile)
         return UNKNOWN_ERROR;
     }
 
+    // The lines before the first camera line are for all the cameras
+    CameraSpec common;
+    cameras.clear();
+
     for (auto& line : utils::splitLines(text)) {
         auto words = utils::splitWords(line);
 
@@ -45,45 +127,159 @@ int CameraSpec::loadFromFile(const char* configFile)
             continue;
         }
 
-        if (cmd == "device" && words.size() == 2) {
-            auto& dev = words[1];
-            ALOGD("loadFromFile: device = %s", dev.c_str());
-            devices.push_back(dev);
-        } else if (cmd == "nodevice" && words.size() == 2) {
-            auto& dev = words[1];
-            ALOGD("loadFromFile: nodevice = %s", dev.c_str());
-            nodevices.push_back(dev);
-        } else if (cmd == "resolution" && words.size() == 2) {
-            auto& res = words[1];
-            int w, h;
-
-            ALOGD("loadFromFile: resolution = %s", res.c_str());
-
-            if (sscanf(res.c_str(), "%dx%d", &w, &h) == 2) {
-                preferredSize = SurfaceSize(w, h);
-            }
-        } else if (cmd == "role" && words.size() == 2) {
-            auto& role = words[1];
-
-            if (role == "front") {
-                facing = CAMERA_FACING_FRONT;
-            } else if (role == "back") {
-                facing = CAMERA_FACING_BACK;
-            }
-        } else if (cmd == "orientation" && words.size() == 2) {
-            auto& o = words[1];
-            if      (o == "0")    orientation = 0;
-            else if (o == "90")   orientation = 90;
-            else if (o == "180")  orientation = 180;
-            else if (o == "270")  orientation = 270;
-            else ALOGW("loadFromFile: orientation should be 0, 90, 180 or 270. Not %s", o.c_str());
+        if (cmd == "camera" && words.size() == 1) {
+            cameras.push_back(common);
+            ALOGD("loadCameras: camera %zu", cameras.size() - 1);
+        } else if (cameras.empty()) {
+            common.parseLine(words, line);
         } else {
-            ALOGD("Unrecognized config line '%s'", line.c_str());
+            cameras.back().parseLine(words, line);
+        }
+    }
+
+    // The device lines of a camera are the only devices it looks for
+    for (auto& c : cameras) {
+        if (c.devices.size() > common.devices.size()) {
+            c.devices.erase(c.devices.begin(), c.devices.begin() + common.devices.size());
+            c.onlyDevices = true;
         }
     }
 
+    if (cameras.empty()) {
+        cameras.push_back(common);
+    }
+
     return NO_ERROR;
 }
 
+
+
+void CameraSpec::parseLine(const StringVec& words, const std::string& line)
+{
+    auto& cmd = words[0];
+
+    if (cmd == "device" && words.size() == 2) {
+        auto& dev = words[1];
+        ALOGD("parseLine: device = %s", dev.c_str());
+        devices.push_back(dev);
+    } else if (cmd == "nodevice" && words.size() == 2) {
+        auto& dev = words[1];
+        ALOGD("parseLine: nodevice = %s", dev.c_str());
+        nodevices.push_back(dev);
+    } else if (cmd == "resolution" && words.size() == 2) {
+        auto& res = words[1];
+        int w, h;
+
+        ALOGD("parseLine: resolution = %s", res.c_str());
+
+        if (sscanf(res.c_str(), "%dx%d", &w, &h) == 2) {
+            preferredSize = SurfaceSize(w, h);
+        }
+    } else if (cmd == "role" && words.size() == 2) {
+        auto& role = words[1];
+
+        if (role == "front") {
+            facing = CAMERA_FACING_FRONT;
+        } else if (role == "back") {
+            facing = CAMERA_FACING_BACK;
+        }
+    } else if (cmd == "orientation" && words.size() == 2) {
+        auto& o = words[1];
+        if      (o == "0")    orientation = 0;
+        else if (o == "90")   orientation = 90;
+        else if (o == "180")  orientation = 180;
+        else if (o == "270")  orientation = 270;
+        else ALOGW("parseLine: orientation should be 0, 90, 180 or 270. Not %s", o.c_str());
+    } else if (cmd == "zerocopy" && words.size() == 2) {
+        auto& z = words[1];
+        if      (z == "off")      zeroCopy = ZEROCOPY_OFF;
+        else if (z == "userptr")  zeroCopy = ZEROCOPY_USERPTR;
+        else if (z == "dmabuf")   zeroCopy = ZEROCOPY_DMABUF;
+        else ALOGW("parseLine: zerocopy should be off, userptr or dmabuf. Not %s", z.c_str());
+    } else if (cmd == "mjpeg-decoder" && words.size() == 2) {
+        auto& d = words[1];
+        if      (d == "builtin")  mjpegDecoder = MJPEG_BUILTIN;
+        else if (d == "libjpeg")  mjpegDecoder = MJPEG_LIBJPEG;
+        else if (d == "hw")       mjpegDecoder = MJPEG_HW;
+        else ALOGW("parseLine: mjpeg-decoder should be builtin, libjpeg or hw. Not %s", d.c_str());
+    } else if (cmd == "still-capture" && words.size() == 2) {
+        auto& c = words[1];
+        if      (c == "preview")  stillCapture = STILL_PREVIEW;
+        else if (c == "restart")  stillCapture = STILL_RESTART;
+        else ALOGW("parseLine: still-capture should be preview or restart. Not %s", c.c_str());
+    } else if (cmd == "zsl" && words.size() == 2) {
+        int n;
+        if (sscanf(words[1].c_str(), "%d", &n) == 1 && n >= 0 && n <= 32) {
+            zslFrames = n;
+        } else {
+            ALOGW("parseLine: zsl should be 0 to 32. Not %s", words[1].c_str());
+        }
+    } else if (cmd == "format-cache" && words.size() == 2) {
+        formatCache = words[1];
+        ALOGD("parseLine: format-cache = %s", formatCache.c_str());
+    } else if (cmd == "converter-threads" && words.size() == 2) {
+        int n;
+        if (sscanf(words[1].c_str(), "%d", &n) == 1 && n >= 1 && n <= 8) {
+            converterThreads = n;
+        } else {
+            ALOGW("parseLine: converter-threads should be 1 to 8. Not %s", words[1].c_str());
+        }
+    } else if (cmd == "buffers" && words.size() == 2) {
+        int n;
+        if (sscanf(words[1].c_str(), "%d", &n) == 1 && n >= 2 && n <= 8) {
+            bufferCount = n;
+        } else {
+            ALOGW("parseLine: buffers should be 2 to 8. Not %s", words[1].c_str());
+        }
+    } else if (cmd == "low-latency" && words.size() == 2) {
+        auto& l = words[1];
+        if      (l == "on")   lowLatency = true;
+        else if (l == "off")  lowLatency = false;
+        else ALOGW("parseLine: low-latency should be on or off. Not %s", l.c_str());
+    } else if (cmd == "prewarm" && words.size() == 2) {
+        auto& w = words[1];
+        if      (w == "on")   prewarm = true;
+        else if (w == "off")  prewarm = false;
+        else ALOGW("parseLine: prewarm should be on or off. Not %s", w.c_str());
+    } else if (cmd == "color-matrix" && words.size() == 2) {
+        auto& m = words[1];
+        if      (m == "bt601")    colorMatrix = COLOR_BT601;
+        else if (m == "bt709")    colorMatrix = COLOR_BT709;
+        else if (m == "auto")     colorMatrix = COLOR_AUTO;
+        else ALOGW("parseLine: color-matrix should be bt601, bt709 or auto. Not %s", m.c_str());
+    } else if (cmd == "color-range" && words.size() == 2) {
+        auto& r = words[1];
+        if      (r == "full")     limitedRange = false;
+        else if (r == "limited")  limitedRange = true;
+        else ALOGW("parseLine: color-range should be full or limited. Not %s", r.c_str());
+    } else if (cmd == "gpu-preview" && words.size() == 2) {
+        auto& g = words[1];
+        if      (g == "off")      gpuPreview = GPU_PREVIEW_OFF;
+        else if (g == "on")       gpuPreview = GPU_PREVIEW_ON;
+        else if (g == "rotate")   gpuPreview = GPU_PREVIEW_ROTATE;
+        else ALOGW("parseLine: gpu-preview should be off, on or rotate. Not %s", g.c_str());
+    } else if (cmd == "record" && (words.size() == 2 || words.size() == 3)) {
+        int mb = 256;
+        if (words.size() == 3 && (sscanf(words[2].c_str(), "%d", &mb) != 1 || mb < 1 || mb > 1024)) {
+            ALOGW("parseLine: record should have 1 to 1024 MB. Not %s", words[2].c_str());
+        } else {
+            recordFile = words[1];
+            recordLimit = mb;
+            ALOGD("parseLine: record = %s, %d MB", recordFile.c_str(), recordLimit);
+        }
+    } else if (cmd == "replay" && (words.size() == 2 || words.size() == 3)) {
+        auto r = words.size() == 3 ? words[2] : std::string("realtime");
+        if (r == "realtime" || r == "max") {
+            replayFile = words[1];
+            replayRealtime = r == "realtime";
+            ALOGD("parseLine: replay = %s, %s", replayFile.c_str(), r.c_str());
+        } else {
+            ALOGW("parseLine: replay should be realtime or max. Not %s", r.c_str());
+        }
+    } else {
+        ALOGD("Unrecognized config line '%s'", line.c_str());
+    }
+}
+
 //======================================================================
 }; /* namespace android */
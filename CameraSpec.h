@@ -18,11 +18,49 @@ class CameraSpec
 public:
     StringVec       devices;            // devices to force
     StringVec       nodevices;          // devices to skip
+    bool            onlyDevices = false;    // search devices alone, in their order
     SurfaceSize     preferredSize;
     int             facing = CAMERA_FACING_EXTERNAL;
     int             orientation = 0;    // 0, 90, 180, 270
 
+    enum { ZEROCOPY_OFF, ZEROCOPY_USERPTR, ZEROCOPY_DMABUF };
+    int             zeroCopy = ZEROCOPY_OFF;    // capture into the preview window buffers
+
+    enum { MJPEG_BUILTIN, MJPEG_LIBJPEG, MJPEG_HW };
+    int             mjpegDecoder = MJPEG_BUILTIN;   // how MJPEG frames are decoded
+
+    enum { STILL_PREVIEW, STILL_RESTART };
+    int             stillCapture = STILL_PREVIEW;   // where pictures come from
+    int             zslFrames = 0;      // preview frames kept for the pictures
+
+    std::string     formatCache;        // file to keep the camera modes in, if any
+    int             converterThreads = 0;   // threads converting the frames, 0 for one per CPU
+    int             bufferCount = 0;    // V4L2 buffers to capture into, 0 for NB_BUFFER
+    bool            lowLatency = false; // only ever take the newest captured frame
+    bool            prewarm = false;    // keep the camera set up for the next preview
+
+    enum { COLOR_BT601, COLOR_BT709, COLOR_AUTO };
+    int             colorMatrix = COLOR_BT601;  // of the YUV the camera sends
+    bool            limitedRange = false;       // luma from 16 to 235, not 0 to 255
+
+    enum { GPU_PREVIEW_OFF, GPU_PREVIEW_ON, GPU_PREVIEW_ROTATE };
+    int             gpuPreview = GPU_PREVIEW_OFF;   // draw the preview window with GLES
+
+    std::string     recordFile;         // capture file to record the frames into, if any
+    int             recordLimit = 256;  // MB it may take
+    std::string     replayFile;         // capture file to take the frames from instead of a camera
+    bool            replayRealtime = true;  // at the pace they were captured, else as fast as taken
+
+    /*  Loads the first camera of a configuration file */
     int loadFromFile(const char* configFile);
+
+    /*  Loads all the cameras of a configuration file, there is at least one
+        if it can be read
+    */
+    static int loadCameras(const char* configFile, std::vector<CameraSpec>& cameras);
+
+private:
+    void parseLine(const StringVec& words, const std::string& line);
 };
 
 //======================================================================
@@ -40,28 +40,30 @@
 
  */
 
+#define LOG_TAG "Converter"
+#include <utils/Log.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <setjmp.h>
 extern "C" {
 #include <jpeglib.h>
 }
 #include "Converter.h"
-#include "V4L2Camera.h"
+#include "ConverterSimd.h"
+#include "WorkerPool.h"
+#include "uvc_compat.h"
+#include "Utils.h"
 
 /*clip value between 0 and 255*/
 #define CLIP(value) (uint8_t)(((value)>0xFF)?0xff:(((value)<0)?0:(value)))
 
 
 /* convert yuyv to YVU420SP */
-void yuyv_to_yvu420sp(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+static void yuyv_to_yvu420sp_c(uint8_t *dstY, uint8_t *dstVU, int dstStride, uint8_t *src, int srcStride, int width, int height)
 {
-	// Start of Y plane
-	uint8_t* dstY = dst;
-
-	// Calculate start of UV plane
-	uint8_t* dstVU = dst + dstStride * dstHeight;
-
 	int h=0;
 	int w=0;
 	int dyvu = dstStride - width;
@@ -90,66 +92,10 @@ void yuyv_to_yvu420sp(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, i
 	}
 }
 
-/* convert yuyv to YVU420P */
-/* This format assumes that the horizontal strides (luma and chroma) are multiple of 16 pixels */
-void yuyv_to_yvu420p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+/* convert yuyv to YVU420P or YUV420P, whose planes only differ by their order */
+static void yuyv_to_420p_c(uint8_t *dstY, uint8_t *dstU, uint8_t *dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
 {
-	// Calculate the chroma plane stride
-	int dstVUStride = ((dstStride >> 1) + 15) & (-16);
-
-	// Start of Y plane
-	uint8_t* dstY = dst;
-
-	// Calculate start of V plane
-	uint8_t* dstV = dst + dstStride * dstHeight;
-
-	// Calculate start of U plane
-	uint8_t* dstU = dstV + (dstVUStride * dstHeight >> 1);
-
-	int h=0;
-	int w=0;
-	int dy  = dstStride - width;
-	int dvu = dstVUStride - (width >> 1);
-	int sw  = srcStride - (width<<1);
-	for (h = 0; h<height; h +=2) {
-		for (w=0; w < width; w += 2) {
-			*dstY++ = *src++;							// Y0
-			*dstU++ = (src[0] + src[srcStride]) >> 1;	// U
-			src++;
-			*dstY++ = *src++;							// Y1
-			*dstV++ = (src[0] + src[srcStride]) >> 1;	// V
-			src++;
-		}
-		src   += sw;
-		dstY  += dy;
-		dstU += dvu;
-		dstV += dvu;
-		for (w=0; w < width; w += 2) {
-			*dstY++  = *src;	// Y0
-			src += 2;
-			*dstY++  = *src;	// Y1
-			src += 2;
-		}
-		src   += sw;
-		dstY  += dy;
-	}
-}
-
-/* This format assumes that the horizontal strides (luma and chroma) are multiple of 16 pixels */
-void yuyv_to_yuv420p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
-{
-	// Calculate the chroma plane stride
-	int dstUVStride = ((dstStride >> 1) + 15) & (-16);
-
-	// Start of Y plane
-	uint8_t* dstY = dst;
-
-	// Calculate start of U plane
-	uint8_t* dstU = dst + dstStride * dstHeight;
-
-	// Calculate start of V plane
-	uint8_t* dstV = dstU + (dstUVStride * dstHeight >> 1);
-
 	int h=0;
 	int w=0;
 	int dy  = dstStride - width;
@@ -179,27 +125,14 @@ void yuyv_to_yuv420p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, in
 	}
 }
 
-
 /* convert yuyv to YVU422P */
-/* This format assumes that the horizontal strides (luma and chroma) are multiple of 16 pixels */
-void yuyv_to_yvu422p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+static void yuyv_to_422p_c(uint8_t *dstY, uint8_t *dstU, uint8_t *dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
 {
-	// Calculate the chroma plane stride
-	int dstVUStride = ((dstStride >> 1) + 15) & (-16);
-
-	// Start of Y plane
-	uint8_t* dstY = dst;
-
-	// Calculate start of U plane
-	uint8_t* dstV = dst + dstStride * dstHeight;
-
-	// Calculate start of V plane
-	uint8_t* dstU = dstV + (dstVUStride * dstHeight);
-
 	int h=0;
 	int w=0;
 	int dy  = dstStride - width;
-	int dvu = dstVUStride - (width >> 1);
+	int dvu = dstUVStride - (width >> 1);
 	int sw  = srcStride - (width<<1);
 	for (h = 0; h<height; h ++) {
 		for (w=0; w < width; w += 2) {
@@ -302,7 +235,7 @@ void yyuv_to_yuyv (uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int
 *      width: picture width
 *      height: picture height
 */
-void uyvy_to_yuyv (uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+static void uyvy_to_yuyv_c(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
 {
 	uint8_t *ptmp = src;
 	uint8_t *pfmb = dst;
@@ -340,7 +273,7 @@ void uyvy_to_yuyv (uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int
 *      width: picture width
 *      height: picture height
 */
-void yvyu_to_yuyv (uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+static void yvyu_to_yuyv_c(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
 {
 	uint8_t *ptmp=NULL;
 	uint8_t *pfmb=NULL;
@@ -1316,6 +1249,74 @@ void bayer_to_rgb24(uint8_t *pBay, uint8_t *pRGB24, int width, int height, int p
 }
 
 
+/* Fused bayer to yuyv. Each pair of samples of a line becomes one yuyv
+   macropixel, with the missing colors interpolated from the lines above and
+   below, so no rgb frame is ever made. The borders are mirrored. The RGB->YUV
+   math is the one of rgb_to_yuyv, in fixed point: 8 bits for luma, 7 bits for
+   chroma so that the vector kernels can do it in 16 bit lanes */
+#define BAYER_Y(r,g,b)	((77 * (r) + 150 * (g) + 29 * (b) + 128) >> 8)
+#define BAYER_U(r,g,b)	(((56 * (b) - 19 * (r) - 37 * (g) + 64) >> 7) + 128)
+#define BAYER_V(r,g,b)	(((79 * (r) - 66 * (g) - 13 * (b) + 64) >> 7) + 128)
+
+void bayer_to_yuyv_pairs(uint8_t *dst, const uint8_t *up, const uint8_t *cur, const uint8_t *down,
+	int width, int x, int end, int gfirst, int redrow)
+{
+	uint8_t *d = dst + (x << 1);
+
+	for (; x < end; x += 2) {
+		int xl = x > 0 ? x - 1 : 1;
+		int xr = x + 2 < width ? x + 2 : width - 2;
+		int c0, g0, o0, c1, g1, o1;
+		int r0, b0, r1, b1, ra, ga, ba;
+
+		/* c is the color of this line, o the one of the lines around it */
+		if (gfirst) {
+			g0 = cur[x];
+			c0 = (cur[xl] + cur[x+1] + 1) >> 1;
+			o0 = (up[x] + down[x] + 1) >> 1;
+			c1 = cur[x+1];
+			g1 = (cur[x] + cur[xr] + up[x+1] + down[x+1] + 2) >> 2;
+			o1 = (up[x] + up[xr] + down[x] + down[xr] + 2) >> 2;
+		} else {
+			c0 = cur[x];
+			g0 = (cur[xl] + cur[x+1] + up[x] + down[x] + 2) >> 2;
+			o0 = (up[xl] + up[x+1] + down[xl] + down[x+1] + 2) >> 2;
+			g1 = cur[x+1];
+			c1 = (cur[x] + cur[xr] + 1) >> 1;
+			o1 = (up[x+1] + down[x+1] + 1) >> 1;
+		}
+
+		r0 = redrow ? c0 : o0;
+		b0 = redrow ? o0 : c0;
+		r1 = redrow ? c1 : o1;
+		b1 = redrow ? o1 : c1;
+		ra = (r0 + r1 + 1) >> 1;
+		ga = (g0 + g1 + 1) >> 1;
+		ba = (b0 + b1 + 1) >> 1;
+
+		*d++ = BAYER_Y(r0, g0, b0);
+		*d++ = CLIP(BAYER_U(ra, ga, ba));
+		*d++ = BAYER_Y(r1, g1, b1);
+		*d++ = CLIP(BAYER_V(ra, ga, ba));
+	}
+}
+
+static void bayer_to_yuyv_c(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height, int pix_order,
+	int y0, int y1)
+{
+	int h;
+	dst += y0 * dstStride;
+	for (h = y0; h < y1; h++) {
+		const uint8_t *up, *cur, *down;
+		int gfirst, redrow;
+
+		bayer_line(src, srcStride, height, h, pix_order, &up, &cur, &down, &gfirst, &redrow);
+		bayer_to_yuyv_pairs(dst, up, cur, down, width, 0, width, gfirst, redrow);
+		dst += dstStride;
+	}
+}
+
+
 void rgb_to_yuyv(uint8_t *pyuv, int dstStride, uint8_t *prgb, int srcStride, int width, int height)
 {
 
@@ -1381,17 +1382,85 @@ static inline uint16_t  make565(int red, int green, int blue)
 
 #define FIX1P8(x) ((int)((x) * (1<<8)))
 
-static inline int clip(int x)
+/* The tables of every matrix and range, made the first time one is asked
+   for. They are never changed after that, so any thread can use them */
+static struct yuv_rgb_table rgb_tables[2][2];
+static pthread_once_t rgb_tables_once = PTHREAD_ONCE_INIT;
+
+/* kr and kb are the weights of red and blue in the luma of the matrix:
+	r = y + 2 (1 - kr) v
+	g = y - 2 kb (1 - kb) / kg u - 2 kr (1 - kr) / kg v
+	b = y + 2 (1 - kb) u
+   Limited range video has its luma from 16 to 235 and its chroma from 16
+   to 240, so both are stretched to the full 0 to 255 */
+static void rgb_table_init(struct yuv_rgb_table *t, double kr, double kb, int limited)
+{
+	double kg = 1.0 - kr - kb;
+	double cs = limited ? 255.0 / 224.0 : 1.0;
+	int i;
+
+	t->yoff  = limited ? 16 : 0;
+	t->ygain = limited ? FIX1P8(255.0 / 219.0) - 256 : 0;
+	t->rv =  FIX1P8(2 * (1 - kr) * cs);
+	t->gu = -FIX1P8(2 * kb * (1 - kb) / kg * cs);
+	t->gv = -FIX1P8(2 * kr * (1 - kr) / kg * cs);
+	t->bu =  FIX1P8(2 * (1 - kb) * cs);
+
+	for (i = 0; i < 256; i++) {
+		int d = i - t->yoff;
+		int c = i - 128;
+		t->ly[i]  = d + ((d * t->ygain + 128) >> 8);
+		t->lrv[i] = (t->rv * c) >> 8;
+		t->lgu[i] = t->gu * c;
+		t->lgv[i] = t->gv * c;
+		t->lbu[i] = (t->bu * c) >> 8;
+	}
+
+	for (i = 0; i < YUV_RGB_CLIP_SIZE; i++) {
+		int x = i - YUV_RGB_CLIP_OFFSET;
+		t->clip[i] = (x < 0) ? 0 : ((x > 255) ? 255 : x);
+	}
+}
+
+static void rgb_tables_init(void)
 {
-	if (x > 255)
-		x = 255;
-	if (x < 0)
-		x = 0;
-	return x;
+	/* BT.601 full range is the one the converters always used */
+	rgb_table_init(&rgb_tables[YUV_MATRIX_BT601][YUV_RANGE_FULL],    0.299,  0.114,  0);
+	rgb_table_init(&rgb_tables[YUV_MATRIX_BT601][YUV_RANGE_LIMITED], 0.299,  0.114,  1);
+	rgb_table_init(&rgb_tables[YUV_MATRIX_BT709][YUV_RANGE_FULL],    0.2126, 0.0722, 0);
+	rgb_table_init(&rgb_tables[YUV_MATRIX_BT709][YUV_RANGE_LIMITED], 0.2126, 0.0722, 1);
 }
 
+static const struct yuv_rgb_table* rgb_table(int matrix, int range)
+{
+	if (matrix < YUV_MATRIX_BT601 || matrix > YUV_MATRIX_BT709 ||
+		range < YUV_RANGE_FULL || range > YUV_RANGE_LIMITED)
+		return NULL;
+
+	pthread_once(&rgb_tables_once, rgb_tables_init);
+	return &rgb_tables[matrix][range];
+}
 
-void yuyv_to_rgb565_line (uint8_t *pyuv, uint8_t *prgb, int width)
+/* The r, g and b of the two pixels of a yuyv pair, from the tables */
+static inline void yuyv_pair_to_rgb(const struct yuv_rgb_table *t, const uint8_t *p, uint8_t *rgb0, uint8_t *rgb1)
+{
+	const uint8_t *clip = t->clip + YUV_RGB_CLIP_OFFSET;
+	int ri = t->lrv[p[3]];
+	int gi = (t->lgu[p[1]] + t->lgv[p[3]]) >> 8;
+	int bi = t->lbu[p[1]];
+	int y0 = t->ly[p[0]];
+	int y1 = t->ly[p[2]];
+
+	rgb0[0] = clip[y0 + ri];
+	rgb0[1] = clip[y0 + gi];
+	rgb0[2] = clip[y0 + bi];
+	rgb1[0] = clip[y1 + ri];
+	rgb1[1] = clip[y1 + gi];
+	rgb1[2] = clip[y1 + bi];
+}
+
+
+void yuyv_to_rgb565_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *prgb, int width)
 {
 	int l=0;
 	int ln = width >> 1;
@@ -1399,248 +1468,1113 @@ void yuyv_to_rgb565_line (uint8_t *pyuv, uint8_t *prgb, int width)
 
 	for(l=0; l<ln; l++)
 	{	/*iterate every 4 bytes*/
-
-		int u  = pyuv[1] - 128;
-		int v  = pyuv[3] - 128;
-
-		int ri = (                       + FIX1P8(1.402)   * v) >> 8;
-		int gi = ( - FIX1P8(0.34414) * u - FIX1P8(0.71414) * v) >> 8;
-		int bi = ( + FIX1P8(1.772)   * u                      ) >> 8;
-
-		/* standart: r = y0 + 1.402 (v-128) */
-		/* logitech: r = y0 + 1.370705 (v-128) */
-		/* standart: g = y0 - 0.34414 (u-128) - 0.71414 (v-128)*/
-		/* logitech: g = y0 - 0.337633 (u-128)- 0.698001 (v-128)*/
-		/* standart: b = y0 + 1.772 (u-128) */
-		/* logitech: b = y0 + 1.732446 (u-128) */
-
-		int y0 = pyuv[0];
-		*p++ = make565(
-			clip(y0 + ri),
-			clip(y0 + gi),
-			clip(y0 + bi)
-			);
-
-		int y1 = pyuv[2];
-		*p++ = make565(
-			clip(y1 + ri),
-			clip(y1 + gi),
-			clip(y1 + bi)
-			);
-
+		uint8_t c0[3], c1[3];
+		yuyv_pair_to_rgb(t, pyuv, c0, c1);
+		*p++ = make565(c0[0], c0[1], c0[2]);
+		*p++ = make565(c1[0], c1[1], c1[2]);
 		pyuv += 4;
 	}
 }
 
 /* regular yuv (YUYV) to rgb565*/
-void yuyv_to_rgb565 (uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+static void yuyv_to_rgb565_c(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
 {
 	int h=0;
 	for(h=0;h<height;h++)
 	{
-		yuyv_to_rgb565_line (pyuv,prgb,width);
+		yuyv_to_rgb565_line (t,pyuv,prgb,width);
 		pyuv += pyuvstride;
 		prgb += prgbstride;
 	}
 }
 
 
-void yuyv_to_rgb24_line (uint8_t *pyuv, uint8_t *prgb, int width)
+static void yuyv_to_rgb24_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *prgb, int width)
 {
 	int l=0;
 	int ln = width >> 1;
 
 	for(l=0; l<ln; l++)
 	{	/*iterate every 4 bytes*/
-
-		int u  = pyuv[1] - 128;
-		int v  = pyuv[3] - 128;
-
-		int ri = (                       + FIX1P8(1.402)   * v) >> 8;
-		int gi = ( - FIX1P8(0.34414) * u - FIX1P8(0.71414) * v) >> 8;
-		int bi = ( + FIX1P8(1.772)   * u                      ) >> 8;
-
-		/* standart: r = y0 + 1.402 (v-128) */
-		/* logitech: r = y0 + 1.370705 (v-128) */
-		/* standart: g = y0 - 0.34414 (u-128) - 0.71414 (v-128)*/
-		/* logitech: g = y0 - 0.337633 (u-128)- 0.698001 (v-128)*/
-		/* standart: b = y0 + 1.772 (u-128) */
-		/* logitech: b = y0 + 1.732446 (u-128) */
-
-		int y0 = pyuv[0];
-		*prgb++ = clip(y0 + ri);
-		*prgb++ = clip(y0 + gi);
-		*prgb++ = clip(y0 + bi);
-
-		int y1 = pyuv[2];
-		*prgb++ = clip(y1 + ri);
-		*prgb++ = clip(y1 + gi);
-		*prgb++ = clip(y1 + bi);
-
+		yuyv_pair_to_rgb(t, pyuv, prgb, prgb + 3);
+		prgb += 6;
 		pyuv += 4;
 	}
 }
 
 /* regular yuv (YUYV) to rgb24*/
-void yuyv_to_rgb24 (uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+static void yuyv_to_rgb24_c(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
 {
 	int h=0;
 	for(h=0;h<height;h++)
 	{
-		yuyv_to_rgb24_line (pyuv,prgb,width);
+		yuyv_to_rgb24_line (t,pyuv,prgb,width);
 		pyuv += pyuvstride;
 		prgb += prgbstride;
 	}
 }
 
-void yuyv_to_rgb32_line (uint8_t *pyuv, uint8_t *prgb, int width)
+void yuyv_to_rgb32_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *prgb, int width)
 {
 	int l=0;
 	int ln = width >> 1;
 
 	for(l=0; l<ln; l++)
-	{	/*iterate every 4 bytes*/
-
-		int u  = pyuv[1] - 128;
-		int v  = pyuv[3] - 128;
-
-		int ri = (                       + FIX1P8(1.402)   * v) >> 8;
-		int gi = ( - FIX1P8(0.34414) * u - FIX1P8(0.71414) * v) >> 8;
-		int bi = ( + FIX1P8(1.772)   * u                      ) >> 8;
-
-		/* standart: r = y0 + 1.402 (v-128) */
-		/* logitech: r = y0 + 1.370705 (v-128) */
-		/* standart: g = y0 - 0.34414 (u-128) - 0.71414 (v-128)*/
-		/* logitech: g = y0 - 0.337633 (u-128)- 0.698001 (v-128)*/
-		/* standart: b = y0 + 1.772 (u-128) */
-		/* logitech: b = y0 + 1.732446 (u-128) */
-
-		int y0 = pyuv[0];
-		*prgb++ = clip(y0 + ri);
-		*prgb++ = clip(y0 + gi);
-		*prgb++ = clip(y0 + bi);
-		prgb++;
-
-		int y1 = pyuv[2];
-		*prgb++ = clip(y1 + ri);
-		*prgb++ = clip(y1 + gi);
-		*prgb++ = clip(y1 + bi);
-		prgb++;
-
+	{	/*iterate every 4 bytes, the 4th byte of each pixel is left as it is*/
+		yuyv_pair_to_rgb(t, pyuv, prgb, prgb + 4);
+		prgb += 8;
 		pyuv += 4;
 	}
 }
 
 /* regular yuv (YUYV) to rgb32*/
-void yuyv_to_rgb32 (uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+static void yuyv_to_rgb32_c(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
 {
 	int h=0;
 	for(h=0;h<height;h++)
 	{
-		yuyv_to_rgb32_line (pyuv,prgb,width);
+		yuyv_to_rgb32_line (t,pyuv,prgb,width);
 		pyuv += pyuvstride;
 		prgb += prgbstride;
 	}
 }
 
-void yuyv_to_bgr24_line (uint8_t *pyuv, uint8_t *pbgr, int width)
+/* The bgr ones have always written the same bytes as yuyv_to_rgb32, which
+   the vector kernels keep to as well */
+static void yuyv_to_bgr24_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *pbgr, int width)
 {
-	int l=0;
-	int ln = width >> 1;
-	for(l=0;l<ln;l++)
-	{	/*iterate every 4 bytes*/
-		int u  = pyuv[1] - 128;
-		int v  = pyuv[3] - 128;
-
-		int ri = (                       + FIX1P8(1.402)   * v) >> 8;
-		int gi = ( - FIX1P8(0.34414) * u - FIX1P8(0.71414) * v) >> 8;
-		int bi = ( + FIX1P8(1.772)   * u                      ) >> 8;
-
-		/* standart: r = y0 + 1.402 (v-128) */
-		/* logitech: r = y0 + 1.370705 (v-128) */
-		/* standart: g = y0 - 0.34414 (u-128) - 0.71414 (v-128)*/
-		/* logitech: g = y0 - 0.337633 (u-128)- 0.698001 (v-128)*/
-		/* standart: b = y0 + 1.772 (u-128) */
-		/* logitech: b = y0 + 1.732446 (u-128) */
-
-		int y0 = pyuv[0];
-		*pbgr++ = clip(y0 + ri);
-		*pbgr++ = clip(y0 + gi);
-		*pbgr++ = clip(y0 + bi);
-		pbgr++;
-
-		int y1 = pyuv[2];
-		*pbgr++ = clip(y1 + ri);
-		*pbgr++ = clip(y1 + gi);
-		*pbgr++ = clip(y1 + bi);
-		pbgr++;
-
-		pyuv += 4;
-	}
+	yuyv_to_rgb32_line (t,pyuv,pbgr,width);
 }
 
 /* used for rgb video (fourcc="RGB ")           */
 /* lines are on correct order                   */
-void yuyv_to_bgr24 (uint8_t *pyuv, int pyuvstride, uint8_t *pbgr, int pbgrstride, int width, int height)
+static void yuyv_to_bgr24_c(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *pbgr, int pbgrstride, int width, int height)
 {
 	int h=0;
 	for(h=0;h<height;h++)
 	{
-		yuyv_to_bgr24_line (pyuv,pbgr,width);
+		yuyv_to_bgr24_line (t,pyuv,pbgr,width);
 		pyuv += pyuvstride;
 		pbgr += pbgrstride;
 	}
 }
 
-void yuyv_to_bgr32_line (uint8_t *pyuv, uint8_t *pbgr, int width)
+void yuyv_to_bgr32_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *pbgr, int width)
 {
-	int l=0;
-	int ln = width >> 1;
-	for(l=0;l<ln;l++)
-	{	/*iterate every 4 bytes*/
-		int u  = pyuv[1] - 128;
-		int v  = pyuv[3] - 128;
-
-		int ri = (                       + FIX1P8(1.402)   * v) >> 8;
-		int gi = ( - FIX1P8(0.34414) * u - FIX1P8(0.71414) * v) >> 8;
-		int bi = ( + FIX1P8(1.772)   * u                      ) >> 8;
-
-		/* standart: r = y0 + 1.402 (v-128) */
-		/* logitech: r = y0 + 1.370705 (v-128) */
-		/* standart: g = y0 - 0.34414 (u-128) - 0.71414 (v-128)*/
-		/* logitech: g = y0 - 0.337633 (u-128)- 0.698001 (v-128)*/
-		/* standart: b = y0 + 1.772 (u-128) */
-		/* logitech: b = y0 + 1.732446 (u-128) */
-
-		int y0 = pyuv[0];
-		*pbgr++ = clip(y0 + ri);
-		*pbgr++ = clip(y0 + gi);
-		*pbgr++ = clip(y0 + bi);
-		pbgr++;
-
-		int y1 = pyuv[2];
-		*pbgr++ = clip(y1 + ri);
-		*pbgr++ = clip(y1 + gi);
-		*pbgr++ = clip(y1 + bi);
-		pbgr++;
-
-		pyuv += 4;
-	}
+	yuyv_to_rgb32_line (t,pyuv,pbgr,width);
 }
 
 /* used for rgb video (fourcc="RGB ")           */
 /* lines are on correct order                   */
-void yuyv_to_bgr32 (uint8_t *pyuv, int pyuvstride, uint8_t *pbgr, int pbgrstride, int width, int height)
+static void yuyv_to_bgr32_c(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *pbgr, int pbgrstride, int width, int height)
 {
 	int h=0;
 	for(h=0;h<height;h++)
 	{
-		yuyv_to_bgr32_line (pyuv,pbgr,width);
+		yuyv_to_bgr32_line (t,pyuv,pbgr,width);
 		pyuv += pyuvstride;
 		pbgr += pbgrstride;
 	}
 }
 
+//--------------------------------------------------------------------------------------
+
+/*------------------------------- Converter dispatch -------------------------*/
+
+/* The plain C versions. They are also the fallback for whatever a SIMD
+   backend does not implement */
+static const struct converter_ops c_ops = {
+	yuyv_to_yvu420sp_c,
+	yuyv_to_420p_c,
+	yuyv_to_422p_c,
+	yuyv_to_rgb565_c,
+	yuyv_to_rgb32_c,
+	yuyv_to_bgr32_c,
+	uyvy_to_yuyv_c,
+	yvyu_to_yuyv_c,
+	bayer_to_yuyv_c,
+	scale_blend_line,
+};
+
+static const char* const backend_names[] = { "C", "NEON", "SSE2", "AVX2" };
+
+static struct converter_ops conv_ops;
+static int conv_backend = CONVERTER_C;
+static pthread_once_t conv_once = PTHREAD_ONCE_INIT;
+
+/* Overrides the entries of ops that the backend implements */
+static void merge_ops(struct converter_ops* ops, const struct converter_ops* simd)
+{
+#define MERGE_OP(f) if (simd->f) ops->f = simd->f
+	MERGE_OP(yuyv_to_yvu420sp);
+	MERGE_OP(yuyv_to_420p);
+	MERGE_OP(yuyv_to_422p);
+	MERGE_OP(yuyv_to_rgb565);
+	MERGE_OP(yuyv_to_rgb32);
+	MERGE_OP(yuyv_to_bgr32);
+	MERGE_OP(uyvy_to_yuyv);
+	MERGE_OP(yvyu_to_yuyv);
+	MERGE_OP(bayer_to_yuyv);
+	MERGE_OP(scale_blend);
+#undef MERGE_OP
+}
+
+static int select_backend(int backend)
+{
+	struct converter_ops ops = c_ops;
+
+	switch (backend) {
+	case CONVERTER_C:
+		break;
+	case CONVERTER_NEON:
+		if (!converter_ops_neon())
+			return -1;
+		merge_ops(&ops, converter_ops_neon());
+		break;
+	case CONVERTER_SSE2:
+		if (!converter_ops_sse2())
+			return -1;
+		merge_ops(&ops, converter_ops_sse2());
+		break;
+	case CONVERTER_AVX2:
+		/* AVX2 only has some of the kernels, SSE2 fills in the rest */
+		if (!converter_ops_avx2() || !converter_ops_sse2())
+			return -1;
+		merge_ops(&ops, converter_ops_sse2());
+		merge_ops(&ops, converter_ops_avx2());
+		break;
+	default:
+		return -1;
+	}
+
+	conv_ops = ops;
+	conv_backend = backend;
+	return 0;
+}
+
+/* Picks the best backend the CPU supports */
+static void init_backend(void)
+{
+	if (select_backend(CONVERTER_AVX2) &&
+		select_backend(CONVERTER_SSE2) &&
+		select_backend(CONVERTER_NEON))
+		select_backend(CONVERTER_C);
+
+	ALOGI("Using %s converters", backend_names[conv_backend]);
+}
+
+static inline const struct converter_ops* ops(void)
+{
+	pthread_once(&conv_once, init_backend);
+	return &conv_ops;
+}
+
+int converter_set_backend(int backend)
+{
+	pthread_once(&conv_once, init_backend);
+	return select_backend(backend);
+}
+
+int converter_get_backend(void)
+{
+	pthread_once(&conv_once, init_backend);
+	return conv_backend;
+}
+
+const char* converter_backend_name(int backend)
+{
+	if (backend < 0 || backend >= (int)(sizeof(backend_names)/sizeof(backend_names[0])))
+		return "unknown";
+	return backend_names[backend];
+}
+
+/*------------------------------- Row bands -------------------------*/
+
+/* Bands of fewer lines than this are not worth a thread */
+#define CONV_BAND_LINES 16
+
+static android::Mutex conv_pool_lock;
+static android::WorkerPool *conv_pool;	/* NULL for no threads. Protected by conv_pool_lock */
+
+int converter_set_threads(int threads)
+{
+	android::Mutex::Autolock lock(conv_pool_lock);
+
+	if (threads < 1)
+		threads = 1;
+	if (threads == (conv_pool ? conv_pool->size() : 1))
+		return threads;
+
+	delete conv_pool;
+	conv_pool = NULL;
+
+	if (threads > 1) {
+		conv_pool = new android::WorkerPool(threads);
+		if (conv_pool->size() == 1) {
+			delete conv_pool;
+			conv_pool = NULL;
+		}
+	}
+
+	threads = conv_pool ? conv_pool->size() : 1;
+	ALOGI("Converting on %d threads", threads);
+	return threads;
+}
+
+int converter_get_threads(void)
+{
+	android::Mutex::Autolock lock(conv_pool_lock);
+	return conv_pool ? conv_pool->size() : 1;
+}
+
+struct conv_bands {
+	converter_band band;
+	void *arg;
+	int height;
+	int lines;		/* per band */
+};
+
+void converter_parallel(int height, int align, converter_band band, void *arg)
+{
+	/* The preview, recording and picture threads all convert frames. The
+	   first one gets the workers, the others do without them */
+	if (height >= 2 * CONV_BAND_LINES && conv_pool_lock.tryLock() == 0) {
+		android::WorkerPool *pool = conv_pool;
+
+		if (pool) {
+			struct conv_bands b;
+			const struct conv_bands *pb = &b;
+			int count = pool->size();
+
+			if (count > height / CONV_BAND_LINES)
+				count = height / CONV_BAND_LINES;
+
+			b.band = band;
+			b.arg = arg;
+			b.height = height;
+			b.lines = (height + count - 1) / count;
+			b.lines = (b.lines + align - 1) / align * align;
+			count = (height + b.lines - 1) / b.lines;
+
+			/* Only a pointer is captured, so the job is not allocated */
+			pool->run(count, [pb](int index, int) {
+				int y0 = index * pb->lines;
+				int y1 = y0 + pb->lines < pb->height ? y0 + pb->lines : pb->height;
+				pb->band(pb->arg, y0, y1);
+			});
+
+			conv_pool_lock.unlock();
+			return;
+		}
+		conv_pool_lock.unlock();
+	}
+
+	band(arg, 0, height);
+}
+
+/* A conversion split in bands. The planes are those of the whole frame,
+   and each band offsets them to its first line */
+struct conv_job {
+	const struct converter_ops *ops;
+	uint8_t *dst, *dstU, *dstV;
+	int dstStride, dstUVStride;
+	uint8_t *src;
+	int srcStride;
+	int width, height;
+	int pix_order;
+	void (*rows)(uint8_t *a, int aStride, uint8_t *b, int bStride, int width, int height);
+	const struct yuv_rgb_table *rgb;
+	yuyv_rgb_rows rgb_rows;
+};
+
+static void band_yvu420sp(void *arg, int y0, int y1)
+{
+	const struct conv_job *j = (const struct conv_job *)arg;
+	j->ops->yuyv_to_yvu420sp(j->dst + y0 * j->dstStride, j->dstU + (y0 >> 1) * j->dstStride, j->dstStride,
+		j->src + y0 * j->srcStride, j->srcStride, j->width, y1 - y0);
+}
+
+static void band_420p(void *arg, int y0, int y1)
+{
+	const struct conv_job *j = (const struct conv_job *)arg;
+	int c = (y0 >> 1) * j->dstUVStride;
+	j->ops->yuyv_to_420p(j->dst + y0 * j->dstStride, j->dstU + c, j->dstV + c, j->dstStride, j->dstUVStride,
+		j->src + y0 * j->srcStride, j->srcStride, j->width, y1 - y0);
+}
+
+static void band_422p(void *arg, int y0, int y1)
+{
+	const struct conv_job *j = (const struct conv_job *)arg;
+	int c = y0 * j->dstUVStride;
+	j->ops->yuyv_to_422p(j->dst + y0 * j->dstStride, j->dstU + c, j->dstV + c, j->dstStride, j->dstUVStride,
+		j->src + y0 * j->srcStride, j->srcStride, j->width, y1 - y0);
+}
+
+static void band_to_rgb(void *arg, int y0, int y1)
+{
+	const struct conv_job *j = (const struct conv_job *)arg;
+	j->rgb_rows(j->rgb, j->src + y0 * j->srcStride, j->srcStride, j->dst + y0 * j->dstStride, j->dstStride, j->width, y1 - y0);
+}
+
+/* rows(dst, dstStride, src, srcStride, ...), as the ones to yuyv are */
+static void band_to_yuyv(void *arg, int y0, int y1)
+{
+	const struct conv_job *j = (const struct conv_job *)arg;
+	j->rows(j->dst + y0 * j->dstStride, j->dstStride, j->src + y0 * j->srcStride, j->srcStride, j->width, y1 - y0);
+}
+
+static void band_bayer(void *arg, int y0, int y1)
+{
+	const struct conv_job *j = (const struct conv_job *)arg;
+	j->ops->bayer_to_yuyv(j->dst, j->dstStride, j->src, j->srcStride, j->width, j->height, j->pix_order, y0, y1);
+}
+
+static void conv_job_init(struct conv_job *j, uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	memset(j, 0, sizeof(*j));
+	j->ops = ops();
+	j->dst = dst;
+	j->dstStride = dstStride;
+	j->src = src;
+	j->srcStride = srcStride;
+	j->width = width;
+	j->height = height;
+}
+
+/* The 4:2:0 formats, whose bands must have an even number of lines. Like
+   the other packed 4:2:2 ones they work on pairs of pixels, and the C rows
+   step past the end of their lines on an odd width, so the last pixel of
+   those is left out, by every backend alike */
+static void yuyv_to_420(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+{
+	struct conv_job j;
+	struct yuv420_planes p;
+
+	conv_job_init(&j, dst, dstStride, src, srcStride, width & ~1, height);
+	yuv420_planes_init(&p, dstFmt, dst, dstStride, dstHeight);
+	j.dstUVStride = p.cstride;
+
+	if (dstFmt == CONV_DST_YVU420SP) {
+		j.dstU = p.v;
+		converter_parallel(height, 2, band_yvu420sp, &j);
+	} else {
+		j.dstU = p.u;
+		j.dstV = p.v;
+		converter_parallel(height, 2, band_420p, &j);
+	}
+}
+
+void yuyv_to_yvu420sp(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+{
+	yuyv_to_420(CONV_DST_YVU420SP, dst, dstStride, dstHeight, src, srcStride, width, height);
+}
+
+void yuyv_to_yvu420p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+{
+	yuyv_to_420(CONV_DST_YVU420P, dst, dstStride, dstHeight, src, srcStride, width, height);
+}
+
+void yuyv_to_yuv420p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+{
+	yuyv_to_420(CONV_DST_YUV420P, dst, dstStride, dstHeight, src, srcStride, width, height);
+}
+
+void yuyv_to_yvu422p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+{
+	struct conv_job j;
+
+	conv_job_init(&j, dst, dstStride, src, srcStride, width & ~1, height);
+	j.dstUVStride = ((dstStride >> 1) + 15) & (-16);
+	j.dstV = dst + dstStride * dstHeight;
+	j.dstU = j.dstV + j.dstUVStride * dstHeight;
+	converter_parallel(height, 1, band_422p, &j);
+}
+
+static void to_rgb(yuyv_rgb_rows rows, const struct yuv_rgb_table *t,
+	uint8_t *src, int srcStride, uint8_t *dst, int dstStride, int width, int height)
+{
+	struct conv_job j;
+
+	conv_job_init(&j, dst, dstStride, src, srcStride, width, height);
+	j.rgb = t;
+	j.rgb_rows = rows;
+	converter_parallel(height, 1, band_to_rgb, &j);
+}
+
+static void to_yuyv(void (*rows)(uint8_t *, int, uint8_t *, int, int, int),
+	uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	struct conv_job j;
+
+	conv_job_init(&j, dst, dstStride, src, srcStride, width, height);
+	j.rows = rows;
+	converter_parallel(height, 1, band_to_yuyv, &j);
+}
+
+/* The scaler converts to rgb with the table of its own colour space, and
+   the plain converters with the default one */
+static int yuyv_to_rgb(int dstFmt, const struct yuv_rgb_table *t,
+	uint8_t *src, int srcStride, uint8_t *dst, int dstStride, int width, int height)
+{
+	yuyv_rgb_rows rows;
+
+	switch (dstFmt) {
+	case SCALE_DST_RGB565:	rows = ops()->yuyv_to_rgb565; break;
+	case SCALE_DST_RGB24:	rows = yuyv_to_rgb24_c; break;
+	case SCALE_DST_RGB32:	rows = ops()->yuyv_to_rgb32; break;
+	case SCALE_DST_BGR32:	rows = ops()->yuyv_to_bgr32; break;
+	default:
+		return -1;
+	}
+
+	to_rgb(rows, t, src, srcStride, dst, dstStride, width, height);
+	return 0;
+}
+
+static inline const struct yuv_rgb_table* default_rgb_table(void)
+{
+	return rgb_table(YUV_MATRIX_BT601, YUV_RANGE_FULL);
+}
+
+void yuyv_to_rgb565 (uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+{
+	yuyv_to_rgb(SCALE_DST_RGB565, default_rgb_table(), pyuv, pyuvstride, prgb, prgbstride, width, height);
+}
+
+void yuyv_to_rgb24 (uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+{
+	yuyv_to_rgb(SCALE_DST_RGB24, default_rgb_table(), pyuv, pyuvstride, prgb, prgbstride, width, height);
+}
+
+void yuyv_to_rgb32 (uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+{
+	yuyv_to_rgb(SCALE_DST_RGB32, default_rgb_table(), pyuv, pyuvstride, prgb, prgbstride, width, height);
+}
+
+void yuyv_to_bgr24 (uint8_t *pyuv, int pyuvstride, uint8_t *pbgr, int pbgrstride, int width, int height)
+{
+	to_rgb(yuyv_to_bgr24_c, default_rgb_table(), pyuv, pyuvstride, pbgr, pbgrstride, width, height);
+}
+
+void yuyv_to_bgr32 (uint8_t *pyuv, int pyuvstride, uint8_t *pbgr, int pbgrstride, int width, int height)
+{
+	yuyv_to_rgb(SCALE_DST_BGR32, default_rgb_table(), pyuv, pyuvstride, pbgr, pbgrstride, width, height);
+}
+
+void uyvy_to_yuyv (uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	to_yuyv(ops()->uyvy_to_yuyv, dst, dstStride, src, srcStride, width & ~1, height);
+}
+
+void yvyu_to_yuyv (uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	to_yuyv(ops()->yvyu_to_yuyv, dst, dstStride, src, srcStride, width & ~1, height);
+}
+
+void bayer_to_yuyv (uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height, int pix_order)
+{
+	struct conv_job j;
+
+	/* The lines above and below each band are read, but not written. The
+	   pairs of an odd width would write into the next line, so its last
+	   pixel is left out */
+	conv_job_init(&j, dst, dstStride, src, srcStride, width & ~1, height);
+	j.pix_order = pix_order;
+	converter_parallel(height, 1, band_bayer, &j);
+}
+
+//--------------------------------------------------------------------------------------
+
+/*------------------------------- Direct converters -------------------------*/
+
+/* These skip the YUYV frame when the camera already captures some YUV format.
+   The results are the same as going through YUYV and then yuyv_to_yvu420sp
+   and friends would give, so the callers can use either path */
+
+void yuv420_planes_init(struct yuv420_planes *p, int dstFmt, uint8_t *dst, int dstStride, int dstHeight)
+{
+	p->y = dst;
+	p->ystride = dstStride;
+
+	switch (dstFmt) {
+	case CONV_DST_YVU420SP:
+		p->cstride = dstStride;
+		p->cstep = 2;
+		p->v = dst + dstStride * dstHeight;
+		p->u = p->v + 1;
+		break;
+
+	case CONV_DST_YVU420P:
+		p->cstride = ((dstStride >> 1) + 15) & (-16);
+		p->cstep = 1;
+		p->v = dst + dstStride * dstHeight;
+		p->u = p->v + (p->cstride * dstHeight >> 1);
+		break;
+
+	default: // CONV_DST_YUV420P
+		p->cstride = ((dstStride >> 1) + 15) & (-16);
+		p->cstep = 1;
+		p->u = dst + dstStride * dstHeight;
+		p->v = p->u + (p->cstride * dstHeight >> 1);
+		break;
+	}
+}
+
+void planar_to_yuv420(const struct yuv420_planes *d, const struct yuv420_planes *s, int vsub, int width, int height)
+{
+	int h, w;
+	int cw = (width + 1) >> 1;
+	int ch = (height + 1) >> 1;
+
+	for (h = 0; h < height; h++)
+		memcpy(d->y + h * d->ystride, s->y + h * s->ystride, width);
+
+	for (h = 0; h < ch; h++) {
+		uint8_t *du = d->u + h * d->cstride;
+		uint8_t *dv = d->v + h * d->cstride;
+		const uint8_t *su = s->u + h * vsub * s->cstride;
+		const uint8_t *sv = s->v + h * vsub * s->cstride;
+
+		if (vsub == 2) {
+			for (w = 0; w < cw; w++) {
+				du[w * d->cstep] = (su[w * s->cstep] + su[w * s->cstep + s->cstride]) >> 1;
+				dv[w * d->cstep] = (sv[w * s->cstep] + sv[w * s->cstep + s->cstride]) >> 1;
+			}
+		} else if (d->cstep == 1 && s->cstep == 1) {
+			memcpy(du, su, cw);
+			memcpy(dv, sv, cw);
+		} else if (d->cstep == 2 && s->cstep == 2 && dv - du == sv - su && (dv - du == 1 || du - dv == 1)) {
+			// Same interleaving, so both planes are copied with one memcpy
+			memcpy(du < dv ? du : dv, su < sv ? su : sv, cw << 1);
+		} else {
+			for (w = 0; w < cw; w++) {
+				du[w * d->cstep] = su[w * s->cstep];
+				dv[w * d->cstep] = sv[w * s->cstep];
+			}
+		}
+	}
+}
+
+void planar_to_yuyv(uint8_t *dst, int dstStride, const struct yuv420_planes *s, int vsub, int width, int height)
+{
+	int h, w;
+
+	for (h = 0; h < height; h++) {
+		uint8_t *pdst = dst + h * dstStride;
+		const uint8_t *py = s->y + h * s->ystride;
+		const uint8_t *pu = s->u + (vsub == 2 ? h : h >> 1) * s->cstride;
+		const uint8_t *pv = s->v + (vsub == 2 ? h : h >> 1) * s->cstride;
+
+		for (w = 0; w < (width >> 1); w++) {
+			*pdst++ = *py++;
+			*pdst++ = *pu;
+			*pdst++ = *py++;
+			*pdst++ = *pv;
+			pu += s->cstep;
+			pv += s->cstep;
+		}
+	}
+}
+
+static int planar_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight,
+		uint8_t *y, uint8_t *u, uint8_t *v, int ystride, int cstride, int cstep, int vsub,
+		int width, int height)
+{
+	struct yuv420_planes d, s;
+	yuv420_planes_init(&d, dstFmt, dst, dstStride, dstHeight);
+
+	s.y = y;
+	s.u = u;
+	s.v = v;
+	s.ystride = ystride;
+	s.cstride = cstride;
+	s.cstep = cstep;
+
+	planar_to_yuv420(&d, &s, vsub, width, height);
+	return 0;
+}
+
+/* The source plane layouts are the same the *_to_yuyv converters assume */
+static int yuv420_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height)
+{
+	uint8_t *u = src + srcWidth * srcHeight;
+	uint8_t *v = u + (srcWidth * srcHeight / 4);
+	return planar_direct(dstFmt, dst, dstStride, dstHeight, src, u, v, srcWidth, srcWidth / 2, 1, 1, width, height);
+}
+
+static int yvu420_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height)
+{
+	uint8_t *v = src + srcWidth * srcHeight;
+	uint8_t *u = v + (srcWidth * srcHeight / 4);
+	return planar_direct(dstFmt, dst, dstStride, dstHeight, src, u, v, srcWidth, srcWidth / 2, 1, 1, width, height);
+}
+
+static int nv12_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height)
+{
+	uint8_t *uv = src + srcWidth * srcHeight;
+	return planar_direct(dstFmt, dst, dstStride, dstHeight, src, uv, uv + 1, srcWidth, srcWidth, 2, 1, width, height);
+}
+
+static int nv21_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height)
+{
+	uint8_t *vu = src + srcWidth * srcHeight;
+	return planar_direct(dstFmt, dst, dstStride, dstHeight, src, vu + 1, vu, srcWidth, srcWidth, 2, 1, width, height);
+}
+
+static int nv16_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height)
+{
+	uint8_t *uv = src + srcWidth * srcHeight;
+	return planar_direct(dstFmt, dst, dstStride, dstHeight, src, uv, uv + 1, srcWidth, srcWidth, 2, 2, width, height);
+}
+
+static int nv61_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height)
+{
+	uint8_t *vu = src + srcWidth * srcHeight;
+	return planar_direct(dstFmt, dst, dstStride, dstHeight, src, vu + 1, vu, srcWidth, srcWidth, 2, 2, width, height);
+}
+
+static int mjpeg_direct(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height)
+{
+	struct yuv420_planes d;
+	yuv420_planes_init(&d, dstFmt, dst, dstStride, dstHeight);
+
+	return utils::jpeg_decode_yuv420(&d, width, height, src, srcWidth, srcHeight) ? -1 : 0;
+}
+
+direct_converter find_direct_converter(uint32_t pixfmt)
+{
+	switch (pixfmt) {
+	case V4L2_PIX_FMT_YUV420:
+		return yuv420_direct;
+	case V4L2_PIX_FMT_YVU420:
+		return yvu420_direct;
+	case V4L2_PIX_FMT_NV12:
+		return nv12_direct;
+	case V4L2_PIX_FMT_NV21:
+		return nv21_direct;
+	case V4L2_PIX_FMT_NV16:
+		return nv16_direct;
+	case V4L2_PIX_FMT_NV61:
+		return nv61_direct;
+	case V4L2_PIX_FMT_JPEG:
+	case V4L2_PIX_FMT_MJPEG:
+		return mjpeg_direct;
+	default:
+		return NULL;
+	}
+}
+
+/* Where each destination sample is taken from: the first of the two source
+   samples and the weight of the second one, out of 256. The samples are
+   centered, so a picture that is scaled down by 2 averages pairs of them */
+static inline void scale_pos(int pos, int size, int *i0, int *i1, int *frac)
+{
+	if (pos < 0)
+		pos = 0;
+	*i0 = pos >> 16;
+	*frac = (pos >> 8) & 0xFF;
+	*i1 = *i0 + 1;
+	if (*i0 >= size - 1) {
+		*i0 = *i1 = size - 1;
+		*frac = 0;
+	}
+}
+
+/* The scaler is separable. Each source line is scaled horizontally once
+   into a line cache, and the two cached lines around each destination line
+   are then blended. Y, U and V are scaled as separate planes, straight to
+   where the destination format keeps them, so the chroma subsampling of
+   the 4:2:0 formats is done by the vertical scaling */
+
+/* Where the samples of one axis are taken from. For horizontal axes the
+   indexes are already multiplied by the distance between samples */
+struct scaler_axis {
+	int src, dst, step;
+	int cap;
+	int *i0, *i1;
+	uint8_t *f;
+};
+
+/* One plane of a frame: its samples are step bytes apart */
+struct scaler_plane {
+	uint8_t *p;
+	int stride;
+	int step;
+	int width;
+	int height;
+};
+
+#define SCALER_BAND 16
+
+struct yuyv_scaler {
+	struct scaler_axis x[2], y[2];		/* luma and chroma */
+
+	/* Two horizontally scaled lines for each of Y, U and V, and the source
+	   lines they come from */
+	uint8_t *rows[3][2];
+	int rowsrc[3][2];
+	uint8_t *line;						/* a destination line before it is spread */
+	uint8_t *band;						/* yuyv lines for the rgb formats */
+	int linecap;
+
+	const struct yuv_rgb_table *rgb;	/* NULL for the default */
+};
+
+static int scaler_axis_setup(struct scaler_axis *a, int src, int dst, int step)
+{
+	int i, pos, inc;
+
+	if (a->src == src && a->dst == dst && a->step == step)
+		return 0;
+
+	if (dst > a->cap) {
+		free(a->i0);
+		free(a->i1);
+		free(a->f);
+		a->cap = 0;
+		a->i0 = (int *)malloc(dst * sizeof(int));
+		a->i1 = (int *)malloc(dst * sizeof(int));
+		a->f = (uint8_t *)malloc(dst);
+		if (!a->i0 || !a->i1 || !a->f) {
+			a->src = a->dst = 0;
+			return -1;
+		}
+		a->cap = dst;
+	}
+
+	/* 16.16 fixed point step, and the position of the first sample */
+	inc = (int)(((int64_t)src << 16) / dst);
+	pos = (inc >> 1) - 32768;
+	for (i = 0; i < dst; i++, pos += inc) {
+		int i0, i1, frac;
+		scale_pos(pos, src, &i0, &i1, &frac);
+		a->i0[i] = i0 * step;
+		a->i1[i] = i1 * step;
+		a->f[i] = frac;
+	}
+
+	a->src = src;
+	a->dst = dst;
+	a->step = step;
+	return 0;
+}
+
+static void scaler_free_lines(struct yuyv_scaler *s)
+{
+	int i;
+	for (i = 0; i < 3; i++) {
+		free(s->rows[i][0]);
+		free(s->rows[i][1]);
+		s->rows[i][0] = s->rows[i][1] = NULL;
+	}
+	free(s->line);
+	free(s->band);
+	s->line = s->band = NULL;
+	s->linecap = 0;
+}
+
+static int scaler_lines(struct yuyv_scaler *s, int width)
+{
+	int i;
+
+	if (width <= s->linecap)
+		return 0;
+
+	scaler_free_lines(s);
+	for (i = 0; i < 3; i++) {
+		s->rows[i][0] = (uint8_t *)malloc(width);
+		s->rows[i][1] = (uint8_t *)malloc(width);
+		if (!s->rows[i][0] || !s->rows[i][1])
+			return -1;
+	}
+	s->line = (uint8_t *)malloc(width);
+	s->band = (uint8_t *)malloc(width * 2 * SCALER_BAND);
+	if (!s->line || !s->band)
+		return -1;
+
+	s->linecap = width;
+	return 0;
+}
+
+/* Returns source line row of plane n scaled horizontally, keeping the
+   cached line keep if it is there */
+static const uint8_t* scaler_row(struct yuyv_scaler *s, int n, int row, int keep,
+	const struct scaler_plane *src, const struct scaler_axis *ax)
+{
+	int i, x;
+	uint8_t *d;
+	const uint8_t *p;
+
+	if (s->rowsrc[n][0] == row)
+		return s->rows[n][0];
+	if (s->rowsrc[n][1] == row)
+		return s->rows[n][1];
+
+	i = (s->rowsrc[n][0] == keep) ? 1 : 0;
+	d = s->rows[n][i];
+	p = src->p + row * src->stride;
+
+	for (x = 0; x < ax->dst; x++) {
+		int f = ax->f[x];
+		d[x] = (p[ax->i0[x]] * (256 - f) + p[ax->i1[x]] * f + 128) >> 8;
+	}
+
+	s->rowsrc[n][i] = row;
+	return d;
+}
+
+/* Scales lines y0 to y1 of plane n. dst->p is where line y0 goes */
+static void scaler_plane_lines(struct yuyv_scaler *s, int n, const struct scaler_plane *dst, int y0, int y1,
+	const struct scaler_plane *src, const struct scaler_axis *ax, const struct scaler_axis *ay)
+{
+	int y, x;
+	const struct converter_ops *o = ops();
+
+	for (y = y0; y < y1; y++) {
+		uint8_t *d = dst->p + (y - y0) * dst->stride;
+		uint8_t *out = (dst->step == 1) ? d : s->line;
+		const uint8_t *r0 = scaler_row(s, n, ay->i0[y], ay->i1[y], src, ax);
+
+		if (ay->f[y] == 0) {
+			memcpy(out, r0, dst->width);
+		} else {
+			const uint8_t *r1 = scaler_row(s, n, ay->i1[y], ay->i0[y], src, ax);
+			o->scale_blend(out, r0, r1, dst->width, ay->f[y]);
+		}
+
+		if (dst->step != 1) {
+			for (x = 0; x < dst->width; x++)
+				d[x * dst->step] = out[x];
+		}
+	}
+}
+
+struct yuyv_scaler* yuyv_scaler_create(void)
+{
+	return (struct yuyv_scaler *)calloc(1, sizeof(struct yuyv_scaler));
+}
+
+void yuyv_scaler_destroy(struct yuyv_scaler *s)
+{
+	int i;
+
+	if (!s)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		free(s->x[i].i0); free(s->x[i].i1); free(s->x[i].f);
+		free(s->y[i].i0); free(s->y[i].i1); free(s->y[i].f);
+	}
+	scaler_free_lines(s);
+	free(s);
+}
+
+int yuyv_scaler_set_colorspace(struct yuyv_scaler *s, int matrix, int range)
+{
+	const struct yuv_rgb_table *t = rgb_table(matrix, range);
+
+	if (!t)
+		return -1;
+	s->rgb = t;
+	return 0;
+}
+
+/* The plain converters, for when there is nothing to scale */
+static int scaler_convert(const struct yuyv_scaler *s, int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height)
+{
+	int h;
+
+	switch (dstFmt) {
+	case SCALE_DST_YVU420SP:
+		yuyv_to_yvu420sp(dst, dstStride, dstHeight, src, srcStride, width, height);
+		break;
+	case SCALE_DST_YVU420P:
+		yuyv_to_yvu420p(dst, dstStride, dstHeight, src, srcStride, width, height);
+		break;
+	case SCALE_DST_YUV420P:
+		yuyv_to_yuv420p(dst, dstStride, dstHeight, src, srcStride, width, height);
+		break;
+	case SCALE_DST_YVU422P:
+		yuyv_to_yvu422p(dst, dstStride, dstHeight, src, srcStride, width, height);
+		break;
+	case SCALE_DST_YUYV:
+		for (h = 0; h < height; h++)
+			memcpy(dst + h * dstStride, src + h * srcStride, width << 1);
+		break;
+	default:
+		return yuyv_to_rgb(dstFmt, s->rgb ? s->rgb : default_rgb_table(), src, srcStride, dst, dstStride, width, height);
+	}
+	return 0;
+}
+
+int yuyv_scaler_run(struct yuyv_scaler *s, int dstFmt, uint8_t *dst, int dstStride, int dstHeight, int width, int height,
+	uint8_t *src, int srcStride, int srcWidth, int srcHeight)
+{
+	struct scaler_plane sp[3], dp[3];
+	int i, cheight;
+
+	if (width == srcWidth && height == srcHeight)
+		return scaler_convert(s, dstFmt, dst, dstStride, dstHeight, src, srcStride, width, height);
+
+	if (width < 2 || height < 2 || srcWidth < 2 || srcHeight < 1)
+		return -1;
+
+	/* The source planes, in the yuyv frame */
+	for (i = 0; i < 3; i++) {
+		sp[i].p = src + (i == 0 ? 0 : (i == 1 ? 1 : 3));
+		sp[i].stride = srcStride;
+		sp[i].step = (i == 0) ? 2 : 4;
+		sp[i].width = (i == 0) ? srcWidth : (srcWidth >> 1);
+		sp[i].height = srcHeight;
+	}
+
+	/* And the destination ones. The rgb formats are scaled into yuyv lines
+	   and converted from there */
+	cheight = height;
+	for (i = 0; i < 3; i++) {
+		dp[i].stride = dstStride;
+		dp[i].step = 1;
+		dp[i].width = (i == 0) ? width : (width >> 1);
+	}
+
+	switch (dstFmt) {
+	case SCALE_DST_YVU420SP:
+	case SCALE_DST_YVU420P:
+	case SCALE_DST_YUV420P:
+	{
+		struct yuv420_planes p;
+		yuv420_planes_init(&p, dstFmt, dst, dstStride, dstHeight);
+		dp[0].p = p.y;
+		dp[1].p = p.u;
+		dp[2].p = p.v;
+		dp[1].stride = dp[2].stride = p.cstride;
+		dp[1].step = dp[2].step = p.cstep;
+		cheight = height >> 1;
+		break;
+	}
+
+	case SCALE_DST_YVU422P:
+		dp[0].p = dst;
+		dp[1].stride = dp[2].stride = ((dstStride >> 1) + 15) & (-16);
+		dp[2].p = dst + dstStride * dstHeight;
+		dp[1].p = dp[2].p + dp[2].stride * dstHeight;
+		break;
+
+	case SCALE_DST_YUYV:
+		dp[0].p = dst;
+		dp[1].p = dst + 1;
+		dp[2].p = dst + 3;
+		dp[0].step = 2;
+		dp[1].step = dp[2].step = 4;
+		break;
+
+	case SCALE_DST_RGB565:
+	case SCALE_DST_RGB24:
+	case SCALE_DST_RGB32:
+	case SCALE_DST_BGR32:
+		for (i = 0; i < 3; i++) {
+			dp[i].stride = width << 1;
+			dp[i].step = (i == 0) ? 2 : 4;
+		}
+		break;
+
+	default:
+		return -1;
+	}
+	dp[0].height = height;
+	dp[1].height = dp[2].height = cheight;
+
+	if (scaler_axis_setup(&s->x[0], sp[0].width, dp[0].width, sp[0].step) ||
+		scaler_axis_setup(&s->x[1], sp[1].width, dp[1].width, sp[1].step) ||
+		scaler_axis_setup(&s->y[0], srcHeight, height, 1) ||
+		scaler_axis_setup(&s->y[1], srcHeight, cheight, 1) ||
+		scaler_lines(s, width))
+		return -1;
+
+	/* A new frame, nothing is cached */
+	for (i = 0; i < 3; i++)
+		s->rowsrc[i][0] = s->rowsrc[i][1] = -1;
+
+	if (dstFmt < SCALE_DST_RGB565) {
+		for (i = 0; i < 3; i++)
+			scaler_plane_lines(s, i, &dp[i], 0, dp[i].height, &sp[i], &s->x[i > 0], &s->y[i > 0]);
+		return 0;
+	}
+
+	/* A band of lines at a time, so they are still in the cache when they
+	   are converted */
+	for (int y = 0; y < height; y += SCALER_BAND) {
+		int y1 = (y + SCALER_BAND < height) ? y + SCALER_BAND : height;
+
+		dp[0].p = s->band;
+		dp[1].p = s->band + 1;
+		dp[2].p = s->band + 3;
+		for (i = 0; i < 3; i++)
+			scaler_plane_lines(s, i, &dp[i], y, y1, &sp[i], &s->x[i > 0], &s->y[i > 0]);
+
+		scaler_convert(s, dstFmt, dst + y * dstStride, dstStride, y1 - y, s->band, width << 1, width, y1 - y);
+	}
+	return 0;
+}
+
+void scale_blend_line(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int frac)
+{
+	int x;
+	for (x = 0; x < width; x++)
+		dst[x] = (a[x] * (256 - frac) + b[x] * frac + 128) >> 8;
+}
+
+void yuyv_scale(uint8_t *dst, int dstStride, int dstWidth, int dstHeight, uint8_t *src, int srcStride, int srcWidth, int srcHeight)
+{
+	struct yuyv_scaler *s = yuyv_scaler_create();
+
+	if (!s || yuyv_scaler_run(s, SCALE_DST_YUYV, dst, dstStride, dstHeight, dstWidth, dstHeight,
+						src, srcStride, srcWidth, srcHeight))
+		ALOGE("yuyv_scale: cannot scale %dx%d to %dx%d", srcWidth, srcHeight, dstWidth, dstHeight);
+
+	yuyv_scaler_destroy(s);
+}
+
+/* Each destination pixel is the mean of the 2x2 source pixels at the centre
+   of the area it stands for. The source is read once, in the capture format,
+   and only 4 bytes of it for each destination pixel whatever its size, so a
+   small analytics frame costs next to nothing to make from a big one. Point
+   sampling alone would alias the sensor noise into the small frame */
+void luma_decimate(uint8_t *dst, int dstStride, int dstWidth, int dstHeight, const uint8_t *src, int srcStride, int srcWidth, int srcHeight, int step)
+{
+	/* 16.16 fixed point centres, clamped so that the 2x2 block stays inside */
+	uint32_t xinc = ((uint32_t)srcWidth << 16) / dstWidth;
+	uint32_t yinc = ((uint32_t)srcHeight << 16) / dstHeight;
+	int xmax = srcWidth - 2, ymax = srcHeight - 2;
+	uint32_t fy = yinc >> 1;
+	int x, y;
+
+	if (xmax < 0) xmax = 0;
+	if (ymax < 0) ymax = 0;
+
+	for (y = 0; y < dstHeight; y++, fy += yinc) {
+		int sy = (fy > 0x8000) ? (int)((fy - 0x8000) >> 16) : 0;
+		const uint8_t *s0, *s1;
+		uint32_t fx = xinc >> 1;
+		uint8_t *d = dst + y * dstStride;
+
+		if (sy > ymax) sy = ymax;
+		s0 = src + sy * srcStride;
+		s1 = (srcHeight > 1) ? s0 + srcStride : s0;
+
+		for (x = 0; x < dstWidth; x++, fx += xinc) {
+			int sx = (fx > 0x8000) ? (int)((fx - 0x8000) >> 16) : 0;
+			int o0, o1;
+
+			if (sx > xmax) sx = xmax;
+			o0 = sx * step;
+			o1 = (srcWidth > 1) ? o0 + step : o0;
+
+			d[x] = (s0[o0] + s0[o1] + s1[o0] + s1[o1] + 2) >> 2;
+		}
+	}
+}
+
 /*	This a custom destination manager for jpeglib that
 	enables the use of memory to memory compression.
 	See IJG documentation for details.
@@ -1663,6 +2597,7 @@ METHODDEF(void) init_destination (j_compress_ptr cinfo)
 	dest->pub.next_output_byte 	= dest->buffer; 	/* set destination buffer */
 	dest->pub.free_in_buffer 	= dest->bufsize; 	/* input buffer size */
 	dest->datasize = 0; 							/* reset output size */
+	dest->overflowed = 0;
 }
 
 /* This function is called by the library if the buffer fills up */
@@ -1714,113 +2649,403 @@ static GLOBAL(void) jpeg_memory_dest (j_compress_ptr cinfo,void* buf,int sz)
 }
 
 
-/* yuyv_to_jpeg
- *  converts an input image in the YUYV format into a jpeg image and puts
- * it in a memory buffer.
- */
-int yuyv_to_jpeg(uint8_t* src, uint8_t* dst, int maxsize, int width, int height,int stride,int quality)
-{
-	// Round height to a multiple of 16:
-	height &= (-16);
+/* Fatal errors of the compressor. The default handler would exit() */
+typedef struct {
+	struct jpeg_error_mgr pub;			/* base class */
+	jmp_buf jump;						/* where to go on fatal errors */
+} encoder_error_mgr;
 
-	// Round width to a multiple of 16
-	width &= (-16);
+METHODDEF(void) encoder_error_exit (j_common_ptr cinfo)
+{
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	ALOGE("jpeg_encoder: %s", msg);
 
-	// Calculate deltaStride
-	int dstride = stride - (width << 1);
+	longjmp(((encoder_error_mgr*)cinfo->err)->jump, 1);
+}
 
-	int i, j;
+/* The lines packed for libjpeg at once, in row bands. A multiple of the 16
+   lines it takes at a time */
+#define JPEG_LINES 64
 
-	JSAMPROW y[16],cb[8],cr[8];
-	JSAMPARRAY data[3];
+/* The pictures of at least JPEG_STRIPE_HEIGHT lines are encoded in up to
+   JPEG_STRIPES stripes at once, one per converter thread */
+#define JPEG_STRIPES 8
+#define JPEG_STRIPE_HEIGHT 256
 
+struct jpeg_encoder {
 	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
+	encoder_error_mgr err;
+
+	/* JPEG_LINES lines of Y and half as many of Cb and Cr, for linewidth pixels */
+	JSAMPROW y[JPEG_LINES], cb[JPEG_LINES / 2], cr[JPEG_LINES / 2];
+	int linewidth;
+
+	/* The encoders of the other stripes, made when first needed */
+	struct jpeg_encoder *stripe[JPEG_STRIPES - 1];
+
+	int nojfif;		/* leave the JFIF APP0 out */
+};
+
+/* The part of the picture packed by each jpeg_pack_band() */
+struct jpeg_pack {
+	struct jpeg_encoder *enc;
+	uint8_t *src;
+	int stride;
+	int width;
+};
+
+struct jpeg_encoder* jpeg_encoder_create(void)
+{
+	struct jpeg_encoder *enc = (struct jpeg_encoder *)calloc(1, sizeof(struct jpeg_encoder));
+	if (!enc)
+		return NULL;
+
+	enc->cinfo.err = jpeg_std_error(&enc->err.pub);
+	enc->err.pub.error_exit = encoder_error_exit;
+
+	jpeg_create_compress(&enc->cinfo);
+	return enc;
+}
+
+void jpeg_encoder_destroy(struct jpeg_encoder *enc)
+{
+	int i;
 
-	// Allocate memory for line buffers
-	y[0] = (JSAMPROW) malloc(sizeof(JSAMPLE) * width * 16);
-	cb[0] = (JSAMPROW) malloc(sizeof(JSAMPLE) * (width >> 1) * 8);
-	cr[0] = (JSAMPROW) malloc(sizeof(JSAMPLE) * (width >> 1) * 8);
+	if (!enc)
+		return;
 
-	for (i = 1; i< 16; i++) {
-		y[i]  =  y[0] + (i*(sizeof(JSAMPLE) * width));
+	for (i = 0; i < JPEG_STRIPES - 1; i++)
+		jpeg_encoder_destroy(enc->stripe[i]);
+
+	jpeg_destroy_compress(&enc->cinfo);
+	free(enc->y[0]);
+	free(enc->cb[0]);
+	free(enc->cr[0]);
+	free(enc);
+}
+
+void jpeg_encoder_set_jfif(struct jpeg_encoder *enc, int jfif)
+{
+	/* Only the headers of the first stripe, which is enc, are kept */
+	enc->nojfif = !jfif;
+}
+
+/* Makes sure the line buffers hold width pixels, and lays them out for
+   lines of that width, so they are filled with consecutive writes */
+static int jpeg_encoder_lines(struct jpeg_encoder *enc, int width)
+{
+	int i;
+
+	if (width > enc->linewidth) {
+		free(enc->y[0]);
+		free(enc->cb[0]);
+		free(enc->cr[0]);
+		enc->linewidth = 0;
+
+		enc->y[0]  = (JSAMPROW) malloc(sizeof(JSAMPLE) * width * JPEG_LINES);
+		enc->cb[0] = (JSAMPROW) malloc(sizeof(JSAMPLE) * (width >> 1) * (JPEG_LINES / 2));
+		enc->cr[0] = (JSAMPROW) malloc(sizeof(JSAMPLE) * (width >> 1) * (JPEG_LINES / 2));
+
+		if (!enc->y[0] || !enc->cb[0] || !enc->cr[0])
+			return -1;
+
+		enc->linewidth = width;
 	}
-	for (i = 1; i< 8; i++) {
-		cb[i] = cb[0] + (i*(sizeof(JSAMPLE) * (width >> 1)));
-		cr[i] = cr[0] + (i*(sizeof(JSAMPLE) * (width >> 1)));
+
+	for (i = 1; i< JPEG_LINES; i++) {
+		enc->y[i]  = enc->y[0] + (i*(sizeof(JSAMPLE) * width));
+	}
+	for (i = 1; i< JPEG_LINES / 2; i++) {
+		enc->cb[i] = enc->cb[0] + (i*(sizeof(JSAMPLE) * (width >> 1)));
+		enc->cr[i] = enc->cr[0] + (i*(sizeof(JSAMPLE) * (width >> 1)));
 	}
 
-	data[0] = y;
-	data[1] = cb;
-	data[2] = cr;
+	return 0;
+}
 
-	cinfo.err = jpeg_std_error(&jerr);  // errors get written to stderr
+/* Splits lines [y0, y1) of the part into the Y, Cb and Cr lines. y0 is even */
+static void jpeg_pack_band(void *arg, int y0, int y1)
+{
+	const struct jpeg_pack *p = (const struct jpeg_pack *)arg;
+	int stride = p->stride;
+	int x, y;
+
+	for (y = y0; y < y1; y += 2) {
+		uint8_t *yuyv = p->src + y * stride;
+		JSAMPROW py0 = p->enc->y[y];
+		JSAMPROW py1 = p->enc->y[y + 1];
+		JSAMPROW pcb = p->enc->cb[y >> 1];
+		JSAMPROW pcr = p->enc->cr[y >> 1];
+
+		for (x = 0; x < (p->width >> 1); x++) {
+			*py0++ = yuyv[0];								// Y0
+			*pcb++ = (yuyv[1] + yuyv[stride + 1]) >> 1;		// U
+			*py0++ = yuyv[2];								// Y1
+			*pcr++ = (yuyv[3] + yuyv[stride + 3]) >> 1;		// V
+			*py1++ = yuyv[stride];							// Y2
+			*py1++ = yuyv[stride + 2];						// Y3
+			yuyv += 4;
+		}
+	}
+}
 
-	jpeg_create_compress(&cinfo);
-	cinfo.image_width = width;
-	cinfo.image_height = height;
-	cinfo.input_components = 3;
-	jpeg_set_defaults (&cinfo);
+/* Encodes width x height pixels, both multiples of 16. With restart, each
+   row of 16 lines is followed by a restart marker */
+static int jpeg_encode_rows(struct jpeg_encoder *enc, uint8_t* src, uint8_t* dst, int maxsize, int width, int height, int stride, int quality, int restart)
+{
+	int i, j;
 
-	jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+	JSAMPARRAY data[3];
+	struct jpeg_compress_struct *cinfo = &enc->cinfo;
 
-	cinfo.raw_data_in = TRUE; 			// supply downsampled data
-	cinfo.comp_info[0].h_samp_factor = 2;
-	cinfo.comp_info[0].v_samp_factor = 2;
-	cinfo.comp_info[1].h_samp_factor = 1;
-	cinfo.comp_info[1].v_samp_factor = 1;
-	cinfo.comp_info[2].h_samp_factor = 1;
-	cinfo.comp_info[2].v_samp_factor = 1;
+	// The line buffers are only reallocated for wider pictures
+	if (jpeg_encoder_lines(enc, width) < 0) {
+		ALOGE("jpeg_encoder: out of memory for the line buffers");
+		return -1;
+	}
 
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	cinfo.dct_method = JDCT_FASTEST;
+	if (setjmp(enc->err.jump)) {
+		jpeg_abort_compress(cinfo);
+		return -1;
+	}
 
-	jpeg_memory_dest(&cinfo,dst,maxsize);	// data written to mem
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	jpeg_set_defaults (cinfo);
 
-	jpeg_start_compress (&cinfo, TRUE);
+	jpeg_set_colorspace(cinfo, JCS_YCbCr);
+	cinfo->write_JFIF_header = !enc->nojfif;
 
-	uint8_t* yuyv = src;
+	cinfo->raw_data_in = TRUE; 			// supply downsampled data
+	cinfo->comp_info[0].h_samp_factor = 2;
+	cinfo->comp_info[0].v_samp_factor = 2;
+	cinfo->comp_info[1].h_samp_factor = 1;
+	cinfo->comp_info[1].v_samp_factor = 1;
+	cinfo->comp_info[2].h_samp_factor = 1;
+	cinfo->comp_info[2].v_samp_factor = 1;
 
-	for (j=0; j<height; j+=16) {
+	jpeg_set_quality(cinfo, quality, TRUE);
+	cinfo->dct_method = JDCT_FASTEST;
+	cinfo->restart_in_rows = restart;
 
-		JSAMPROW pcb = cb[0];
-		JSAMPROW pcr = cr[0];
-		JSAMPROW py  = y[0];
-		for (i=0; i<8; i++) {
+	jpeg_memory_dest(cinfo,dst,maxsize);	// data written to mem
 
-			int x;
-			for (x = 0; x < (width>>1); x++) {
-				*py++ = *yuyv++;		// Y0
-				*pcb++ = (yuyv[0] + yuyv[stride]) >> 1; // U
-				yuyv++;
-				*py++ = *yuyv++;		// Y1
-				*pcr++ = (yuyv[0] + yuyv[stride]) >> 1;	// V
-				yuyv++;
-			}
-			yuyv += dstride;
-			for (x = 0; x < (width>>1); x++) {
-				*py++ = *yuyv++;		// Y2
-				yuyv++;
-				*py++ = *yuyv++;		// Y3
-				yuyv++;
+	jpeg_start_compress (cinfo, TRUE);
+
+	struct jpeg_pack pack;
+	pack.enc = enc;
+	pack.stride = stride;
+	pack.width = width;
+
+	for (j = 0; j < height; j += JPEG_LINES) {
+		int lines = height - j < JPEG_LINES ? height - j : JPEG_LINES;
+
+		pack.src = src + j * stride;
+		converter_parallel(lines, 2, jpeg_pack_band, &pack);
+
+		for (i = 0; i < lines; i += 16) {
+			data[0] = enc->y + i;
+			data[1] = enc->cb + (i >> 1);
+			data[2] = enc->cr + (i >> 1);
+			jpeg_write_raw_data(cinfo, data, 8*2);
+		}
+	}
+
+	jpeg_finish_compress(cinfo);
+
+	// The destination wraps around when it fills up, so the picture is no good
+	if (((mem_dest_ptr)cinfo->dest)->overflowed) {
+		ALOGE("jpeg_encoder: the picture does not fit in %d bytes", maxsize);
+		return -1;
+	}
+
+	return ((mem_dest_ptr)cinfo->dest)->datasize;
+}
+
+/* A picture encoded in stripes. Each stripe is encoded on its own into the
+   part of dst of the share of the picture it has, with a restart marker
+   after each of its rows. Restart markers reset the state of the entropy
+   coder, so the coded data of the stripes only has to be moved together,
+   with the markers renumbered for their place in the whole picture, to be
+   the one JPEG a single encoder would have made. */
+struct jpeg_stripes {
+	struct jpeg_encoder *enc[JPEG_STRIPES];
+	int count;							/* of enc */
+	int next;							/* the next of enc for a stripe */
+	int failed;
+
+	uint8_t *src;
+	uint8_t *dst;
+	int maxsize;
+	int width;
+	int height;
+	int stride;
+	int quality;
+
+	/* By the row of 16 lines each stripe starts at, where its coded data
+	   is in dst and how long it is, or -1 */
+	int *start;
+	int *length;
+	int sof;							/* where the height is in the headers of the first */
+};
+
+static void jpeg_stripe_band(void *arg, int y0, int y1)
+{
+	struct jpeg_stripes *s = (struct jpeg_stripes *)arg;
+	int k = __sync_fetch_and_add(&s->next, 1);
+	int begin, end, pos, shift, i;
+
+	if (k >= s->count) {
+		s->failed = 1;
+		return;
+	}
+
+	int off = (int)((long long)s->maxsize * y0 / s->height);
+	int size = (int)((long long)s->maxsize * y1 / s->height) - off;
+	uint8_t *d = s->dst + off;
+
+	int n = jpeg_encode_rows(s->enc[k], s->src + y0 * s->stride, d, size, s->width, y1 - y0, s->stride, s->quality, 1);
+	if (n < 4 || d[n - 2] != 0xff || d[n - 1] != 0xd9) {
+		s->failed = 1;
+		return;
+	}
+
+	/* The headers end with the start of scan */
+	begin = 0;
+	for (pos = 2; pos + 4 <= n && d[pos] == 0xff; pos += 2 + ((d[pos + 2] << 8) | d[pos + 3])) {
+		if (d[pos + 1] == 0xc0 && y0 == 0)
+			s->sof = off + pos + 5;
+		if (d[pos + 1] == 0xda) {
+			begin = pos + 2 + ((d[pos + 2] << 8) | d[pos + 3]);
+			break;
+		}
+	}
+	if (begin == 0 || (y0 == 0 && s->sof == 0)) {
+		s->failed = 1;
+		return;
+	}
+	end = n - 2;
+
+	/* A 0xff in the coded data is followed by a 0 or is a marker */
+	shift = (y0 >> 4) & 7;
+	if (shift) {
+		for (i = begin; i < end - 1; i++) {
+			if (d[i] == 0xff && d[i + 1] >= 0xd0 && d[i + 1] <= 0xd7) {
+				d[i + 1] = 0xd0 + ((d[i + 1] - 0xd0 + shift) & 7);
+				i++;
 			}
-			yuyv += dstride;
 		}
-		jpeg_write_raw_data(&cinfo, data, 8*2);
 	}
 
-	jpeg_finish_compress(&cinfo);
+	/* The first stripe keeps its headers */
+	if (y0 == 0)
+		begin = 0;
+
+	s->start[y0 >> 4] = off + begin;
+	s->length[y0 >> 4] = end - begin;
+}
+
+static int jpeg_encode_stripes(struct jpeg_encoder *enc, uint8_t* src, uint8_t* dst, int maxsize, int width, int height, int stride, int quality)
+{
+	struct jpeg_stripes s;
+	int rows = height >> 4;
+	int threads = converter_get_threads();
+	int r, pos;
+
+	memset(&s, 0, sizeof(s));
+	s.enc[0] = enc;
+	s.count = 1;
+
+	/* A stripe for each thread that may take one, at most */
+	while (s.count < threads && s.count < JPEG_STRIPES) {
+		if (!enc->stripe[s.count - 1])
+			enc->stripe[s.count - 1] = jpeg_encoder_create();
+		if (!enc->stripe[s.count - 1])
+			break;
+		s.enc[s.count] = enc->stripe[s.count - 1];
+		s.count++;
+	}
+
+	s.src = src;
+	s.dst = dst;
+	s.maxsize = maxsize;
+	s.width = width;
+	s.height = height;
+	s.stride = stride;
+	s.quality = quality;
+	s.start = (int *)malloc(sizeof(int) * rows * 2);
+	if (!s.start)
+		return -1;
+	s.length = s.start + rows;
+	for (r = 0; r < rows; r++)
+		s.start[r] = -1;
+
+	converter_parallel(height, 16, jpeg_stripe_band, &s);
+
+	pos = -1;
+	if (!s.failed) {
+		/* The first stripe stays where it is, and has the height of all */
+		dst[s.sof]	   = height >> 8;
+		dst[s.sof + 1] = height & 0xff;
+		pos = s.length[0];
+
+		/* Each stripe is after the first byte of its part of dst, so the
+		   ones before it and the marker never reach its data */
+		for (r = 1; r < rows; r++) {
+			if (s.start[r] < 0)
+				continue;
+			dst[pos++] = 0xff;
+			dst[pos++] = 0xd0 + ((r - 1) & 7);
+			memmove(dst + pos, dst + s.start[r], s.length[r]);
+			pos += s.length[r];
+		}
+
+		dst[pos++] = 0xff;
+		dst[pos++] = 0xd9;
+	}
+
+	free(s.start);
+	return pos;
+}
+
+int jpeg_encoder_encode(struct jpeg_encoder *enc, uint8_t* src, uint8_t* dst, int maxsize, int width, int height, int stride, int quality)
+{
+	// Round height to a multiple of 16:
+	height &= (-16);
+
+	// Round width to a multiple of 16
+	width &= (-16);
 
-	// Release memory for line buffers
-	free(y[0]);
-	free(cb[0]);
-	free(cr[0]);
+	if (width == 0 || height == 0)
+		return -1;
+
+	/* The big pictures always have a restart marker after each row, so they
+	   are the same however many stripes they were encoded in. If a stripe
+	   did not fit in its share of dst, the picture is encoded in one go */
+	if (height >= JPEG_STRIPE_HEIGHT) {
+		int size = jpeg_encode_stripes(enc, src, dst, maxsize, width, height, stride, quality);
+		if (size >= 0)
+			return size;
+		return jpeg_encode_rows(enc, src, dst, maxsize, width, height, stride, quality, 1);
+	}
 
-	// Create a buffer with the compressed data
-    int fileSize = ((mem_dest_ptr)cinfo.dest)->datasize;
+	return jpeg_encode_rows(enc, src, dst, maxsize, width, height, stride, quality, 0);
+}
+
+/* yuyv_to_jpeg
+ *  converts an input image in the YUYV format into a jpeg image and puts
+ * it in a memory buffer.
+ */
+int yuyv_to_jpeg(uint8_t* src, uint8_t* dst, int maxsize, int width, int height,int stride,int quality)
+{
+	struct jpeg_encoder *enc = jpeg_encoder_create();
+	if (!enc)
+		return -1;
 
-	// Destroy compressor context
-	jpeg_destroy_compress(&cinfo);
+	int fileSize = jpeg_encoder_encode(enc, src, dst, maxsize, width, height, stride, quality);
 
+	jpeg_encoder_destroy(enc);
 	return fileSize;
 }
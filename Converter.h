@@ -2,7 +2,7 @@
 	libcamera: An implementation of the library required by Android OS 3.2 so
 	it can access V4L2 devices as cameras.
 
-    (C) 2011 Eduardo Jos Tagle <ejtagle@tutopia.com>
+    (C) 2011 Eduardo Jos� Tagle <ejtagle@tutopia.com>
 	(C) 2011 RedScorpion
 
 	Based on several packages:
@@ -57,6 +57,19 @@ void yuyv_to_yuv420p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, in
 void yuyv_to_yvu422p(uint8_t *dst,int dstStride, int dstHeight, uint8_t *src, int srcStride, int width, int height);
 
 
+/* The colour matrices and ranges of the conversions from yuv to rgb. The
+   converters below use BT.601 at full range, which is also what a scaler
+   uses until yuyv_scaler_set_colorspace() is called */
+enum {
+	YUV_MATRIX_BT601 = 0,	/* SD video and most webcams */
+	YUV_MATRIX_BT709,		/* HD video */
+};
+
+enum {
+	YUV_RANGE_FULL = 0,		/* luma and chroma from 0 to 255 */
+	YUV_RANGE_LIMITED,		/* luma from 16 to 235, chroma from 16 to 240 */
+};
+
 /*convert yuyv to rgb24/32/565
 * args:
 *      pyuv: pointer to buffer containing yuv data (yuyv)
@@ -247,6 +260,18 @@ void s508_to_yuyv(uint8_t *dst,int dstStride, uint8_t *src, int width, int heigh
 */
 void bayer_to_rgb24(uint8_t *pBay, uint8_t *pRGB24, int width, int height, int pix_order);
 
+/*convert bayer raw data to yuyv in a single pass, without an rgb frame
+* args:
+*      dst: pointer to buffer containing yuv data (yuyv)
+*      dstStride: stride of the yuyv frame
+*      src: pointer to buffer containing Raw bayer data data
+*      srcStride: stride of the bayer frame
+*      width: picture width, even
+*      height: picture height
+*      pix_order: bayer pixel order (0=gb/rg   1=gr/bg  2=bg/gr  3=rg/gb)
+*/
+void bayer_to_yuyv(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height, int pix_order);
+
 /*convert rgb24 to yuyv
 * args:
 *	   src: pointer to buffer containing rgb24 data
@@ -267,11 +292,164 @@ void rgb_to_yuyv(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int w
 */
 void bgr_to_yuyv(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height);
 
+/* SIMD backends of the converters. The best one the CPU supports is picked
+   the first time a converter is called; the C code is always available */
+enum {
+	CONVERTER_C = 0,
+	CONVERTER_NEON,
+	CONVERTER_SSE2,
+	CONVERTER_AVX2,
+};
+
+/* Forces a backend, mostly for testing. Returns 0 on success, or -1 if the
+   backend was not built in or the CPU does not support it */
+int converter_set_backend(int backend);
+int converter_get_backend(void);
+const char* converter_backend_name(int backend);
+
+/* The threads the converters split the frames between, counting the caller,
+   so 1 converts on the caller only, which is the default. Only one thread
+   at a time gets the others, so the converters can still be called from
+   several threads at once. Returns the number of threads actually used */
+int converter_set_threads(int threads);
+int converter_get_threads(void);
+
+/* Destination formats of the direct converters */
+enum {
+	CONV_DST_YVU420SP = 0,	/* NV21: Y plane followed by an interleaved VU plane */
+	CONV_DST_YVU420P,		/* YV12: Y plane followed by the V and U planes */
+	CONV_DST_YUV420P,		/* I420: Y plane followed by the U and V planes */
+};
+
+/* The planes of a 4:2:0 image. Chroma samples are cstep bytes apart, so this
+   describes both the planar and the semi planar formats */
+struct yuv420_planes {
+	uint8_t *y;
+	uint8_t *u;
+	uint8_t *v;
+	int ystride;
+	int cstride;
+	int cstep;
+};
+
+/* Finds the planes of a destination frame. They are laid out the same way
+   yuyv_to_yvu420sp, yuyv_to_yvu420p and yuyv_to_yuv420p do for the same
+   dst, dstStride and dstHeight */
+void yuv420_planes_init(struct yuv420_planes *p, int dstFmt, uint8_t *dst, int dstStride, int dstHeight);
+
+/* Copies planar yuv with half width chroma to the destination planes. The
+   chroma samples of the source are s->cstep bytes apart. If vsub is 2 the
+   source has a chroma line for each luma line (4:2:2) and each pair of them
+   is averaged, else it has one for every two luma lines (4:2:0) */
+void planar_to_yuv420(const struct yuv420_planes *d, const struct yuv420_planes *s, int vsub, int width, int height);
+
+/* Same as planar_to_yuv420() but to a YUYV frame, so each chroma line of a
+   4:2:0 source is used for two lines of the destination */
+void planar_to_yuyv(uint8_t *dst, int dstStride, const struct yuv420_planes *s, int vsub, int width, int height);
+
+/*convert a captured frame straight to one of the CONV_DST_* formats
+* args:
+*      dstFmt: destination format
+*      dst, dstStride, dstHeight: destination frame, as for yuyv_to_yvu420sp
+*      src: pointer to the captured frame
+*      srcWidth, srcHeight: size of the captured frame
+*      width, height: size of the top left part of the frame to convert
+* returns 0, or -1 if the captured frame could not be decoded
+*/
+typedef int (*direct_converter)(int dstFmt, uint8_t *dst, int dstStride, int dstHeight, uint8_t *src, int srcWidth, int srcHeight, int width, int height);
+
+/* Returns the direct converter from a V4L2 pixel format, or NULL if there
+   is none and the frame has to be converted to YUYV first */
+direct_converter find_direct_converter(uint32_t pixfmt);
+
+/* Destination formats of the scaler. The 4:2:0 ones are the CONV_DST_* ones */
+enum {
+	SCALE_DST_YVU420SP = CONV_DST_YVU420SP,
+	SCALE_DST_YVU420P = CONV_DST_YVU420P,
+	SCALE_DST_YUV420P = CONV_DST_YUV420P,
+	SCALE_DST_YVU422P,		/* YV16 */
+	SCALE_DST_YUYV,
+	SCALE_DST_RGB565,		/* these are converted from yuyv lines */
+	SCALE_DST_RGB24,
+	SCALE_DST_RGB32,
+	SCALE_DST_BGR32,
+};
+
+/* A bilinear scaler from YUYV to any of the SCALE_DST_* formats, that
+   scales and converts in the same pass. It keeps its tables and line buffers
+   from one frame to the next, so it allocates nothing while the sizes stay
+   the same. Only one thread may use it at a time */
+struct yuyv_scaler;
+
+struct yuyv_scaler* yuyv_scaler_create(void);
+void yuyv_scaler_destroy(struct yuyv_scaler *s);
+
+/* Sets the YUV_MATRIX_* and YUV_RANGE_* the scaler converts to the rgb
+   formats with. The tables of each of them are only built once, so this
+   can be called for every frame. Returns 0, or -1 if either is unknown */
+int yuyv_scaler_set_colorspace(struct yuyv_scaler *s, int matrix, int range);
+
+/*scale a yuyv frame and convert it
+* args:
+*      dstFmt: destination format
+*      dst, dstStride, dstHeight: destination frame, as for the converter of
+*          the format: yuyv_to_yvu420sp, yuyv_to_rgb32, ...
+*      width, height: size to scale to, width even
+*      src: pointer to the frame to scale (yuyv)
+*      srcStride: stride of the frame to scale
+*      srcWidth, srcHeight: size of the picture to scale, width even
+* returns 0, or -1 if the format is unknown or there was no memory. If the
+* sizes are the same it is just the converter of the format
+*/
+int yuyv_scaler_run(struct yuyv_scaler *s, int dstFmt, uint8_t *dst, int dstStride, int dstHeight, int width, int height,
+	uint8_t *src, int srcStride, int srcWidth, int srcHeight);
+
+/*scale a yuyv picture with bilinear filtering, with a scaler of its own
+* args:
+*      dst: pointer to the scaled frame (yuyv)
+*      dstStride: stride of the scaled frame
+*      dstWidth, dstHeight: size of the scaled picture, width even
+*      src: pointer to the frame to scale (yuyv)
+*      srcStride: stride of the frame to scale
+*      srcWidth, srcHeight: size of the picture to scale, width even
+*/
+void yuyv_scale(uint8_t *dst, int dstStride, int dstWidth, int dstHeight, uint8_t *src, int srcStride, int srcWidth, int srcHeight);
+
+/*decimate the luma of a frame to a grey picture, straight from the capture format
+* args:
+*      dst: pointer to the decimated picture (one byte per pixel)
+*      dstStride: stride of the decimated picture
+*      dstWidth, dstHeight: size of the decimated picture
+*      src: pointer to the luma of the first pixel of the frame
+*      srcStride: stride of the luma of the frame, in bytes
+*      srcWidth, srcHeight: size of the frame
+*      step: bytes from the luma of a pixel to that of the next one (2 for yuyv, 1 for a Y plane)
+*/
+void luma_decimate(uint8_t *dst, int dstStride, int dstWidth, int dstHeight, const uint8_t *src, int srcStride, int srcWidth, int srcHeight, int step);
+
 /* yuyv_to_jpeg
  *  converts an input image in the YUYV format into a jpeg image and puts
  * it in a memory buffer.
+ * returns the size of the jpeg image, or -1 if it did not fit in maxsize
+ * bytes or could not be encoded
  */
 int yuyv_to_jpeg(uint8_t* src, uint8_t* dst, int maxsize, int srcwidth, int srcheight, int srcstride, int quality);
 
+/* A JPEG encoder that keeps its compressor and line buffers from one picture
+   to the next, for when several pictures are taken. jpeg_encoder_encode()
+   does the same as yuyv_to_jpeg(). Only one thread may use it at a time.
+   The pictures of 256 lines or more are split in stripes that the converter
+   threads encode at once, with a restart marker after every 16 lines, so
+   the JPEG is the same whatever the thread count */
+struct jpeg_encoder;
+
+struct jpeg_encoder* jpeg_encoder_create(void);
+void jpeg_encoder_destroy(struct jpeg_encoder *enc);
+int  jpeg_encoder_encode(struct jpeg_encoder *enc, uint8_t* src, uint8_t* dst, int maxsize, int srcwidth, int srcheight, int srcstride, int quality);
+
+/* Whether the JFIF APP0 is written after the SOI, which it is by default.
+   It is left out of the pictures that get an EXIF APP1 there instead */
+void jpeg_encoder_set_jfif(struct jpeg_encoder *enc, int jfif);
+
 
 #endif
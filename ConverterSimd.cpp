@@ -0,0 +1,1082 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+/* Vectorized versions of the hot YUYV converters.
+
+	All the kernels here must produce exactly the same output as their C
+	counterparts in Converter.cpp, so every rounding is done the same way:
+	chroma averages truncate ((a+b)>>1) except in the bayer demosaic, which
+	rounds them, and the YUV<->RGB math uses the same fixed point
+	coefficients and the same arithmetic shifts. Pixels left
+	over at the end of a line are handled by scalar code. */
+
+#include <stdint.h>
+#include <string.h>
+#include "ConverterSimd.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#define HAVE_NEON_KERNELS 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_KERNELS 1
+
+/* AVX2 kernels are built with a per function target, so the rest of the
+   library does not need to be compiled for AVX2 */
+#if defined(__GNUC__) || defined(__clang__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define HAVE_AVX2_KERNELS 1
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+//--------------------------------------------------------------------------------------
+
+/* Scalar tails. They mirror the inner loops of the C converters */
+
+static inline void tail_yuyv_to_yvu420sp(uint8_t* dY0, uint8_t* dY1, uint8_t* dVU,
+	const uint8_t* s0, const uint8_t* s1, int width)
+{
+	for (; width > 0; width -= 2) {
+		dY0[0] = s0[0];
+		dY0[1] = s0[2];
+		dY1[0] = s1[0];
+		dY1[1] = s1[2];
+		dVU[1] = (s0[1] + s1[1]) >> 1;	// U
+		dVU[0] = (s0[3] + s1[3]) >> 1;	// V
+		dY0 += 2; dY1 += 2; dVU += 2;
+		s0 += 4; s1 += 4;
+	}
+}
+
+static inline void tail_yuyv_to_420p(uint8_t* dY0, uint8_t* dY1, uint8_t* dU, uint8_t* dV,
+	const uint8_t* s0, const uint8_t* s1, int width)
+{
+	for (; width > 0; width -= 2) {
+		dY0[0] = s0[0];
+		dY0[1] = s0[2];
+		dY1[0] = s1[0];
+		dY1[1] = s1[2];
+		*dU++ = (s0[1] + s1[1]) >> 1;
+		*dV++ = (s0[3] + s1[3]) >> 1;
+		dY0 += 2; dY1 += 2;
+		s0 += 4; s1 += 4;
+	}
+}
+
+static inline void tail_yuyv_to_422p(uint8_t* dY, uint8_t* dU, uint8_t* dV, const uint8_t* s, int width)
+{
+	for (; width > 0; width -= 2) {
+		*dY++ = s[0];
+		*dU++ = s[1];
+		*dY++ = s[2];
+		*dV++ = s[3];
+		s += 4;
+	}
+}
+
+static inline void tail_uyvy_to_yuyv(uint8_t* d, const uint8_t* s, int width)
+{
+	for (; width > 0; width -= 2) {
+		d[0] = s[1];
+		d[1] = s[0];
+		d[2] = s[3];
+		d[3] = s[2];
+		d += 4; s += 4;
+	}
+}
+
+static inline void tail_yvyu_to_yuyv(uint8_t* d, const uint8_t* s, int width)
+{
+	for (; width > 0; width -= 2) {
+		d[0] = s[0];
+		d[1] = s[3];
+		d[2] = s[2];
+		d[3] = s[1];
+		d += 4; s += 4;
+	}
+}
+
+//--------------------------------------------------------------------------------------
+#ifdef HAVE_NEON_KERNELS
+
+static void yuyv_to_yvu420sp_neon(uint8_t *dstY, uint8_t *dstVU, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~15;
+
+	for (int h = 0; h < height; h += 2) {
+		const uint8_t* s0 = src;
+		const uint8_t* s1 = src + srcStride;
+		uint8_t* y0 = dstY;
+		uint8_t* y1 = dstY + dstStride;
+		uint8_t* vu = dstVU;
+
+		for (int w = 0; w < vw; w += 16) {
+			uint8x8x4_t a = vld4_u8(s0);	// Y0 U Y1 V of 16 pixels
+			uint8x8x4_t b = vld4_u8(s1);
+			uint8x8x2_t ya, yb, c;
+			ya.val[0] = a.val[0]; ya.val[1] = a.val[2];
+			yb.val[0] = b.val[0]; yb.val[1] = b.val[2];
+			c.val[0]  = vhadd_u8(a.val[3], b.val[3]);	// V (truncated average)
+			c.val[1]  = vhadd_u8(a.val[1], b.val[1]);	// U
+			vst2_u8(y0, ya);
+			vst2_u8(y1, yb);
+			vst2_u8(vu, c);
+			s0 += 32; s1 += 32;
+			y0 += 16; y1 += 16; vu += 16;
+		}
+		tail_yuyv_to_yvu420sp(y0, y1, vu, s0, s1, width - vw);
+
+		src   += srcStride << 1;
+		dstY  += dstStride << 1;
+		dstVU += dstStride;
+	}
+}
+
+static void yuyv_to_420p_neon(uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~15;
+
+	for (int h = 0; h < height; h += 2) {
+		const uint8_t* s0 = src;
+		const uint8_t* s1 = src + srcStride;
+		uint8_t* y0 = dstY;
+		uint8_t* y1 = dstY + dstStride;
+		uint8_t* u  = dstU;
+		uint8_t* v  = dstV;
+
+		for (int w = 0; w < vw; w += 16) {
+			uint8x8x4_t a = vld4_u8(s0);
+			uint8x8x4_t b = vld4_u8(s1);
+			uint8x8x2_t ya, yb;
+			ya.val[0] = a.val[0]; ya.val[1] = a.val[2];
+			yb.val[0] = b.val[0]; yb.val[1] = b.val[2];
+			vst2_u8(y0, ya);
+			vst2_u8(y1, yb);
+			vst1_u8(u, vhadd_u8(a.val[1], b.val[1]));
+			vst1_u8(v, vhadd_u8(a.val[3], b.val[3]));
+			s0 += 32; s1 += 32;
+			y0 += 16; y1 += 16; u += 8; v += 8;
+		}
+		tail_yuyv_to_420p(y0, y1, u, v, s0, s1, width - vw);
+
+		src  += srcStride << 1;
+		dstY += dstStride << 1;
+		dstU += dstUVStride;
+		dstV += dstUVStride;
+	}
+}
+
+static void yuyv_to_422p_neon(uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~15;
+
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* y = dstY;
+		uint8_t* u = dstU;
+		uint8_t* v = dstV;
+
+		for (int w = 0; w < vw; w += 16) {
+			uint8x8x4_t a = vld4_u8(s);
+			uint8x8x2_t ya;
+			ya.val[0] = a.val[0]; ya.val[1] = a.val[2];
+			vst2_u8(y, ya);
+			vst1_u8(u, a.val[1]);
+			vst1_u8(v, a.val[3]);
+			s += 32; y += 16; u += 8; v += 8;
+		}
+		tail_yuyv_to_422p(y, u, v, s, width - vw);
+
+		src  += srcStride;
+		dstY += dstStride;
+		dstU += dstUVStride;
+		dstV += dstUVStride;
+	}
+}
+
+/* Computes the R, G and B offsets of 8 chroma pairs */
+static inline void neon_chroma_to_rgb(const struct yuv_rgb_table *t, uint8x8_t u8, uint8x8_t v8,
+	int16x8_t& ri, int16x8_t& gi, int16x8_t& bi)
+{
+	int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), vdupq_n_s16(128));
+	int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), vdupq_n_s16(128));
+
+	int32x4_t rl = vmull_n_s16(vget_low_s16(v),  t->rv);
+	int32x4_t rh = vmull_n_s16(vget_high_s16(v), t->rv);
+	int32x4_t gl = vmlal_n_s16(vmull_n_s16(vget_low_s16(u),  t->gu), vget_low_s16(v),  t->gv);
+	int32x4_t gh = vmlal_n_s16(vmull_n_s16(vget_high_s16(u), t->gu), vget_high_s16(v), t->gv);
+	int32x4_t bl = vmull_n_s16(vget_low_s16(u),  t->bu);
+	int32x4_t bh = vmull_n_s16(vget_high_s16(u), t->bu);
+
+	ri = vcombine_s16(vshrn_n_s32(rl, 8), vshrn_n_s32(rh, 8));
+	gi = vcombine_s16(vshrn_n_s32(gl, 8), vshrn_n_s32(gh, 8));
+	bi = vcombine_s16(vshrn_n_s32(bl, 8), vshrn_n_s32(bh, 8));
+}
+
+/* The luma of 8 pixels, stretched if it is limited range */
+static inline int16x8_t neon_luma(const struct yuv_rgb_table *t, uint8x8_t y8)
+{
+	int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y8)), vdupq_n_s16(t->yoff));
+	return vaddq_s16(d, vrshrq_n_s16(vmulq_n_s16(d, t->ygain), 8));
+}
+
+/* Converts 16 YUYV pixels into 16 clipped R, G and B values, in pixel order */
+static inline void neon_yuyv_to_rgb(const struct yuv_rgb_table *t, const uint8_t* p,
+	uint8x8x2_t& r, uint8x8x2_t& g, uint8x8x2_t& b)
+{
+	uint8x8x4_t a = vld4_u8(p);
+	int16x8_t ri, gi, bi;
+	neon_chroma_to_rgb(t, a.val[1], a.val[3], ri, gi, bi);
+
+	int16x8_t y0 = neon_luma(t, a.val[0]);
+	int16x8_t y1 = neon_luma(t, a.val[2]);
+
+	r = vzip_u8(vqmovun_s16(vaddq_s16(y0, ri)), vqmovun_s16(vaddq_s16(y1, ri)));
+	g = vzip_u8(vqmovun_s16(vaddq_s16(y0, gi)), vqmovun_s16(vaddq_s16(y1, gi)));
+	b = vzip_u8(vqmovun_s16(vaddq_s16(y0, bi)), vqmovun_s16(vaddq_s16(y1, bi)));
+}
+
+static inline uint16x8_t neon_make565(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t p = vandq_u16(vshll_n_u8(r, 8), vdupq_n_u16(0xf800));
+	p = vorrq_u16(p, vandq_u16(vshll_n_u8(g, 3), vdupq_n_u16(0x07e0)));
+	p = vorrq_u16(p, vmovl_u8(vshr_n_u8(b, 3)));
+	return p;
+}
+
+static void yuyv_to_rgb565_neon(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+{
+	int vw = width & ~15;
+	for (int h = 0; h < height; h++) {
+		uint8_t* s = pyuv;
+		uint16_t* d = (uint16_t*)prgb;
+		for (int w = 0; w < vw; w += 16) {
+			uint8x8x2_t r, g, b;
+			neon_yuyv_to_rgb(t, s, r, g, b);
+			vst1q_u16(d,     neon_make565(r.val[0], g.val[0], b.val[0]));
+			vst1q_u16(d + 8, neon_make565(r.val[1], g.val[1], b.val[1]));
+			s += 32; d += 16;
+		}
+		yuyv_to_rgb565_line(t, s, (uint8_t*)d, width - vw);
+		pyuv += pyuvstride;
+		prgb += prgbstride;
+	}
+}
+
+/* The C version writes R, G, B and skips the 4th byte, so the 4th byte is
+   read back and stored unchanged */
+static void yuyv_to_rgb32_neon(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+{
+	int vw = width & ~15;
+	for (int h = 0; h < height; h++) {
+		uint8_t* s = pyuv;
+		uint8_t* d = prgb;
+		for (int w = 0; w < vw; w += 16) {
+			uint8x8x2_t r, g, b;
+			neon_yuyv_to_rgb(t, s, r, g, b);
+			uint8x8x4_t o0 = vld4_u8(d);
+			uint8x8x4_t o1 = vld4_u8(d + 32);
+			o0.val[0] = r.val[0]; o0.val[1] = g.val[0]; o0.val[2] = b.val[0];
+			o1.val[0] = r.val[1]; o1.val[1] = g.val[1]; o1.val[2] = b.val[1];
+			vst4_u8(d, o0);
+			vst4_u8(d + 32, o1);
+			s += 32; d += 64;
+		}
+		yuyv_to_rgb32_line(t, s, d, width - vw);
+		pyuv += pyuvstride;
+		prgb += prgbstride;
+	}
+}
+
+static void uyvy_to_yuyv_neon(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~7;
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* d = dst;
+		for (int w = 0; w < vw; w += 8) {
+			vst1q_u8(d, vrev16q_u8(vld1q_u8(s)));
+			s += 16; d += 16;
+		}
+		tail_uyvy_to_yuyv(d, s, width - vw);
+		src += srcStride;
+		dst += dstStride;
+	}
+}
+
+static void yvyu_to_yuyv_neon(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~15;
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* d = dst;
+		for (int w = 0; w < vw; w += 16) {
+			uint8x8x4_t a = vld4_u8(s);		// Y0 V Y1 U
+			uint8x8_t t = a.val[1];
+			a.val[1] = a.val[3];
+			a.val[3] = t;
+			vst4_u8(d, a);
+			s += 32; d += 32;
+		}
+		tail_yvyu_to_yuyv(d, s, width - vw);
+		src += srcStride;
+		dst += dstStride;
+	}
+}
+
+/* The demosaic of bayer_to_yuyv_pairs() for 8 sample pairs, from the even
+   (e) and odd (o) samples of a line, the odd ones before them (om) and the
+   even ones after them (en); all widened to 16 bits */
+struct neon_bayer_cols {
+	uint16x8_t e, o, om, en;
+};
+
+static inline void neon_bayer_load(const uint8_t* p, neon_bayer_cols& c)
+{
+	uint8x8x2_t x = vld2_u8(p);
+	c.e  = vmovl_u8(x.val[0]);
+	c.o  = vmovl_u8(x.val[1]);
+	c.om = vmovl_u8(vld2_u8(p - 1).val[0]);
+	c.en = vmovl_u8(vld2_u8(p + 1).val[1]);
+}
+
+/* (a+b+c+d+2)>>2 */
+static inline uint16x8_t neon_avg4(uint16x8_t a, uint16x8_t b, uint16x8_t c, uint16x8_t d)
+{
+	return vrshrq_n_u16(vaddq_u16(vaddq_u16(a, b), vaddq_u16(c, d)), 2);
+}
+
+static inline uint8x8_t neon_bayer_y(uint16x8_t r, uint16x8_t g, uint16x8_t b)
+{
+	uint16x8_t s = vmulq_n_u16(r, 77);
+	s = vmlaq_n_u16(s, g, 150);
+	s = vmlaq_n_u16(s, b, 29);
+	return vrshrn_n_u16(s, 8);
+}
+
+/* ((kr*r + kg*g + kb*b + 64) >> 7) + 128, clipped to a byte */
+static inline uint8x8_t neon_bayer_c(uint16x8_t r, uint16x8_t g, uint16x8_t b, int16_t kr, int16_t kg, int16_t kb)
+{
+	int16x8_t s = vmulq_n_s16(vreinterpretq_s16_u16(r), kr);
+	s = vmlaq_n_s16(s, vreinterpretq_s16_u16(g), kg);
+	s = vmlaq_n_s16(s, vreinterpretq_s16_u16(b), kb);
+	return vqmovun_s16(vaddq_s16(vrshrq_n_s16(s, 7), vdupq_n_s16(128)));
+}
+
+static void bayer_to_yuyv_neon(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height, int pix_order,
+	int y0, int y1)
+{
+	dst += y0 * dstStride;
+	for (int h = y0; h < y1; h++) {
+		const uint8_t *up, *cur, *down;
+		int gfirst, redrow;
+		int x = 2;
+
+		bayer_line(src, srcStride, height, h, pix_order, &up, &cur, &down, &gfirst, &redrow);
+		bayer_to_yuyv_pairs(dst, up, cur, down, width, 0, 2, gfirst, redrow);
+
+		uint8_t* d = dst + (x << 1);
+		for (; x + 17 <= width; x += 16) {
+			neon_bayer_cols u, c, l;
+			uint16x8_t c0, g0, o0, c1, g1, o1;
+
+			neon_bayer_load(up + x, u);
+			neon_bayer_load(cur + x, c);
+			neon_bayer_load(down + x, l);
+
+			if (gfirst) {
+				g0 = c.e;
+				c0 = vrhaddq_u16(c.om, c.o);
+				o0 = vrhaddq_u16(u.e, l.e);
+				c1 = c.o;
+				g1 = neon_avg4(c.e, c.en, u.o, l.o);
+				o1 = neon_avg4(u.e, u.en, l.e, l.en);
+			} else {
+				c0 = c.e;
+				g0 = neon_avg4(c.om, c.o, u.e, l.e);
+				o0 = neon_avg4(u.om, u.o, l.om, l.o);
+				g1 = c.o;
+				c1 = vrhaddq_u16(c.e, c.en);
+				o1 = vrhaddq_u16(u.o, l.o);
+			}
+
+			uint16x8_t r0 = redrow ? c0 : o0, b0 = redrow ? o0 : c0;
+			uint16x8_t r1 = redrow ? c1 : o1, b1 = redrow ? o1 : c1;
+			uint16x8_t ra = vrhaddq_u16(r0, r1);
+			uint16x8_t ga = vrhaddq_u16(g0, g1);
+			uint16x8_t ba = vrhaddq_u16(b0, b1);
+
+			uint8x8x4_t o;
+			o.val[0] = neon_bayer_y(r0, g0, b0);
+			o.val[1] = neon_bayer_c(ra, ga, ba, -19, -37, 56);
+			o.val[2] = neon_bayer_y(r1, g1, b1);
+			o.val[3] = neon_bayer_c(ra, ga, ba, 79, -66, -13);
+			vst4_u8(d, o);
+			d += 32;
+		}
+		bayer_to_yuyv_pairs(dst, up, cur, down, width, x, width, gfirst, redrow);
+
+		dst += dstStride;
+	}
+}
+
+static void scale_blend_neon(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int frac)
+{
+	const uint8x8_t fa = vdup_n_u8(256 - frac);
+	const uint8x8_t fb = vdup_n_u8(frac);
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t va = vld1q_u8(a + x);
+		uint8x16_t vb = vld1q_u8(b + x);
+		uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), fa), vget_low_u8(vb), fb);
+		uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), fa), vget_high_u8(vb), fb);
+		vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+	}
+	scale_blend_line(dst + x, a + x, b + x, width - x, frac);
+}
+
+static const struct converter_ops neon_ops = {
+	yuyv_to_yvu420sp_neon,
+	yuyv_to_420p_neon,
+	yuyv_to_422p_neon,
+	yuyv_to_rgb565_neon,
+	yuyv_to_rgb32_neon,
+	yuyv_to_rgb32_neon,		// yuyv_to_bgr32 writes the same byte order as rgb32
+	uyvy_to_yuyv_neon,
+	yvyu_to_yuyv_neon,
+	bayer_to_yuyv_neon,
+	scale_blend_neon,
+};
+
+#endif
+
+const struct converter_ops* converter_ops_neon(void)
+{
+#ifdef HAVE_NEON_KERNELS
+#if !defined(__aarch64__)
+	if (!(getauxval(AT_HWCAP) & HWCAP_NEON))
+		return NULL;
+#endif
+	return &neon_ops;
+#else
+	return NULL;
+#endif
+}
+
+//--------------------------------------------------------------------------------------
+#ifdef HAVE_SSE2_KERNELS
+
+/* (a+b)>>1 for unsigned bytes. pavgb rounds up, so take the carry out */
+static inline __m128i sse2_avg_floor(__m128i a, __m128i b)
+{
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+/* Splits 16 YUYV pixels into 16 Y and 8 interleaved UV pairs */
+static inline void sse2_split_yuyv(const uint8_t* s, __m128i& y, __m128i& uv)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	__m128i a0 = _mm_loadu_si128((const __m128i*)s);
+	__m128i a1 = _mm_loadu_si128((const __m128i*)(s + 16));
+	y  = _mm_packus_epi16(_mm_and_si128(a0, lo), _mm_and_si128(a1, lo));
+	uv = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+}
+
+static void yuyv_to_yvu420sp_sse2(uint8_t *dstY, uint8_t *dstVU, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~15;
+
+	for (int h = 0; h < height; h += 2) {
+		const uint8_t* s0 = src;
+		const uint8_t* s1 = src + srcStride;
+		uint8_t* y0 = dstY;
+		uint8_t* y1 = dstY + dstStride;
+		uint8_t* vu = dstVU;
+
+		for (int w = 0; w < vw; w += 16) {
+			__m128i ya, yb, ca, cb;
+			sse2_split_yuyv(s0, ya, ca);
+			sse2_split_yuyv(s1, yb, cb);
+			__m128i c = sse2_avg_floor(ca, cb);					// U V U V ...
+			c = _mm_or_si128(_mm_slli_epi16(c, 8), _mm_srli_epi16(c, 8));	// V U V U ...
+			_mm_storeu_si128((__m128i*)y0, ya);
+			_mm_storeu_si128((__m128i*)y1, yb);
+			_mm_storeu_si128((__m128i*)vu, c);
+			s0 += 32; s1 += 32;
+			y0 += 16; y1 += 16; vu += 16;
+		}
+		tail_yuyv_to_yvu420sp(y0, y1, vu, s0, s1, width - vw);
+
+		src   += srcStride << 1;
+		dstY  += dstStride << 1;
+		dstVU += dstStride;
+	}
+}
+
+static void yuyv_to_420p_sse2(uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	int vw = width & ~15;
+
+	for (int h = 0; h < height; h += 2) {
+		const uint8_t* s0 = src;
+		const uint8_t* s1 = src + srcStride;
+		uint8_t* y0 = dstY;
+		uint8_t* y1 = dstY + dstStride;
+		uint8_t* u  = dstU;
+		uint8_t* v  = dstV;
+
+		for (int w = 0; w < vw; w += 16) {
+			__m128i ya, yb, ca, cb;
+			sse2_split_yuyv(s0, ya, ca);
+			sse2_split_yuyv(s1, yb, cb);
+			__m128i c = sse2_avg_floor(ca, cb);
+			_mm_storeu_si128((__m128i*)y0, ya);
+			_mm_storeu_si128((__m128i*)y1, yb);
+			_mm_storel_epi64((__m128i*)u, _mm_packus_epi16(_mm_and_si128(c, lo), _mm_setzero_si128()));
+			_mm_storel_epi64((__m128i*)v, _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_setzero_si128()));
+			s0 += 32; s1 += 32;
+			y0 += 16; y1 += 16; u += 8; v += 8;
+		}
+		tail_yuyv_to_420p(y0, y1, u, v, s0, s1, width - vw);
+
+		src  += srcStride << 1;
+		dstY += dstStride << 1;
+		dstU += dstUVStride;
+		dstV += dstUVStride;
+	}
+}
+
+static void yuyv_to_422p_sse2(uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	int vw = width & ~15;
+
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* y = dstY;
+		uint8_t* u = dstU;
+		uint8_t* v = dstV;
+
+		for (int w = 0; w < vw; w += 16) {
+			__m128i yy, c;
+			sse2_split_yuyv(s, yy, c);
+			_mm_storeu_si128((__m128i*)y, yy);
+			_mm_storel_epi64((__m128i*)u, _mm_packus_epi16(_mm_and_si128(c, lo), _mm_setzero_si128()));
+			_mm_storel_epi64((__m128i*)v, _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_setzero_si128()));
+			s += 32; y += 16; u += 8; v += 8;
+		}
+		tail_yuyv_to_422p(y, u, v, s, width - vw);
+
+		src  += srcStride;
+		dstY += dstStride;
+		dstU += dstUVStride;
+		dstV += dstUVStride;
+	}
+}
+
+/* The coefficients of a colour space, laid out for sse2_yuyv_to_rgb() */
+struct sse2_rgb_coefs {
+	__m128i yoff, ygain;
+	__m128i r, g, b;				// for the u v pairs
+};
+
+static inline void sse2_rgb_coefs_init(sse2_rgb_coefs& k, const struct yuv_rgb_table *t)
+{
+	k.yoff  = _mm_set1_epi16(t->yoff);
+	k.ygain = _mm_set1_epi16(t->ygain);
+	k.r = _mm_set1_epi32((int)((uint32_t)(uint16_t)t->rv << 16));
+	k.g = _mm_set1_epi32((int)(((uint32_t)(uint16_t)t->gv << 16) | (uint16_t)t->gu));
+	k.b = _mm_set1_epi32((int)(uint16_t)t->bu);
+}
+
+/* Converts 8 YUYV pixels into 8 R, G and B values as 16 bit lanes, not clipped yet */
+static inline void sse2_yuyv_to_rgb(const sse2_rgb_coefs& k, const uint8_t* p, __m128i& r, __m128i& g, __m128i& b)
+{
+	__m128i x = _mm_loadu_si128((const __m128i*)p);
+	__m128i y = _mm_sub_epi16(_mm_and_si128(x, _mm_set1_epi16(0x00ff)), k.yoff);
+	__m128i c = _mm_sub_epi16(_mm_srli_epi16(x, 8), _mm_set1_epi16(128));	// u v u v ...
+
+	y = _mm_add_epi16(y, _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(y, k.ygain), _mm_set1_epi16(128)), 8));
+
+	// One 32 bit result per chroma pair, then shifted exactly like the C code
+	__m128i ri = _mm_srai_epi32(_mm_madd_epi16(c, k.r), 8);
+	__m128i gi = _mm_srai_epi32(_mm_madd_epi16(c, k.g), 8);
+	__m128i bi = _mm_srai_epi32(_mm_madd_epi16(c, k.b), 8);
+
+	// Spread every offset over the two pixels of its pair
+	ri = _mm_packs_epi32(ri, ri); ri = _mm_unpacklo_epi16(ri, ri);
+	gi = _mm_packs_epi32(gi, gi); gi = _mm_unpacklo_epi16(gi, gi);
+	bi = _mm_packs_epi32(bi, bi); bi = _mm_unpacklo_epi16(bi, bi);
+
+	r = _mm_add_epi16(y, ri);
+	g = _mm_add_epi16(y, gi);
+	b = _mm_add_epi16(y, bi);
+}
+
+static inline __m128i sse2_clip(__m128i x)
+{
+	return _mm_min_epi16(_mm_max_epi16(x, _mm_setzero_si128()), _mm_set1_epi16(255));
+}
+
+static void yuyv_to_rgb565_sse2(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+{
+	sse2_rgb_coefs k;
+	sse2_rgb_coefs_init(k, t);
+	int vw = width & ~7;
+	for (int h = 0; h < height; h++) {
+		uint8_t* s = pyuv;
+		uint8_t* d = prgb;
+		for (int w = 0; w < vw; w += 8) {
+			__m128i r, g, b;
+			sse2_yuyv_to_rgb(k, s, r, g, b);
+			r = _mm_and_si128(_mm_slli_epi16(sse2_clip(r), 8), _mm_set1_epi16((short)0xf800));
+			g = _mm_and_si128(_mm_slli_epi16(sse2_clip(g), 3), _mm_set1_epi16(0x07e0));
+			b = _mm_srli_epi16(sse2_clip(b), 3);
+			_mm_storeu_si128((__m128i*)d, _mm_or_si128(_mm_or_si128(r, g), b));
+			s += 16; d += 16;
+		}
+		yuyv_to_rgb565_line(t, s, d, width - vw);
+		pyuv += pyuvstride;
+		prgb += prgbstride;
+	}
+}
+
+/* The 4th byte of every pixel is kept as it was, like the C version does */
+static void yuyv_to_rgb32_sse2(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb,int prgbstride, int width, int height)
+{
+	sse2_rgb_coefs k;
+	sse2_rgb_coefs_init(k, t);
+	const __m128i keep = _mm_set1_epi32((int)0xff000000);
+	const __m128i zero = _mm_setzero_si128();
+	int vw = width & ~7;
+	for (int h = 0; h < height; h++) {
+		uint8_t* s = pyuv;
+		uint8_t* d = prgb;
+		for (int w = 0; w < vw; w += 8) {
+			__m128i r, g, b;
+			sse2_yuyv_to_rgb(k, s, r, g, b);
+			__m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, zero), _mm_packus_epi16(g, zero));
+			__m128i b0 = _mm_unpacklo_epi8(_mm_packus_epi16(b, zero), zero);
+			__m128i p0 = _mm_unpacklo_epi16(rg, b0);
+			__m128i p1 = _mm_unpackhi_epi16(rg, b0);
+			__m128i o0 = _mm_loadu_si128((const __m128i*)d);
+			__m128i o1 = _mm_loadu_si128((const __m128i*)(d + 16));
+			_mm_storeu_si128((__m128i*)d,        _mm_or_si128(_mm_and_si128(o0, keep), p0));
+			_mm_storeu_si128((__m128i*)(d + 16), _mm_or_si128(_mm_and_si128(o1, keep), p1));
+			s += 16; d += 32;
+		}
+		yuyv_to_rgb32_line(t, s, d, width - vw);
+		pyuv += pyuvstride;
+		prgb += prgbstride;
+	}
+}
+
+static void uyvy_to_yuyv_sse2(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~7;
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* d = dst;
+		for (int w = 0; w < vw; w += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i*)s);
+			_mm_storeu_si128((__m128i*)d, _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+			s += 16; d += 16;
+		}
+		tail_uyvy_to_yuyv(d, s, width - vw);
+		src += srcStride;
+		dst += dstStride;
+	}
+}
+
+static void yvyu_to_yuyv_sse2(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	const __m128i ys = _mm_set1_epi32(0x00ff00ff);
+	const __m128i b1 = _mm_set1_epi32(0x0000ff00);
+	const __m128i b3 = _mm_set1_epi32((int)0xff000000);
+	int vw = width & ~7;
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* d = dst;
+		for (int w = 0; w < vw; w += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i*)s);
+			__m128i o = _mm_and_si128(x, ys);
+			o = _mm_or_si128(o, _mm_slli_epi32(_mm_and_si128(x, b1), 16));
+			o = _mm_or_si128(o, _mm_srli_epi32(_mm_and_si128(x, b3), 16));
+			_mm_storeu_si128((__m128i*)d, o);
+			s += 16; d += 16;
+		}
+		tail_yvyu_to_yuyv(d, s, width - vw);
+		src += srcStride;
+		dst += dstStride;
+	}
+}
+
+/* The demosaic of bayer_to_yuyv_pairs() for 8 sample pairs, from the even
+   (e) and odd (o) samples of a line, the odd ones before them (om) and the
+   even ones after them (en); all zero extended to 16 bits */
+struct sse2_bayer_cols {
+	__m128i e, o, om, en;
+};
+
+static inline void sse2_bayer_load(const uint8_t* p, sse2_bayer_cols& c)
+{
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	__m128i x = _mm_loadu_si128((const __m128i*)p);
+	c.e  = _mm_and_si128(x, lo);
+	c.o  = _mm_srli_epi16(x, 8);
+	c.om = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p - 1)), lo);
+	c.en = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(p + 1)), 8);
+}
+
+/* (a+b+c+d+2)>>2 */
+static inline __m128i sse2_avg4(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	__m128i s = _mm_add_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, d));
+	return _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(2)), 2);
+}
+
+static inline __m128i sse2_bayer_y(__m128i r, __m128i g, __m128i b)
+{
+	__m128i s = _mm_mullo_epi16(r, _mm_set1_epi16(77));
+	s = _mm_add_epi16(s, _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+	s = _mm_add_epi16(s, _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+	return _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(128)), 8);
+}
+
+/* ((kr*r + kg*g + kb*b + 64) >> 7) + 128, clipped to a byte */
+static inline __m128i sse2_bayer_c(__m128i r, __m128i g, __m128i b, short kr, short kg, short kb)
+{
+	__m128i s = _mm_mullo_epi16(r, _mm_set1_epi16(kr));
+	s = _mm_add_epi16(s, _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+	s = _mm_add_epi16(s, _mm_mullo_epi16(b, _mm_set1_epi16(kb)));
+	s = _mm_srai_epi16(_mm_add_epi16(s, _mm_set1_epi16(64)), 7);
+	s = _mm_add_epi16(s, _mm_set1_epi16(128));
+	return _mm_max_epi16(_mm_min_epi16(s, _mm_set1_epi16(255)), _mm_setzero_si128());
+}
+
+static void bayer_to_yuyv_sse2(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height, int pix_order,
+	int y0, int y1)
+{
+	dst += y0 * dstStride;
+	for (int h = y0; h < y1; h++) {
+		const uint8_t *up, *cur, *down;
+		int gfirst, redrow;
+		int x = 2;
+
+		bayer_line(src, srcStride, height, h, pix_order, &up, &cur, &down, &gfirst, &redrow);
+		bayer_to_yuyv_pairs(dst, up, cur, down, width, 0, 2, gfirst, redrow);
+
+		uint8_t* d = dst + (x << 1);
+		for (; x + 17 <= width; x += 16) {
+			sse2_bayer_cols u, c, l;
+			__m128i c0, g0, o0, c1, g1, o1;
+
+			sse2_bayer_load(up + x, u);
+			sse2_bayer_load(cur + x, c);
+			sse2_bayer_load(down + x, l);
+
+			if (gfirst) {
+				g0 = c.e;
+				c0 = _mm_avg_epu16(c.om, c.o);
+				o0 = _mm_avg_epu16(u.e, l.e);
+				c1 = c.o;
+				g1 = sse2_avg4(c.e, c.en, u.o, l.o);
+				o1 = sse2_avg4(u.e, u.en, l.e, l.en);
+			} else {
+				c0 = c.e;
+				g0 = sse2_avg4(c.om, c.o, u.e, l.e);
+				o0 = sse2_avg4(u.om, u.o, l.om, l.o);
+				g1 = c.o;
+				c1 = _mm_avg_epu16(c.e, c.en);
+				o1 = _mm_avg_epu16(u.o, l.o);
+			}
+
+			__m128i r0 = redrow ? c0 : o0, b0 = redrow ? o0 : c0;
+			__m128i r1 = redrow ? c1 : o1, b1 = redrow ? o1 : c1;
+			__m128i ra = _mm_avg_epu16(r0, r1);
+			__m128i ga = _mm_avg_epu16(g0, g1);
+			__m128i ba = _mm_avg_epu16(b0, b1);
+
+			__m128i yu = _mm_or_si128(sse2_bayer_y(r0, g0, b0), _mm_slli_epi16(sse2_bayer_c(ra, ga, ba, -19, -37, 56), 8));
+			__m128i yv = _mm_or_si128(sse2_bayer_y(r1, g1, b1), _mm_slli_epi16(sse2_bayer_c(ra, ga, ba, 79, -66, -13), 8));
+			_mm_storeu_si128((__m128i*)d, _mm_unpacklo_epi16(yu, yv));
+			_mm_storeu_si128((__m128i*)(d + 16), _mm_unpackhi_epi16(yu, yv));
+			d += 32;
+		}
+		bayer_to_yuyv_pairs(dst, up, cur, down, width, x, width, gfirst, redrow);
+
+		dst += dstStride;
+	}
+}
+
+static void scale_blend_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int frac)
+{
+	const __m128i z = _mm_setzero_si128();
+	const __m128i fa = _mm_set1_epi16(256 - frac);
+	const __m128i fb = _mm_set1_epi16(frac);
+	const __m128i r = _mm_set1_epi16(128);
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, z), fa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, z), fb));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, z), fa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, z), fb));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, r), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, r), 8);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+	}
+	scale_blend_line(dst + x, a + x, b + x, width - x, frac);
+}
+
+static const struct converter_ops sse2_ops = {
+	yuyv_to_yvu420sp_sse2,
+	yuyv_to_420p_sse2,
+	yuyv_to_422p_sse2,
+	yuyv_to_rgb565_sse2,
+	yuyv_to_rgb32_sse2,
+	yuyv_to_rgb32_sse2,		// yuyv_to_bgr32 writes the same byte order as rgb32
+	uyvy_to_yuyv_sse2,
+	yvyu_to_yuyv_sse2,
+	bayer_to_yuyv_sse2,
+	scale_blend_sse2,
+};
+
+#endif
+
+const struct converter_ops* converter_ops_sse2(void)
+{
+#ifdef HAVE_SSE2_KERNELS
+	return &sse2_ops;
+#else
+	return NULL;
+#endif
+}
+
+//--------------------------------------------------------------------------------------
+#ifdef HAVE_AVX2_KERNELS
+
+/* The AVX2 kernels only cover the plain repacking converters, where the
+   wider registers pay off. The RGB ones keep using SSE2 */
+
+/* packus works per 128 bit lane. This puts the 64 bit quarters back in order */
+#define AVX2_FIXPACK(x) _mm256_permute4x64_epi64((x), 0xd8)
+
+static inline AVX2_TARGET __m256i avx2_avg_floor(__m256i a, __m256i b)
+{
+	return _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+}
+
+/* Splits 32 YUYV pixels into 32 Y and 16 interleaved UV pairs */
+static inline AVX2_TARGET void avx2_split_yuyv(const uint8_t* s, __m256i& y, __m256i& uv)
+{
+	const __m256i lo = _mm256_set1_epi16(0x00ff);
+	__m256i a0 = _mm256_loadu_si256((const __m256i*)s);
+	__m256i a1 = _mm256_loadu_si256((const __m256i*)(s + 32));
+	y  = AVX2_FIXPACK(_mm256_packus_epi16(_mm256_and_si256(a0, lo), _mm256_and_si256(a1, lo)));
+	uv = AVX2_FIXPACK(_mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8)));
+}
+
+/* Splits 16 interleaved UV pairs in 16 U and 16 V */
+static inline AVX2_TARGET void avx2_split_uv(__m256i c, __m128i& u, __m128i& v)
+{
+	const __m256i lo = _mm256_set1_epi16(0x00ff);
+	__m256i uu = AVX2_FIXPACK(_mm256_packus_epi16(_mm256_and_si256(c, lo), _mm256_setzero_si256()));
+	__m256i vv = AVX2_FIXPACK(_mm256_packus_epi16(_mm256_srli_epi16(c, 8), _mm256_setzero_si256()));
+	u = _mm256_castsi256_si128(uu);
+	v = _mm256_castsi256_si128(vv);
+}
+
+static AVX2_TARGET void yuyv_to_yvu420sp_avx2(uint8_t *dstY, uint8_t *dstVU, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~31;
+
+	for (int h = 0; h < height; h += 2) {
+		const uint8_t* s0 = src;
+		const uint8_t* s1 = src + srcStride;
+		uint8_t* y0 = dstY;
+		uint8_t* y1 = dstY + dstStride;
+		uint8_t* vu = dstVU;
+
+		for (int w = 0; w < vw; w += 32) {
+			__m256i ya, yb, ca, cb;
+			avx2_split_yuyv(s0, ya, ca);
+			avx2_split_yuyv(s1, yb, cb);
+			__m256i c = avx2_avg_floor(ca, cb);
+			c = _mm256_or_si256(_mm256_slli_epi16(c, 8), _mm256_srli_epi16(c, 8));
+			_mm256_storeu_si256((__m256i*)y0, ya);
+			_mm256_storeu_si256((__m256i*)y1, yb);
+			_mm256_storeu_si256((__m256i*)vu, c);
+			s0 += 64; s1 += 64;
+			y0 += 32; y1 += 32; vu += 32;
+		}
+		tail_yuyv_to_yvu420sp(y0, y1, vu, s0, s1, width - vw);
+
+		src   += srcStride << 1;
+		dstY  += dstStride << 1;
+		dstVU += dstStride;
+	}
+}
+
+static AVX2_TARGET void yuyv_to_420p_avx2(uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~31;
+
+	for (int h = 0; h < height; h += 2) {
+		const uint8_t* s0 = src;
+		const uint8_t* s1 = src + srcStride;
+		uint8_t* y0 = dstY;
+		uint8_t* y1 = dstY + dstStride;
+		uint8_t* u  = dstU;
+		uint8_t* v  = dstV;
+
+		for (int w = 0; w < vw; w += 32) {
+			__m256i ya, yb, ca, cb;
+			__m128i uu, vv;
+			avx2_split_yuyv(s0, ya, ca);
+			avx2_split_yuyv(s1, yb, cb);
+			avx2_split_uv(avx2_avg_floor(ca, cb), uu, vv);
+			_mm256_storeu_si256((__m256i*)y0, ya);
+			_mm256_storeu_si256((__m256i*)y1, yb);
+			_mm_storeu_si128((__m128i*)u, uu);
+			_mm_storeu_si128((__m128i*)v, vv);
+			s0 += 64; s1 += 64;
+			y0 += 32; y1 += 32; u += 16; v += 16;
+		}
+		tail_yuyv_to_420p(y0, y1, u, v, s0, s1, width - vw);
+
+		src  += srcStride << 1;
+		dstY += dstStride << 1;
+		dstU += dstUVStride;
+		dstV += dstUVStride;
+	}
+}
+
+static AVX2_TARGET void yuyv_to_422p_avx2(uint8_t* dstY, uint8_t* dstU, uint8_t* dstV, int dstStride, int dstUVStride,
+	uint8_t *src, int srcStride, int width, int height)
+{
+	int vw = width & ~31;
+
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* y = dstY;
+		uint8_t* u = dstU;
+		uint8_t* v = dstV;
+
+		for (int w = 0; w < vw; w += 32) {
+			__m256i yy, c;
+			__m128i uu, vv;
+			avx2_split_yuyv(s, yy, c);
+			avx2_split_uv(c, uu, vv);
+			_mm256_storeu_si256((__m256i*)y, yy);
+			_mm_storeu_si128((__m128i*)u, uu);
+			_mm_storeu_si128((__m128i*)v, vv);
+			s += 64; y += 32; u += 16; v += 16;
+		}
+		tail_yuyv_to_422p(y, u, v, s, width - vw);
+
+		src  += srcStride;
+		dstY += dstStride;
+		dstU += dstUVStride;
+		dstV += dstUVStride;
+	}
+}
+
+static AVX2_TARGET void avx2_shuffle_rows(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height,
+	__m256i mask, void (*tail)(uint8_t*, const uint8_t*, int))
+{
+	int vw = width & ~15;
+	for (int h = 0; h < height; h++) {
+		const uint8_t* s = src;
+		uint8_t* d = dst;
+		for (int w = 0; w < vw; w += 16) {
+			_mm256_storeu_si256((__m256i*)d, _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)s), mask));
+			s += 32; d += 32;
+		}
+		tail(d, s, width - vw);
+		src += srcStride;
+		dst += dstStride;
+	}
+}
+
+static AVX2_TARGET void uyvy_to_yuyv_avx2(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	avx2_shuffle_rows(dst, dstStride, src, srcStride, width, height, mask, tail_uyvy_to_yuyv);
+}
+
+static AVX2_TARGET void yvyu_to_yuyv_avx2(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		0, 3, 2, 1, 4, 7, 6, 5, 8, 11, 10, 9, 12, 15, 14, 13,
+		0, 3, 2, 1, 4, 7, 6, 5, 8, 11, 10, 9, 12, 15, 14, 13);
+	avx2_shuffle_rows(dst, dstStride, src, srcStride, width, height, mask, tail_yvyu_to_yuyv);
+}
+
+static const struct converter_ops avx2_ops = {
+	yuyv_to_yvu420sp_avx2,
+	yuyv_to_420p_avx2,
+	yuyv_to_422p_avx2,
+	NULL,
+	NULL,
+	NULL,
+	uyvy_to_yuyv_avx2,
+	yvyu_to_yuyv_avx2,
+	NULL,
+	NULL,
+};
+
+/* AVX2 needs both the CPU support and the OS saving the YMM registers */
+static bool cpu_has_avx2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return false;
+
+	unsigned int xcr0lo, xcr0hi;
+	__asm__ ("xgetbv" : "=a" (xcr0lo), "=d" (xcr0hi) : "c" (0));
+	if ((xcr0lo & 6) != 6)
+		return false;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & bit_AVX2) != 0;
+}
+
+#endif
+
+const struct converter_ops* converter_ops_avx2(void)
+{
+#ifdef HAVE_AVX2_KERNELS
+	return cpu_has_avx2() ? &avx2_ops : NULL;
+#else
+	return NULL;
+#endif
+}
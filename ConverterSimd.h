@@ -0,0 +1,116 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef CONVERTER_SIMD_H
+#define CONVERTER_SIMD_H
+
+#include <stdint.h>
+
+/* The colour space of a yuv to rgb conversion, built once by Converter.cpp
+   for each matrix and range. The vector kernels use the coefficients and
+   the scalar code the tables, which give the same results:
+	y' = (y - yoff) + (((y - yoff) * ygain + 128) >> 8)
+	r = clip(y' + ((rv * (v - 128)) >> 8))
+	g = clip(y' + ((gu * (u - 128) + gv * (v - 128)) >> 8))
+	b = clip(y' + ((bu * (u - 128)) >> 8))
+   with the coefficients in 8 bit fixed point. The values clipped are all
+   within [-YUV_RGB_CLIP_OFFSET, YUV_RGB_CLIP_SIZE - YUV_RGB_CLIP_OFFSET) */
+#define YUV_RGB_CLIP_OFFSET	384
+#define YUV_RGB_CLIP_SIZE	1024
+
+struct yuv_rgb_table {
+	int16_t yoff, ygain;
+	int16_t rv, gu, gv, bu;
+
+	int16_t ly[256];				/* y' */
+	int16_t lrv[256];				/* (rv * (v - 128)) >> 8 */
+	int16_t lgu[256];				/* gu * (u - 128), not shifted yet */
+	int16_t lgv[256];				/* gv * (v - 128), not shifted yet */
+	int16_t lbu[256];				/* (bu * (u - 128)) >> 8 */
+	uint8_t clip[YUV_RGB_CLIP_SIZE];	/* clip[x + YUV_RGB_CLIP_OFFSET] */
+};
+
+typedef void (*yuyv_rgb_rows)(const struct yuv_rgb_table *t, uint8_t *pyuv, int pyuvstride, uint8_t *prgb, int prgbstride,
+	int width, int height);
+
+/* The converters that have vectorized versions. Every public converter in
+   Converter.h listed here is called through one of these tables. A backend
+   may leave an entry NULL, and then the plain C version is used instead.
+
+   The planar ones are given their planes, and the bayer one the range of
+   lines [y0, y1) to convert, so that the public converters can hand
+   bands of a frame to converter_parallel(). The 4:2:0 ones take an even
+   number of lines */
+struct converter_ops {
+	void (*yuyv_to_yvu420sp)(uint8_t *dstY, uint8_t *dstVU, int dstStride, uint8_t *src, int srcStride, int width, int height);
+	void (*yuyv_to_420p)(uint8_t *dstY, uint8_t *dstU, uint8_t *dstV, int dstStride, int dstUVStride,
+		uint8_t *src, int srcStride, int width, int height);
+	void (*yuyv_to_422p)(uint8_t *dstY, uint8_t *dstU, uint8_t *dstV, int dstStride, int dstUVStride,
+		uint8_t *src, int srcStride, int width, int height);
+	yuyv_rgb_rows yuyv_to_rgb565;
+	yuyv_rgb_rows yuyv_to_rgb32;
+	yuyv_rgb_rows yuyv_to_bgr32;
+	void (*uyvy_to_yuyv)(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height);
+	void (*yvyu_to_yuyv)(uint8_t *dst,int dstStride, uint8_t *src, int srcStride, int width, int height);
+	void (*bayer_to_yuyv)(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height, int pix_order,
+		int y0, int y1);
+
+	/* The vertical pass of yuyv_scaler_run(), one line at a time:
+	   dst = (a * (256 - frac) + b * frac + 128) >> 8, with frac from 1 to 255 */
+	void (*scale_blend)(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int frac);
+};
+
+/* Per backend tables. They return NULL if the backend was not built in, or
+   if the CPU we are running on does not support it */
+const struct converter_ops* converter_ops_neon(void);
+const struct converter_ops* converter_ops_sse2(void);
+const struct converter_ops* converter_ops_avx2(void);
+
+/* Calls band(arg, y0, y1) for bands of the lines [0, height) that cover all
+   of them, on the threads set by converter_set_threads(). The bands start
+   at a multiple of align lines, and all but the last end at one too. They
+   run one after the other on the caller if the frame is small, or if
+   another thread is already using the workers */
+typedef void (*converter_band)(void *arg, int y0, int y1);
+void converter_parallel(int height, int align, converter_band band, void *arg);
+
+/* Scalar line converters, used by the vector kernels for the end of lines
+   that are not a multiple of the vector width */
+void yuyv_to_rgb565_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *prgb, int width);
+void yuyv_to_rgb32_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *prgb, int width);
+void yuyv_to_bgr32_line (const struct yuv_rgb_table *t, uint8_t *pyuv, uint8_t *pbgr, int width);
+void scale_blend_line(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int frac);
+
+/* Converts the sample pairs from x to end of a bayer line to yuyv. dst is the
+   start of the yuyv line. The pairs at the borders of the line, that need
+   samples outside of it, can only be done by this one */
+void bayer_to_yuyv_pairs(uint8_t *dst, const uint8_t *up, const uint8_t *cur, const uint8_t *down,
+	int width, int x, int end, int gfirst, int redrow);
+
+/* Finds line y of a bayer frame and the ones above and below it, mirrored at
+   the top and bottom, and its pattern: whether its first sample is green and
+   whether the other ones are red. pix_order is as for bayer_to_yuyv */
+static inline void bayer_line(const uint8_t *src, int srcStride, int height, int y, int pix_order,
+	const uint8_t **up, const uint8_t **cur, const uint8_t **down, int *gfirst, int *redrow)
+{
+	int yu = y > 0 ? y - 1 : 1;
+	int yd = y + 1 < height ? y + 1 : y - 1;
+
+	if (height < 2)
+		yu = yd = y;
+
+	*up = src + yu * srcStride;
+	*cur = src + y * srcStride;
+	*down = src + yd * srcStride;
+
+	/* 0=gb/rg 1=gr/bg 2=bg/gr 3=rg/gb on the first two lines */
+	*gfirst = (pix_order < 2) ^ (y & 1);
+	*redrow = (pix_order & 1) ^ (y & 1);
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "DeviceWatcher"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <utils/Log.h>
+
+#include "DeviceWatcher.h"
+
+namespace android {
+//======================================================================
+
+DeviceWatcher::DeviceWatcher()
+  : mInotify(-1),
+    mWakeFd(-1)
+{
+    mWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    mInotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+    if (mInotify >= 0 &&
+        inotify_add_watch(mInotify, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+        ALOGW("Cannot watch /dev (%d: %s), polling for the camera", errno, strerror(errno));
+        close(mInotify);
+        mInotify = -1;
+    } else if (mInotify < 0) {
+        ALOGW("No inotify (%d: %s), polling for the camera", errno, strerror(errno));
+    }
+}
+
+
+
+DeviceWatcher::~DeviceWatcher()
+{
+    if (mInotify >= 0) {
+        close(mInotify);
+    }
+    if (mWakeFd >= 0) {
+        close(mWakeFd);
+    }
+}
+
+
+
+bool DeviceWatcher::wait(nsecs_t timeout)
+{
+    struct pollfd fds[2];
+    int n = 0;
+
+    if (mWakeFd >= 0) {
+        fds[n].fd = mWakeFd;
+        fds[n].events = POLLIN;
+        n++;
+    }
+    if (mInotify >= 0) {
+        fds[n].fd = mInotify;
+        fds[n].events = POLLIN;
+        n++;
+    }
+
+    int e = poll(fds, n, (int)ns2ms(timeout));
+    if (e <= 0) {
+        if (n == 0) {
+            usleep(ns2us(timeout));     // nothing to poll
+        }
+        return false;
+    }
+
+    if (mWakeFd >= 0 && fds[0].revents & POLLIN) {
+        eventfd_t value;
+        eventfd_read(mWakeFd, &value);
+        return false;
+    }
+
+    // Look for a video device among all the events that are queued
+    bool changed = false;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(mInotify, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+
+        for (char* p = buf; p < buf + len; ) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+
+            if (event->len > 0 && strncmp(event->name, "video", 5) == 0) {
+                ALOGD("wait: /dev/%s mask 0x%x", event->name, event->mask);
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return changed;
+}
+
+
+
+void DeviceWatcher::wake()
+{
+    if (mWakeFd >= 0) {
+        eventfd_write(mWakeFd, 1);
+    }
+}
+
+//======================================================================
+}; // namespace android
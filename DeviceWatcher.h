@@ -0,0 +1,49 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _DEVICE_WATCHER_H
+#define _DEVICE_WATCHER_H
+
+#include <utils/Timers.h>               // for nsecs_t
+
+namespace android {
+//======================================================================
+
+/*  Watches /dev with inotify for the video device nodes coming and going,
+    so that the hotplug thread can sleep until there is something to look
+    at. The nodes are seen when they are made, removed, and when udev has
+    given them their permissions.
+
+    If inotify can't be used wait() just sleeps for the timeout, and the
+    caller is back to polling.
+*/
+class DeviceWatcher
+{
+public:
+    DeviceWatcher();
+    ~DeviceWatcher();
+
+    bool isWatching() const { return mInotify >= 0; }
+
+    /*  Waits up to timeout for a /dev/video* node to change. Returns true
+        if one did, false on a time-out or if wake() was called.
+    */
+    bool wait(nsecs_t timeout);
+
+    /*  Makes wait() return now, or the next time it is called */
+    void wake();
+
+private:
+    int     mInotify;
+    int     mWakeFd;                    // an eventfd
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "Exif"
+#include <utils/Log.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "Exif.h"
+
+namespace android {
+//======================================================================
+
+enum {
+    EXIF_BYTE       = 1,
+    EXIF_ASCII      = 2,
+    EXIF_SHORT      = 3,
+    EXIF_LONG       = 4,
+    EXIF_RATIONAL   = 5,
+    EXIF_UNDEFINED  = 7,
+};
+
+static void put16(std::vector<uint8_t>& out, uint16_t v)
+{
+    out.push_back(v);
+    out.push_back(v >> 8);
+}
+
+
+
+static void put32(std::vector<uint8_t>& out, uint32_t v)
+{
+    put16(out, v);
+    put16(out, v >> 16);
+}
+
+
+
+/*  The entries of an IFD, kept in tag order as the standard wants. The
+    values of more than 4 bytes go right after the IFD.
+*/
+class Ifd
+{
+public:
+    void add(uint16_t tag, uint16_t type, uint32_t count, const std::vector<uint8_t>& data)
+    {
+        Entry e = { tag, type, count, data };
+        std::vector<Entry>::iterator it = mEntries.begin();
+        while (it != mEntries.end() && it->tag < tag) {
+            ++it;
+        }
+        mEntries.insert(it, e);
+    }
+
+    void addAscii(uint16_t tag, const std::string& s)
+    {
+        std::vector<uint8_t> data(s.begin(), s.end());
+        data.push_back(0);
+        add(tag, EXIF_ASCII, data.size(), data);
+    }
+
+    void addUndefined(uint16_t tag, const void* bytes, size_t size)
+    {
+        std::vector<uint8_t> data((const uint8_t*)bytes, (const uint8_t*)bytes + size);
+        add(tag, EXIF_UNDEFINED, size, data);
+    }
+
+    void addByte(uint16_t tag, uint8_t v)
+    {
+        add(tag, EXIF_BYTE, 1, std::vector<uint8_t>(1, v));
+    }
+
+    void addShort(uint16_t tag, uint16_t v)
+    {
+        std::vector<uint8_t> data;
+        put16(data, v);
+        add(tag, EXIF_SHORT, 1, data);
+    }
+
+    void addLong(uint16_t tag, uint32_t v)
+    {
+        std::vector<uint8_t> data;
+        put32(data, v);
+        add(tag, EXIF_LONG, 1, data);
+    }
+
+    /*  count numerator, denominator pairs */
+    void addRationals(uint16_t tag, const uint32_t* v, int count)
+    {
+        std::vector<uint8_t> data;
+        for (int i = 0; i < 2 * count; i++) {
+            put32(data, v[i]);
+        }
+        add(tag, EXIF_RATIONAL, count, data);
+    }
+
+    /*  For the offsets, which are only known once the sizes are */
+    void setLong(uint16_t tag, uint32_t v)
+    {
+        for (size_t i = 0; i < mEntries.size(); i++) {
+            if (mEntries[i].tag == tag) {
+                mEntries[i].data.clear();
+                put32(mEntries[i].data, v);
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        size_t size = 2 + 12 * mEntries.size() + 4;
+        for (size_t i = 0; i < mEntries.size(); i++) {
+            if (mEntries[i].data.size() > 4) {
+                size += (mEntries[i].data.size() + 1) & ~1;
+            }
+        }
+        return size;
+    }
+
+    /*  Appends it to out, where the TIFF header is at tiff, with next the
+        offset of the IFD that follows, or 0
+    */
+    void write(std::vector<uint8_t>& out, size_t tiff, uint32_t next) const
+    {
+        uint32_t offset = out.size() - tiff + 2 + 12 * mEntries.size() + 4;
+
+        put16(out, mEntries.size());
+        for (size_t i = 0; i < mEntries.size(); i++) {
+            const Entry& e = mEntries[i];
+            put16(out, e.tag);
+            put16(out, e.type);
+            put32(out, e.count);
+            if (e.data.size() <= 4) {
+                out.insert(out.end(), e.data.begin(), e.data.end());
+                out.resize(out.size() + 4 - e.data.size(), 0);
+            } else {
+                put32(out, offset);
+                offset += (e.data.size() + 1) & ~1;
+            }
+        }
+        put32(out, next);
+
+        for (size_t i = 0; i < mEntries.size(); i++) {
+            const Entry& e = mEntries[i];
+            if (e.data.size() > 4) {
+                out.insert(out.end(), e.data.begin(), e.data.end());
+                if (e.data.size() & 1) {
+                    out.push_back(0);
+                }
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        uint16_t                tag;
+        uint16_t                type;
+        uint32_t                count;
+        std::vector<uint8_t>    data;           // little endian
+    };
+
+    std::vector<Entry> mEntries;
+};
+
+
+
+static std::string exifDate(time_t t, const char* format)
+{
+    struct tm tm;
+    char buf[32];
+
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), format, &tm);
+    return buf;
+}
+
+
+
+/*  Degrees as the degrees, minutes and seconds rationals of GPS */
+static void toDms(double degrees, uint32_t dms[6])
+{
+    degrees = fabs(degrees);
+    double minutes = (degrees - floor(degrees)) * 60;
+    double seconds = (minutes - floor(minutes)) * 60;
+
+    dms[0] = (uint32_t)floor(degrees);
+    dms[1] = 1;
+    dms[2] = (uint32_t)floor(minutes);
+    dms[3] = 1;
+    dms[4] = (uint32_t)lround(seconds * 1000);
+    dms[5] = 1000;
+}
+
+
+
+static void addResolution(Ifd& ifd)
+{
+    static const uint32_t dpi[2] = { 72, 1 };
+
+    ifd.addRationals(0x011a, dpi, 1);       // XResolution
+    ifd.addRationals(0x011b, dpi, 1);       // YResolution
+    ifd.addShort(0x0128, 2);                // ResolutionUnit: inches
+}
+
+
+
+bool buildExifApp1(const ExifInfo& info, const uint8_t* thumb, size_t thumbSize,
+                   std::vector<uint8_t>& app1)
+{
+    std::string date = exifDate(info.time, "%Y:%m:%d %H:%M:%S");
+
+    // The 0th IFD, of the picture itself
+    Ifd ifd0;
+    if (!info.make.empty()) {
+        ifd0.addAscii(0x010f, info.make);
+    }
+    if (!info.model.empty()) {
+        ifd0.addAscii(0x0110, info.model);
+    }
+
+    uint16_t orientation;
+    switch (info.rotation) {
+    case 90:  orientation = 6; break;
+    case 180: orientation = 3; break;
+    case 270: orientation = 8; break;
+    default:  orientation = 1; break;
+    }
+    ifd0.addShort(0x0112, orientation);
+    addResolution(ifd0);
+    ifd0.addAscii(0x0132, date);            // DateTime
+    ifd0.addShort(0x0213, 1);               // YCbCrPositioning: centered
+    ifd0.addLong(0x8769, 0);                // the Exif IFD
+    if (info.hasGps) {
+        ifd0.addLong(0x8825, 0);            // the GPS IFD
+    }
+
+    Ifd exif;
+    exif.addUndefined(0x9000, "0220", 4);   // ExifVersion
+    exif.addAscii(0x9003, date);            // DateTimeOriginal
+    exif.addAscii(0x9004, date);            // DateTimeDigitized
+    static const uint8_t ycbcr[4] = { 1, 2, 3, 0 };
+    exif.addUndefined(0x9101, ycbcr, 4);    // ComponentsConfiguration
+    if (info.focalLength > 0) {
+        uint32_t focal[2] = { (uint32_t)lround(info.focalLength * 100), 100 };
+        exif.addRationals(0x920a, focal, 1);
+    }
+    exif.addUndefined(0xa000, "0100", 4);   // FlashpixVersion
+    exif.addShort(0xa001, 1);               // ColorSpace: sRGB
+    exif.addLong(0xa002, info.width);       // PixelXDimension
+    exif.addLong(0xa003, info.height);
+
+    Ifd gps;
+    if (info.hasGps) {
+        static const uint8_t version[4] = { 2, 2, 0, 0 };
+        uint32_t dms[6];
+
+        gps.add(0x0000, EXIF_BYTE, 4, std::vector<uint8_t>(version, version + 4));
+        gps.addAscii(0x0001, info.latitude < 0 ? "S" : "N");
+        toDms(info.latitude, dms);
+        gps.addRationals(0x0002, dms, 3);
+        gps.addAscii(0x0003, info.longitude < 0 ? "W" : "E");
+        toDms(info.longitude, dms);
+        gps.addRationals(0x0004, dms, 3);
+
+        gps.addByte(0x0005, info.altitude < 0 ? 1 : 0);
+        uint32_t altitude[2] = { (uint32_t)lround(fabs(info.altitude) * 100), 100 };
+        gps.addRationals(0x0006, altitude, 1);
+
+        struct tm tm;
+        gmtime_r(&info.gpsTime, &tm);
+        uint32_t hms[6] = { (uint32_t)tm.tm_hour, 1, (uint32_t)tm.tm_min, 1, (uint32_t)tm.tm_sec, 1 };
+        gps.addRationals(0x0007, hms, 3);   // GPSTimeStamp
+
+        if (!info.gpsMethod.empty()) {
+            // An UNDEFINED string, with its character code first
+            std::string method("ASCII\0\0\0", 8);
+            method += info.gpsMethod;
+            gps.addUndefined(0x001b, method.data(), method.size());
+        }
+
+        char datestamp[16];
+        strftime(datestamp, sizeof(datestamp), "%Y:%m:%d", &tm);
+        gps.addAscii(0x001d, datestamp);
+    }
+
+    // The 1st IFD, of the thumbnail
+    Ifd ifd1;
+    if (thumb != NULL) {
+        ifd1.addShort(0x0103, 6);           // Compression: JPEG
+        addResolution(ifd1);
+        ifd1.addLong(0x0201, 0);            // JPEGInterchangeFormat
+        ifd1.addLong(0x0202, thumbSize);    // JPEGInterchangeFormatLength
+    }
+
+    // The offsets, from the TIFF header
+    uint32_t exifOffset = 8 + ifd0.size();
+    uint32_t gpsOffset = exifOffset + exif.size();
+    uint32_t ifd1Offset = gpsOffset + (info.hasGps ? gps.size() : 0);
+    uint32_t thumbOffset = ifd1Offset + ifd1.size();
+    size_t tiffSize = thumb != NULL ? thumbOffset + thumbSize : ifd1Offset;
+
+    if (2 + 2 + 6 + tiffSize > kExifMaxApp1Size) {
+        return false;
+    }
+
+    ifd0.setLong(0x8769, exifOffset);
+    ifd0.setLong(0x8825, gpsOffset);
+    ifd1.setLong(0x0201, thumbOffset);
+
+    app1.clear();
+    app1.reserve(2 + 2 + 6 + tiffSize);
+    app1.push_back(0xff);
+    app1.push_back(0xe1);
+    app1.push_back((2 + 6 + tiffSize) >> 8);
+    app1.push_back((2 + 6 + tiffSize) & 0xff);
+    app1.insert(app1.end(), "Exif\0\0", "Exif\0\0" + 6);
+
+    size_t tiff = app1.size();
+    app1.push_back('I');
+    app1.push_back('I');
+    put16(app1, 42);
+    put32(app1, 8);                         // the 0th IFD
+
+    ifd0.write(app1, tiff, thumb != NULL ? ifd1Offset : 0);
+    exif.write(app1, tiff, 0);
+    if (info.hasGps) {
+        gps.write(app1, tiff, 0);
+    }
+    if (thumb != NULL) {
+        ifd1.write(app1, tiff, 0);
+        app1.insert(app1.end(), thumb, thumb + thumbSize);
+    }
+
+    return true;
+}
+
+//======================================================================
+}; // namespace android
@@ -0,0 +1,57 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _EXIF_H
+#define _EXIF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+namespace android {
+//======================================================================
+
+/*  The APP1 segment can't be longer than its 16 bit length allows */
+static const size_t kExifMaxApp1Size = 2 + 65535;
+
+/*  What goes in the EXIF of a picture */
+struct ExifInfo {
+    std::string make;                       // ro.product.manufacturer
+    std::string model;                      // ro.product.model
+    int         width;
+    int         height;
+    int         rotation;                   // KEY_ROTATION, in degrees clockwise
+    time_t      time;                       // when it was taken
+    double      focalLength;                // in mm, 0 if not known
+
+    bool        hasGps;
+    double      latitude;                   // in degrees, north and east positive
+    double      longitude;
+    double      altitude;                   // in meters above sea level
+    time_t      gpsTime;                    // UTC
+    std::string gpsMethod;                  // GPSProcessingMethod, may be empty
+
+    ExifInfo()
+      : width(0), height(0), rotation(0), time(0), focalLength(0),
+        hasGps(false), latitude(0), longitude(0), altitude(0), gpsTime(0) {}
+};
+
+/*  Builds the APP1 segment, from its FF E1 marker on, of a little endian
+    EXIF with the 0th, Exif and GPS IFDs and, if thumb is not NULL, the
+    1st IFD with that JPEG as its thumbnail. Returns false if it would be
+    longer than kExifMaxApp1Size, which only a big thumbnail can make it.
+*/
+bool buildExifApp1(const ExifInfo& info, const uint8_t* thumb, size_t thumbSize,
+                   std::vector<uint8_t>& app1);
+
+//======================================================================
+}; // namespace android
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "FormatCache"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <map>
+#include <vector>
+#include <utils/Log.h>
+#include <utils/threads.h>
+
+#include "FormatCache.h"
+#include "Utils.h"
+
+using namespace std;
+
+namespace android {
+//======================================================================
+
+namespace {
+
+struct PixelFormat {
+    SurfaceSize size;
+    bool        crop;
+    uint32_t    pixfmt;
+};
+
+struct Device {
+    bool                        haveModes = false;
+    SortedVector<SurfaceDesc>   modes;
+    vector<PixelFormat>         pixfmts;
+};
+
+// All protected by gLock
+Mutex                   gLock;
+map<string, Device>     gDevices;
+string                  gFile;
+
+
+
+/*  The file is made of lines of
+        device KEY
+        mode WIDTHxHEIGHT FPS
+        pixfmt WIDTHxHEIGHT CROP FOURCC
+    where the modes and pixel formats are those of the device above them.
+*/
+void loadLocked()
+{
+    auto text = utils::readFile(gFile);
+    Device* device = NULL;
+    int w, h, n;
+    unsigned int fourcc;
+
+    for (auto& line : utils::splitLines(text)) {
+        auto words = utils::splitWords(line);
+
+        if (words.empty() || words[0][0] == '#') {
+            continue;
+        }
+
+        if (words[0] == "device" && words.size() == 2) {
+            device = &gDevices[words[1]];
+            device->haveModes = false;
+            device->modes.clear();
+            device->pixfmts.clear();
+        } else if (device == NULL) {
+            break;
+        } else if (words[0] == "mode" && words.size() == 3 &&
+                   sscanf(words[1].c_str(), "%dx%d", &w, &h) == 2 &&
+                   sscanf(words[2].c_str(), "%d", &n) == 1) {
+            device->modes.add(SurfaceDesc(w, h, n));
+            device->haveModes = true;
+        } else if (words[0] == "pixfmt" && words.size() == 4 &&
+                   sscanf(words[1].c_str(), "%dx%d", &w, &h) == 2 &&
+                   sscanf(words[2].c_str(), "%d", &n) == 1 &&
+                   sscanf(words[3].c_str(), "%x", &fourcc) == 1) {
+            device->pixfmts.push_back(PixelFormat{ SurfaceSize(w, h), n != 0, fourcc });
+        } else {
+            ALOGW("load: bad line '%s' in %s", line.c_str(), gFile.c_str());
+        }
+    }
+
+    ALOGD("load: %zu cameras in %s", gDevices.size(), gFile.c_str());
+}
+
+
+
+void saveLocked()
+{
+    if (gFile.empty()) {
+        return;
+    }
+
+    string tmp = gFile + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (f == NULL) {
+        ALOGW("save: cannot write %s (%d: %s)", tmp.c_str(), errno, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "# The modes of the V4L2 cameras, found by the camera HAL\n");
+
+    for (auto& d : gDevices) {
+        fprintf(f, "device %s\n", d.first.c_str());
+
+        for (size_t i = 0; i < d.second.modes.size(); i++) {
+            const SurfaceDesc& m = d.second.modes[i];
+            fprintf(f, "mode %dx%d %d\n", m.getWidth(), m.getHeight(), m.getFps());
+        }
+
+        for (auto& p : d.second.pixfmts) {
+            fprintf(f, "pixfmt %dx%d %d %08x\n", p.size.getWidth(), p.size.getHeight(), p.crop ? 1 : 0, p.pixfmt);
+        }
+    }
+
+    bool ok = fclose(f) == 0;
+
+    if (!ok || rename(tmp.c_str(), gFile.c_str()) != 0) {
+        ALOGW("save: cannot write %s (%d: %s)", gFile.c_str(), errno, strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
+} // namespace
+
+
+
+string FormatCache::deviceKey(const string& device, const struct v4l2_capability& cap)
+{
+    char version[16];
+    snprintf(version, sizeof(version), "%08x", cap.version);
+
+    string key = string((const char*)cap.driver) + "," + (const char*)cap.card + "," +
+                 (const char*)cap.bus_info + "," + version;
+
+    // The USB ids of the camera, if it is one
+    string sys = "/sys/class/video4linux/" + device.substr(device.rfind('/') + 1) + "/device/../";
+    auto vid = utils::splitWords(utils::readFile(sys + "idVendor"));
+    auto pid = utils::splitWords(utils::readFile(sys + "idProduct"));
+
+    if (vid.size() == 1 && pid.size() == 1) {
+        key += "," + vid[0] + ":" + pid[0];
+    }
+
+    // It must be one word in the file
+    for (auto& c : key) {
+        if (isspace((unsigned char)c)) {
+            c = '_';
+        }
+    }
+
+    return key;
+}
+
+
+
+void FormatCache::setFile(const string& path)
+{
+    Mutex::Autolock lock(gLock);
+
+    if (path == gFile) {
+        return;
+    }
+
+    gFile = path;
+
+    if (!gFile.empty()) {
+        loadLocked();
+    }
+}
+
+
+
+bool FormatCache::getModes(const string& key, SortedVector<SurfaceDesc>& modes)
+{
+    Mutex::Autolock lock(gLock);
+
+    auto d = gDevices.find(key);
+    if (d == gDevices.end() || !d->second.haveModes) {
+        return false;
+    }
+
+    modes = d->second.modes;
+    return true;
+}
+
+
+
+uint32_t FormatCache::getPixelFormat(const string& key, const SurfaceSize& size, bool crop)
+{
+    Mutex::Autolock lock(gLock);
+
+    auto d = gDevices.find(key);
+    if (d == gDevices.end()) {
+        return 0;
+    }
+
+    for (auto& p : d->second.pixfmts) {
+        if (p.size == size && p.crop == crop) {
+            return p.pixfmt;
+        }
+    }
+
+    return 0;
+}
+
+
+
+void FormatCache::putModes(const string& key, const SortedVector<SurfaceDesc>& modes)
+{
+    Mutex::Autolock lock(gLock);
+
+    // The pixel formats go with the modes
+    Device& d = gDevices[key];
+    d.haveModes = true;
+    d.modes = modes;
+    d.pixfmts.clear();
+
+    saveLocked();
+}
+
+
+
+void FormatCache::putPixelFormat(const string& key, const SurfaceSize& size, bool crop, uint32_t pixfmt)
+{
+    Mutex::Autolock lock(gLock);
+
+    Device& d = gDevices[key];
+
+    for (auto& p : d.pixfmts) {
+        if (p.size == size && p.crop == crop) {
+            p.pixfmt = pixfmt;
+            saveLocked();
+            return;
+        }
+    }
+
+    d.pixfmts.push_back(PixelFormat{ size, crop, pixfmt });
+    saveLocked();
+}
+
+//======================================================================
+}; // namespace android
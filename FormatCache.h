@@ -0,0 +1,53 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _FORMAT_CACHE_H
+#define _FORMAT_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <utils/SortedVector.h>
+
+#include "uvc_compat.h"
+#include "SurfaceDesc.h"
+
+namespace android {
+//======================================================================
+
+/*  What we have found out about each camera, so that it is only asked
+    once. That is the modes it can capture, which take a lot of ioctls to
+    enumerate, and the pixel format Init() chose for each capture size.
+
+    The cameras are told apart by a key made from their capabilities and
+    USB ids, so a different camera on the same device node is enumerated
+    again. The cache is shared by the whole process and is thread safe.
+    If it has a file it is loaded from it and saved to it on each change,
+    so it also survives the camera service restarting.
+*/
+class FormatCache
+{
+public:
+    static std::string deviceKey(const std::string& device, const struct v4l2_capability& cap);
+
+    /*  Sets the file to keep the cache in, empty for none. Does nothing
+        if it is the file already in use.
+    */
+    static void setFile(const std::string& path);
+
+    /*  These return false or 0 if the camera is not in the cache */
+    static bool     getModes(const std::string& key, SortedVector<SurfaceDesc>& modes);
+    static uint32_t getPixelFormat(const std::string& key, const SurfaceSize& size, bool crop);
+
+    static void putModes(const std::string& key, const SortedVector<SurfaceDesc>& modes);
+    static void putPixelFormat(const std::string& key, const SurfaceSize& size, bool crop, uint32_t pixfmt);
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
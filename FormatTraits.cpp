@@ -0,0 +1,138 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "FormatTraits"
+#include <utils/Log.h>
+
+extern "C" {
+#include <stdint.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include <system/graphics.h>
+#include "v4l2_formats.h"
+};
+
+#include "FormatTraits.h"
+#include "Converter.h"
+
+namespace android {
+//======================================================================
+
+/*  Each entry of the table points straight at the converter of its format,
+    so the converters that lack an argument of yuyv_converter, or take one
+    more, get a wrapper made for each of them by a template. The function
+    is a template argument, so the call in the wrapper is a direct one and
+    can be inlined, and there is no switch left to go through per frame.
+*/
+
+// For the converters that work out the stride of the frame from the width
+template<void (*F)(uint8_t*, int, uint8_t*, int, int)>
+static void noStride(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+    (void)srcStride;
+    F(dst, dstStride, src, width, height);
+}
+
+
+// The pix_order of bayer_to_yuyv() is known for each bayer format
+template<int order>
+static void bayer(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+    bayer_to_yuyv(dst, dstStride, src, srcStride, width, height, order);
+}
+
+
+// YUYV only needs its lines copied, as the strides may differ
+static void copyYUYV(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height)
+{
+    int bytes = width << 1;
+    for (int h = 0; h < height; h++) {
+        memcpy(dst, src, bytes);
+        dst += dstStride;
+        src += srcStride;
+    }
+}
+
+
+
+//  fourcc                  layout              hsub vsub bpp crop converter                 luma at, step, planes, vu
+const CaptureFormat kCaptureFormats[] = {
+    {V4L2_PIX_FMT_YUYV,     LAYOUT_PACKED,      1, 0, 2, true,  copyYUYV,                 0, 2, 1, false},
+    {V4L2_PIX_FMT_YVYU,     LAYOUT_PACKED,      1, 0, 2, true,  yvyu_to_yuyv,             0, 2, 1, false},
+    {V4L2_PIX_FMT_UYVY,     LAYOUT_PACKED,      1, 0, 2, true,  uyvy_to_yuyv,             1, 2, 1, false},
+    {V4L2_PIX_FMT_YYUV,     LAYOUT_PACKED,      1, 0, 2, true,  yyuv_to_yuyv,             0, 0, 1, false},
+    {V4L2_PIX_FMT_SPCA501,  LAYOUT_LINES,       1, 1, 2, false, noStride<s501_to_yuyv>,   0, 0, 1, false},
+    {V4L2_PIX_FMT_SPCA505,  LAYOUT_LINES,       1, 1, 2, false, noStride<s505_to_yuyv>,   0, 0, 1, false},
+    {V4L2_PIX_FMT_SPCA508,  LAYOUT_LINES,       1, 1, 2, false, noStride<s508_to_yuyv>,   0, 0, 1, false},
+    {V4L2_PIX_FMT_YUV420,   LAYOUT_PLANAR,      1, 1, 0, false, noStride<yuv420_to_yuyv>, 0, 1, 1, false},
+    {V4L2_PIX_FMT_YVU420,   LAYOUT_PLANAR,      1, 1, 0, false, noStride<yvu420_to_yuyv>, 0, 1, 1, true},
+    {V4L2_PIX_FMT_NV12,     LAYOUT_SEMIPLANAR,  1, 1, 0, false, noStride<nv12_to_yuyv>,   0, 1, 1, false},
+    {V4L2_PIX_FMT_NV21,     LAYOUT_SEMIPLANAR,  1, 1, 0, false, noStride<nv21_to_yuyv>,   0, 1, 1, true},
+    {V4L2_PIX_FMT_NV16,     LAYOUT_SEMIPLANAR,  1, 0, 0, false, noStride<nv16_to_yuyv>,   0, 1, 1, false},
+    {V4L2_PIX_FMT_NV61,     LAYOUT_SEMIPLANAR,  1, 0, 0, false, noStride<nv61_to_yuyv>,   0, 1, 1, true},
+    {V4L2_PIX_FMT_NV12M,    LAYOUT_SEMIPLANAR,  1, 1, 0, false, NULL,                     0, 1, 2, false},
+    {V4L2_PIX_FMT_NV21M,    LAYOUT_SEMIPLANAR,  1, 1, 0, false, NULL,                     0, 1, 2, true},
+    {V4L2_PIX_FMT_YUV420M,  LAYOUT_PLANAR,      1, 1, 0, false, NULL,                     0, 1, 3, false},
+    {V4L2_PIX_FMT_YVU420M,  LAYOUT_PLANAR,      1, 1, 0, false, NULL,                     0, 1, 3, true},
+    {V4L2_PIX_FMT_Y41P,     LAYOUT_PACKED,      2, 0, 0, false, noStride<y41p_to_yuyv>,   0, 0, 1, false},
+    {V4L2_PIX_FMT_SGBRG8,   LAYOUT_BAYER,       0, 0, 0, false, bayer<0>,                 0, 0, 1, false},
+    {V4L2_PIX_FMT_SGRBG8,   LAYOUT_BAYER,       0, 0, 0, false, bayer<1>,                 0, 0, 1, false},
+    {V4L2_PIX_FMT_SBGGR8,   LAYOUT_BAYER,       0, 0, 0, false, bayer<2>,                 0, 0, 1, false},
+    {V4L2_PIX_FMT_SRGGB8,   LAYOUT_BAYER,       0, 0, 0, false, bayer<3>,                 0, 0, 1, false},
+    {V4L2_PIX_FMT_BGR24,    LAYOUT_PACKED,      0, 0, 3, true,  bgr_to_yuyv,              0, 0, 1, false},
+    {V4L2_PIX_FMT_RGB24,    LAYOUT_PACKED,      0, 0, 3, true,  rgb_to_yuyv,              0, 0, 1, false},
+    {V4L2_PIX_FMT_MJPEG,    LAYOUT_COMPRESSED,  0, 0, 0, false, NULL,                     0, 0, 1, false},
+    {V4L2_PIX_FMT_JPEG,     LAYOUT_COMPRESSED,  0, 0, 0, false, NULL,                     0, 0, 1, false},
+    {V4L2_PIX_FMT_GREY,     LAYOUT_PACKED,      0, 0, 1, true,  grey_to_yuyv,             0, 1, 1, false},
+    {V4L2_PIX_FMT_Y16,      LAYOUT_PACKED,      0, 0, 2, true,  y16_to_yuyv,              1, 2, 1, false},
+};
+
+const size_t kCaptureFormatCount = sizeof(kCaptureFormats) / sizeof(kCaptureFormats[0]);
+
+
+const CaptureFormat* findCaptureFormat(uint32_t fourcc)
+{
+    for (size_t i = 0; i < kCaptureFormatCount; i++) {
+        if (kCaptureFormats[i].fourcc == fourcc) {
+            return &kCaptureFormats[i];
+        }
+    }
+    return NULL;
+}
+
+
+
+/*  NV16 is misused by android for NV21, so it gets the same conversion.
+    YV16 has no gralloc format and is only ever a window format.
+*/
+static const HalFormat kHalFormats[] = {
+    {PIXEL_FORMAT_YCbCr_422_SP, SCALE_DST_YVU420SP, 1, HAL_PIXEL_FORMAT_YCrCb_420_SP},
+    {PIXEL_FORMAT_YCbCr_420_SP, SCALE_DST_YVU420SP, 1, HAL_PIXEL_FORMAT_YCrCb_420_SP},
+    {PIXEL_FORMAT_YV12,         SCALE_DST_YVU420P,  1, HAL_PIXEL_FORMAT_YV12},
+    {PIXEL_FORMAT_YV16,         SCALE_DST_YVU422P,  1, 0},
+    {PIXEL_FORMAT_YCrCb_422_I,  SCALE_DST_YUYV,     2, HAL_PIXEL_FORMAT_YCbCr_422_I},
+    {PIXEL_FORMAT_RGB_888,      SCALE_DST_RGB24,    3, HAL_PIXEL_FORMAT_RGB_888},
+    {PIXEL_FORMAT_RGBA_8888,    SCALE_DST_RGB32,    4, HAL_PIXEL_FORMAT_RGBA_8888},
+    {PIXEL_FORMAT_RGBX_8888,    SCALE_DST_RGB32,    4, HAL_PIXEL_FORMAT_RGBX_8888},
+    {PIXEL_FORMAT_BGRA_8888,    SCALE_DST_BGR32,    4, HAL_PIXEL_FORMAT_BGRA_8888},
+    {PIXEL_FORMAT_RGB_565,      SCALE_DST_RGB565,   2, HAL_PIXEL_FORMAT_RGB_565},
+};
+
+
+const HalFormat* findHalFormat(int format)
+{
+    for (size_t i = 0; i < sizeof(kHalFormats) / sizeof(kHalFormats[0]); i++) {
+        if (kHalFormats[i].format == format) {
+            return &kHalFormats[i];
+        }
+    }
+    return NULL;
+}
+
+//======================================================================
+}; // namespace android
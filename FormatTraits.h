@@ -0,0 +1,146 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _FORMAT_TRAITS_H
+#define _FORMAT_TRAITS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The Android formats the frames are converted to, as the framework
+// numbers them. Some headers lack a few of them.
+#ifndef PIXEL_FORMAT_RGB_888
+#define PIXEL_FORMAT_RGB_888 3 /* */
+#endif
+
+#ifndef PIXEL_FORMAT_RGBA_8888
+#define PIXEL_FORMAT_RGBA_8888 1 /* [ov] */
+#endif
+
+#ifndef PIXEL_FORMAT_RGBX_8888
+#define PIXEL_FORMAT_RGBX_8888 2
+#endif
+
+#ifndef PIXEL_FORMAT_BGRA_8888
+#define PIXEL_FORMAT_BGRA_8888 5 /* [ov] */
+#endif
+
+#ifndef PIXEL_FORMAT_RGB_565
+#define PIXEL_FORMAT_RGB_565  4 /* [ov] */
+#endif
+
+// We need this format to allow special preview modes
+#ifndef PIXEL_FORMAT_YCrCb_422_I
+#define PIXEL_FORMAT_YCrCb_422_I 100
+#endif
+
+#ifndef PIXEL_FORMAT_YCbCr_422_SP
+#define PIXEL_FORMAT_YCbCr_422_SP 0x10    /* NV16  [ov] */
+#endif
+
+#ifndef PIXEL_FORMAT_YCbCr_420_SP
+#define PIXEL_FORMAT_YCbCr_420_SP 0x21    /* NV12 */
+#endif
+
+#ifndef PIXEL_FORMAT_UNKNOWN
+#define PIXEL_FORMAT_UNKNOWN 0
+#endif
+
+    /*
+     * Android YUV format:
+     *
+     * This format is exposed outside of the HAL to software
+     * decoders and applications.
+     * EGLImageKHR must support it in conjunction with the
+     * OES_EGL_image_external extension.
+     *
+     * YV12 is 4:2:0 YCrCb planar format comprised of a WxH Y plane followed
+     * by (W/2) x (H/2) Cr and Cb planes.
+     *
+     * This format assumes
+     * - an even width
+     * - an even height
+     * - a horizontal stride multiple of 16 pixels
+     * - a vertical stride equal to the height
+     *
+     *   y_size = stride * height
+     *   c_size = ALIGN(stride/2, 16) * height/2
+     *   size = y_size + c_size * 2
+     *   cr_offset = y_size
+     *   cb_offset = y_size + c_size
+     *
+     */
+#ifndef PIXEL_FORMAT_YV12
+#define PIXEL_FORMAT_YV12  0x32315659 /* YCrCb 4:2:0 Planar */
+#endif
+
+#ifndef PIXEL_FORMAT_YV16
+#define PIXEL_FORMAT_YV16  0x36315659 /* YCrCb 4:2:2 Planar */
+#endif
+
+namespace android {
+//======================================================================
+
+/*  What the code needs to know about each format, in one table for each
+    side, instead of a switch on the format wherever a frame is touched.
+    The entry of the capture format is looked up in V4L2Camera::Init(),
+    and those of the preview, window and video formats when they are set,
+    so converting a frame goes straight to the right function.
+*/
+
+enum {
+    LAYOUT_PACKED = 0,              // all the components in one plane
+    LAYOUT_PLANAR,                  // a plane for each of Y, U and V
+    LAYOUT_SEMIPLANAR,              // a Y plane and an interleaved chroma plane
+    LAYOUT_LINES,                   // the planes of each line one after the other
+    LAYOUT_BAYER,
+    LAYOUT_COMPRESSED,              // needs the MJPEG decoder
+};
+
+/*  Converts width x height pixels of a captured frame to YUYV */
+typedef void (*yuyv_converter)(uint8_t *dst, int dstStride, uint8_t *src, int srcStride, int width, int height);
+
+struct CaptureFormat {
+    uint32_t        fourcc;         // V4L2_PIX_FMT_*
+    int             layout;         // LAYOUT_*
+    int             hsub;           // log2 of the chroma subsampling
+    int             vsub;
+    int             bytesPerPixel;  // of a packed format, that can be cropped
+    bool            allowsCrop;     // if the start of the frame can be moved for cropping
+    yuyv_converter  toYUYV;         // NULL for the compressed and the multi-planar formats
+    int             lumaOffset;     // of the luma of the first pixel, in bytes
+    int             lumaStep;       // bytes from one luma to the next, 0 if they aren't evenly spaced
+    int             memPlanes;      // buffers of a frame, more than one only with the multi-planar API
+    bool            vFirst;         // the V plane or sample before the U one
+};
+
+/*  The capture formats we can use, from the one we like best to the one
+    we like least
+*/
+extern const CaptureFormat  kCaptureFormats[];
+extern const size_t         kCaptureFormatCount;
+
+/*  The entry of a V4L2 fourcc, or NULL if we can't capture it */
+const CaptureFormat* findCaptureFormat(uint32_t fourcc);
+
+
+
+struct HalFormat {
+    int             format;         // PIXEL_FORMAT_*
+    int             scaleDst;       // SCALE_DST_* that yuyv_scaler_run() converts to
+    int             bytesPerPixel;  // of the first plane, for the stride in bytes
+    int             grallocFormat;  // HAL_PIXEL_FORMAT_* of a buffer that holds it, or 0 for none
+};
+
+/*  The entry of an Android format, or NULL if we can't convert to it */
+const HalFormat* findHalFormat(int format);
+
+//======================================================================
+}; // namespace android
+
+#endif
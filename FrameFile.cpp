@@ -0,0 +1,236 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "FrameFile"
+#include <utils/Log.h>
+
+extern "C" {
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+};
+
+#include "FrameFile.h"
+
+namespace android {
+//======================================================================
+
+static size_t pad8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+
+
+FrameFileWriter::FrameFileWriter()
+  : mFd(-1),
+    mMem(NULL),
+    mSize(0),
+    mUsed(0),
+    mFull(false)
+{
+}
+
+
+
+FrameFileWriter::~FrameFileWriter()
+{
+    close();
+}
+
+
+
+status_t FrameFileWriter::open(const std::string& path, size_t maxBytes, const FrameFileHeader& header)
+{
+    close();
+
+    if (maxBytes < sizeof(FrameFileHeader)) {
+        return BAD_VALUE;
+    }
+
+    mFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (mFd < 0) {
+        ALOGE("open: cannot create %s: %s", path.c_str(), strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    // The file is made as big as it may get, so the mapping can be written
+    // all the way. It is cut down when we are done.
+    if (ftruncate(mFd, maxBytes) < 0) {
+        ALOGE("open: cannot make %s %zu bytes: %s", path.c_str(), maxBytes, strerror(errno));
+        close();
+        return UNKNOWN_ERROR;
+    }
+
+    void* mem = mmap(NULL, maxBytes, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (mem == MAP_FAILED) {
+        ALOGE("open: cannot map %s: %s", path.c_str(), strerror(errno));
+        close();
+        return UNKNOWN_ERROR;
+    }
+
+    mMem  = (uint8_t*)mem;
+    mSize = maxBytes;
+    mPath = path;
+
+    FrameFileHeader* h = (FrameFileHeader*)mMem;
+    *h = header;
+    h->magic   = FRAME_FILE_MAGIC;
+    h->version = FRAME_FILE_VERSION;
+    h->frames  = 0;
+    mUsed = sizeof(FrameFileHeader);
+
+    ALOGI("open: recording the frames into %s, up to %zu MB", path.c_str(), maxBytes >> 20);
+    return NO_ERROR;
+}
+
+
+
+void FrameFileWriter::add(const void* data, uint32_t bytesused, uint32_t sequence, uint32_t flags, nsecs_t timestamp)
+{
+    if (mMem == NULL || mFull) {
+        return;
+    }
+
+    size_t need = sizeof(FrameFileRecord) + pad8(bytesused);
+    if (mUsed + need > mSize) {
+        ALOGW("add: %s is full, not recording any more frames", mPath.c_str());
+        mFull = true;
+        return;
+    }
+
+    FrameFileRecord* r = (FrameFileRecord*)(mMem + mUsed);
+    r->bytesused = bytesused;
+    r->sequence  = sequence;
+    r->flags     = flags;
+    r->reserved  = 0;
+    r->timestamp = timestamp;
+    memcpy(r + 1, data, bytesused);
+
+    mUsed += need;
+    ((FrameFileHeader*)mMem)->frames++;
+}
+
+
+
+void FrameFileWriter::close()
+{
+    if (mMem != NULL) {
+        ALOGI("close: recorded %u frames, %zu bytes, into %s",
+              ((FrameFileHeader*)mMem)->frames, mUsed, mPath.c_str());
+        munmap(mMem, mSize);
+        mMem = NULL;
+
+        if (ftruncate(mFd, mUsed) < 0) {
+            ALOGW("close: cannot cut %s down: %s", mPath.c_str(), strerror(errno));
+        }
+    }
+
+    if (mFd >= 0) {
+        ::close(mFd);
+        mFd = -1;
+    }
+
+    mSize = 0;
+    mUsed = 0;
+    mFull = false;
+}
+
+
+
+FrameFileReader::FrameFileReader()
+  : mMem(NULL),
+    mSize(0)
+{
+}
+
+
+
+FrameFileReader::~FrameFileReader()
+{
+    close();
+}
+
+
+
+status_t FrameFileReader::open(const std::string& path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("open: cannot open %s: %s", path.c_str(), strerror(errno));
+        return NAME_NOT_FOUND;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(FrameFileHeader)) {
+        ALOGE("open: %s is not a capture file", path.c_str());
+        ::close(fd);
+        return BAD_VALUE;
+    }
+
+    void* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mem == MAP_FAILED) {
+        ALOGE("open: cannot map %s: %s", path.c_str(), strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    mMem  = (uint8_t*)mem;
+    mSize = st.st_size;
+
+    const FrameFileHeader& h = header();
+    if (h.magic != FRAME_FILE_MAGIC || h.version != FRAME_FILE_VERSION ||
+        h.width == 0 || h.height == 0 || h.sizeimage == 0) {
+        ALOGE("open: %s is not a capture file we can read", path.c_str());
+        close();
+        return BAD_VALUE;
+    }
+
+    // A file that was not closed may end with a frame cut short
+    size_t pos = sizeof(FrameFileHeader);
+    for (uint32_t i = 0; i < h.frames; i++) {
+        const FrameFileRecord* r = (const FrameFileRecord*)(mMem + pos);
+        if (pos + sizeof(FrameFileRecord) > mSize ||
+            pos + sizeof(FrameFileRecord) + pad8(r->bytesused) > mSize ||
+            r->bytesused > h.sizeimage) {
+            ALOGW("open: %s ends after %u of %u frames", path.c_str(), i, h.frames);
+            break;
+        }
+        mRecords.push_back(r);
+        pos += sizeof(FrameFileRecord) + pad8(r->bytesused);
+    }
+
+    if (mRecords.empty()) {
+        ALOGE("open: %s has no frames", path.c_str());
+        close();
+        return BAD_VALUE;
+    }
+
+    return NO_ERROR;
+}
+
+
+
+void FrameFileReader::close()
+{
+    if (mMem != NULL) {
+        munmap(mMem, mSize);
+        mMem = NULL;
+    }
+    mSize = 0;
+    mRecords.clear();
+}
+
+//======================================================================
+}; // namespace android
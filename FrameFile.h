@@ -0,0 +1,116 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _FRAME_FILE_H
+#define _FRAME_FILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <utils/Errors.h>
+#include <utils/Timers.h>
+
+namespace android {
+//======================================================================
+
+/*  A capture file holds the frames of one stream as the driver gave them,
+    so the pipeline can be run and timed away from the camera they came
+    from. It is a header, then for each frame a record and its bytes,
+    padded to 8 bytes. All the fields are in the byte order of the CPU
+    that recorded them.
+*/
+
+#define FRAME_FILE_MAGIC    0x52464356      // "VCFR"
+#define FRAME_FILE_VERSION  1
+
+struct FrameFileHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    fourcc;                     // V4L2_PIX_FMT_* of the frames
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    bytesperline;
+    uint32_t    sizeimage;                  // the size of the driver buffers
+    uint32_t    fpsNumerator;               // the timeperframe of the stream
+    uint32_t    fpsDenominator;
+    uint32_t    frames;                     // records that follow
+    uint32_t    reserved[6];
+};
+
+struct FrameFileRecord {
+    uint32_t    bytesused;                  // bytes of the frame that follow
+    uint32_t    sequence;                   // as the driver counted it
+    uint32_t    flags;                      // V4L2_BUF_FLAG_* of the buffer
+    uint32_t    reserved;
+    int64_t     timestamp;                  // SYSTEM_TIME_MONOTONIC of the capture
+};
+
+
+/*  Writes the dequeued frames into a file of up to maxBytes, that is
+    mapped so that each frame is a single memcpy. The frame count in the
+    header is kept up to date, so what has been written is readable even
+    if we never get to close() it. Only the thread that takes the frames
+    uses it.
+*/
+class FrameFileWriter
+{
+public:
+    FrameFileWriter();
+    ~FrameFileWriter();
+
+    status_t open(const std::string& path, size_t maxBytes, const FrameFileHeader& header);
+
+    /*  Appends a frame, unless the file is full */
+    void     add(const void* data, uint32_t bytesused, uint32_t sequence, uint32_t flags, nsecs_t timestamp);
+
+    /*  Cuts the file to what has been written */
+    void     close();
+
+    bool     isOpen() const { return mFd >= 0; }
+
+private:
+    int         mFd;
+    uint8_t*    mMem;
+    size_t      mSize;                      // of the mapping
+    size_t      mUsed;
+    bool        mFull;
+    std::string mPath;
+};
+
+
+/*  Maps a capture file to read its frames in place */
+class FrameFileReader
+{
+public:
+    FrameFileReader();
+    ~FrameFileReader();
+
+    status_t open(const std::string& path);
+    void     close();
+
+    const FrameFileHeader& header() const { return *(const FrameFileHeader*)mMem; }
+
+    size_t   count() const { return mRecords.size(); }
+    const FrameFileRecord& record(size_t i) const { return *mRecords[i]; }
+
+    /*  The bytes of frame i. The mapping is private, so they can be
+        written to without changing the file.
+    */
+    uint8_t* data(size_t i) const { return (uint8_t*)(mRecords[i] + 1); }
+
+private:
+    uint8_t*    mMem;
+    size_t      mSize;
+    std::vector<const FrameFileRecord*> mRecords;
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
@@ -0,0 +1,457 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "FrameReplay"
+#include <utils/Log.h>
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include "v4l2_formats.h"
+};
+
+#include "FrameReplay.h"
+
+namespace android {
+//======================================================================
+
+#define MAX_REPLAY_BUFFERS  32              // as VIDEO_MAX_FRAME
+
+static int fail(int e)
+{
+    errno = e;
+    return -1;
+}
+
+
+
+FrameReplay::FrameReplay()
+  : mRealtime(true),
+    mTimer(-1),
+    mPageSize(4096),
+    mFpsNumerator(1),
+    mFpsDenominator(30),
+    mMemory(V4L2_MEMORY_MMAP),
+    mStreaming(false),
+    mNext(0),
+    mSequence(0),
+    mPassStart(0),
+    mPassLength(0)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0) {
+        mPageSize = page;
+    }
+}
+
+
+
+FrameReplay::~FrameReplay()
+{
+    freeBuffers();
+    if (mTimer >= 0) {
+        close(mTimer);
+    }
+}
+
+
+
+status_t FrameReplay::open(const std::string& path, bool realtime)
+{
+    status_t status = mFile.open(path);
+    if (status != NO_ERROR) {
+        return status;
+    }
+
+    mTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mTimer < 0) {
+        ALOGE("open: no timerfd: %s", strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    mPath     = path;
+    mRealtime = realtime;
+
+    const FrameFileHeader& h = header();
+    if (h.fpsNumerator != 0 && h.fpsDenominator != 0) {
+        mFpsNumerator   = h.fpsNumerator;
+        mFpsDenominator = h.fpsDenominator;
+    }
+
+    // The gap between the last frame and the first one of the next pass
+    nsecs_t first = mFile.record(0).timestamp;
+    nsecs_t last  = mFile.record(mFile.count() - 1).timestamp;
+    mPassLength = (last > first ? last - first : 0) + s2ns(mFpsNumerator) / mFpsDenominator;
+
+    ALOGI("open: %s has %zu frames of %ux%u '%c%c%c%c', %.1f s, played %s",
+          path.c_str(), mFile.count(), h.width, h.height,
+          h.fourcc & 0xFF, (h.fourcc >> 8) & 0xFF, (h.fourcc >> 16) & 0xFF, (h.fourcc >> 24) & 0xFF,
+          mPassLength / 1e9, realtime ? "in real time" : "as fast as possible");
+    return NO_ERROR;
+}
+
+
+
+int FrameReplay::ioctl(unsigned long request, void* arg)
+{
+    const FrameFileHeader& h = header();
+
+    switch (request) {
+    case VIDIOC_QUERYCAP: {
+        struct v4l2_capability* cap = (struct v4l2_capability*)arg;
+        memset(cap, 0, sizeof(*cap));
+
+        // The card has the mode, so the FormatCache key changes with it
+        strncpy((char*)cap->driver, "replay", sizeof(cap->driver) - 1);
+        snprintf((char*)cap->card, sizeof(cap->card), "replay %ux%u %.4s", h.width, h.height, (const char*)&h.fourcc);
+        snprintf((char*)cap->bus_info, sizeof(cap->bus_info), "replay:%s", mPath.c_str());
+        cap->version      = FRAME_FILE_VERSION;
+        cap->device_caps  = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+        cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+        return 0;
+    }
+
+    case VIDIOC_ENUM_FMT: {
+        struct v4l2_fmtdesc* fmt = (struct v4l2_fmtdesc*)arg;
+        if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || fmt->index != 0) {
+            return fail(EINVAL);
+        }
+        fmt->pixelformat = h.fourcc;
+        fmt->flags = (h.fourcc == V4L2_PIX_FMT_MJPEG || h.fourcc == V4L2_PIX_FMT_JPEG) ? V4L2_FMT_FLAG_COMPRESSED : 0;
+        snprintf((char*)fmt->description, sizeof(fmt->description), "%.4s replay", (const char*)&h.fourcc);
+        return 0;
+    }
+
+    case VIDIOC_ENUM_FRAMESIZES: {
+        struct v4l2_frmsizeenum* fsize = (struct v4l2_frmsizeenum*)arg;
+        if (fsize->index != 0 || fsize->pixel_format != h.fourcc) {
+            return fail(EINVAL);
+        }
+        fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+        fsize->discrete.width  = h.width;
+        fsize->discrete.height = h.height;
+        return 0;
+    }
+
+    case VIDIOC_ENUM_FRAMEINTERVALS: {
+        struct v4l2_frmivalenum* fival = (struct v4l2_frmivalenum*)arg;
+        if (fival->index != 0 || fival->pixel_format != h.fourcc ||
+            fival->width != h.width || fival->height != h.height) {
+            return fail(EINVAL);
+        }
+        fival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+        fival->discrete.numerator   = mFpsNumerator;
+        fival->discrete.denominator = mFpsDenominator;
+        return 0;
+    }
+
+    case VIDIOC_TRY_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_G_FMT: {
+        // Whatever is asked for, there is only the recorded format
+        struct v4l2_format* fmt = (struct v4l2_format*)arg;
+        if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+            return fail(EINVAL);
+        }
+        if (request == VIDIOC_S_FMT && !mBuffers.empty()) {
+            return fail(EBUSY);
+        }
+        memset(&fmt->fmt.pix, 0, sizeof(fmt->fmt.pix));
+        fmt->fmt.pix.width        = h.width;
+        fmt->fmt.pix.height       = h.height;
+        fmt->fmt.pix.pixelformat  = h.fourcc;
+        fmt->fmt.pix.field        = V4L2_FIELD_NONE;
+        fmt->fmt.pix.bytesperline = h.bytesperline;
+        fmt->fmt.pix.sizeimage    = h.sizeimage;
+        return 0;
+    }
+
+    case VIDIOC_S_PARM:
+    case VIDIOC_G_PARM: {
+        struct v4l2_streamparm* parm = (struct v4l2_streamparm*)arg;
+        if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+            return fail(EINVAL);
+        }
+        memset(&parm->parm.capture, 0, sizeof(parm->parm.capture));
+        parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+        parm->parm.capture.timeperframe.numerator   = mFpsNumerator;
+        parm->parm.capture.timeperframe.denominator = mFpsDenominator;
+        return 0;
+    }
+
+    case VIDIOC_REQBUFS:
+        return requestBuffers((struct v4l2_requestbuffers*)arg);
+
+    case VIDIOC_QUERYBUF: {
+        struct v4l2_buffer* buf = (struct v4l2_buffer*)arg;
+        Mutex::Autolock lock(mLock);
+        if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->index >= mBuffers.size()) {
+            return fail(EINVAL);
+        }
+        size_t stride = (h.sizeimage + mPageSize - 1) & ~(mPageSize - 1);
+        buf->memory   = mMemory;
+        buf->length   = h.sizeimage;
+        buf->m.offset = buf->index * stride;
+        buf->flags    = (mMemory == V4L2_MEMORY_MMAP ? V4L2_BUF_FLAG_MAPPED : 0) |
+                        (mBuffers[buf->index].queued ? V4L2_BUF_FLAG_QUEUED : 0);
+        return 0;
+    }
+
+    case VIDIOC_QBUF:
+        return queueBuffer((struct v4l2_buffer*)arg);
+
+    case VIDIOC_DQBUF:
+        return dequeueBuffer((struct v4l2_buffer*)arg);
+
+    case VIDIOC_STREAMON: {
+        Mutex::Autolock lock(mLock);
+        if (*(int*)arg != V4L2_BUF_TYPE_VIDEO_CAPTURE || mBuffers.empty()) {
+            return fail(EINVAL);
+        }
+        if (!mStreaming) {
+            mStreaming = true;
+            mNext      = 0;
+            mSequence  = 0;
+            mPassStart = systemTime(SYSTEM_TIME_MONOTONIC);
+            armLocked();
+        }
+        return 0;
+    }
+
+    case VIDIOC_STREAMOFF: {
+        Mutex::Autolock lock(mLock);
+        if (*(int*)arg != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+            return fail(EINVAL);
+        }
+        // As with a driver, all the buffers are dequeued
+        mStreaming = false;
+        for (auto& b : mBuffers) {
+            b.queued = false;
+        }
+        mQueue.clear();
+        armLocked();
+        return 0;
+    }
+
+    default:
+        return fail(ENOTTY);
+    }
+}
+
+
+
+void* FrameReplay::mmap(size_t length, off_t offset)
+{
+    Mutex::Autolock lock(mLock);
+    size_t stride = (header().sizeimage + mPageSize - 1) & ~(mPageSize - 1);
+    size_t index = offset / stride;
+
+    if (mMemory != V4L2_MEMORY_MMAP || offset % stride != 0 || index >= mBuffers.size() ||
+        length > header().sizeimage) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    return mBuffers[index].mem;
+}
+
+
+
+int FrameReplay::requestBuffers(struct v4l2_requestbuffers* rb)
+{
+    Mutex::Autolock lock(mLock);
+
+    if (rb->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+        (rb->memory != V4L2_MEMORY_MMAP && rb->memory != V4L2_MEMORY_USERPTR)) {
+        return fail(EINVAL);
+    }
+    if (mStreaming) {
+        return fail(EBUSY);
+    }
+
+    freeBuffers();
+    mMemory = rb->memory;
+
+    uint32_t count = rb->count < MAX_REPLAY_BUFFERS ? rb->count : MAX_REPLAY_BUFFERS;
+    mBuffers.resize(count);
+
+    for (auto& b : mBuffers) {
+        b.mem    = NULL;
+        b.user   = NULL;
+        b.length = 0;
+        b.queued = false;
+
+        if (mMemory == V4L2_MEMORY_MMAP) {
+            b.mem = (uint8_t*)calloc(1, header().sizeimage);
+            if (b.mem == NULL) {
+                freeBuffers();
+                return fail(ENOMEM);
+            }
+            b.length = header().sizeimage;
+        }
+    }
+
+    rb->count = count;
+    return 0;
+}
+
+
+
+int FrameReplay::queueBuffer(struct v4l2_buffer* buf)
+{
+    Mutex::Autolock lock(mLock);
+
+    if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->index >= mBuffers.size() ||
+        buf->memory != (uint32_t)mMemory || mBuffers[buf->index].queued) {
+        return fail(EINVAL);
+    }
+
+    Buffer& b = mBuffers[buf->index];
+    if (mMemory == V4L2_MEMORY_USERPTR) {
+        if (buf->m.userptr == 0 || buf->length < header().sizeimage) {
+            return fail(EINVAL);
+        }
+        b.user   = (void*)buf->m.userptr;
+        b.length = buf->length;
+    }
+
+    b.queued = true;
+    mQueue.push_back(buf->index);
+    buf->flags |= V4L2_BUF_FLAG_QUEUED;
+
+    // The first buffer after none may make a frame due
+    if (mQueue.size() == 1) {
+        armLocked();
+    }
+    return 0;
+}
+
+
+
+int FrameReplay::dequeueBuffer(struct v4l2_buffer* buf)
+{
+    Mutex::Autolock lock(mLock);
+
+    if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || !mStreaming) {
+        return fail(EINVAL);
+    }
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t captured = now;
+
+    if (mQueue.empty() || (mRealtime && dueLocked(mNext) > now)) {
+        return fail(EAGAIN);
+    }
+
+    if (mRealtime) {
+        // The frames the camera would have had no buffer for are lost
+        while (nextDueLocked() <= now) {
+            advanceLocked();
+        }
+        captured = dueLocked(mNext);
+    }
+
+    int index = mQueue.front();
+    mQueue.pop_front();
+
+    Buffer& b = mBuffers[index];
+    const FrameFileRecord& r = mFile.record(mNext);
+    memcpy(b.mem != NULL ? b.mem : b.user, mFile.data(mNext), r.bytesused);
+    b.queued = false;
+
+    memset(&buf->timestamp, 0, sizeof(buf->timestamp));
+    buf->index     = index;
+    buf->memory    = mMemory;
+    buf->bytesused = r.bytesused;
+    buf->field     = V4L2_FIELD_NONE;
+    buf->sequence  = mSequence;
+    buf->flags     = (r.flags & V4L2_BUF_FLAG_ERROR) | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+                     (mMemory == V4L2_MEMORY_MMAP ? V4L2_BUF_FLAG_MAPPED : 0);
+    buf->timestamp.tv_sec  = captured / 1000000000LL;
+    buf->timestamp.tv_usec = (captured % 1000000000LL) / 1000;
+    buf->length    = b.length;
+    if (mMemory == V4L2_MEMORY_USERPTR) {
+        buf->m.userptr = (unsigned long)b.user;
+    }
+
+    advanceLocked();
+    armLocked();
+    return 0;
+}
+
+
+
+void FrameReplay::freeBuffers()
+{
+    for (auto& b : mBuffers) {
+        free(b.mem);
+    }
+    mBuffers.clear();
+    mQueue.clear();
+}
+
+
+
+/*  When the record index of this pass is due */
+nsecs_t FrameReplay::dueLocked(size_t index) const
+{
+    nsecs_t offset = mFile.record(index).timestamp - mFile.record(0).timestamp;
+    return mPassStart + (offset > 0 ? offset : 0);
+}
+
+
+
+/*  When the record after mNext is due, which may be the first of the next pass */
+nsecs_t FrameReplay::nextDueLocked() const
+{
+    return mNext + 1 < mFile.count() ? dueLocked(mNext + 1) : mPassStart + mPassLength;
+}
+
+
+
+void FrameReplay::advanceLocked()
+{
+    mSequence++;
+    if (++mNext == mFile.count()) {
+        mNext = 0;
+        mPassStart += mPassLength;
+    }
+}
+
+
+
+/*  The timer expires when the next frame can be dequeued, which is never
+    while there is no buffer to put it in. Setting it clears an
+    expiration that nobody has seen yet.
+*/
+void FrameReplay::armLocked()
+{
+    struct itimerspec t;
+    memset(&t, 0, sizeof(t));
+
+    if (mStreaming && !mQueue.empty()) {
+        nsecs_t due = mRealtime ? dueLocked(mNext) : 1;
+        if (due <= 0) {
+            due = 1;
+        }
+        t.it_value.tv_sec  = due / 1000000000LL;
+        t.it_value.tv_nsec = due % 1000000000LL;
+    }
+
+    if (timerfd_settime(mTimer, TFD_TIMER_ABSTIME, &t, NULL) < 0) {
+        ALOGE("armLocked: timerfd_settime failed: %s", strerror(errno));
+    }
+}
+
+//======================================================================
+}; // namespace android
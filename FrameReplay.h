@@ -0,0 +1,106 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _FRAME_REPLAY_H
+#define _FRAME_REPLAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <utils/Errors.h>
+#include <utils/Timers.h>
+#include <utils/threads.h>
+
+#include "uvc_compat.h"
+#include "FrameFile.h"
+
+namespace android {
+//======================================================================
+
+/*  A V4L2 capture device that streams the frames of a capture file, so
+    that V4L2Camera and all that is above it run as they do with the
+    camera that recorded it. It has the ioctls V4L2Camera uses, on a
+    single-planar device with the one mode of the recording, and fails
+    the others with ENOTTY as a driver that lacks them would.
+
+    The buffers are memory we allocate, or those of the caller with
+    V4L2_MEMORY_USERPTR, and each frame is copied into one when it is
+    dequeued, as a camera writes it. fd() is readable when a frame can be
+    dequeued, so it is polled as the device node is.
+
+    In realtime mode the frames come at the times they were captured,
+    and the ones nobody took in time are dropped, with a gap in the
+    sequence as a driver would have. Else they come as fast as buffers
+    are queued. The file is played in a loop.
+*/
+class FrameReplay
+{
+public:
+    FrameReplay();
+    ~FrameReplay();
+
+    status_t open(const std::string& path, bool realtime);
+
+    const FrameFileHeader& header() const { return mFile.header(); }
+
+    /*  To poll for POLLIN */
+    int      fd() const { return mTimer; }
+
+    /*  As ioctl(2) on the device */
+    int      ioctl(unsigned long request, void* arg);
+
+    /*  As mmap(2) of a buffer, which stays mapped until VIDIOC_REQBUFS
+        frees the buffers
+    */
+    void*    mmap(size_t length, off_t offset);
+
+private:
+    struct Buffer {
+        uint8_t*    mem;                    // ours, with V4L2_MEMORY_MMAP
+        void*       user;                   // the caller's, with V4L2_MEMORY_USERPTR
+        size_t      length;
+        bool        queued;
+    };
+
+    int      requestBuffers(struct v4l2_requestbuffers* rb);
+    int      queueBuffer(struct v4l2_buffer* buf);
+    int      dequeueBuffer(struct v4l2_buffer* buf);
+    void     freeBuffers();
+
+    nsecs_t  dueLocked(size_t index) const;
+    nsecs_t  nextDueLocked() const;
+    void     advanceLocked();
+    void     armLocked();
+
+    Mutex               mLock;
+    FrameFileReader     mFile;
+    std::string         mPath;
+    bool                mRealtime;
+    int                 mTimer;             // timerfd, expired when a frame is due
+    size_t              mPageSize;
+    uint32_t            mFpsNumerator;      // of the header, or 1/30 if it has none
+    uint32_t            mFpsDenominator;
+
+    int                 mMemory;            // V4L2_MEMORY_* of the buffers
+    std::vector<Buffer> mBuffers;
+    std::deque<int>     mQueue;             // the queued buffers, in order
+    bool                mStreaming;
+
+    size_t              mNext;              // the record to give next
+    uint32_t            mSequence;          // of the next frame
+    nsecs_t             mPassStart;         // when the first record of this pass is due
+    nsecs_t             mPassLength;        // of the whole file, with one frame time after the last
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "FrameRing"
+
+#include <stdlib.h>
+#include <utils/Log.h>
+
+#include "FrameRing.h"
+
+namespace android {
+//======================================================================
+
+FrameRing::FrameRing()
+  : mFrames(NULL),
+    mCount(0),
+    mSize(0),
+    mLatest(0),
+    mDropped(0),
+    mSeq(0),
+    mNext(0),
+    mWakeups(0)
+{
+}
+
+
+
+FrameRing::~FrameRing()
+{
+    clear();
+}
+
+
+
+bool FrameRing::init(int count, size_t size)
+{
+    clear();
+
+    if (count < 2 || count >= (1 << kIndexBits)) {
+        ALOGE("init: cannot have %d frames", count);
+        return false;
+    }
+
+    mFrames = new Frame[count];
+    mCount  = count;
+    mSize   = size;
+
+    for (int i = 0; i < count; i++) {
+        mFrames[i].data = (uint8_t*)malloc(size);
+        mFrames[i].timestamp = 0;
+        mFrames[i].seq = 0;
+        mFrames[i].flags = 0;
+        mFrames[i].users = 0;
+
+        if (mFrames[i].data == NULL) {
+            ALOGE("init: couldn't allocate %d frames of %zu bytes", count, size);
+            clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+void FrameRing::clear()
+{
+    if (mFrames != NULL) {
+        for (int i = 0; i < mCount; i++) {
+            free(mFrames[i].data);
+        }
+        delete[] mFrames;
+    }
+
+    mFrames  = NULL;
+    mCount   = 0;
+    mSize    = 0;
+    mLatest  = 0;
+    mDropped = 0;
+    mSeq     = 0;
+    mNext    = 0;
+}
+
+
+
+FrameRing::Frame* FrameRing::beginWrite()
+{
+    // Never write over the newest frame, a consumer may be about to take it
+    uint64_t latest = mLatest.load(std::memory_order_acquire);
+    int newest = (latest != 0) ? (int)(latest & ((1 << kIndexBits) - 1)) : -1;
+
+    for (int i = 0; i < mCount; i++) {
+        int index = (mNext + i) % mCount;
+        int users = 0;
+
+        if (index != newest &&
+            mFrames[index].users.compare_exchange_strong(users, -1, std::memory_order_acquire)) {
+            mNext = (index + 1) % mCount;
+            return &mFrames[index];
+        }
+    }
+
+    mDropped++;
+    return NULL;
+}
+
+
+
+void FrameRing::endWrite(Frame* frame, nsecs_t timestamp)
+{
+    frame->timestamp = timestamp;
+    frame->seq = ++mSeq;
+    frame->users.store(0, std::memory_order_release);
+
+    mLatest.store((frame->seq << kIndexBits) | (frame - mFrames), std::memory_order_release);
+
+    Mutex::Autolock lock(mLock);
+    mCond.broadcast();
+}
+
+
+
+void FrameRing::cancelWrite(Frame* frame)
+{
+    // What was in it has been partly written over
+    frame->seq = 0;
+    frame->users.store(0, std::memory_order_release);
+}
+
+
+
+FrameRing::Frame* FrameRing::tryAcquire(Reader& reader)
+{
+    for (;;) {
+        uint64_t latest = mLatest.load(std::memory_order_acquire);
+        uint64_t seq = latest >> kIndexBits;
+
+        if (seq <= reader.seq) {
+            return NULL;
+        }
+
+        Frame* frame = &mFrames[latest & ((1 << kIndexBits) - 1)];
+
+        // Hold it, unless the producer is writing it
+        int users = frame->users.load(std::memory_order_relaxed);
+        if (users < 0 ||
+            !frame->users.compare_exchange_weak(users, users + 1, std::memory_order_acquire)) {
+            continue;
+        }
+
+        // It may have been written again before we could hold it
+        if (frame->seq != seq) {
+            release(frame);
+            continue;
+        }
+
+        if (reader.seq != 0) {
+            reader.dropped += seq - reader.seq - 1;
+        }
+        reader.seq = seq;
+        reader.frames++;
+
+        return frame;
+    }
+}
+
+
+
+FrameRing::Frame* FrameRing::acquire(Reader& reader, nsecs_t timeout)
+{
+    Frame* frame = tryAcquire(reader);
+
+    if (frame == NULL) {
+        Mutex::Autolock lock(mLock);
+        int wakeups = mWakeups;
+
+        while ((mLatest.load(std::memory_order_acquire) >> kIndexBits) <= reader.seq &&
+               wakeups == mWakeups) {
+            if (mCond.waitRelative(mLock, timeout) != NO_ERROR) {
+                break;      // timed out
+            }
+        }
+    }
+
+    return (frame != NULL) ? frame : tryAcquire(reader);
+}
+
+
+
+FrameRing::Frame* FrameRing::acquireClosest(nsecs_t when)
+{
+    Frame* best = NULL;
+    nsecs_t bestDistance = 0;
+
+    for (int i = 0; i < mCount; i++) {
+        Frame* frame = &mFrames[i];
+
+        // Hold it, unless the producer is writing it
+        int users = frame->users.load(std::memory_order_relaxed);
+        do {
+            if (users < 0) {
+                break;
+            }
+        } while (!frame->users.compare_exchange_weak(users, users + 1, std::memory_order_acquire));
+
+        if (users < 0) {
+            continue;
+        }
+
+        // Now it can't be written until it is released
+        nsecs_t distance = frame->timestamp - when;
+        if (distance < 0) {
+            distance = -distance;
+        }
+
+        if (frame->seq != 0 && (best == NULL || distance < bestDistance)) {
+            if (best != NULL) {
+                release(best);
+            }
+            best = frame;
+            bestDistance = distance;
+        } else {
+            release(frame);
+        }
+    }
+
+    return best;
+}
+
+
+
+void FrameRing::release(Frame* frame)
+{
+    frame->users.fetch_sub(1, std::memory_order_release);
+}
+
+
+
+void FrameRing::wakeAll()
+{
+    Mutex::Autolock lock(mLock);
+    mWakeups++;
+    mCond.broadcast();
+}
+
+//======================================================================
+}; // namespace android
@@ -0,0 +1,107 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _FRAME_RING_H
+#define _FRAME_RING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <utils/threads.h>
+#include <utils/Timers.h>               // for nsecs_t
+
+namespace android {
+//======================================================================
+
+/*  A ring of frames written by one producer and read by several consumers.
+
+    The producer never waits for the consumers. It writes each frame into
+    a slot that no consumer is holding. A consumer always takes the newest
+    frame, and the frames that were published while it was busy are counted
+    as dropped by that consumer. So a slow consumer only loses frames itself.
+
+    No lock is taken to pass a frame. The mutex is only used to sleep on
+    while waiting for the next frame.
+*/
+class FrameRing
+{
+public:
+    struct Frame {
+        uint8_t*            data;
+        nsecs_t             timestamp;
+        uint64_t            seq;        // counts from 1
+        uint32_t            flags;      // what the producer filled in, for the consumers to check
+        std::atomic<int>    users;      // consumers holding it, -1 while being written
+    };
+
+    /*  Where one consumer is in the ring */
+    struct Reader {
+        uint64_t            seq;        // the last frame it took
+        uint64_t            frames;     // frames it took
+        uint64_t            dropped;    // frames it never saw
+
+        Reader() : seq(0), frames(0), dropped(0) {}
+    };
+
+    FrameRing();
+    ~FrameRing();
+
+    /*  Neither of these are thread safe. No frame may be held. */
+    bool init(int count, size_t size);
+    void clear();
+
+    size_t frameSize() const { return mSize; }
+
+    /*  Producer side. beginWrite() returns NULL, and counts a drop,
+        if there is no free frame.
+    */
+    Frame*   beginWrite();
+    void     endWrite(Frame* frame, nsecs_t timestamp);
+    void     cancelWrite(Frame* frame);
+    uint64_t dropped() const { return mDropped; }
+
+    /*  Consumer side. Waits up to timeout for a frame newer than the last
+        one the reader took. Returns NULL if there was none, or if wakeAll()
+        was called. The frame is held until release().
+    */
+    Frame*  acquire(Reader& reader, nsecs_t timeout);
+    void    release(Frame* frame);
+
+    /*  Holds the frame whose timestamp is closest to when, out of all the
+        frames in the ring that are not being written. Doesn't wait and
+        doesn't move any reader. Returns NULL if no frame has been written.
+    */
+    Frame*  acquireClosest(nsecs_t when);
+
+    /*  Makes all the waiting consumers return */
+    void    wakeAll();
+
+private:
+    Frame*  tryAcquire(Reader& reader);
+
+    // The newest frame as (seq << 8) | index, 0 for none
+    static const int kIndexBits = 8;
+
+    Frame*                  mFrames;
+    int                     mCount;
+    size_t                  mSize;
+    std::atomic<uint64_t>   mLatest;
+    std::atomic<uint64_t>   mDropped;
+
+    // only used by the producer
+    uint64_t                mSeq;
+    int                     mNext;
+
+    Mutex                   mLock;
+    Condition               mCond;
+    int                     mWakeups;   // protected by mLock
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
@@ -0,0 +1,706 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "GlPreview"
+#include <utils/Log.h>
+
+extern "C" {
+#include <string.h>
+#include <linux/videodev2.h>
+#include <hardware/gralloc.h>
+#include "v4l2_formats.h"
+};
+
+#include "GlPreview.h"
+#include "FormatTraits.h"
+
+namespace android {
+//======================================================================
+
+// The DRM fourccs are the V4L2 ones for the formats in a single buffer
+#define DRM_FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+/*  How each capture format the GPU may read is laid out as a DRM format.
+    The chroma planes are stride >> cshift bytes wide and height >> vsub
+    lines high.
+*/
+struct DrmLayout {
+    uint32_t    fourcc;         // V4L2_PIX_FMT_*
+    uint32_t    drm;            // DRM_FORMAT_*
+    int         planes;
+    int         cshift;
+    int         vsub;
+};
+
+static const DrmLayout kDrmLayouts[] = {
+    {V4L2_PIX_FMT_YUYV,     DRM_FOURCC('Y', 'U', 'Y', 'V'), 1, 0, 0},
+    {V4L2_PIX_FMT_YVYU,     DRM_FOURCC('Y', 'V', 'Y', 'U'), 1, 0, 0},
+    {V4L2_PIX_FMT_UYVY,     DRM_FOURCC('U', 'Y', 'V', 'Y'), 1, 0, 0},
+    {V4L2_PIX_FMT_NV12,     DRM_FOURCC('N', 'V', '1', '2'), 2, 0, 1},
+    {V4L2_PIX_FMT_NV12M,    DRM_FOURCC('N', 'V', '1', '2'), 2, 0, 1},
+    {V4L2_PIX_FMT_NV21,     DRM_FOURCC('N', 'V', '2', '1'), 2, 0, 1},
+    {V4L2_PIX_FMT_NV21M,    DRM_FOURCC('N', 'V', '2', '1'), 2, 0, 1},
+    {V4L2_PIX_FMT_NV16,     DRM_FOURCC('N', 'V', '1', '6'), 2, 0, 0},
+    {V4L2_PIX_FMT_NV61,     DRM_FOURCC('N', 'V', '6', '1'), 2, 0, 0},
+    {V4L2_PIX_FMT_YUV420,   DRM_FOURCC('Y', 'U', '1', '2'), 3, 1, 1},
+    {V4L2_PIX_FMT_YUV420M,  DRM_FOURCC('Y', 'U', '1', '2'), 3, 1, 1},
+    {V4L2_PIX_FMT_YVU420,   DRM_FOURCC('Y', 'V', '1', '2'), 3, 1, 1},
+    {V4L2_PIX_FMT_YVU420M,  DRM_FOURCC('Y', 'V', '1', '2'), 3, 1, 1},
+};
+
+static const DrmLayout* findDrmLayout(uint32_t fourcc)
+{
+    for (size_t i = 0; i < sizeof(kDrmLayouts) / sizeof(kDrmLayouts[0]); i++) {
+        if (kDrmLayouts[i].fourcc == fourcc) {
+            return &kDrmLayouts[i];
+        }
+    }
+    return NULL;
+}
+
+
+// The texture coordinates are those of the crop, already turned
+static const char kVertexShader[] =
+    "attribute vec2 aPosition;\n"
+    "attribute vec2 aTexCoord;\n"
+    "varying vec2 vTexCoord;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(aPosition, 0.0, 1.0);\n"
+    "    vTexCoord = aTexCoord;\n"
+    "}\n";
+
+/*  A YUYV frame is uploaded twice from the same memory: as a luminance
+    alpha texture of the full width, whose luminance is the luma, and as
+    an RGBA texture of half the width, whose green and alpha are the U and
+    V of each pair of pixels. So both are filtered right by the GPU, and
+    there is no per pixel arithmetic on the coordinates, which mediump
+    can't do for frames as wide as 1920.
+*/
+static const char kYuyvShader[] =
+    "precision mediump float;\n"
+    "uniform sampler2D uLuma;\n"
+    "uniform sampler2D uChroma;\n"
+    "uniform mat3 uMatrix;\n"
+    "uniform vec3 uOffset;\n"
+    "varying vec2 vTexCoord;\n"
+    "void main() {\n"
+    "    vec3 yuv = vec3(texture2D(uLuma, vTexCoord).r, texture2D(uChroma, vTexCoord).ga);\n"
+    "    gl_FragColor = vec4(clamp(uMatrix * (yuv - uOffset), 0.0, 1.0), 1.0);\n"
+    "}\n";
+
+// The dma-bufs are converted by the sampler, with the colour space of the import
+static const char kExternalShader[] =
+    "#extension GL_OES_EGL_image_external : require\n"
+    "precision mediump float;\n"
+    "uniform samplerExternalOES uLuma;\n"
+    "varying vec2 vTexCoord;\n"
+    "void main() {\n"
+    "    gl_FragColor = texture2D(uLuma, vTexCoord);\n"
+    "}\n";
+
+
+static bool hasExtension(const char* extensions, const char* name)
+{
+    if (extensions == NULL) {
+        return false;
+    }
+
+    size_t len = strlen(name);
+    for (const char* p = strstr(extensions, name); p != NULL; p = strstr(p + len, name)) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static GLuint compileShader(GLenum type, const char* source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint ok = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[256];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        ALOGE("compileShader: %s", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+
+/*  The YUV to RGB of a matrix and range, as the column major matrix the
+    shader multiplies yuv - offset with
+*/
+static void yuvToRgb(bool bt709, bool limitedRange, GLfloat matrix[9], GLfloat offset[3])
+{
+    float kr = bt709 ? 0.2126f : 0.299f;
+    float kb = bt709 ? 0.0722f : 0.114f;
+    float kg = 1.0f - kr - kb;
+    float ys = limitedRange ? 255.0f / 219.0f : 1.0f;
+    float cs = limitedRange ? 255.0f / 224.0f : 1.0f;
+
+    // Y
+    matrix[0] = ys;
+    matrix[1] = ys;
+    matrix[2] = ys;
+    // U
+    matrix[3] = 0.0f;
+    matrix[4] = -2.0f * (1.0f - kb) * kb / kg * cs;
+    matrix[5] = 2.0f * (1.0f - kb) * cs;
+    // V
+    matrix[6] = 2.0f * (1.0f - kr) * cs;
+    matrix[7] = -2.0f * (1.0f - kr) * kr / kg * cs;
+    matrix[8] = 0.0f;
+
+    offset[0] = limitedRange ? 16.0f / 255.0f : 0.0f;
+    offset[1] = 128.0f / 255.0f;
+    offset[2] = 128.0f / 255.0f;
+}
+
+
+
+GlPreview::GlPreview()
+  : mFailed(false),
+    mHasDmaBuf(false),
+    mDisplay(EGL_NO_DISPLAY),
+    mContext(EGL_NO_CONTEXT),
+    mSurface(EGL_NO_SURFACE),
+    mCreateImage(NULL),
+    mDestroyImage(NULL),
+    mImageTargetTexture(NULL),
+    mLumaTexture(0),
+    mChromaTexture(0),
+    mUploadWidth(0),
+    mUploadHeight(0)
+{
+    memset(mPrograms, 0, sizeof(mPrograms));
+}
+
+
+
+GlPreview::~GlPreview()
+{
+    Mutex::Autolock lock(mLock);
+    releaseLocked();
+}
+
+
+
+status_t GlPreview::draw(buffer_handle_t buffer, int stride, int width, int height, int format,
+                         const Source& src, const Params& params)
+{
+    Mutex::Autolock lock(mLock);
+
+    if (!makeCurrentLocked()) {
+        return INVALID_OPERATION;
+    }
+
+    Target* target = targetLocked(buffer, stride, width, height, format);
+    if (target == NULL) {
+        doneCurrentLocked();
+        return INVALID_OPERATION;
+    }
+
+    const Program* p;
+    if (src.yuyv != NULL) {
+        p = &mPrograms[PROG_YUYV];
+        uploadLocked(src);
+    } else {
+        p = &mPrograms[PROG_EXTERNAL];
+        GLuint texture = importLocked(src, params);
+        if (texture == 0) {
+            doneCurrentLocked();
+            return BAD_VALUE;
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+    }
+
+    // The centered part of the frame that has the aspect ratio of the
+    // window once turned, so nothing is stretched
+    int turns = (params.rotation / 90) & 3;
+    float aw = (turns & 1) ? height : width;
+    float ah = (turns & 1) ? width : height;
+    float cw = src.width, ch = src.height;
+    if (cw * ah > ch * aw) {
+        cw = ch * aw / ah;
+    } else {
+        ch = cw * ah / aw;
+    }
+    float u0 = (1.0f - cw / src.width) * 0.5f, u1 = 1.0f - u0;
+    float v0 = (1.0f - ch / src.height) * 0.5f, v1 = 1.0f - v0;
+
+    /*  The first lines of the textures and of the window buffer are the
+        top ones. The corners of each go clockwise from the top left, and
+        turning the frame clockwise shows the corner before, in the corner
+        of the window.
+    */
+    static const GLfloat windowCorners[4][2] = { {-1, -1}, {1, -1}, {1, 1}, {-1, 1} };
+    const GLfloat frameCorners[4][2] = { {u0, v0}, {u1, v0}, {u1, v1}, {u0, v1} };
+    static const int strip[4] = { 0, 1, 3, 2 };
+
+    GLfloat position[8], texCoord[8];
+    for (int i = 0; i < 4; i++) {
+        int corner = strip[i];
+        position[i * 2]     = windowCorners[corner][0];
+        position[i * 2 + 1] = windowCorners[corner][1];
+        texCoord[i * 2]     = frameCorners[(corner - turns + 4) & 3][0];
+        texCoord[i * 2 + 1] = frameCorners[(corner - turns + 4) & 3][1];
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glViewport(0, 0, width, height);
+    glUseProgram(p->program);
+
+    if (src.yuyv != NULL) {
+        GLfloat matrix[9], offset[3];
+        yuvToRgb(params.bt709, params.limitedRange, matrix, offset);
+        glUniformMatrix3fv(p->matrix, 1, GL_FALSE, matrix);
+        glUniform3fv(p->offset, 1, offset);
+        glUniform1i(p->chroma, 1);
+    }
+    glUniform1i(p->luma, 0);
+
+    glVertexAttribPointer(p->position, 2, GL_FLOAT, GL_FALSE, 0, position);
+    glVertexAttribPointer(p->texCoord, 2, GL_FLOAT, GL_FALSE, 0, texCoord);
+    glEnableVertexAttribArray(p->position);
+    glEnableVertexAttribArray(p->texCoord);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    // The window has no fence to wait on, so the frame must be done now
+    glFinish();
+
+    GLenum error = glGetError();
+    doneCurrentLocked();
+
+    if (error != GL_NO_ERROR) {
+        ALOGE("draw: GL error 0x%x", error);
+        return INVALID_OPERATION;
+    }
+    return NO_ERROR;
+}
+
+
+
+void GlPreview::forgetBuffers()
+{
+    Mutex::Autolock lock(mLock);
+
+    if (!mTargets.empty() && makeCurrentLocked()) {
+        forgetBuffersLocked();
+        doneCurrentLocked();
+    }
+}
+
+
+
+void GlPreview::forgetFrames()
+{
+    Mutex::Autolock lock(mLock);
+
+    if (!mFrames.empty() && makeCurrentLocked()) {
+        forgetFramesLocked();
+        doneCurrentLocked();
+    }
+}
+
+
+
+void GlPreview::release()
+{
+    Mutex::Autolock lock(mLock);
+    releaseLocked();
+}
+
+
+
+bool GlPreview::initLocked()
+{
+    mDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (mDisplay == EGL_NO_DISPLAY || !eglInitialize(mDisplay, NULL, NULL)) {
+        ALOGE("initLocked: no EGL display");
+        return false;
+    }
+
+    const char* eglExtensions = eglQueryString(mDisplay, EGL_EXTENSIONS);
+    if (!hasExtension(eglExtensions, "EGL_KHR_image_base") ||
+        !hasExtension(eglExtensions, "EGL_ANDROID_image_native_buffer")) {
+        ALOGE("initLocked: the EGL can't make images of the window buffers");
+        return false;
+    }
+
+    static const EGLint configAttribs[] = {
+        EGL_RENDERABLE_TYPE,    EGL_OPENGL_ES2_BIT,
+        EGL_SURFACE_TYPE,       EGL_PBUFFER_BIT,
+        EGL_RED_SIZE,           8,
+        EGL_GREEN_SIZE,         8,
+        EGL_BLUE_SIZE,          8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    if (!eglChooseConfig(mDisplay, configAttribs, &config, 1, &configs) || configs == 0) {
+        ALOGE("initLocked: no GLES 2 config");
+        return false;
+    }
+
+    static const EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+    mContext = eglCreateContext(mDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+
+    static const EGLint surfaceAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    mSurface = eglCreatePbufferSurface(mDisplay, config, surfaceAttribs);
+
+    if (mContext == EGL_NO_CONTEXT || mSurface == EGL_NO_SURFACE ||
+        !eglMakeCurrent(mDisplay, mSurface, mSurface, mContext)) {
+        ALOGE("initLocked: unable to make a GLES 2 context (0x%x)", eglGetError());
+        return false;
+    }
+
+    mCreateImage = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+    mDestroyImage = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+    mImageTargetTexture = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+    const char* glExtensions = (const char*)glGetString(GL_EXTENSIONS);
+    if (mCreateImage == NULL || mDestroyImage == NULL || mImageTargetTexture == NULL ||
+        !hasExtension(glExtensions, "GL_OES_EGL_image")) {
+        ALOGE("initLocked: GL_OES_EGL_image is missing");
+        return false;
+    }
+
+    if (!buildProgram(mPrograms[PROG_YUYV], kYuyvShader, true)) {
+        return false;
+    }
+
+    // Without it the frames are always uploaded
+    mHasDmaBuf = hasExtension(eglExtensions, "EGL_EXT_image_dma_buf_import") &&
+                 hasExtension(glExtensions, "GL_OES_EGL_image_external") &&
+                 buildProgram(mPrograms[PROG_EXTERNAL], kExternalShader, false);
+
+    ALOGI("initLocked: %s, %s frames from dma-bufs", (const char*)glGetString(GL_RENDERER),
+          mHasDmaBuf ? "reading" : "not reading");
+    return true;
+}
+
+
+
+bool GlPreview::makeCurrentLocked()
+{
+    if (mFailed) {
+        return false;
+    }
+
+    if (mContext == EGL_NO_CONTEXT) {
+        if (!initLocked()) {
+            // Don't try again for each frame
+            releaseLocked();
+            mFailed = true;
+            return false;
+        }
+        return true;
+    }
+
+    if (!eglMakeCurrent(mDisplay, mSurface, mSurface, mContext)) {
+        ALOGE("makeCurrentLocked: eglMakeCurrent failed (0x%x)", eglGetError());
+        return false;
+    }
+    return true;
+}
+
+
+
+void GlPreview::doneCurrentLocked()
+{
+    eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+
+
+bool GlPreview::buildProgram(Program& p, const char* fragment, bool yuyv)
+{
+    GLuint vs = compileShader(GL_VERTEX_SHADER, kVertexShader);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragment);
+
+    if (vs == 0 || fs == 0) {
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        return false;
+    }
+
+    p.program = glCreateProgram();
+    glAttachShader(p.program, vs);
+    glAttachShader(p.program, fs);
+    glLinkProgram(p.program);
+
+    // The program keeps them
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok = GL_FALSE;
+    glGetProgramiv(p.program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        ALOGE("buildProgram: unable to link");
+        glDeleteProgram(p.program);
+        p.program = 0;
+        return false;
+    }
+
+    p.position = glGetAttribLocation(p.program, "aPosition");
+    p.texCoord = glGetAttribLocation(p.program, "aTexCoord");
+    p.luma     = glGetUniformLocation(p.program, "uLuma");
+    if (yuyv) {
+        p.chroma = glGetUniformLocation(p.program, "uChroma");
+        p.matrix = glGetUniformLocation(p.program, "uMatrix");
+        p.offset = glGetUniformLocation(p.program, "uOffset");
+    }
+    return true;
+}
+
+
+
+GlPreview::Target* GlPreview::targetLocked(buffer_handle_t buffer, int stride, int width, int height, int format)
+{
+    auto it = mTargets.find(buffer);
+    if (it != mTargets.end()) {
+        return &it->second;
+    }
+
+    // Only the RGB formats can be rendered to
+    if (format != PIXEL_FORMAT_RGBA_8888 && format != PIXEL_FORMAT_RGBX_8888 &&
+        format != PIXEL_FORMAT_BGRA_8888 && format != PIXEL_FORMAT_RGB_565) {
+        ALOGE("targetLocked: can't render to format %d", format);
+        return NULL;
+    }
+
+    Target t;
+    t.buffer = new GraphicBuffer(width, height, format, GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE,
+                                 stride, (native_handle_t*)buffer, false);
+
+    static const EGLint imageAttribs[] = { EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE };
+    t.image = mCreateImage(mDisplay, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_ANDROID,
+                           (EGLClientBuffer)t.buffer->getNativeBuffer(), imageAttribs);
+    if (t.image == EGL_NO_IMAGE_KHR) {
+        ALOGE("targetLocked: unable to make an image of the window buffer (0x%x)", eglGetError());
+        return NULL;
+    }
+
+    glGenTextures(1, &t.texture);
+    glBindTexture(GL_TEXTURE_2D, t.texture);
+    mImageTargetTexture(GL_TEXTURE_2D, (GLeglImageOES)t.image);
+
+    glGenFramebuffers(1, &t.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, t.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.texture, 0);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        ALOGE("targetLocked: the window buffer can't be rendered to");
+        glDeleteFramebuffers(1, &t.fbo);
+        glDeleteTextures(1, &t.texture);
+        mDestroyImage(mDisplay, t.image);
+        return NULL;
+    }
+
+    return &(mTargets[buffer] = t);
+}
+
+
+
+GLuint GlPreview::importLocked(const Source& src, const Params& params)
+{
+    uint64_t key = ((uint64_t)(uint32_t)src.fd[0] << 32) | (uint32_t)src.offset[0];
+    auto it = mFrames.find(key);
+    if (it != mFrames.end()) {
+        return it->second.texture;
+    }
+
+    const DrmLayout* layout = findDrmLayout(src.fourcc);
+    if (!mHasDmaBuf || layout == NULL || src.planeCount < 1) {
+        return 0;
+    }
+
+    // The planes of a frame in a single buffer follow each other
+    int fd[MAX_PLANES];
+    EGLint offset[MAX_PLANES], pitch[MAX_PLANES];
+    for (int p = 0; p < layout->planes; p++) {
+        if (p < src.planeCount) {
+            fd[p] = src.fd[p];
+            offset[p] = src.offset[p];
+            pitch[p] = src.stride[p];
+        } else {
+            int lines = (p == 1) ? src.height : src.height >> layout->vsub;
+            fd[p] = fd[p - 1];
+            offset[p] = offset[p - 1] + pitch[p - 1] * lines;
+            pitch[p] = src.stride[0] >> layout->cshift;
+        }
+    }
+
+    static const EGLint planeAttribs[MAX_PLANES][3] = {
+        { EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT },
+        { EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT },
+        { EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT },
+    };
+
+    EGLint attribs[32];
+    int n = 0;
+    attribs[n++] = EGL_WIDTH;                       attribs[n++] = src.width;
+    attribs[n++] = EGL_HEIGHT;                      attribs[n++] = src.height;
+    attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;        attribs[n++] = layout->drm;
+    for (int p = 0; p < layout->planes; p++) {
+        attribs[n++] = planeAttribs[p][0];          attribs[n++] = fd[p];
+        attribs[n++] = planeAttribs[p][1];          attribs[n++] = offset[p];
+        attribs[n++] = planeAttribs[p][2];          attribs[n++] = pitch[p];
+    }
+    attribs[n++] = EGL_YUV_COLOR_SPACE_HINT_EXT;    attribs[n++] = params.bt709 ? EGL_ITU_REC709_EXT : EGL_ITU_REC601_EXT;
+    attribs[n++] = EGL_SAMPLE_RANGE_HINT_EXT;       attribs[n++] = params.limitedRange ? EGL_YUV_NARROW_RANGE_EXT : EGL_YUV_FULL_RANGE_EXT;
+    attribs[n++] = EGL_NONE;
+
+    Frame f;
+    f.image = mCreateImage(mDisplay, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+    if (f.image == EGL_NO_IMAGE_KHR) {
+        ALOGW("importLocked: unable to import a '%c%c%c%c' frame (0x%x)",
+              src.fourcc & 0xFF, (src.fourcc >> 8) & 0xFF, (src.fourcc >> 16) & 0xFF, (src.fourcc >> 24) & 0xFF,
+              eglGetError());
+        return 0;
+    }
+
+    glGenTextures(1, &f.texture);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, f.texture);
+    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    mImageTargetTexture(GL_TEXTURE_EXTERNAL_OES, (GLeglImageOES)f.image);
+
+    mFrames[key] = f;
+    return f.texture;
+}
+
+
+
+GLuint GlPreview::uploadLocked(const Source& src)
+{
+    if (mLumaTexture == 0) {
+        GLuint textures[2];
+        glGenTextures(2, textures);
+        mLumaTexture = textures[0];
+        mChromaTexture = textures[1];
+
+        for (int i = 0; i < 2; i++) {
+            glBindTexture(GL_TEXTURE_2D, textures[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+    }
+
+    // GLES 2 has no row length, so padded lines go one at a time
+    bool packed = src.yuyvStride == src.width * 2;
+    bool resize = src.width != mUploadWidth || src.height != mUploadHeight;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, mChromaTexture);
+    if (resize) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, src.width / 2, src.height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                     packed ? src.yuyv : NULL);
+    }
+    if (!resize || !packed) {
+        for (int y = 0; y < src.height; y += packed ? src.height : 1) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, src.width / 2, packed ? src.height : 1,
+                            GL_RGBA, GL_UNSIGNED_BYTE, src.yuyv + y * src.yuyvStride);
+        }
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, mLumaTexture);
+    if (resize) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, src.width, src.height, 0, GL_LUMINANCE_ALPHA,
+                     GL_UNSIGNED_BYTE, packed ? src.yuyv : NULL);
+    }
+    if (!resize || !packed) {
+        for (int y = 0; y < src.height; y += packed ? src.height : 1) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, src.width, packed ? src.height : 1,
+                            GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, src.yuyv + y * src.yuyvStride);
+        }
+    }
+
+    mUploadWidth = src.width;
+    mUploadHeight = src.height;
+    return mLumaTexture;
+}
+
+
+
+void GlPreview::forgetBuffersLocked()
+{
+    for (auto& it : mTargets) {
+        glDeleteFramebuffers(1, &it.second.fbo);
+        glDeleteTextures(1, &it.second.texture);
+        mDestroyImage(mDisplay, it.second.image);
+    }
+    mTargets.clear();
+}
+
+
+
+void GlPreview::forgetFramesLocked()
+{
+    for (auto& it : mFrames) {
+        glDeleteTextures(1, &it.second.texture);
+        mDestroyImage(mDisplay, it.second.image);
+    }
+    mFrames.clear();
+}
+
+
+
+void GlPreview::releaseLocked()
+{
+    if (mContext != EGL_NO_CONTEXT && eglMakeCurrent(mDisplay, mSurface, mSurface, mContext)) {
+        forgetBuffersLocked();
+        forgetFramesLocked();
+
+        for (int i = 0; i < PROG_COUNT; i++) {
+            if (mPrograms[i].program != 0) {
+                glDeleteProgram(mPrograms[i].program);
+            }
+        }
+        if (mLumaTexture != 0) {
+            GLuint textures[2] = { mLumaTexture, mChromaTexture };
+            glDeleteTextures(2, textures);
+        }
+        doneCurrentLocked();
+    }
+
+    // The images and textures went with the context anyway
+    mTargets.clear();
+    mFrames.clear();
+    memset(mPrograms, 0, sizeof(mPrograms));
+    mLumaTexture = mChromaTexture = 0;
+    mUploadWidth = mUploadHeight = 0;
+    mHasDmaBuf = false;
+
+    // The display is the process's, others may use it, so it isn't terminated
+    if (mSurface != EGL_NO_SURFACE) {
+        eglDestroySurface(mDisplay, mSurface);
+        mSurface = EGL_NO_SURFACE;
+    }
+    if (mContext != EGL_NO_CONTEXT) {
+        eglDestroyContext(mDisplay, mContext);
+        mContext = EGL_NO_CONTEXT;
+    }
+}
+
+//======================================================================
+}; // namespace android
@@ -0,0 +1,163 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _GL_PREVIEW_H
+#define _GL_PREVIEW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <system/window.h>
+#include <ui/GraphicBuffer.h>
+#include <utils/Errors.h>
+#include <utils/threads.h>
+
+namespace android {
+//======================================================================
+
+/*  Draws the preview frames into the preview window buffers with the GPU,
+    instead of converting them on the CPU into buffers the CPU can write.
+    The colour conversion, the scaling of the centered part of the frame
+    that has the aspect ratio of the window and the rotation are all done
+    by one shader, into window buffers that only the GPU and the display
+    touch.
+
+    A frame is either a YUYV frame in memory, that is uploaded, or a
+    captured frame in dma-bufs, that the GPU reads where the camera wrote
+    it, if the EGL has EGL_EXT_image_dma_buf_import. The EGLImages of the
+    window buffers and of the dma-bufs are made once and kept, so they must
+    be forgotten when the window buffers or the camera buffers change.
+
+    It has its own EGL context, that is only current while it draws, so it
+    can be used from any thread. Its calls are serialised by its own lock.
+*/
+class GlPreview
+{
+public:
+    GlPreview();
+    ~GlPreview();
+
+    enum { MAX_PLANES = 3 };
+
+    /*  A frame to draw */
+    struct Source {
+        int             width;
+        int             height;
+
+        // A YUYV frame in memory...
+        const uint8_t*  yuyv;
+        int             yuyvStride;
+
+        // ...or, if yuyv is NULL, a V4L2_PIX_FMT_* frame in dma-bufs. The
+        // frames in a single buffer have only their first plane here.
+        uint32_t        fourcc;
+        int             planeCount;
+        int             fd[MAX_PLANES];
+        size_t          offset[MAX_PLANES];
+        int             stride[MAX_PLANES];
+    };
+
+    /*  How to draw it */
+    struct Params {
+        int             rotation;       // clockwise, 0, 90, 180 or 270
+        bool            bt709;          // else BT.601
+        bool            limitedRange;   // else full range
+    };
+
+    /*  Draws src into a window buffer of width x height pixels of an RGB
+        PIXEL_FORMAT_*. Returns
+            NO_ERROR          - the buffer has the frame, once the GPU is done
+            BAD_VALUE         - the GPU can't read this frame where it is,
+                                but it could draw the frame from memory
+            INVALID_OPERATION - the buffer can't be drawn into, or there is
+                                no usable GPU, so the CPU has to do it
+        The GPU is done with the buffer when this returns.
+    */
+    status_t draw(buffer_handle_t buffer, int stride, int width, int height, int format,
+                  const Source& src, const Params& params);
+
+    /*  Lets go of the EGLImages of the window buffers, for when they are
+        reallocated, and of the dma-bufs, for when the camera closes them.
+    */
+    void     forgetBuffers();
+    void     forgetFrames();
+
+    /*  Lets go of the context too. The next draw makes it again, unless
+        there turned out to be no usable GPU.
+    */
+    void     release();
+
+private:
+    // The program of each kind of frame
+    enum { PROG_YUYV, PROG_EXTERNAL, PROG_COUNT };
+
+    struct Program {
+        GLuint          program;
+        GLint           position;
+        GLint           texCoord;
+        GLint           luma;           // the samplers
+        GLint           chroma;
+        GLint           matrix;         // the YUV to RGB of the YUYV program
+        GLint           offset;
+    };
+
+    struct Target {
+        sp<GraphicBuffer> buffer;       // wraps the window buffer for EGL
+        EGLImageKHR     image;
+        GLuint          texture;
+        GLuint          fbo;
+    };
+
+    struct Frame {
+        EGLImageKHR     image;
+        GLuint          texture;
+    };
+
+    bool        initLocked();
+    bool        makeCurrentLocked();
+    void        doneCurrentLocked();
+    bool        buildProgram(Program& p, const char* fragment, bool yuyv);
+
+    Target*     targetLocked(buffer_handle_t buffer, int stride, int width, int height, int format);
+    GLuint      importLocked(const Source& src, const Params& params);
+    GLuint      uploadLocked(const Source& src);
+
+    void        forgetBuffersLocked();
+    void        forgetFramesLocked();
+    void        releaseLocked();
+
+    Mutex       mLock;
+    bool        mFailed;                // no usable GPU, don't try again
+    bool        mHasDmaBuf;             // EGL_EXT_image_dma_buf_import
+
+    EGLDisplay  mDisplay;
+    EGLContext  mContext;
+    EGLSurface  mSurface;               // a pbuffer, for the EGLs that need one
+
+    PFNEGLCREATEIMAGEKHRPROC            mCreateImage;
+    PFNEGLDESTROYIMAGEKHRPROC           mDestroyImage;
+    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC mImageTargetTexture;
+
+    Program     mPrograms[PROG_COUNT];
+    GLuint      mLumaTexture;           // the uploaded YUYV frames
+    GLuint      mChromaTexture;
+    int         mUploadWidth;
+    int         mUploadHeight;
+
+    std::map<buffer_handle_t, Target>   mTargets;
+    std::map<uint64_t, Frame>           mFrames;    // by fd and offset of the first plane
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
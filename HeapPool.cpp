@@ -0,0 +1,207 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "HeapPool"
+#include <utils/Log.h>
+
+#include "HeapPool.h"
+
+namespace android {
+//======================================================================
+
+static const size_t kMinHeapSize = 64 * 1024;
+
+
+// The power of two a heap of size bytes is made with
+static size_t bucketSize(size_t size)
+{
+    size_t bucket = kMinHeapSize;
+    while (bucket < size) {
+        bucket <<= 1;
+    }
+    return bucket;
+}
+
+
+
+HeapPool::HeapPool()
+  : mPuts(0),
+    mAllocated(0),
+    mReused(0),
+    mDropped(0)
+{
+}
+
+
+
+HeapPool::~HeapPool()
+{
+    // Any heap still given out keeps its own reference to the memory
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        ALOGW_IF(mEntries[i].user != NULL, "~HeapPool: a heap of %zu bytes was never put back",
+                 mEntries[i].heap->getSize());
+    }
+}
+
+
+
+camera_memory_t* HeapPool::get(size_t bufSize, unsigned int count,
+                               camera_request_memory request, void* cookie)
+{
+    if (request == NULL || bufSize == 0 || count == 0) {
+        return NULL;
+    }
+
+    size_t size = bucketSize(bufSize * count);
+
+    // The smallest free heap that is big enough, put back first
+    Entry* entry = NULL;
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        Entry& e = mEntries[i];
+        if (e.user != NULL || e.heap->getSize() < size) {
+            continue;
+        }
+        if (entry == NULL || e.heap->getSize() < entry->heap->getSize() ||
+            (e.heap->getSize() == entry->heap->getSize() && e.freed < entry->freed)) {
+            entry = &e;
+        }
+    }
+
+    if (entry != NULL) {
+        mReused++;
+    } else {
+        sp<MemoryHeapBase> heap = new MemoryHeapBase(size, 0, "CameraHeapPool");
+        if (heap->getHeapID() < 0) {
+            ALOGE("get: unable to allocate %zu bytes", size);
+            return NULL;
+        }
+
+        Entry e;
+        e.heap = heap;
+        e.user = NULL;
+        e.freed = 0;
+        mEntries.push_back(e);
+        entry = &mEntries.back();
+        mAllocated++;
+    }
+
+    // The app maps the start of our heap, and indexes it with bufSize
+    camera_memory_t* mem = request(entry->heap->getHeapID(), bufSize, count, cookie);
+    if (mem == NULL) {
+        ALOGE("get: unable to map %u buffers of %zu bytes", count, bufSize);
+        return NULL;
+    }
+
+    entry->user = mem;
+    return mem;
+}
+
+
+
+void HeapPool::put(camera_memory_t* mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    size_t i = find(mem);
+    mem->release(mem);
+
+    if (i < mEntries.size()) {
+        mEntries[i].user = NULL;
+        mEntries[i].freed = ++mPuts;
+    }
+
+    trimTo(kMaxFreeBytes);
+}
+
+
+
+void HeapPool::drop(camera_memory_t* mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+
+    size_t i = find(mem);
+    mem->release(mem);
+
+    if (i < mEntries.size()) {
+        mEntries.erase(mEntries.begin() + i);
+        mDropped++;
+    }
+}
+
+
+
+size_t HeapPool::find(camera_memory_t* mem) const
+{
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        if (mEntries[i].user == mem) {
+            return i;
+        }
+    }
+    return mEntries.size();
+}
+
+
+
+void HeapPool::trim()
+{
+    trimTo(0);
+}
+
+
+
+void HeapPool::trimTo(size_t maxFree)
+{
+    for (;;) {
+        size_t free = 0;
+        size_t oldest = mEntries.size();
+
+        for (size_t i = 0; i < mEntries.size(); i++) {
+            if (mEntries[i].user == NULL) {
+                free += mEntries[i].heap->getSize();
+                if (oldest == mEntries.size() || mEntries[i].freed < mEntries[oldest].freed) {
+                    oldest = i;
+                }
+            }
+        }
+
+        if (free <= maxFree || oldest == mEntries.size()) {
+            return;
+        }
+
+        mEntries.erase(mEntries.begin() + oldest);
+        mDropped++;
+    }
+}
+
+
+
+void HeapPool::dump(String8& out) const
+{
+    size_t used = 0, usedBytes = 0, free = 0, freeBytes = 0;
+
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        if (mEntries[i].user != NULL) {
+            used++;
+            usedBytes += mEntries[i].heap->getSize();
+        } else {
+            free++;
+            freeBytes += mEntries[i].heap->getSize();
+        }
+    }
+
+    out.appendFormat("  Heaps: %llu allocated, %llu reused, %llu let go; %zu in use (%zu KB), %zu free (%zu KB)\n",
+                     (unsigned long long)mAllocated, (unsigned long long)mReused,
+                     (unsigned long long)mDropped, used, usedBytes >> 10, free, freeBytes >> 10);
+}
+
+//======================================================================
+}; // namespace android
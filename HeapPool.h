@@ -0,0 +1,86 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _HEAP_POOL_H
+#define _HEAP_POOL_H
+
+#include <stdint.h>
+#include <vector>
+#include <binder/MemoryHeapBase.h>
+#include <hardware/camera.h>
+#include <utils/String8.h>
+
+namespace android {
+//======================================================================
+
+/*  The camera_memory_t heaps of a camera, kept when they are given back
+    so that changing the sizes doesn't make and map a new ashmem region
+    for each of them every time.
+
+    Each heap is a view, made by the camera_request_memory of the app, of
+    one of our own ashmem heaps. Those come in power of two sizes, so a
+    heap for a slightly different frame size fits in one given back
+    before, and a smaller one in any bigger one. ashmem only uses memory
+    for the pages that are written, so the rounding up costs address space
+    only. The smallest free heap that fits is reused, the least recently
+    freed of those first, and the oldest ones are let go once they add up
+    to more than kMaxFreeBytes.
+
+    A heap that may still have frames in use elsewhere, such as the video
+    frames the encoder has yet to give back, must be given back with drop()
+    so that it is never given out again while they are.
+
+    It isn't thread safe. The camera calls it with its lock held.
+*/
+class HeapPool
+{
+public:
+    HeapPool();
+    ~HeapPool();
+
+    /*  A heap of count buffers of bufSize bytes, as mRequestMemory gives,
+        or NULL. It must be given back with put() and not released.
+    */
+    camera_memory_t* get(size_t bufSize, unsigned int count,
+                         camera_request_memory request, void* cookie);
+    void             put(camera_memory_t* mem);
+
+    /*  Gives back a heap from get() and lets go of it instead of keeping
+        it. Those who still have it mapped keep the memory.
+    */
+    void             drop(camera_memory_t* mem);
+
+    /*  Lets go of all the heaps that are not in use */
+    void             trim();
+
+    /*  Appends the allocation and reuse counts to out, for dumpCamera() */
+    void             dump(String8& out) const;
+
+private:
+    static const size_t kMaxFreeBytes = 64 * 1024 * 1024;
+
+    struct Entry {
+        sp<MemoryHeapBase>  heap;
+        camera_memory_t*    user;           // the view given out, or NULL if free
+        uint64_t            freed;          // when it was put back, in put() calls
+    };
+
+    void                trimTo(size_t maxFree);
+    size_t              find(camera_memory_t* mem) const;
+
+    std::vector<Entry>  mEntries;
+    uint64_t            mPuts;
+    uint64_t            mAllocated;         // new ashmem heaps made
+    uint64_t            mReused;            // heaps given out again
+    uint64_t            mDropped;           // freed heaps let go
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#include "LatencyHistogram.h"
+
+namespace android {
+//======================================================================
+
+void LatencyHistogram::add(nsecs_t duration)
+{
+    uint64_t us = duration > 0 ? duration / 1000 : 0;
+    uint32_t clipped = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+
+    int bucket = clipped == 0 ? 0 : 32 - __builtin_clz(clipped);
+    if (bucket >= kBuckets) {
+        bucket = kBuckets - 1;
+    }
+
+    mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mTotalUs.fetch_add(us, std::memory_order_relaxed);
+
+    uint32_t max = mMaxUs.load(std::memory_order_relaxed);
+    while (clipped > max &&
+           !mMaxUs.compare_exchange_weak(max, clipped, std::memory_order_relaxed)) {
+    }
+}
+
+
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < kBuckets; i++) {
+        mBuckets[i].store(0, std::memory_order_relaxed);
+    }
+    mCount.store(0, std::memory_order_relaxed);
+    mTotalUs.store(0, std::memory_order_relaxed);
+    mMaxUs.store(0, std::memory_order_relaxed);
+}
+
+
+
+void LatencyHistogram::dump(String8& out, const char* name) const
+{
+    uint32_t buckets[kBuckets];
+    uint64_t count = 0;
+
+    // Counted from the buckets, so the percentiles add up even if samples
+    // were added while they were read
+    for (int i = 0; i < kBuckets; i++) {
+        buckets[i] = mBuckets[i].load(std::memory_order_relaxed);
+        count += buckets[i];
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    static const int kPercents[] = { 50, 90, 99 };
+    double top[3];
+
+    for (int p = 0; p < 3; p++) {
+        uint64_t wanted = (count * kPercents[p] + 99) / 100;
+        uint64_t seen = 0;
+        int i = 0;
+
+        while (i < kBuckets - 1 && (seen += buckets[i]) < wanted) {
+            i++;
+        }
+        top[p] = (1u << i) / 1000.0;
+    }
+
+    out.appendFormat("    %-24s %8llu  mean %8.2f ms  p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f\n",
+                     name, (unsigned long long)count,
+                     mTotalUs.load(std::memory_order_relaxed) / 1000.0 / count,
+                     top[0], top[1], top[2],
+                     mMaxUs.load(std::memory_order_relaxed) / 1000.0);
+}
+
+//======================================================================
+}; // namespace android
@@ -0,0 +1,79 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _LATENCY_HISTOGRAM_H
+#define _LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <utils/String8.h>
+#include <utils/Timers.h>
+
+namespace android {
+//======================================================================
+
+/*  How long something took, counted in power of two buckets of
+    microseconds, for dumpCamera().
+
+    add() is a few relaxed atomic operations and takes no lock, so it can
+    stay on in the hot paths of every thread. The numbers are read the same
+    way, so a dump taken while frames are flowing may be a sample or two
+    out, but never torn.
+*/
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() { reset(); }
+
+    void     add(nsecs_t duration);
+    void     reset();
+    uint64_t count() const { return mCount.load(std::memory_order_relaxed); }
+
+    /*  Appends a line with the count, mean, max and the 50th, 90th and 99th
+        percentiles to out. The percentiles are the top of their bucket.
+        Nothing is appended if there are no samples yet.
+    */
+    void     dump(String8& out, const char* name) const;
+
+private:
+    // Bucket 0 is below 1 us, bucket i from 2^(i-1) to 2^i us, and the
+    // last one everything from about a second
+    static const int kBuckets = 21;
+
+    std::atomic<uint32_t>   mBuckets[kBuckets];
+    std::atomic<uint64_t>   mCount;
+    std::atomic<uint64_t>   mTotalUs;
+    std::atomic<uint32_t>   mMaxUs;
+};
+
+
+
+/*  Adds the time from its construction to its destruction to a histogram */
+class ScopedLatency
+{
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram)
+      : mHistogram(histogram),
+        mStart(systemTime(SYSTEM_TIME_MONOTONIC))
+    {
+    }
+
+    ~ScopedLatency()
+    {
+        mHistogram.add(systemTime(SYSTEM_TIME_MONOTONIC) - mStart);
+    }
+
+private:
+    LatencyHistogram&   mHistogram;
+    nsecs_t             mStart;
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
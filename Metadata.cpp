@@ -28,9 +28,9 @@
 namespace android {
 
 Metadata::Metadata():
+    mDataCount(0),
     mData(NULL)
 {
-    mData = allocate_camera_metadata(30, 400);
 }
 
 Metadata::~Metadata()
@@ -40,7 +40,7 @@ Metadata::~Metadata()
 
 void Metadata::replace(camera_metadata_t *m)
 {
-    if (m == mData) {
+    if (m != NULL && m == mData) {
         ALOGE("%s: Replacing metadata with itself?!", __func__);
         return;
     }
@@ -136,46 +136,55 @@ bool Metadata::validate(uint32_t tag, int tag_type, int count)
 
 int Metadata::add(uint32_t tag, int count, const void *tag_data)
 {
-    int res;
-    camera_metadata_t* tmp;
     int tag_type = get_camera_metadata_tag_type(tag);
-    size_t size = calculate_camera_metadata_entry_data_size(tag_type, count);
-    size_t entry_capacity = get_camera_metadata_entry_count(mData) + 1;
-    size_t data_capacity = get_camera_metadata_data_count(mData) + size;
-
-    // Opportunistically attempt to add if metadata has room for it
-    if (!add_camera_metadata_entry(mData, tag, tag_data, count))
-        return 0;
-
-    // Double new dimensions to minimize future reallocations
-    tmp = allocate_camera_metadata(entry_capacity * 2, data_capacity * 2);
-    if (tmp == NULL) {
-        ALOGE("%s: Failed to allocate new metadata with %zu entries, %zu data",
-                __func__, entry_capacity, data_capacity);
-        return -ENOMEM;
-    }
-    // Append the current metadata to the new (empty) metadata
-    res = append_camera_metadata(tmp, mData);
-    if (res) {
-        ALOGE("%s: Failed to append old metadata %p to new %p",
-                __func__, mData, tmp);
-        return res;
+    size_t size = camera_metadata_type_size[tag_type] * count;
+
+    Entry e = { tag, count, mValues.size() };
+    mEntries.push_back(e);
+    mValues.insert(mValues.end(), (const uint8_t *)tag_data,
+            (const uint8_t *)tag_data + size);
+    mDataCount += calculate_camera_metadata_entry_data_size(tag_type, count);
+
+    // Made again, with room for this one, when it is next asked for
+    replace(NULL);
+    return 0;
+}
+
+camera_metadata_t* Metadata::build()
+{
+    camera_metadata_t* m = allocate_camera_metadata(mEntries.size(), mDataCount);
+    if (m == NULL) {
+        ALOGE("%s: Failed to allocate metadata with %zu entries, %zu data",
+                __func__, mEntries.size(), mDataCount);
+        return NULL;
     }
-    // Add the remaining new item
-    res = add_camera_metadata_entry(tmp, tag, tag_data, count);
-    if (res) {
-        ALOGE("%s: Failed to add new entry (%d, %p, %d) to metadata %p",
-                __func__, tag, tag_data, count, tmp);
-        return res;
+
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        const Entry& e = mEntries[i];
+        int res = add_camera_metadata_entry(m, e.tag, &mValues[e.offset], e.count);
+        if (res) {
+            ALOGE("%s: Failed to add entry (%d, %d) to metadata %p",
+                    __func__, e.tag, e.count, m);
+            free_camera_metadata(m);
+            return NULL;
+        }
     }
 
-    replace(tmp);
-    return 0;
+    return m;
 }
 
 camera_metadata_t* Metadata::get()
 {
+    if (mData == NULL)
+        mData = build();
     return mData;
 }
 
+camera_metadata_t* Metadata::release()
+{
+    camera_metadata_t* m = get();
+    mData = NULL;
+    return m;
+}
+
 } // namespace android
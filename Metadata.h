@@ -18,11 +18,14 @@
 #define METADATA_H_
 
 #include <stdint.h>
+#include <vector>
 #include <hardware/camera.h>
 #include <system/camera_metadata.h>
 
 namespace android {
-// Metadata is a convenience class for dealing with libcamera_metadata
+// Metadata is a convenience class for dealing with libcamera_metadata.
+// The entries are kept as they are added, and the camera_metadata_t is
+// only made when it is asked for, in one allocation of just its size.
 class Metadata {
     public:
         Metadata();
@@ -31,7 +34,7 @@ class Metadata {
         // Initialize with framework metadata
         //int init(const camera_metadata_t *metadata);
 
-        // Parse and add an entry. Allocates and copies new storage for *data.
+        // Parse and add an entry. Copies *data.
         int addUInt8(uint32_t tag, int count, const uint8_t *data);
         int add1UInt8(uint32_t tag, const uint8_t data);
         int addInt32(uint32_t tag, int count, const int32_t *data);
@@ -45,11 +48,27 @@ class Metadata {
         // This is not a durable handle, and may be destroyed by add*/init
         camera_metadata_t* get();
 
+        // The current metadata, for the caller to free_camera_metadata()
+        camera_metadata_t* release();
+
     private:
-        // Actual internal storage
+        struct Entry {
+            uint32_t tag;
+            int count;
+            size_t offset;              // of the data in mValues
+        };
+
+        // The entries as they were added, and their data
+        std::vector<Entry> mEntries;
+        std::vector<uint8_t> mValues;
+        // What the data of the entries takes in a camera_metadata_t
+        size_t mDataCount;
+        // Made from the entries by get(), NULL until then
         camera_metadata_t* mData;
         // Destroy old metadata and replace with new
         void replace(camera_metadata_t *m);
+        // Make mData from the entries
+        camera_metadata_t* build();
         // Validate the tag, type and count for a metadata entry
         bool validate(uint32_t tag, int tag_type, int count);
         // Add a verified tag with data
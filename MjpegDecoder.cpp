@@ -0,0 +1,1120 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "MjpegDecoder"
+#include <utils/Log.h>
+
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <jpeglib.h>
+#include "uvc_compat.h"
+};
+
+#include <vector>
+
+#include "MjpegDecoder.h"
+#include "CameraSpec.h"
+#include "Converter.h"
+#include "Utils.h"
+
+#define DEBUG_FRAME 0
+
+#if DEBUG_FRAME
+#define LOG_FRAME ALOGD
+#else
+#define LOG_FRAME ALOGV
+#endif
+
+namespace android {
+//======================================================================
+
+static const unsigned LogInterval = 300;        // frames between two logs of the decode times
+
+
+
+MjpegDecoder::MjpegDecoder(int backend)
+  : mBackend(backend),
+    mFrames(0),
+    mLast(0),
+    mTotal(0),
+    mMax(0)
+{
+}
+
+
+
+MjpegDecoder::~MjpegDecoder()
+{
+    logTimes();
+}
+
+
+
+const char* MjpegDecoder::backendName(int backend)
+{
+    switch (backend) {
+        case CameraSpec::MJPEG_LIBJPEG:  return "libjpeg";
+        case CameraSpec::MJPEG_HW:       return "hw";
+        default:                         return "builtin";
+    }
+}
+
+
+
+status_t MjpegDecoder::decode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height)
+{
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    status_t status = doDecode(dst, dstStride, src, size, width, height);
+
+    account(start);
+    return status;
+}
+
+
+
+status_t MjpegDecoder::decodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                    const uint8_t* src, size_t size, int width, int height)
+{
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    // Never convert more than what was captured
+    if (cropWidth > width)
+        cropWidth = width;
+    if (cropHeight > height)
+        cropHeight = height;
+
+    status_t status = doDecodeDirect(dstFmt, dst, dstStride, dstHeight, cropWidth, cropHeight, src, size, width, height);
+
+    account(start);
+    return status;
+}
+
+
+
+void MjpegDecoder::account(nsecs_t start)
+{
+    mLast   = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    mTotal += mLast;
+    mFrames++;
+
+    if (mLast > mMax) {
+        mMax = mLast;
+    }
+
+    LOG_FRAME("%s decoder: frame %u took %lld us", name(), mFrames, (long long)ns2us(mLast));
+
+    if (mFrames % LogInterval == 0) {
+        logTimes();
+    }
+}
+
+
+
+void MjpegDecoder::logTimes() const
+{
+    if (mFrames != 0) {
+        ALOGD("%s decoder: %u frames, average %lld us, max %lld us, last %lld us", name(), mFrames,
+            (long long)ns2us(averageDecodeTime()), (long long)ns2us(mMax), (long long)ns2us(mLast));
+    }
+}
+
+
+
+//======================================================================
+/*  Our own decoder, from Utils.cpp
+*/
+
+class BuiltinDecoder : public MjpegDecoder
+{
+public:
+    static BuiltinDecoder* create(int threads);
+    virtual ~BuiltinDecoder();
+
+protected:
+    virtual status_t doDecode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height);
+    virtual status_t doDecodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                    const uint8_t* src, size_t size, int width, int height);
+
+private:
+    explicit BuiltinDecoder(struct utils::jpeg_decoder* dec);
+
+    struct utils::jpeg_decoder* mDecoder;
+};
+
+
+
+BuiltinDecoder* BuiltinDecoder::create(int threads)
+{
+    struct utils::jpeg_decoder* dec = utils::jpeg_decoder_create(threads);
+    return dec ? new BuiltinDecoder(dec) : NULL;
+}
+
+
+
+BuiltinDecoder::BuiltinDecoder(struct utils::jpeg_decoder* dec)
+  : MjpegDecoder(CameraSpec::MJPEG_BUILTIN),
+    mDecoder(dec)
+{
+}
+
+
+
+BuiltinDecoder::~BuiltinDecoder()
+{
+    utils::jpeg_decoder_destroy(mDecoder);
+}
+
+
+
+status_t BuiltinDecoder::doDecode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height)
+{
+    if (utils::jpeg_decoder_decode(mDecoder, dst, dstStride, (uint8_t*)src, width, height)) {
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
+
+
+status_t BuiltinDecoder::doDecodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                        const uint8_t* src, size_t size, int width, int height)
+{
+    struct yuv420_planes planes;
+    yuv420_planes_init(&planes, dstFmt, dst, dstStride, dstHeight);
+
+    if (utils::jpeg_decoder_decode_yuv420(mDecoder, &planes, cropWidth, cropHeight, (uint8_t*)src, width, height)) {
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
+
+
+//======================================================================
+/*  libjpeg, or libjpeg-turbo and its SIMD code where the platform has it.
+    The frames are decoded to raw planes, so there is no colour conversion
+    or upsampling done by the library, and then copied out like the frames
+    of the planar YUV cameras are.
+*/
+
+struct JpegError {
+    struct jpeg_error_mgr pub;              // base class
+    jmp_buf jump;                           // where to go on fatal errors
+};
+
+struct JpegSource {
+    struct jpeg_source_mgr pub;             // base class
+    const JOCTET* chunk[4];                 // the frame, in up to 4 pieces
+    size_t length[4];
+    int count;
+    int next;                               // the next piece to give libjpeg
+};
+
+
+/* Fatal errors. The default handler would exit() */
+METHODDEF(void) error_exit (j_common_ptr cinfo)
+{
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    ALOGE("libjpeg: %s", msg);
+
+    longjmp(((JpegError*)cinfo->err)->jump, 1);
+}
+
+/* Warnings, mostly corrupt data in a frame that is still decoded */
+METHODDEF(void) output_message (j_common_ptr cinfo)
+{
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    LOG_FRAME("libjpeg: %s", msg);
+}
+
+METHODDEF(void) init_source (j_decompress_ptr cinfo)
+{
+}
+
+METHODDEF(boolean) fill_input_buffer (j_decompress_ptr cinfo)
+{
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+    JpegSource* src = (JpegSource*)cinfo->src;
+
+    if (src->next < src->count) {
+        src->pub.next_input_byte = src->chunk[src->next];
+        src->pub.bytes_in_buffer = src->length[src->next];
+        src->next++;
+    } else {
+        // A truncated frame. Ending it lets libjpeg show what it got
+        src->pub.next_input_byte = eoi;
+        src->pub.bytes_in_buffer = 2;
+    }
+    return TRUE;
+}
+
+METHODDEF(void) skip_input_data (j_decompress_ptr cinfo, long count)
+{
+    JpegSource* src = (JpegSource*)cinfo->src;
+
+    if (count <= 0)
+        return;
+
+    while (count > (long)src->pub.bytes_in_buffer) {
+        count -= (long)src->pub.bytes_in_buffer;
+        fill_input_buffer(cinfo);
+    }
+    src->pub.next_input_byte += count;
+    src->pub.bytes_in_buffer -= count;
+}
+
+METHODDEF(void) term_source (j_decompress_ptr cinfo)
+{
+}
+
+
+/* True if the tables, frame and scan headers of a frame include a DHT */
+static bool hasHuffmanTables(const uint8_t* src, size_t size)
+{
+    size_t i = 2;
+
+    while (i + 4 <= size && src[i] == 0xFF) {
+        uint8_t marker = src[i + 1];
+
+        if (marker == 0xC4) {
+            return true;
+        }
+        if (marker == 0xDA || marker == 0xD9) {
+            break;                              // SOS or EOI, no more tables
+        }
+        if (marker == 0xFF) {
+            i++;                                // fill byte
+            continue;
+        }
+        i += 2 + ((src[i + 2] << 8) | src[i + 3]);
+    }
+    return false;
+}
+
+
+class LibjpegDecoder : public MjpegDecoder
+{
+public:
+    LibjpegDecoder();
+    virtual ~LibjpegDecoder();
+
+protected:
+    virtual status_t doDecode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height);
+    virtual status_t doDecodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                    const uint8_t* src, size_t size, int width, int height);
+
+private:
+    status_t decodePlanes(const uint8_t* src, size_t size, int width, int height);
+
+    struct jpeg_decompress_struct mInfo;
+    JpegError               mError;
+    JpegSource              mSource;
+
+    std::vector<uint8_t>    mPlanes;        // the raw components of the last frame
+    std::vector<uint8_t>    mGrey;          // chroma of greyscale frames
+    struct yuv420_planes    mDecoded;       // where they are in mPlanes
+    int                     mVsub;          // as for planar_to_yuv420()
+};
+
+
+
+LibjpegDecoder::LibjpegDecoder()
+  : MjpegDecoder(CameraSpec::MJPEG_LIBJPEG),
+    mVsub(1)
+{
+    memset(&mInfo, 0, sizeof(mInfo));
+    memset(&mSource, 0, sizeof(mSource));
+    memset(&mDecoded, 0, sizeof(mDecoded));
+
+    mInfo.err = jpeg_std_error(&mError.pub);
+    mError.pub.error_exit     = error_exit;
+    mError.pub.output_message = output_message;
+
+    jpeg_create_decompress(&mInfo);
+
+    mSource.pub.init_source       = init_source;
+    mSource.pub.fill_input_buffer = fill_input_buffer;
+    mSource.pub.skip_input_data   = skip_input_data;
+    mSource.pub.resync_to_restart = jpeg_resync_to_restart;
+    mSource.pub.term_source       = term_source;
+    mInfo.src = &mSource.pub;
+}
+
+
+
+LibjpegDecoder::~LibjpegDecoder()
+{
+    jpeg_destroy_decompress(&mInfo);
+}
+
+
+
+status_t LibjpegDecoder::decodePlanes(const uint8_t* src, size_t size, int width, int height)
+{
+    static const JOCTET dht[4] = {
+        0xFF, 0xC4, (JPG_HUFFMAN_TABLE_LENGTH + 2) >> 8, (JPG_HUFFMAN_TABLE_LENGTH + 2) & 0xFF
+    };
+
+    if (size < 4 || src[0] != 0xFF || src[1] != 0xD8) {
+        ALOGE("libjpeg: not a JPEG frame");
+        return UNKNOWN_ERROR;
+    }
+
+    // MJPEG frames usually have no huffman tables, so the standard ones go after the SOI
+    if (hasHuffmanTables(src, size)) {
+        mSource.chunk[0]  = src;
+        mSource.length[0] = size;
+        mSource.count     = 1;
+    } else {
+        mSource.chunk[0]  = src;
+        mSource.length[0] = 2;
+        mSource.chunk[1]  = dht;
+        mSource.length[1] = sizeof(dht);
+        mSource.chunk[2]  = utils::JPEGHuffmanTable;
+        mSource.length[2] = JPG_HUFFMAN_TABLE_LENGTH;
+        mSource.chunk[3]  = src + 2;
+        mSource.length[3] = size - 2;
+        mSource.count     = 4;
+    }
+    mSource.next                = 0;
+    mSource.pub.next_input_byte = NULL;
+    mSource.pub.bytes_in_buffer = 0;
+
+    if (setjmp(mError.jump)) {
+        jpeg_abort_decompress(&mInfo);
+        return UNKNOWN_ERROR;
+    }
+
+    jpeg_read_header(&mInfo, TRUE);
+
+    if (mInfo.image_width != (JDIMENSION)width || mInfo.image_height != (JDIMENSION)height) {
+        ALOGE("libjpeg: the frame is %dx%d instead of %dx%d", mInfo.image_width, mInfo.image_height, width, height);
+        jpeg_abort_decompress(&mInfo);
+        return UNKNOWN_ERROR;
+    }
+
+    // Only the samplings where the chroma is at most halved each way
+    int hs = mInfo.max_h_samp_factor;
+    int vs = mInfo.max_v_samp_factor;
+    bool ok = hs <= 2 && vs <= 2;
+
+    if (mInfo.num_components == 3 && mInfo.jpeg_color_space == JCS_YCbCr) {
+        ok = ok && mInfo.comp_info[1].h_samp_factor == 1 && mInfo.comp_info[1].v_samp_factor == 1 &&
+                   mInfo.comp_info[2].h_samp_factor == 1 && mInfo.comp_info[2].v_samp_factor == 1;
+        mInfo.out_color_space = JCS_YCbCr;
+    } else if (mInfo.num_components == 1) {
+        mInfo.out_color_space = JCS_GRAYSCALE;
+    } else {
+        ok = false;
+    }
+
+    if (!ok) {
+        ALOGE("libjpeg: unsupported sampling, %d components", mInfo.num_components);
+        jpeg_abort_decompress(&mInfo);
+        return INVALID_OPERATION;
+    }
+
+    mInfo.raw_data_out = TRUE;
+    jpeg_start_decompress(&mInfo);
+
+    // Room for whole frames of each component, padded to whole iMCU rows
+    uint8_t* base[3];
+    int      stride[3];
+    int      lines[3];
+    size_t   total = 0;
+
+    for (int ci = 0; ci < mInfo.num_components; ci++) {
+        stride[ci] = mInfo.comp_info[ci].width_in_blocks * DCTSIZE;
+        lines[ci]  = mInfo.comp_info[ci].v_samp_factor * DCTSIZE;
+        total     += (size_t)stride[ci] * lines[ci] * mInfo.total_iMCU_rows;
+    }
+    if (mPlanes.size() < total) {
+        mPlanes.resize(total);
+    }
+
+    base[0] = &mPlanes[0];
+    for (int ci = 1; ci < mInfo.num_components; ci++) {
+        base[ci] = base[ci - 1] + (size_t)stride[ci - 1] * lines[ci - 1] * mInfo.total_iMCU_rows;
+    }
+
+    JSAMPROW   rows[3][2 * DCTSIZE];
+    JSAMPARRAY data[3] = { rows[0], rows[1], rows[2] };
+
+    for (JDIMENSION row = 0; row < mInfo.total_iMCU_rows; row++) {
+        for (int ci = 0; ci < mInfo.num_components; ci++) {
+            for (int i = 0; i < lines[ci]; i++) {
+                rows[ci][i] = base[ci] + (size_t)(row * lines[ci] + i) * stride[ci];
+            }
+        }
+        if (jpeg_read_raw_data(&mInfo, data, vs * DCTSIZE) == 0) {
+            break;
+        }
+    }
+
+    jpeg_finish_decompress(&mInfo);
+
+    mDecoded.y       = base[0];
+    mDecoded.ystride = stride[0];
+
+    if (mInfo.num_components == 3) {
+        mDecoded.u       = base[1];
+        mDecoded.v       = base[2];
+        mDecoded.cstride = stride[1];
+        mDecoded.cstep   = (hs == 1) ? 2 : 1;       // full width chroma is subsampled as it is copied
+        mVsub            = (vs == 1) ? 2 : 1;
+    } else {
+        if (mGrey.size() < (size_t)width) {
+            mGrey.assign(width, 128);
+        }
+        mDecoded.u       = &mGrey[0];
+        mDecoded.v       = &mGrey[0];
+        mDecoded.cstride = 0;
+        mDecoded.cstep   = 1;
+        mVsub            = 1;
+    }
+
+    return NO_ERROR;
+}
+
+
+
+status_t LibjpegDecoder::doDecode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height)
+{
+    status_t status = decodePlanes(src, size, width, height);
+
+    if (status == NO_ERROR) {
+        planar_to_yuyv(dst, dstStride, &mDecoded, mVsub, width, height);
+    }
+    return status;
+}
+
+
+
+status_t LibjpegDecoder::doDecodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                        const uint8_t* src, size_t size, int width, int height)
+{
+    status_t status = decodePlanes(src, size, width, height);
+
+    if (status == NO_ERROR) {
+        struct yuv420_planes planes;
+        yuv420_planes_init(&planes, dstFmt, dst, dstStride, dstHeight);
+        planar_to_yuv420(&planes, &mDecoded, mVsub, cropWidth, cropHeight);
+    }
+    return status;
+}
+
+
+
+//======================================================================
+/*  A V4L2 mem2mem JPEG decoder, as most SoCs with a hardware JPEG block
+    have. Each frame is copied to the one output buffer, decoded to the one
+    capture buffer and copied out of it from there.
+*/
+
+static const int DecodeTimeoutMs = 1000;
+
+/* The capture formats we can copy out, best first */
+static const uint32_t CaptureFormats[] = {
+    V4L2_PIX_FMT_NV12,
+    V4L2_PIX_FMT_NV21,
+    V4L2_PIX_FMT_YUV420,
+    V4L2_PIX_FMT_YVU420,
+    V4L2_PIX_FMT_NV16,
+    V4L2_PIX_FMT_NV61,
+    V4L2_PIX_FMT_YUYV,
+};
+
+
+class V4l2JpegDecoder : public MjpegDecoder
+{
+public:
+    /*  Looks for a decoder device. Returns NULL if there is none */
+    static V4l2JpegDecoder* open();
+    virtual ~V4l2JpegDecoder();
+
+protected:
+    virtual status_t doDecode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height);
+    virtual status_t doDecodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                    const uint8_t* src, size_t size, int width, int height);
+
+private:
+    V4l2JpegDecoder(int fd, bool mplane, uint32_t jpegFmt, uint32_t capFmt);
+
+    static bool hasFormat(int fd, uint32_t type, uint32_t pixfmt);
+
+    status_t setFormat(uint32_t type, uint32_t pixfmt, int width, int height, size_t sizeimage);
+    status_t getFormat(uint32_t type, uint32_t& pixfmt, int& width, int& height, int& stride);
+    status_t mapBuffer(uint32_t type, void*& mem, size_t& length);
+    void     initBuffer(struct v4l2_buffer& buf, struct v4l2_plane& plane, uint32_t type) const;
+    status_t queue(uint32_t type, size_t bytesused);
+    status_t dequeue(uint32_t type, short event, uint32_t& flags);
+
+    status_t configure(int width, int height);
+    void     unconfigure();
+    status_t decodeFrame(const uint8_t* src, size_t size, int width, int height);
+    void     capturedPlanes(struct yuv420_planes& planes, int& vsub) const;
+
+    int         mFd;
+    bool        mMplane;                    // uses the multi-planar API, with one plane
+    uint32_t    mOutType;                   // V4L2_BUF_TYPE_VIDEO_OUTPUT*, the JPEG frames
+    uint32_t    mCapType;                   // V4L2_BUF_TYPE_VIDEO_CAPTURE*, the decoded frames
+    uint32_t    mJpegFmt;
+    uint32_t    mCapFmt;
+
+    int         mWidth;                     // configured frame size, 0 if not configured
+    int         mHeight;
+    int         mStride;                    // bytes per line of the decoded frames
+    int         mLines;                     // lines of their luma plane, with any padding
+    bool        mChecked;                   // the capture format was checked after a frame
+
+    void*       mOutMem;
+    size_t      mOutLength;
+    void*       mCapMem;
+    size_t      mCapLength;
+};
+
+
+
+V4l2JpegDecoder* V4l2JpegDecoder::open()
+{
+    for (auto& v : utils::listVideos()) {
+        int fd = ::open(v.c_str(), O_RDWR | O_NONBLOCK);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct v4l2_capability cap;
+        memset(&cap, 0, sizeof(cap));
+
+        if (ioctl(fd, VIDIOC_QUERYCAP, &cap) >= 0) {
+            uint32_t caps  = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+            bool     m2m   = (caps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE)) && (caps & V4L2_CAP_STREAMING);
+            bool    mplane = !(caps & V4L2_CAP_VIDEO_M2M);
+
+            uint32_t outType = mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+            uint32_t capType = mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            uint32_t jpegFmt = 0;
+
+            if (m2m && hasFormat(fd, outType, V4L2_PIX_FMT_JPEG)) {
+                jpegFmt = V4L2_PIX_FMT_JPEG;
+            } else if (m2m && hasFormat(fd, outType, V4L2_PIX_FMT_MJPEG)) {
+                jpegFmt = V4L2_PIX_FMT_MJPEG;
+            }
+
+            for (size_t i = 0; jpegFmt && i < sizeof(CaptureFormats) / sizeof(CaptureFormats[0]); i++) {
+                if (hasFormat(fd, capType, CaptureFormats[i])) {
+                    ALOGI("%s: %s decodes JPEG to %.4s", v.c_str(), cap.card, (const char*)&CaptureFormats[i]);
+                    return new V4l2JpegDecoder(fd, mplane, jpegFmt, CaptureFormats[i]);
+                }
+            }
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+
+
+V4l2JpegDecoder::V4l2JpegDecoder(int fd, bool mplane, uint32_t jpegFmt, uint32_t capFmt)
+  : MjpegDecoder(CameraSpec::MJPEG_HW),
+    mFd(fd),
+    mMplane(mplane),
+    mOutType(mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT),
+    mCapType(mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE),
+    mJpegFmt(jpegFmt),
+    mCapFmt(capFmt),
+    mWidth(0),
+    mHeight(0),
+    mStride(0),
+    mLines(0),
+    mChecked(false),
+    mOutMem(MAP_FAILED),
+    mOutLength(0),
+    mCapMem(MAP_FAILED),
+    mCapLength(0)
+{
+}
+
+
+
+V4l2JpegDecoder::~V4l2JpegDecoder()
+{
+    unconfigure();
+    close(mFd);
+}
+
+
+
+bool V4l2JpegDecoder::hasFormat(int fd, uint32_t type, uint32_t pixfmt)
+{
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = type;
+
+    while (ioctl(fd, VIDIOC_ENUM_FMT, &desc) >= 0) {
+        if (desc.pixelformat == pixfmt) {
+            return true;
+        }
+        desc.index++;
+    }
+    return false;
+}
+
+
+
+status_t V4l2JpegDecoder::setFormat(uint32_t type, uint32_t pixfmt, int width, int height, size_t sizeimage)
+{
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = type;
+
+    if (mMplane) {
+        fmt.fmt.pix_mp.width       = width;
+        fmt.fmt.pix_mp.height      = height;
+        fmt.fmt.pix_mp.pixelformat = pixfmt;
+        fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
+        fmt.fmt.pix_mp.num_planes  = 1;
+        fmt.fmt.pix_mp.plane_fmt[0].sizeimage = sizeimage;
+    } else {
+        fmt.fmt.pix.width       = width;
+        fmt.fmt.pix.height      = height;
+        fmt.fmt.pix.pixelformat = pixfmt;
+        fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+        fmt.fmt.pix.sizeimage   = sizeimage;
+    }
+
+    if (ioctl(mFd, VIDIOC_S_FMT, &fmt) < 0) {
+        ALOGE("VIDIOC_S_FMT %.4s %dx%d failed (%d: %s)", (const char*)&pixfmt, width, height, errno, strerror(errno));
+        return INVALID_OPERATION;
+    }
+    return NO_ERROR;
+}
+
+
+
+status_t V4l2JpegDecoder::getFormat(uint32_t type, uint32_t& pixfmt, int& width, int& height, int& stride)
+{
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = type;
+
+    if (ioctl(mFd, VIDIOC_G_FMT, &fmt) < 0) {
+        ALOGE("VIDIOC_G_FMT failed (%d: %s)", errno, strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    if (mMplane) {
+        if (fmt.fmt.pix_mp.num_planes != 1) {
+            ALOGE("The decoded frames have %d planes", fmt.fmt.pix_mp.num_planes);
+            return INVALID_OPERATION;
+        }
+        pixfmt = fmt.fmt.pix_mp.pixelformat;
+        width  = fmt.fmt.pix_mp.width;
+        height = fmt.fmt.pix_mp.height;
+        stride = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+    } else {
+        pixfmt = fmt.fmt.pix.pixelformat;
+        width  = fmt.fmt.pix.width;
+        height = fmt.fmt.pix.height;
+        stride = fmt.fmt.pix.bytesperline;
+    }
+    return NO_ERROR;
+}
+
+
+
+void V4l2JpegDecoder::initBuffer(struct v4l2_buffer& buf, struct v4l2_plane& plane, uint32_t type) const
+{
+    memset(&buf, 0, sizeof(buf));
+    memset(&plane, 0, sizeof(plane));
+
+    buf.type   = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index  = 0;
+
+    if (mMplane) {
+        buf.m.planes = &plane;
+        buf.length   = 1;
+    }
+}
+
+
+
+status_t V4l2JpegDecoder::mapBuffer(uint32_t type, void*& mem, size_t& length)
+{
+    struct v4l2_requestbuffers rb;
+    memset(&rb, 0, sizeof(rb));
+    rb.count  = 1;
+    rb.type   = type;
+    rb.memory = V4L2_MEMORY_MMAP;
+
+    if (ioctl(mFd, VIDIOC_REQBUFS, &rb) < 0 || rb.count < 1) {
+        ALOGE("VIDIOC_REQBUFS failed (%d: %s)", errno, strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    struct v4l2_buffer buf;
+    struct v4l2_plane  plane;
+    initBuffer(buf, plane, type);
+
+    if (ioctl(mFd, VIDIOC_QUERYBUF, &buf) < 0) {
+        ALOGE("VIDIOC_QUERYBUF failed (%d: %s)", errno, strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    length = mMplane ? plane.length : buf.length;
+    mem    = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, mFd,
+                  mMplane ? plane.m.mem_offset : buf.m.offset);
+
+    if (mem == MAP_FAILED) {
+        ALOGE("mmap failed (%d: %s)", errno, strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
+
+
+status_t V4l2JpegDecoder::queue(uint32_t type, size_t bytesused)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane  plane;
+    initBuffer(buf, plane, type);
+
+    if (mMplane) {
+        plane.bytesused = bytesused;
+        plane.length    = (type == mOutType) ? mOutLength : mCapLength;
+    } else {
+        buf.bytesused   = bytesused;
+    }
+
+    if (ioctl(mFd, VIDIOC_QBUF, &buf) < 0) {
+        ALOGE("VIDIOC_QBUF failed (%d: %s)", errno, strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
+
+
+status_t V4l2JpegDecoder::dequeue(uint32_t type, short event, uint32_t& flags)
+{
+    struct pollfd p;
+    p.fd      = mFd;
+    p.events  = event;
+    p.revents = 0;
+
+    int e = poll(&p, 1, DecodeTimeoutMs);
+    if (e <= 0) {
+        ALOGE("The hardware decoder %s", e == 0 ? "timed out" : "failed");
+        return TIMED_OUT;
+    }
+
+    struct v4l2_buffer buf;
+    struct v4l2_plane  plane;
+    initBuffer(buf, plane, type);
+
+    if (ioctl(mFd, VIDIOC_DQBUF, &buf) < 0) {
+        ALOGE("VIDIOC_DQBUF failed (%d: %s)", errno, strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    flags = buf.flags;
+    return NO_ERROR;
+}
+
+
+
+status_t V4l2JpegDecoder::configure(int width, int height)
+{
+    uint32_t pixfmt;
+    int      w, h;
+
+    // A JPEG frame is never bigger than the raw YUYV one
+    status_t status = setFormat(mOutType, mJpegFmt, width, height, (size_t)width * height * 2);
+
+    if (status == NO_ERROR) {
+        status = setFormat(mCapType, mCapFmt, width, height, 0);
+    }
+    if (status == NO_ERROR) {
+        status = getFormat(mCapType, pixfmt, w, h, mStride);
+    }
+    if (status == NO_ERROR && (pixfmt != mCapFmt || w < width || h < height)) {
+        ALOGE("The hardware decoder can't decode %dx%d frames to %.4s", width, height, (const char*)&mCapFmt);
+        status = INVALID_OPERATION;
+    }
+
+    if (status == NO_ERROR) {
+        mLines = h;
+        status = mapBuffer(mOutType, mOutMem, mOutLength);
+    }
+    if (status == NO_ERROR) {
+        status = mapBuffer(mCapType, mCapMem, mCapLength);
+    }
+
+    if (status == NO_ERROR) {
+        int type = mOutType;
+        if (ioctl(mFd, VIDIOC_STREAMON, &type) < 0) {
+            status = UNKNOWN_ERROR;
+        }
+        type = mCapType;
+        if (status == NO_ERROR && ioctl(mFd, VIDIOC_STREAMON, &type) < 0) {
+            status = UNKNOWN_ERROR;
+        }
+    }
+
+    mWidth   = width;
+    mHeight  = height;
+    mChecked = false;
+
+    if (status != NO_ERROR) {
+        unconfigure();
+        // The device is no use if it can't even be set up
+        return INVALID_OPERATION;
+    }
+
+    ALOGD("The hardware decoder is set up for %dx%d, %d bytes per line", width, height, mStride);
+    return NO_ERROR;
+}
+
+
+
+void V4l2JpegDecoder::unconfigure()
+{
+    if (mWidth == 0) {
+        return;
+    }
+
+    int type = mOutType;
+    ioctl(mFd, VIDIOC_STREAMOFF, &type);
+    type = mCapType;
+    ioctl(mFd, VIDIOC_STREAMOFF, &type);
+
+    if (mOutMem != MAP_FAILED) {
+        munmap(mOutMem, mOutLength);
+        mOutMem = MAP_FAILED;
+    }
+    if (mCapMem != MAP_FAILED) {
+        munmap(mCapMem, mCapLength);
+        mCapMem = MAP_FAILED;
+    }
+
+    struct v4l2_requestbuffers rb;
+    memset(&rb, 0, sizeof(rb));
+    rb.memory = V4L2_MEMORY_MMAP;
+    rb.type   = mOutType;
+    ioctl(mFd, VIDIOC_REQBUFS, &rb);
+    rb.type   = mCapType;
+    ioctl(mFd, VIDIOC_REQBUFS, &rb);
+
+    mWidth  = 0;
+    mHeight = 0;
+}
+
+
+
+status_t V4l2JpegDecoder::decodeFrame(const uint8_t* src, size_t size, int width, int height)
+{
+    if (width != mWidth || height != mHeight) {
+        unconfigure();
+
+        status_t status = configure(width, height);
+        if (status != NO_ERROR) {
+            return status;
+        }
+    }
+
+    if (size > mOutLength) {
+        ALOGE("The frame is %d bytes, the decoder takes %d", (int)size, (int)mOutLength);
+        return UNKNOWN_ERROR;
+    }
+
+    memcpy(mOutMem, src, size);
+
+    uint32_t capFlags = 0;
+    uint32_t outFlags = 0;
+
+    if (queue(mOutType, size) != NO_ERROR ||
+        queue(mCapType, 0) != NO_ERROR ||
+        dequeue(mCapType, POLLIN, capFlags) != NO_ERROR ||
+        dequeue(mOutType, POLLOUT, outFlags) != NO_ERROR) {
+        // Start again from scratch with the next frame, to get our buffers back
+        unconfigure();
+        return UNKNOWN_ERROR;
+    }
+
+    if (capFlags & V4L2_BUF_FLAG_ERROR) {
+        return UNKNOWN_ERROR;
+    }
+
+    // Some decoders only pick their output size once they have seen a frame
+    if (!mChecked) {
+        uint32_t pixfmt;
+        int      w, h, stride;
+
+        if (getFormat(mCapType, pixfmt, w, h, stride) != NO_ERROR ||
+            pixfmt != mCapFmt || w < width || h != mLines || stride != mStride) {
+            ALOGE("The hardware decoder changed its output format");
+            unconfigure();
+            return INVALID_OPERATION;
+        }
+        mChecked = true;
+    }
+
+    return NO_ERROR;
+}
+
+
+
+void V4l2JpegDecoder::capturedPlanes(struct yuv420_planes& planes, int& vsub) const
+{
+    uint8_t* y = (uint8_t*)mCapMem;
+    uint8_t* c = y + mStride * mLines;
+
+    planes.y       = y;
+    planes.ystride = mStride;
+    planes.cstride = mStride;
+    planes.cstep   = 2;
+    vsub           = 1;
+
+    switch (mCapFmt) {
+        case V4L2_PIX_FMT_NV16:
+            vsub = 2;
+            // fall through
+        case V4L2_PIX_FMT_NV12:
+            planes.u = c;
+            planes.v = c + 1;
+            break;
+
+        case V4L2_PIX_FMT_NV61:
+            vsub = 2;
+            // fall through
+        case V4L2_PIX_FMT_NV21:
+            planes.v = c;
+            planes.u = c + 1;
+            break;
+
+        case V4L2_PIX_FMT_YUV420:
+            planes.cstride = mStride >> 1;
+            planes.cstep   = 1;
+            planes.u       = c;
+            planes.v       = c + planes.cstride * (mLines >> 1);
+            break;
+
+        case V4L2_PIX_FMT_YVU420:
+            planes.cstride = mStride >> 1;
+            planes.cstep   = 1;
+            planes.v       = c;
+            planes.u       = c + planes.cstride * (mLines >> 1);
+            break;
+    }
+}
+
+
+
+status_t V4l2JpegDecoder::doDecode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height)
+{
+    status_t status = decodeFrame(src, size, width, height);
+
+    if (status != NO_ERROR) {
+        return status;
+    }
+
+    if (mCapFmt == V4L2_PIX_FMT_YUYV) {
+        for (int h = 0; h < height; h++) {
+            memcpy(dst + h * dstStride, (uint8_t*)mCapMem + h * mStride, width << 1);
+        }
+    } else {
+        struct yuv420_planes planes;
+        int vsub;
+        capturedPlanes(planes, vsub);
+        planar_to_yuyv(dst, dstStride, &planes, vsub, width, height);
+    }
+    return NO_ERROR;
+}
+
+
+
+status_t V4l2JpegDecoder::doDecodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                         const uint8_t* src, size_t size, int width, int height)
+{
+    status_t status = decodeFrame(src, size, width, height);
+
+    if (status != NO_ERROR) {
+        return status;
+    }
+
+    if (mCapFmt == V4L2_PIX_FMT_YUYV) {
+        uint8_t* yuyv = (uint8_t*)mCapMem;
+
+        switch (dstFmt) {
+            case CONV_DST_YVU420SP:
+                yuyv_to_yvu420sp(dst, dstStride, dstHeight, yuyv, mStride, cropWidth, cropHeight);
+                break;
+            case CONV_DST_YVU420P:
+                yuyv_to_yvu420p(dst, dstStride, dstHeight, yuyv, mStride, cropWidth, cropHeight);
+                break;
+            default:
+                yuyv_to_yuv420p(dst, dstStride, dstHeight, yuyv, mStride, cropWidth, cropHeight);
+                break;
+        }
+    } else {
+        struct yuv420_planes d, s;
+        int vsub;
+        yuv420_planes_init(&d, dstFmt, dst, dstStride, dstHeight);
+        capturedPlanes(s, vsub);
+        planar_to_yuv420(&d, &s, vsub, cropWidth, cropHeight);
+    }
+    return NO_ERROR;
+}
+
+
+
+//======================================================================
+
+MjpegDecoder* MjpegDecoder::create(int backend, int threads)
+{
+    MjpegDecoder* dec = NULL;
+
+    switch (backend) {
+        case CameraSpec::MJPEG_HW:
+            dec = V4l2JpegDecoder::open();
+            if (dec == NULL) {
+                ALOGW("There is no hardware JPEG decoder");
+            }
+            break;
+
+        case CameraSpec::MJPEG_LIBJPEG:
+            dec = new LibjpegDecoder();
+            break;
+    }
+
+    if (dec == NULL) {
+        dec = BuiltinDecoder::create(threads);
+    }
+
+    if (dec != NULL) {
+        ALOGI("Decoding MJPEG with the %s decoder", dec->name());
+    }
+    return dec;
+}
+
+//======================================================================
+}; // namespace android
@@ -0,0 +1,81 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _MJPEG_DECODER_H
+#define _MJPEG_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utils/Errors.h>
+#include <utils/Timers.h>
+
+namespace android {
+//======================================================================
+
+/*  Decodes the frames of MJPEG cameras. The backends are the ones of
+    CameraSpec::MJPEG_*. Each one times the frames it decodes, and the
+    times are logged every few seconds of video and when it is deleted.
+
+    The decode calls return
+        NO_ERROR          - the frame has been decoded
+        UNKNOWN_ERROR     - the frame is corrupt, or the wrong size
+        INVALID_OPERATION - this backend can't decode this stream at all,
+                            so the caller should use another one
+    Only one thread may use a decoder at a time.
+*/
+class MjpegDecoder
+{
+public:
+    /*  Makes a decoder with the given backend, or with the builtin one if
+        that backend is not available. threads is only used by the builtin
+        decoder. Returns NULL if out of memory.
+    */
+    static MjpegDecoder* create(int backend, int threads);
+    static const char* backendName(int backend);
+
+    virtual ~MjpegDecoder();
+
+    int         backend() const { return mBackend; }
+    const char* name() const { return backendName(mBackend); }
+
+    /*  Decodes a frame of size bytes and width x height pixels to YUYV */
+    status_t decode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height);
+
+    /*  Decodes the top left cropWidth x cropHeight pixels of a frame straight
+        to one of the CONV_DST_* formats, as find_direct_converter() would.
+    */
+    status_t decodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                          const uint8_t* src, size_t size, int width, int height);
+
+    nsecs_t  lastDecodeTime() const { return mLast; }
+    nsecs_t  averageDecodeTime() const { return mFrames ? mTotal / mFrames : 0; }
+    nsecs_t  maxDecodeTime() const { return mMax; }
+    unsigned decodedFrames() const { return mFrames; }
+
+protected:
+    explicit MjpegDecoder(int backend);
+
+    virtual status_t doDecode(uint8_t* dst, int dstStride, const uint8_t* src, size_t size, int width, int height) = 0;
+    virtual status_t doDecodeDirect(int dstFmt, uint8_t* dst, int dstStride, int dstHeight, int cropWidth, int cropHeight,
+                                    const uint8_t* src, size_t size, int width, int height) = 0;
+
+private:
+    void account(nsecs_t start);
+    void logTimes() const;
+
+    int         mBackend;
+    unsigned    mFrames;
+    nsecs_t     mLast;
+    nsecs_t     mTotal;
+    nsecs_t     mMax;
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
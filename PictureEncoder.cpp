@@ -0,0 +1,351 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "PictureEncoder"
+#include <utils/Log.h>
+
+#include <string.h>
+
+#include "Converter.h"
+#include "PictureEncoder.h"
+
+namespace android {
+//======================================================================
+
+uint8_t* cropToAspect(uint8_t* yuyv, int srcWidth, int srcHeight, int width, int height,
+                      int& cropWidth, int& cropHeight)
+{
+    cropWidth = srcWidth;
+    cropHeight = srcHeight;
+
+    if (cropWidth * height > cropHeight * width) {
+        cropWidth = (cropHeight * width / height) & ~1;
+    } else {
+        cropHeight = cropWidth * height / width;
+    }
+
+    return yuyv + ((srcHeight - cropHeight) >> 1) * (srcWidth << 1) +
+                  (((srcWidth - cropWidth) >> 1) & ~1) * 2;
+}
+
+
+
+PictureCompressor::PictureCompressor()
+  : mMain(NULL),
+    mThumb(NULL),
+    mThumbSize(0)
+{
+}
+
+
+
+PictureCompressor::~PictureCompressor()
+{
+    if (mMain != NULL) {
+        jpeg_encoder_destroy(mMain);
+    }
+    if (mThumb != NULL) {
+        jpeg_encoder_destroy(mThumb);
+    }
+}
+
+
+
+/*  Scales the picture down to the thumbnail size, cropped to its aspect
+    ratio, and compresses it into mThumbJpeg
+*/
+bool PictureCompressor::makeThumbnail(const PictureSettings& settings, uint8_t* yuyv, int stride, int quality)
+{
+    int width = settings.thumbWidth & ~1;
+    int height = settings.thumbHeight;
+
+    if (mThumb == NULL) {
+        mThumb = jpeg_encoder_create();
+        if (mThumb == NULL) {
+            return false;
+        }
+        // No APPn segment is allowed in the thumbnail
+        jpeg_encoder_set_jfif(mThumb, 0);
+    }
+
+    mThumbYuyv.resize(width * height * 2);
+    mThumbJpeg.resize(width * height * 2 + 4096);
+
+    int cropWidth, cropHeight;
+    uint8_t* src = cropToAspect(yuyv, settings.exif.width, settings.exif.height, width, height,
+                                cropWidth, cropHeight);
+    yuyv_scale(&mThumbYuyv[0], width << 1, width, height, src, stride, cropWidth, cropHeight);
+
+    mThumbSize = jpeg_encoder_encode(mThumb, &mThumbYuyv[0], &mThumbJpeg[0], mThumbJpeg.size(),
+                                     width, height, width << 1, quality);
+    return mThumbSize > 0;
+}
+
+
+
+int PictureCompressor::compress(const PictureSettings& settings, uint8_t* yuyv, int stride,
+                                uint8_t* dst, int maxsize)
+{
+    if (mMain == NULL) {
+        mMain = jpeg_encoder_create();
+        if (mMain == NULL) {
+            return -1;
+        }
+        // The APP1 has to come right after the SOI
+        jpeg_encoder_set_jfif(mMain, 0);
+    }
+
+    // The size the encoder rounds the picture down to
+    ExifInfo exif = settings.exif;
+    exif.width &= -16;
+    exif.height &= -16;
+
+    // A thumbnail too big for the 64 KB of the APP1 is made again at a
+    // lower quality, and left out if that is not enough
+    bool wantThumb = settings.thumbWidth >= 16 && settings.thumbHeight >= 16;
+    int thumbQuality = settings.thumbQuality;
+
+    for (;;) {
+        const uint8_t* thumb = NULL;
+
+        if (wantThumb && makeThumbnail(settings, yuyv, stride, thumbQuality)) {
+            thumb = &mThumbJpeg[0];
+        }
+
+        if (buildExifApp1(exif, thumb, thumb != NULL ? mThumbSize : 0, mApp1)) {
+            break;
+        }
+
+        if (thumb == NULL) {
+            ALOGE("compress: the EXIF is too big");
+            return -1;
+        }
+
+        ALOGW("compress: a %d byte thumbnail at q=%d is too big for the EXIF", mThumbSize, thumbQuality);
+        thumbQuality /= 2;
+        wantThumb = thumbQuality >= 10;
+    }
+
+    int app1Size = mApp1.size();
+    if (maxsize <= app1Size + 2) {
+        return -1;
+    }
+
+    // The picture, with no JFIF APP0, is compressed after the room for the
+    // APP1, whose last two bytes then take the place of its SOI. So it is
+    // never copied, and the APP1 is right after the SOI.
+    int size = jpeg_encoder_encode(mMain, yuyv, dst + app1Size, maxsize - app1Size,
+                                   settings.exif.width, settings.exif.height, stride, settings.quality);
+    if (size < 0) {
+        return -1;
+    }
+
+    dst[0] = 0xff;
+    dst[1] = 0xd8;
+    memcpy(dst + 2, &mApp1[0], app1Size);
+
+    return app1Size + size;
+}
+
+
+
+PictureEncoder::Worker::Worker(PictureEncoder* encoder) :
+        Thread(false),
+        mEncoder(encoder)
+{
+}
+
+
+
+bool PictureEncoder::Worker::threadLoop()
+{
+    Job job;
+
+    while (mEncoder->waitForJob(job)) {
+        int size = mCompressor.compress(job.settings, job.yuyv, job.stride, job.dst, job.maxsize);
+        mEncoder->finish(job, size);
+    }
+
+    return false;
+}
+
+
+
+PictureEncoder::PictureEncoder(int threads, int buffers)
+  : mThreads(threads),
+    mBuffers(buffers),
+    mQueued(0),
+    mDelivered(0),
+    mExit(false)
+{
+    for (size_t i = 0; i < mBuffers.size(); i++) {
+        mBuffers[i].busy = false;
+    }
+}
+
+
+
+PictureEncoder::~PictureEncoder()
+{
+    flush();
+
+    {
+        Mutex::Autolock lock(mLock);
+        mExit = true;
+        mWork.broadcast();
+    }
+
+    for (auto& w : mWorkers) {
+        w->requestExitAndWait();
+    }
+}
+
+
+
+bool PictureEncoder::startLocked()
+{
+    if (!mWorkers.empty()) {
+        return true;
+    }
+
+    for (int i = 0; i < mThreads; i++) {
+        sp<Worker> w = new Worker(this);
+
+        if (w->run("CameraJpeg", PRIORITY_DEFAULT) != NO_ERROR) {
+            ALOGE("PictureEncoder: cannot start worker %d", i);
+            break;
+        }
+
+        mWorkers.push_back(w);
+    }
+
+    ALOGD("PictureEncoder: %zu threads, %zu buffers", mWorkers.size(), mBuffers.size());
+    return !mWorkers.empty();
+}
+
+
+
+uint8_t* PictureEncoder::acquire(size_t size, nsecs_t timeout)
+{
+    Mutex::Autolock lock(mLock);
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + timeout;
+
+    for (;;) {
+        for (size_t i = 0; i < mBuffers.size(); i++) {
+            Buffer& b = mBuffers[i];
+
+            if (!b.busy) {
+                if (b.mem.size() < size) {
+                    b.mem.resize(size);
+                }
+                b.busy = true;
+                return &b.mem[0];
+            }
+        }
+
+        nsecs_t left = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+        if (left <= 0) {
+            return NULL;
+        }
+        mTurn.waitRelative(mLock, left);
+    }
+}
+
+
+
+void PictureEncoder::releaseLocked(uint8_t* yuyv)
+{
+    for (size_t i = 0; i < mBuffers.size(); i++) {
+        if (!mBuffers[i].mem.empty() && &mBuffers[i].mem[0] == yuyv) {
+            mBuffers[i].busy = false;
+        }
+    }
+    mTurn.broadcast();
+}
+
+
+
+void PictureEncoder::cancel(uint8_t* yuyv)
+{
+    Mutex::Autolock lock(mLock);
+    releaseLocked(yuyv);
+}
+
+
+
+void PictureEncoder::queue(uint8_t* yuyv, int stride, const PictureSettings& settings,
+                           uint8_t* dst, int maxsize, int tag, const Deliver& deliver)
+{
+    {
+        Mutex::Autolock lock(mLock);
+
+        if (startLocked()) {
+            Job job = { yuyv, stride, settings, dst, maxsize, tag, deliver, mQueued++ };
+            mJobs.push_back(job);
+            mWork.signal();
+            return;
+        }
+    }
+
+    cancel(yuyv);
+    deliver(tag, -1);
+}
+
+
+
+void PictureEncoder::flush()
+{
+    Mutex::Autolock lock(mLock);
+
+    while (mDelivered != mQueued) {
+        mTurn.wait(mLock);
+    }
+}
+
+
+
+bool PictureEncoder::waitForJob(Job& job)
+{
+    Mutex::Autolock lock(mLock);
+
+    while (mJobs.empty() && !mExit) {
+        mWork.wait(mLock);
+    }
+
+    if (mJobs.empty()) {
+        return false;
+    }
+
+    job = mJobs.front();
+    mJobs.pop_front();
+    return true;
+}
+
+
+
+/*  Hands the picture over once all the ones queued before it have been */
+void PictureEncoder::finish(const Job& job, int size)
+{
+    {
+        Mutex::Autolock lock(mLock);
+
+        while (job.seq != mDelivered) {
+            mTurn.wait(mLock);
+        }
+    }
+
+    job.deliver(job.tag, size);
+
+    Mutex::Autolock lock(mLock);
+    releaseLocked(job.yuyv);
+    mDelivered++;
+    mTurn.broadcast();
+}
+
+//======================================================================
+}; // namespace android
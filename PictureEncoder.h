@@ -0,0 +1,154 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _PICTURE_ENCODER_H
+#define _PICTURE_ENCODER_H
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <utils/Timers.h>
+#include <utils/threads.h>
+
+#include "Exif.h"
+
+struct jpeg_encoder;
+
+namespace android {
+//======================================================================
+
+/*  The centered part of a YUYV frame that has the aspect ratio of width x height */
+uint8_t* cropToAspect(uint8_t* yuyv, int srcWidth, int srcHeight, int width, int height,
+                      int& cropWidth, int& cropHeight);
+
+
+/*  How a picture is to be compressed, as the parameters were when it was taken */
+struct PictureSettings {
+    int         quality;
+    int         thumbWidth;                 // 0 for no thumbnail
+    int         thumbHeight;
+    int         thumbQuality;
+    ExifInfo    exif;                       // with the size of the picture
+
+    PictureSettings() : quality(90), thumbWidth(0), thumbHeight(0), thumbQuality(75) {}
+};
+
+
+/*  Compresses pictures into a JPEG with an EXIF APP1 segment, that holds
+    a thumbnail if there is to be one, right after the SOI. It keeps its
+    encoders and buffers from one picture to the next. The big pictures
+    are encoded in stripes by the converter threads. Only one thread may
+    use it at a time.
+*/
+class PictureCompressor
+{
+public:
+    PictureCompressor();
+    ~PictureCompressor();
+
+    /*  Returns the size of the JPEG in dst, or -1 */
+    int compress(const PictureSettings& settings, uint8_t* yuyv, int stride,
+                 uint8_t* dst, int maxsize);
+
+private:
+    bool makeThumbnail(const PictureSettings& settings, uint8_t* yuyv, int stride, int quality);
+
+    struct jpeg_encoder*    mMain;
+    struct jpeg_encoder*    mThumb;
+    std::vector<uint8_t>    mThumbYuyv;
+    std::vector<uint8_t>    mThumbJpeg;
+    int                     mThumbSize;
+    std::vector<uint8_t>    mApp1;
+};
+
+
+/*  The pictures of a burst, compressed by a few threads while the next
+    ones are captured, and handed back in the order they were queued.
+
+    The caller takes a raw buffer with acquire(), puts the picture in it
+    and queue()s it. There are only so many buffers, and one is only
+    given back once its picture has been delivered, so acquire() waits
+    when the workers fall behind and no more pictures are in flight than
+    there are buffers. deliver() is called on a worker thread with no
+    lock held.
+*/
+class PictureEncoder
+{
+public:
+    /*  Called with the tag given to queue() and the size of the JPEG
+        in dst, or -1 if it could not be made
+    */
+    typedef std::function<void(int tag, int size)> Deliver;
+
+    PictureEncoder(int threads, int buffers);
+    ~PictureEncoder();
+
+    /*  A buffer of at least size bytes, or NULL if none was given back
+        within timeout
+    */
+    uint8_t* acquire(size_t size, nsecs_t timeout);
+
+    /*  Gives back a buffer from acquire() that is not queued */
+    void     cancel(uint8_t* yuyv);
+
+    void     queue(uint8_t* yuyv, int stride, const PictureSettings& settings,
+                   uint8_t* dst, int maxsize, int tag, const Deliver& deliver);
+
+    /*  Waits until all the queued pictures have been delivered */
+    void     flush();
+
+private:
+    class Worker : public Thread
+    {
+        PictureEncoder*     mEncoder;
+        PictureCompressor   mCompressor;
+
+    public:
+        Worker(PictureEncoder* encoder);
+        virtual bool threadLoop();
+    };
+
+    struct Buffer {
+        std::vector<uint8_t>    mem;
+        bool                    busy;
+    };
+
+    struct Job {
+        uint8_t*        yuyv;               // one of mBuffers
+        int             stride;
+        PictureSettings settings;
+        uint8_t*        dst;
+        int             maxsize;
+        int             tag;
+        Deliver         deliver;
+        uint64_t        seq;
+    };
+
+    bool     startLocked();
+    void     releaseLocked(uint8_t* yuyv);
+    bool     waitForJob(Job& job);
+    void     finish(const Job& job, int size);
+
+    int                 mThreads;
+    std::vector< sp<Worker> > mWorkers;     // made on the first queue()
+
+    Mutex               mLock;
+    Condition           mWork;              // a job was queued
+    Condition           mTurn;              // a picture was delivered
+    std::vector<Buffer> mBuffers;
+    std::deque<Job>     mJobs;
+    uint64_t            mQueued;            // the seq of the next job
+    uint64_t            mDelivered;         // the seq of the next picture to deliver
+    bool                mExit;
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
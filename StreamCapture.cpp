@@ -0,0 +1,487 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "StreamCapture"
+#include <utils/Log.h>
+
+extern "C" {
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "uvc_compat.h"
+#include "v4l2_formats.h"
+};
+
+#include "StreamCapture.h"
+#include "Utils.h"
+
+using namespace std;
+
+namespace android {
+//======================================================================
+
+// How long the thread waits for a frame before looking again
+static const nsecs_t kPollTimeout = s2ns(1);
+
+
+StreamCapture::StreamCapture()
+  : mFd(-1),
+    mWakeFd(-1),
+    mFourcc(0),
+    mWidth(0),
+    mHeight(0),
+    mMaxFrameSize(0),
+    mBufCount(0),
+    mStreaming(false),
+    mGotKeyFrame(false),
+    mCallback(NULL),
+    mCookie(NULL),
+    mFrames(0),
+    mKeyFrames(0),
+    mSkipped(0),
+    mBytes(0)
+{
+    memset(mMem, 0, sizeof(mMem));
+    memset(mMemLength, 0, sizeof(mMemLength));
+
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ALOGE_IF(mWakeFd < 0, "StreamCapture: no eventfd, stopping waits for a frame: %s", strerror(errno));
+}
+
+
+
+StreamCapture::~StreamCapture()
+{
+    stop();
+
+    if (mWakeFd >= 0) {
+        close(mWakeFd);
+    }
+}
+
+
+
+string StreamCapture::findDevice(const string& camera, const char* busInfo, uint32_t fourcc)
+{
+    // The nodes of one UVC camera all have the bus_info of its USB port
+    for (auto& v : utils::listVideos()) {
+        if (v == camera) {
+            continue;
+        }
+
+        int fd = ::open(v.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        bool found = false;
+        struct v4l2_capability cap;
+
+        if (ioctl(fd, VIDIOC_QUERYCAP, &cap) >= 0 &&
+            cap.capabilities & V4L2_CAP_VIDEO_CAPTURE &&
+            cap.capabilities & V4L2_CAP_STREAMING &&
+            !strncmp((const char*)cap.bus_info, busInfo, sizeof(cap.bus_info))) {
+
+            struct v4l2_fmtdesc fmt;
+            memset(&fmt, 0, sizeof(fmt));
+            fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+            while (!found && ioctl(fd, VIDIOC_ENUM_FMT, &fmt) >= 0) {
+                found = fmt.pixelformat == fourcc;
+                fmt.index++;
+            }
+        }
+
+        close(fd);
+
+        if (found) {
+            ALOGD("findDevice: '%c%c%c%c' of %s is on %s", fourcc & 0xFF, (fourcc >> 8) & 0xFF,
+                  (fourcc >> 16) & 0xFF, (fourcc >> 24) & 0xFF, camera.c_str(), v.c_str());
+            return v;
+        }
+    }
+
+    return string();
+}
+
+
+
+status_t StreamCapture::open(const string& device, uint32_t fourcc, int width, int height, int fps)
+{
+    stop();
+
+    mFd = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (mFd < 0) {
+        ALOGE("open: cannot open %s: %s", device.c_str(), strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+    mDevice = device;
+
+    struct v4l2_format format;
+    memset(&format, 0, sizeof(format));
+    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    format.fmt.pix.width = width;
+    format.fmt.pix.height = height;
+    format.fmt.pix.pixelformat = fourcc;
+    format.fmt.pix.field = V4L2_FIELD_ANY;
+
+    if (ioctl(mFd, VIDIOC_S_FMT, &format) < 0 || format.fmt.pix.pixelformat != fourcc) {
+        ALOGE("open: %s cannot capture '%c%c%c%c' at %dx%d", device.c_str(), fourcc & 0xFF,
+              (fourcc >> 8) & 0xFF, (fourcc >> 16) & 0xFF, (fourcc >> 24) & 0xFF, width, height);
+        stop();
+        return BAD_VALUE;
+    }
+
+    // The driver picks the nearest size it has, which the encoder is told
+    mFourcc = fourcc;
+    mWidth = format.fmt.pix.width;
+    mHeight = format.fmt.pix.height;
+    mMaxFrameSize = format.fmt.pix.sizeimage;
+
+    ALOGW_IF(mWidth != width || mHeight != height, "open: asked for %dx%d, the stream is %dx%d",
+             width, height, mWidth, mHeight);
+
+    struct v4l2_streamparm params;
+    memset(&params, 0, sizeof(params));
+    params.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    params.parm.capture.timeperframe.numerator = 1;
+    params.parm.capture.timeperframe.denominator = fps;
+
+    // Not fatal, the stream goes at the rate the camera likes
+    if (ioctl(mFd, VIDIOC_S_PARM, &params) < 0) {
+        ALOGW("open: unable to set %d fps", fps);
+    }
+
+    struct v4l2_requestbuffers rb;
+    memset(&rb, 0, sizeof(rb));
+    rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    rb.memory = V4L2_MEMORY_MMAP;
+    rb.count = NB_BUFFER;
+
+    if (ioctl(mFd, VIDIOC_REQBUFS, &rb) < 0 || rb.count < 1) {
+        ALOGE("open: VIDIOC_REQBUFS failed: %s", strerror(errno));
+        stop();
+        return NO_MEMORY;
+    }
+
+    mBufCount = (rb.count < MAX_BUFFERS) ? rb.count : MAX_BUFFERS;
+
+    for (int i = 0; i < mBufCount; i++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.index = i;
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (ioctl(mFd, VIDIOC_QUERYBUF, &buf) < 0) {
+            ALOGE("open: unable to query buffer %d: %s", i, strerror(errno));
+            stop();
+            return UNKNOWN_ERROR;
+        }
+
+        void* mem = mmap(0, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, buf.m.offset);
+        if (mem == MAP_FAILED) {
+            ALOGE("open: unable to map buffer %d: %s", i, strerror(errno));
+            stop();
+            return UNKNOWN_ERROR;
+        }
+        mMem[i] = mem;
+        mMemLength[i] = buf.length;
+
+        // An access unit can't be bigger than the buffer it came in
+        if (buf.length > mMaxFrameSize) {
+            mMaxFrameSize = buf.length;
+        }
+    }
+
+    mFrames = 0;
+    mKeyFrames = 0;
+    mSkipped = 0;
+    mBytes = 0;
+
+    ALOGI("open: %s streams '%c%c%c%c' at %dx%d into %d buffers of up to %zu bytes", device.c_str(),
+          fourcc & 0xFF, (fourcc >> 8) & 0xFF, (fourcc >> 16) & 0xFF, (fourcc >> 24) & 0xFF,
+          mWidth, mHeight, mBufCount, mMaxFrameSize);
+    return NO_ERROR;
+}
+
+
+
+status_t StreamCapture::start(Callback callback, void* cookie)
+{
+    if (mFd < 0 || mStreaming) {
+        return INVALID_OPERATION;
+    }
+
+    for (int i = 0; i < mBufCount; i++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.index = i;
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (ioctl(mFd, VIDIOC_QBUF, &buf) < 0) {
+            ALOGE("start: VIDIOC_QBUF failed: %s", strerror(errno));
+            return UNKNOWN_ERROR;
+        }
+    }
+
+    // Forget a stop() from before
+    if (mWakeFd >= 0) {
+        uint64_t count;
+        while (read(mWakeFd, &count, sizeof(count)) > 0) {
+        }
+    }
+
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(mFd, VIDIOC_STREAMON, &type) < 0) {
+        ALOGE("start: VIDIOC_STREAMON failed: %s", strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+    mStreaming = true;
+
+    mCallback = callback;
+    mCookie = cookie;
+    mGotKeyFrame = false;
+
+    mThread = new CaptureThread(this);
+    status_t status = mThread->run("StreamCaptureThread", PRIORITY_URGENT_DISPLAY);
+    if (status != NO_ERROR) {
+        ALOGE("start: cannot start the thread: %d", status);
+        mThread.clear();
+        return status;
+    }
+
+    return NO_ERROR;
+}
+
+
+
+void StreamCapture::stop()
+{
+    if (mThread != 0) {
+        mThread->requestExit();
+
+        uint64_t one = 1;
+        if (mWakeFd >= 0 && write(mWakeFd, &one, sizeof(one)) < 0) {
+            ALOGE("stop: cannot write the eventfd: %s", strerror(errno));
+        }
+
+        mThread->requestExitAndWait();
+        mThread.clear();
+    }
+
+    if (mStreaming) {
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (ioctl(mFd, VIDIOC_STREAMOFF, &type) < 0) {
+            ALOGE("stop: VIDIOC_STREAMOFF failed: %s", strerror(errno));
+        }
+        mStreaming = false;
+    }
+
+    freeBuffers();
+
+    if (mFd >= 0) {
+        ALOGD("stop: %s: %llu frames, %llu keyframes, %llu skipped waiting for one",
+              mDevice.c_str(), (unsigned long long)mFrames.load(),
+              (unsigned long long)mKeyFrames.load(), (unsigned long long)mSkipped.load());
+        close(mFd);
+        mFd = -1;
+    }
+}
+
+
+
+void StreamCapture::freeBuffers()
+{
+    for (int i = 0; i < mBufCount; i++) {
+        if (mMem[i] != NULL) {
+            munmap(mMem[i], mMemLength[i]);
+            mMem[i] = NULL;
+        }
+    }
+
+    if (mBufCount > 0) {
+        struct v4l2_requestbuffers rb;
+        memset(&rb, 0, sizeof(rb));
+        rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        rb.memory = V4L2_MEMORY_MMAP;
+        rb.count = 0;
+        ioctl(mFd, VIDIOC_REQBUFS, &rb);
+        mBufCount = 0;
+    }
+}
+
+
+
+StreamCapture::CaptureThread::CaptureThread(StreamCapture* capture) :
+        Thread(false),
+        mCapture(capture)
+{
+}
+
+
+
+bool StreamCapture::CaptureThread::threadLoop()
+{
+    return mCapture->captureFrame();
+}
+
+
+
+bool StreamCapture::captureFrame()
+{
+    /*  We return true to be called again, and false once stopped or when
+        the stream can't go on, as when the camera is unplugged. The
+        preview thread finds out about that and tells the app.
+    */
+    struct pollfd fds[2];
+    fds[0].fd     = mFd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd     = mWakeFd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    int e = ::poll(fds, mWakeFd >= 0 ? 2 : 1, ns2ms(kPollTimeout));
+
+    if (e < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+        ALOGE("captureFrame: poll failed: %s", strerror(errno));
+        return false;
+    }
+
+    if (fds[1].revents & POLLIN) {
+        return false;
+    }
+
+    if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        ALOGE("captureFrame: %s has stopped streaming (0x%x)", mDevice.c_str(), fds[0].revents);
+        return false;
+    }
+
+    if (!(fds[0].revents & POLLIN)) {
+        ALOGW("captureFrame: no frame from %s for %lld ms", mDevice.c_str(), (long long)ns2ms(kPollTimeout));
+        return true;
+    }
+
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    if (ioctl(mFd, VIDIOC_DQBUF, &buf) < 0) {
+        ALOGE("captureFrame: VIDIOC_DQBUF failed: %s", strerror(errno));
+        return errno == EAGAIN || errno == EINTR;
+    }
+
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    // As in V4L2Camera::dequeueBuf(), the capture time, if it is on our clock
+    const timeval& t = buf.timestamp;
+    nsecs_t captured = s2ns(t.tv_sec) + us2ns(t.tv_usec);
+
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC ||
+        captured <= 0 || captured > now) {
+        captured = now;
+    }
+
+    size_t size = buf.bytesused;
+
+    if (buf.index < (uint32_t)mBufCount && size > 0 && !(buf.flags & V4L2_BUF_FLAG_ERROR)) {
+        const uint8_t* data = (const uint8_t*)mMem[buf.index];
+
+        // uvcvideo doesn't set V4L2_BUF_FLAG_KEYFRAME, so the NAL units are looked at
+        bool keyframe = buf.flags & V4L2_BUF_FLAG_KEYFRAME || isKeyFrame(mFourcc, data, size);
+
+        if (keyframe) {
+            mGotKeyFrame = true;
+            mKeyFrames.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (mGotKeyFrame) {
+            mFrames.fetch_add(1, std::memory_order_relaxed);
+            mBytes.fetch_add(size, std::memory_order_relaxed);
+
+            mCallback(mCookie, data, size, captured, keyframe);
+        } else {
+            mSkipped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (ioctl(mFd, VIDIOC_QBUF, &buf) < 0) {
+        ALOGE("captureFrame: VIDIOC_QBUF failed: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+
+
+bool StreamCapture::isKeyFrame(uint32_t fourcc, const uint8_t* data, size_t size)
+{
+    /*  Looks at the NAL units up to the first slice. A keyframe starts
+        with its parameter sets, so its slice is never far in.
+    */
+    const uint8_t* end = data + size;
+    const uint8_t* p = data;
+
+    while (end - p > 3) {
+        // Each NAL unit follows a 00 00 01 start code
+        if (p[0] != 0 || p[1] != 0 || p[2] != 1) {
+            p++;
+            continue;
+        }
+        p += 3;
+
+        if (fourcc == V4L2_PIX_FMT_HEVC) {
+            int type = (p[0] >> 1) & 0x3f;
+            if (type < 32) {
+                return type >= 16 && type <= 21;    // BLA, IDR or CRA
+            }
+        } else {
+            int type = p[0] & 0x1f;
+            if (type >= 1 && type <= 5) {
+                return type == 5;                   // IDR
+            }
+        }
+    }
+
+    return false;
+}
+
+
+
+void StreamCapture::dumpStats(String8& out) const
+{
+    if (mFd < 0) {
+        return;
+    }
+
+    uint64_t frames = mFrames.load(std::memory_order_relaxed);
+    uint64_t bytes = mBytes.load(std::memory_order_relaxed);
+
+    out.appendFormat("  Passthrough: %s %c%c%c%c %dx%d, %llu frames, %llu keyframes, %llu skipped before the first, %llu bytes a frame\n",
+                     mDevice.c_str(), mFourcc & 0xFF, (mFourcc >> 8) & 0xFF,
+                     (mFourcc >> 16) & 0xFF, (mFourcc >> 24) & 0xFF, mWidth, mHeight,
+                     (unsigned long long)frames,
+                     (unsigned long long)mKeyFrames.load(std::memory_order_relaxed),
+                     (unsigned long long)mSkipped.load(std::memory_order_relaxed),
+                     (unsigned long long)(frames ? bytes / frames : 0));
+}
+
+//======================================================================
+}; // namespace android
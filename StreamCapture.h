@@ -0,0 +1,120 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _STREAM_CAPTURE_H
+#define _STREAM_CAPTURE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <utils/String8.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>               // for nsecs_t
+
+#include "V4L2Camera.h"
+
+namespace android {
+//======================================================================
+
+/*  What is at the start of each recording buffer in passthrough mode,
+    before the access unit. The access unit is the Annex B byte stream
+    of one frame, as the camera sent it.
+*/
+struct StreamFrameHeader {
+    uint32_t size;                      // bytes of access unit after the header
+    uint32_t flags;                     // STREAM_FRAME_*
+};
+
+enum {
+    STREAM_FRAME_KEYFRAME = 1,          // an IDR or IRAP frame, with its parameter sets
+};
+
+
+
+/*  Captures the H.264 or HEVC elementary stream of a UVC camera, so it can
+    be recorded with no decoding and encoding. Those cameras have a second
+    video node next to the one with the raw formats, which findDevice()
+    looks for. The preview goes on from the raw node as before.
+
+    The access units are given to a callback on a thread of our own, with
+    the driver timestamp. Nothing is given before the first keyframe, as
+    nothing can be decoded before it.
+*/
+class StreamCapture
+{
+public:
+    typedef void (*Callback)(void* cookie, const uint8_t* data, size_t size,
+                             nsecs_t timestamp, bool keyframe);
+
+    StreamCapture();
+    ~StreamCapture();
+
+    /*  The video node with the same bus_info as the camera that has fourcc,
+        or an empty string if there is none. Only the device the camera is
+        using is skipped, as it can't be streamed from twice.
+    */
+    static std::string findDevice(const std::string& camera, const char* busInfo, uint32_t fourcc);
+
+    /*  open() sets the format and maps the buffers, so that getMaxFrameSize()
+        is known before start() is called. stop() stops the stream and closes
+        the device, and can be called at any time.
+    */
+    status_t open(const std::string& device, uint32_t fourcc, int width, int height, int fps);
+    status_t start(Callback callback, void* cookie);
+    void     stop();
+
+    bool     isOpen() const { return mFd >= 0; }
+    size_t   getMaxFrameSize() const { return mMaxFrameSize; }
+    void     getSize(int& width, int& height) const { width = mWidth; height = mHeight; }
+
+    /*  Appends what was captured since open() to out, for dumpCamera() */
+    void     dumpStats(String8& out) const;
+
+private:
+    class CaptureThread : public Thread
+    {
+        StreamCapture* mCapture;
+
+    public:
+        CaptureThread(StreamCapture* capture);
+        virtual bool threadLoop();
+    };
+
+    bool     captureFrame();
+    void     freeBuffers();
+
+    static bool isKeyFrame(uint32_t fourcc, const uint8_t* data, size_t size);
+
+    std::string         mDevice;
+    int                 mFd;
+    int                 mWakeFd;                // eventfd for stop()
+    uint32_t            mFourcc;
+    int                 mWidth;
+    int                 mHeight;
+    size_t              mMaxFrameSize;          // sizeimage
+    void*               mMem[MAX_BUFFERS];
+    size_t              mMemLength[MAX_BUFFERS];
+    int                 mBufCount;
+    bool                mStreaming;
+    bool                mGotKeyFrame;           // only used by the thread
+
+    Callback            mCallback;
+    void*               mCookie;
+    sp<CaptureThread>   mThread;
+
+    // Only updated by the thread
+    std::atomic<uint64_t> mFrames;
+    std::atomic<uint64_t> mKeyFrames;
+    std::atomic<uint64_t> mSkipped;             // before the first keyframe
+    std::atomic<uint64_t> mBytes;
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
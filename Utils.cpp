@@ -40,6 +40,8 @@
  */
 
 #include "Utils.h"
+#include "Converter.h"
+#include "WorkerPool.h"
 #include <errno.h>
 #include <dirent.h>
 #include <malloc.h>
@@ -257,9 +259,89 @@ static void yuv400pto422(int * out,uint8_t *pic,int stride)
 }
 
 
-#define JPG_HUFFMAN_TABLE_LENGTH 0x01A0
+/*jpeg decoding of a macroblock to 420 planes
+* args:
+*      out: pointer to data output of idct (macroblocks yyyy u v)
+*      mb: number of blocks in the macroblock (6: 420, 4: 422, 3: 444, 1: 400)
+*      p: destination planes
+*      x, y: position of the macroblock in the picture
+*      width, height: size of the picture, the macroblock is clipped to it
+* The chroma is sampled the same way the yuvXXXpto422 functions do, and then
+* averaged over each pair of lines as yuyv_to_yvu420p does.
+*/
+static void mcutoyuv420(int *out, int mb, const struct yuv420_planes *p, int x, int y, int width, int height)
+{
+	int r, c;
+	int mw = (mb == 6 || mb == 4) ? 16 : 8;
+	int mh = (mb == 6) ? 16 : 8;
+	int *outu = out + 64 * 4;
+	int *outv = out + 64 * 5;
+
+	if (mw > width - x)
+		mw = width - x;
+	if (mh > height - y)
+		mh = height - y;
+	if (mw <= 0 || mh <= 0)
+		return;
+
+	for (r = 0; r < mh; r++)
+	{
+		uint8_t *py = p->y + (y + r) * p->ystride + x;
+		int *outy0, *outy1;
+		if (mb == 6)
+			outy0 = out + ((r & 8) << 4) + ((r & 7) << 3);
+		else
+			outy0 = out + (r << 3);
+		outy1 = outy0 + 64;
+
+		for (c = 0; c < mw; c++)
+			py[c] = CLIP(c < 8 ? outy0[c] : outy1[c - 8]);
+	}
+
+	for (r = 0; r < mh; r += 2)
+	{
+		int j = r >> 1;
+		uint8_t *pu = p->u + ((y + r) >> 1) * p->cstride + (x >> 1) * p->cstep;
+		uint8_t *pv = p->v + ((y + r) >> 1) * p->cstride + (x >> 1) * p->cstep;
+		int line0, line1, step;
 
-static const unsigned char JPEGHuffmanTable[JPG_HUFFMAN_TABLE_LENGTH] =
+		if (mb == 1)
+		{
+			for (c = 0; c < mw; c += 2)
+			{
+				*pu = 128;
+				*pv = 128;
+				pu += p->cstep;
+				pv += p->cstep;
+			}
+			continue;
+		}
+
+		switch (mb)
+		{
+			case 6:  // Both lines have the same chroma
+				line0 = j * 8; line1 = line0; step = 1;
+				break;
+			case 4:  // Same lines as yuv422pto422 uses
+				line0 = j * 8; line1 = line0 + 8; step = 1;
+				break;
+			default:
+				line0 = j * 16; line1 = line0 + 8; step = 2;
+				break;
+		}
+
+		for (c = 0; c < mw; c += 2)
+		{
+			int k = (c >> 1) * step;
+			*pu = (CLIP(128 + outu[line0 + k]) + CLIP(128 + outu[line1 + k])) >> 1;
+			*pv = (CLIP(128 + outv[line0 + k]) + CLIP(128 + outv[line1 + k])) >> 1;
+			pu += p->cstep;
+			pv += p->cstep;
+		}
+	}
+}
+
+const unsigned char JPEGHuffmanTable[JPG_HUFFMAN_TABLE_LENGTH] =
 {
 	// luminance dc - length bits
 	0x00,
@@ -338,7 +420,6 @@ struct jpeg_decdata
 {
 	int dcts[6 * 64 + 16];
 	int out[64 * 6];
-	int dquant[3][64];
 };
 
 struct in
@@ -566,42 +647,314 @@ static int dec_checkmarker(struct ctx* ctx)
 	return 0;
 }
 
+/* All the decoders share their workers, so that more cameras don't mean
+   more threads. The first one decoding a frame gets them, the others decode
+   on their own thread. The pool is made with the first decoder that wants
+   one, and dropped with the last one */
+static android::Mutex dec_pool_lock;		/* held while the pool decodes */
+static android::WorkerPool *dec_pool;		/* protected by dec_pool_lock */
+static int dec_pool_users;			/* protected by dec_pool_lock */
+
+/* The frame being decoded, as the workers see it */
+struct jpeg_frame
+{
+	uint8_t *pic;		/* the yuyv picture */
+	int stride;
+	const struct yuv420_planes *planes; /* or else the 420 planes */
+	int pw, ph;		/* size the planes are clipped to */
+	int mb;			/* blocks per mcu */
+	int mcusx, mcusy;
+	int mcuw, mcuh;		/* mcu size in pixels */
+	int xpitch, ypitch;	/* mcu size in the yuyv picture */
+	ftopict convert;
+	int dquant[3][64];
+};
+
+/* Everything that is kept from one frame to the next */
+struct jpeg_decoder
+{
+	struct ctx ctx;
+	int hasDefaultHuffman;		/* ctx.dhuff has the built in tables */
+	android::WorkerPool *pool;	/* dec_pool, or NULL to decode on the caller only */
+	struct jpeg_decdata *decdata;	/* one for each worker */
+
+	/* Restart interval decoding */
+	std::vector<uint8_t*> segments;	/* where each interval starts */
+	int lastMarker;			/* marker after the last interval */
+
+	/* Row band decoding */
+	int16_t *coefs;			/* the huffman decoded mcus */
+	uint8_t *maxs;			/* and their max values, 6 per mcu */
+	int ncoefs;			/* coefs there is room for */
+	android::Mutex rowLock;
+	android::Condition rowCond;
+	int rowsDecoded;		/* protected by rowLock, -1 on error */
+};
+
+/* idct of the decoded mcu in d->dcts and write it to the picture
+* args:
+*      max:  max index for each block, as decode_mcus returns it
+*      mx, my: position of the mcu
+*/
+static void put_mcu(struct jpeg_frame *f, struct jpeg_decdata *d, int *max, int mx, int my)
+{
+	switch (f->mb)
+	{
+		case 6:
+			idct(d->dcts, d->out, f->dquant[0],
+				IFIX(128.5), max[0]);
+			idct(d->dcts + 64, d->out + 64,
+				f->dquant[0], IFIX(128.5), max[1]);
+			idct(d->dcts + 128, d->out + 128,
+				f->dquant[0], IFIX(128.5), max[2]);
+			idct(d->dcts + 192, d->out + 192,
+				f->dquant[0], IFIX(128.5), max[3]);
+			idct(d->dcts + 256, d->out + 256,
+				f->dquant[1], IFIX(0.5), max[4]);
+			idct(d->dcts + 320, d->out + 320,
+				f->dquant[2], IFIX(0.5), max[5]);
+			break;
+
+		case 4:
+			idct(d->dcts, d->out, f->dquant[0],
+				IFIX(128.5), max[0]);
+			idct(d->dcts + 64, d->out + 64,
+				f->dquant[0], IFIX(128.5), max[1]);
+			idct(d->dcts + 128, d->out + 256,
+					f->dquant[1], IFIX(0.5), max[4]);
+			idct(d->dcts + 192, d->out + 320,
+				f->dquant[2], IFIX(0.5), max[5]);
+			break;
+
+		case 3:
+			idct(d->dcts, d->out, f->dquant[0],
+				IFIX(128.5), max[0]);
+			idct(d->dcts + 64, d->out + 256,
+				f->dquant[1], IFIX(0.5), max[4]);
+			idct(d->dcts + 128, d->out + 320,
+				f->dquant[2], IFIX(0.5), max[5]);
+			break;
+
+		case 1:
+			idct(d->dcts, d->out, f->dquant[0],
+				IFIX(128.5), max[0]);
+			break;
+	} // switch enc411
+
+	if (f->planes)
+		mcutoyuv420(d->out, f->mb, f->planes, mx * f->mcuw, my * f->mcuh, f->pw, f->ph);
+	else
+		f->convert(d->out, f->pic + my * f->ypitch + mx * f->xpitch, f->stride); //convert to 422
+}
+
+/* decode all the mcus on the calling thread */
+static int decode_serial(struct jpeg_decoder *dec, struct jpeg_frame *f)
+{
+	struct ctx *ctx = &dec->ctx;
+	struct jpeg_decdata *d = dec->decdata;
+	int max[6] = { 0, 0, 0, 0, 0, 0 };
+	int mx, my;
+
+	for (my = 0; my < f->mcusy; my++)
+	{
+		for (mx = 0; mx < f->mcusx; mx++)
+		{
+			if (ctx->info.dri && !--ctx->info.nm)
+				if (dec_checkmarker(ctx))
+					return ERR_WRONG_MARKER;
+			decode_mcus(&ctx->in, d->dcts, f->mb, ctx->dscans, max);
+			put_mcu(f, d, max, mx, my);
+		}
+	}
+
+	return dec_readmarker(&ctx->in) == M_EOI ? 0 : ERR_NO_EOI;
+}
+
+/* find where each restart interval starts. A marker that is not the next
+* restart marker means the frame can't be split, and then the serial decoder
+* reports the error.
+* args:
+*      count: number of intervals
+*/
+static int find_restarts(struct jpeg_decoder *dec, int count)
+{
+	uint8_t *p = dec->ctx.datap;
+	int rm = M_RST0;
+
+	dec->segments.clear();
+	dec->segments.push_back(p);
+
+	while ((int)dec->segments.size() < count)
+	{
+		int m;
+		if (*p++ != 0xff)
+			continue;
+		if ((m = *p++) == 0)
+			continue;
+		if (m != rm)
+			return -1;
+		rm = (rm + 1) & ~0x08;
+		dec->segments.push_back(p);
+	}
+	return 0;
+}
+
+/* decode the restart intervals in parallel. Each one starts with fresh dc
+* values at a known place, so the workers need nothing from each other.
+*/
+static int decode_restarts(struct jpeg_decoder *dec, struct jpeg_frame *f)
+{
+	int total = f->mcusx * f->mcusy;
+	int dri = dec->ctx.info.dri;
+	int count = (total + dri - 1) / dri;
+	int jobs, per;
+
+	if (find_restarts(dec, count) < 0)
+		return -1;
+
+	// A few jobs per worker so that they finish about together
+	jobs = dec->pool->size() * 4;
+	if (jobs > count)
+		jobs = count;
+	per = (count + jobs - 1) / jobs;
+	jobs = (count + per - 1) / per;
+
+	dec->lastMarker = 0;
+	dec->pool->run(jobs, [&](int job, int worker) {
+		struct jpeg_decdata *d = dec->decdata + worker;
+		struct scan scans[MAXCOMP];
+		struct in in;
+		int max[6] = { 0, 0, 0, 0, 0, 0 };
+		int seg, n, i;
+
+		memset(&in, 0, sizeof(in));
+		memcpy(scans, dec->ctx.dscans, sizeof(scans));
+
+		for (seg = job * per; seg < count && seg < (job + 1) * per; seg++)
+		{
+			int last = (seg + 1) * dri;
+			if (last > total)
+				last = total;
+
+			setinput(&in, dec->segments[seg]);
+			for (i = 0; i < dec->ctx.info.ns; i++)
+				scans[i].dc = 0;
+
+			for (n = seg * dri; n < last; n++)
+			{
+				decode_mcus(&in, d->dcts, f->mb, scans, max);
+				put_mcu(f, d, max, n % f->mcusx, n / f->mcusx);
+			}
+
+			if (seg == count - 1)
+				dec->lastMarker = dec_readmarker(&in);
+		}
+	});
+
+	return dec->lastMarker == M_EOI ? 0 : ERR_NO_EOI;
+}
+
+/* huffman decode on one thread while the others do the idct and write
+* out the rows of mcus already decoded.
+*/
+static int decode_rows(struct jpeg_decoder *dec, struct jpeg_frame *f)
+{
+	int total = f->mcusx * f->mcusy;
+	int bsize = f->mb * 64;
+	int err = 0;
+
+	if (dec->ncoefs < total * bsize)
+	{
+		free(dec->coefs);
+		free(dec->maxs);
+		dec->coefs = (int16_t*) malloc(total * bsize * sizeof(int16_t));
+		dec->maxs = (uint8_t*) malloc(total * 6);
+		dec->ncoefs = (dec->coefs && dec->maxs) ? total * bsize : 0;
+		if (!dec->ncoefs)
+			return -1;
+	}
+
+	dec->rowsDecoded = 0;
+
+	// Job 0 is always handed out first, so the decoding never waits
+	dec->pool->run(f->mcusy + 1, [&](int job, int worker) {
+		struct jpeg_decdata *d = dec->decdata + worker;
+		int max[6] = { 0, 0, 0, 0, 0, 0 };
+		int mx, my, i;
+
+		if (job == 0)
+		{
+			for (my = 0; my < f->mcusy; my++)
+			{
+				for (mx = 0; mx < f->mcusx; mx++)
+				{
+					int n = my * f->mcusx + mx;
+					int16_t *c = dec->coefs + n * bsize;
+					decode_mcus(&dec->ctx.in, d->dcts, f->mb, dec->ctx.dscans, max);
+					for (i = 0; i < bsize; i++)
+						c[i] = d->dcts[i];
+					for (i = 0; i < f->mb; i++)
+						dec->maxs[n * 6 + i] = max[i];
+				}
+
+				android::Mutex::Autolock lock(dec->rowLock);
+				dec->rowsDecoded = my + 1;
+				dec->rowCond.broadcast();
+			}
+
+			if (dec_readmarker(&dec->ctx.in) != M_EOI)
+				err = ERR_NO_EOI;
+			return;
+		}
+
+		my = job - 1;
+		{
+			android::Mutex::Autolock lock(dec->rowLock);
+			while (dec->rowsDecoded <= my)
+				dec->rowCond.wait(dec->rowLock);
+		}
+
+		for (mx = 0; mx < f->mcusx; mx++)
+		{
+			int n = my * f->mcusx + mx;
+			int16_t *c = dec->coefs + n * bsize;
+			for (i = 0; i < bsize; i++)
+				d->dcts[i] = c[i];
+			for (i = 0; i < f->mb; i++)
+				max[i] = dec->maxs[n * 6 + i];
+			put_mcu(f, d, max, mx, my);
+		}
+	});
+
+	return err;
+}
+
 /*jpeg decode
 * args:
+*      dec:  the decoder
 *      pic:  pointer to picture data ( decoded image - yuyv format)
+*      planes: or else the 420 planes for the decoded image
+*      pw, ph: size the planes are clipped to
 *      buf:  pointer to input data ( compressed jpeg )
 *      with: picture width
 *      height: picture height
 */
-int jpeg_decode(uint8_t *pic, int stride, uint8_t *buf, int width, int height)
+static int jpeg_decode_to(struct jpeg_decoder *dec, uint8_t *pic, int stride, const struct yuv420_planes *planes, int pw, int ph, uint8_t *buf, int width, int height)
 {
-	struct ctx ctx;
-	struct jpeg_decdata *decdata;
+	struct ctx &ctx = dec->ctx;
+	struct jpeg_frame frame;
 	int i=0, j=0, m=0, tac=0, tdc=0;
 	int intwidth=0, intheight=0;
-	int mcusx=0, mcusy=0, mx=0, my=0;
-	int ypitch=0 ,xpitch=0,x=0,y=0;
-	int mb=0;
-	int max[6];
-	ftopict convert;
 	int err = 0;
 	int isInitHuffman = 0;
-	decdata = (struct jpeg_decdata*) calloc(1, sizeof(struct jpeg_decdata));
-
-	for(i=0;i<6;i++)
-		max[i]=0;
 
-	if (!decdata)
-	{
-		err = -1;
-		goto error;
-	}
 	if (buf == NULL)
 	{
 		err = -1;
 		goto error;
 	}
 	ctx.datap = buf;
+	ctx.info.dri = 0;
 	/*check SOI (0xFFD8)*/
 	if (getbyte(&ctx) != 0xff)
 	{
@@ -709,11 +1062,16 @@ int jpeg_decode(uint8_t *pic, int stride, uint8_t *buf, int width, int height)
 		ALOGE("hmm FW error,not seq DCT ??\n");
 	}
 
-	/*build huffman tables*/
-	if(!isInitHuffman)
+	/*build huffman tables. The built in ones are kept for the next frame*/
+	if (isInitHuffman)
+	{
+		dec->hasDefaultHuffman = 0;
+	}
+	else if (!dec->hasDefaultHuffman)
 	{
 		if(huffman_init(&ctx) < 0)
 			return -ERR_BAD_TABLES;
+		dec->hasDefaultHuffman = 1;
 	}
 	/*
 	if (ctx->dscans[0].cid != 1 || ctx->dscans[1].cid != 2 || ctx->dscans[2].cid != 3)
@@ -742,44 +1100,53 @@ int jpeg_decode(uint8_t *pic, int stride, uint8_t *buf, int width, int height)
 #endif
 	}
 
+	frame.pic = pic;
+	frame.stride = stride;
+	frame.planes = planes;
+	frame.pw = pw;
+	frame.ph = ph;
+
 	switch (ctx.dscans[0].hv)
 	{
 		case 0x22: // 411
-			mb=6;
-			mcusx = width >> 4;
-			mcusy = height >> 4;
+			frame.mb=6;
+			frame.mcusx = width >> 4;
+			frame.mcusy = height >> 4;
 
-			xpitch = 16 * 2;
+			frame.xpitch = 16 * 2;
 
-			ypitch = 16 * stride;
-			convert = yuv420pto422; //choose the right conversion function
+			frame.ypitch = 16 * stride;
+			frame.mcuw = 16; frame.mcuh = 16;
+			frame.convert = yuv420pto422; //choose the right conversion function
 			break;
 		case 0x21: //422
-			mb=4;
-			mcusx = width >> 4;
-			mcusy = height >> 3;
+			frame.mb=4;
+			frame.mcusx = width >> 4;
+			frame.mcusy = height >> 3;
 
-			xpitch = 16 * 2;
+			frame.xpitch = 16 * 2;
 
-			ypitch = 8 * stride;
-			convert = yuv422pto422; //choose the right conversion function
+			frame.ypitch = 8 * stride;
+			frame.mcuw = 16; frame.mcuh = 8;
+			frame.convert = yuv422pto422; //choose the right conversion function
 			break;
 		case 0x11: //444
-			mcusx = width >> 3;
-			mcusy = height >> 3;
+			frame.mcusx = width >> 3;
+			frame.mcusy = height >> 3;
 
-			xpitch = 8 * 2;
+			frame.xpitch = 8 * 2;
 
-			ypitch = 8 * stride;
+			frame.ypitch = 8 * stride;
+			frame.mcuw = 8; frame.mcuh = 8;
 			if (ctx.info.ns==1)
 			{
-				mb = 1;
-				convert = yuv400pto422; //choose the right conversion function
+				frame.mb = 1;
+				frame.convert = yuv400pto422; //choose the right conversion function
 			}
 			else
 			{
-				mb=3;
-				convert = yuv444pto422; //choose the right conversion function
+				frame.mb=3;
+				frame.convert = yuv444pto422; //choose the right conversion function
 			}
 			break;
 		default:
@@ -788,85 +1155,136 @@ int jpeg_decode(uint8_t *pic, int stride, uint8_t *buf, int width, int height)
 			break;
 	}
 
-	idctqtab(ctx.quant[ctx.dscans[0].tq], decdata->dquant[0]);
-	idctqtab(ctx.quant[ctx.dscans[1].tq], decdata->dquant[1]);
-	idctqtab(ctx.quant[ctx.dscans[2].tq], decdata->dquant[2]);
+	idctqtab(ctx.quant[ctx.dscans[0].tq], frame.dquant[0]);
+	idctqtab(ctx.quant[ctx.dscans[1].tq], frame.dquant[1]);
+	idctqtab(ctx.quant[ctx.dscans[2].tq], frame.dquant[2]);
 	setinput(&ctx.in, ctx.datap);
 	dec_initscans(&ctx);
 
 	ctx.dscans[0].next = 2;
 	ctx.dscans[1].next = 1;
 	ctx.dscans[2].next = 0;	/* 4xx encoding */
-	for (my = 0,y=0; my < mcusy; my++,y+=ypitch)
+
+	/* Split the work if we can. Else, if another decoder has the threads,
+	   or if the restart markers are not where they should be, decode it
+	   all here */
+	if (dec->pool && frame.mcusy > 1 && dec_pool_lock.tryLock() == 0)
 	{
-		for (mx = 0,x=0; mx < mcusx; mx++,x+=xpitch)
+		int done = 0;
+
+		if (!ctx.info.dri)
 		{
-			if (ctx.info.dri && !--ctx.info.nm)
-				if (dec_checkmarker(&ctx))
-				{
-					err = ERR_WRONG_MARKER;
-					goto error;
-				}
-			switch (mb)
+			err = decode_rows(dec, &frame);
+			done = 1;
+		}
+		else if (ctx.info.dri < frame.mcusx * frame.mcusy &&
+		         (err = decode_restarts(dec, &frame)) >= 0)
+			done = 1;
+
+		dec_pool_lock.unlock();
+		if (done)
+			return err;
+	}
+
+	err = decode_serial(dec, &frame);
+error:
+	return err;
+}
+
+struct jpeg_decoder* jpeg_decoder_create(int threads)
+{
+	struct jpeg_decoder *dec = new jpeg_decoder();
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > 1)
+	{
+		android::Mutex::Autolock lock(dec_pool_lock);
+
+		if (!dec_pool)
+		{
+			dec_pool = new android::WorkerPool(threads);
+
+			/* No worker could be started, there is nothing to share */
+			if (dec_pool->size() <= 1)
 			{
-				case 6:
-					decode_mcus(&ctx.in, decdata->dcts, mb, ctx.dscans, max);
-					idct(decdata->dcts, decdata->out, decdata->dquant[0],
-						IFIX(128.5), max[0]);
-					idct(decdata->dcts + 64, decdata->out + 64,
-						decdata->dquant[0], IFIX(128.5), max[1]);
-					idct(decdata->dcts + 128, decdata->out + 128,
-						decdata->dquant[0], IFIX(128.5), max[2]);
-					idct(decdata->dcts + 192, decdata->out + 192,
-						decdata->dquant[0], IFIX(128.5), max[3]);
-					idct(decdata->dcts + 256, decdata->out + 256,
-						decdata->dquant[1], IFIX(0.5), max[4]);
-					idct(decdata->dcts + 320, decdata->out + 320,
-						decdata->dquant[2], IFIX(0.5), max[5]);
-					break;
-
-				case 4:
-					decode_mcus(&ctx.in, decdata->dcts, mb, ctx.dscans, max);
-					idct(decdata->dcts, decdata->out, decdata->dquant[0],
-						IFIX(128.5), max[0]);
-					idct(decdata->dcts + 64, decdata->out + 64,
-						decdata->dquant[0], IFIX(128.5), max[1]);
-					idct(decdata->dcts + 128, decdata->out + 256,
-							decdata->dquant[1], IFIX(0.5), max[4]);
-					idct(decdata->dcts + 192, decdata->out + 320,
-						decdata->dquant[2], IFIX(0.5), max[5]);
-					break;
-
-				case 3:
-					decode_mcus(&ctx.in, decdata->dcts, mb, ctx.dscans, max);
-					idct(decdata->dcts, decdata->out, decdata->dquant[0],
-						IFIX(128.5), max[0]);
-					idct(decdata->dcts + 64, decdata->out + 256,
-						decdata->dquant[1], IFIX(0.5), max[4]);
-					idct(decdata->dcts + 128, decdata->out + 320,
-						decdata->dquant[2], IFIX(0.5), max[5]);
-					break;
-
-				case 1:
-					decode_mcus(&ctx.in, decdata->dcts, mb, ctx.dscans, max);
-					idct(decdata->dcts, decdata->out, decdata->dquant[0],
-						IFIX(128.5), max[0]);
-					break;
-			} // switch enc411
-			convert(decdata->out,pic+y+x,stride); //convert to 422
+				delete dec_pool;
+				dec_pool = NULL;
+			}
 		}
+
+		if (dec_pool)
+		{
+			dec_pool_users++;
+			dec->pool = dec_pool;
+
+			/* The pool keeps the size of the first decoder */
+			threads = dec->pool->size();
+		}
+		else
+			threads = 1;
 	}
 
-	m = dec_readmarker(&ctx.in);
-	if (m != M_EOI)
+	dec->decdata = (struct jpeg_decdata*) calloc(threads, sizeof(struct jpeg_decdata));
+	if (!dec->decdata)
 	{
-		err = ERR_NO_EOI;
-		goto error;
+		jpeg_decoder_destroy(dec);
+		return NULL;
 	}
-	free(decdata);
-	return 0;
-error:
-	free(decdata);
+	return dec;
+}
+
+void jpeg_decoder_destroy(struct jpeg_decoder *dec)
+{
+	if (!dec)
+		return;
+	if (dec->pool)
+	{
+		android::Mutex::Autolock lock(dec_pool_lock);
+
+		if (--dec_pool_users == 0)
+		{
+			delete dec_pool;
+			dec_pool = NULL;
+		}
+	}
+	free(dec->decdata);
+	free(dec->coefs);
+	free(dec->maxs);
+	delete dec;
+}
+
+int jpeg_decoder_decode(struct jpeg_decoder *dec, uint8_t *pic, int stride, uint8_t *buf, int width, int height)
+{
+	return jpeg_decode_to(dec, pic, stride, NULL, 0, 0, buf, width, height);
+}
+
+int jpeg_decoder_decode_yuv420(struct jpeg_decoder *dec, const struct yuv420_planes *dst, int dstWidth, int dstHeight, uint8_t *buf, int width, int height)
+{
+	return jpeg_decode_to(dec, NULL, 0, dst, dstWidth, dstHeight, buf, width, height);
+}
+
+int jpeg_decode(uint8_t *pic, int stride, uint8_t *buf, int width, int height)
+{
+	struct jpeg_decoder *dec = jpeg_decoder_create(1);
+	int err;
+
+	if (!dec)
+		return -1;
+	err = jpeg_decoder_decode(dec, pic, stride, buf, width, height);
+	jpeg_decoder_destroy(dec);
+	return err;
+}
+
+int jpeg_decode_yuv420(const struct yuv420_planes *dst, int dstWidth, int dstHeight, uint8_t *buf, int width, int height)
+{
+	struct jpeg_decoder *dec = jpeg_decoder_create(1);
+	int err;
+
+	if (!dec)
+		return -1;
+	err = jpeg_decoder_decode_yuv420(dec, dst, dstWidth, dstHeight, buf, width, height);
+	jpeg_decoder_destroy(dec);
 	return err;
 }
 
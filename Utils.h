@@ -50,6 +50,8 @@
 
 typedef std::vector<std::string> StringVec;
 
+struct yuv420_planes;
+
 //======================================================================
 /*  Shorthands for shared_ptr.
 */
@@ -70,8 +72,33 @@ mkRef(Args&& ...args)
 namespace utils {
 //======================================================================
 
+/*  A JPEG decoder that keeps its tables and buffers from one frame to the
+    next. With more than one thread the frame is decoded in parallel: the
+    restart intervals when the stream has them, else the huffman decoding
+    runs on one thread while the others do the IDCT and colour conversion
+    of the rows of MCUs decoded so far. Only one thread may use it at a time.
+*/
+struct jpeg_decoder;
+
+struct jpeg_decoder* jpeg_decoder_create(int threads);
+void jpeg_decoder_destroy(struct jpeg_decoder *dec);
+int  jpeg_decoder_decode(struct jpeg_decoder *dec, uint8_t *pic, int stride, uint8_t *buf, int width, int height);
+int  jpeg_decoder_decode_yuv420(struct jpeg_decoder *dec, const struct yuv420_planes *dst, int dstWidth, int dstHeight, uint8_t *buf, int width, int height);
+
+/*  The standard huffman tables of the JPEG spec (K.3), as the body of a DHT
+    segment. MJPEG cameras leave them out of their frames.
+*/
+#define JPG_HUFFMAN_TABLE_LENGTH 0x01A0
+extern const unsigned char JPEGHuffmanTable[JPG_HUFFMAN_TABLE_LENGTH];
+
+/*  One off decoding, on the calling thread */
 int jpeg_decode(uint8_t *pic,int stride, uint8_t *buf, int width, int height);
 
+/*  Decodes straight to 4:2:0 planes, clipping the picture to dstWidth x dstHeight.
+    The result is the same as jpeg_decode() followed by yuyv_to_yvu420p().
+*/
+int jpeg_decode_yuv420(const struct yuv420_planes *dst, int dstWidth, int dstHeight, uint8_t *buf, int width, int height);
+
 /*******Error codes *******/
 #define ERR_NO_SOI 1
 #define ERR_NOT_8BIT 2
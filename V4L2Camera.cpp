@@ -17,15 +17,20 @@ extern "C" {
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
-#include <sys/select.h>
 #include "uvc_compat.h"
 #include "v4l2_formats.h"
 };
 
+#include <map>
+
 #include "V4L2Camera.h"
 #include "Utils.h"
 #include "Converter.h"
+#include "WorkerPool.h"
+#include "FormatCache.h"
 
 using namespace std;
 
@@ -49,13 +54,71 @@ static int my_abs(int x)
 }
 
 
+// The compressed video formats, that StreamCapture records as they are
+// and we never capture from
+static bool isCompressedVideo(uint32_t pixfmt)
+{
+    return pixfmt == V4L2_PIX_FMT_H264 || pixfmt == V4L2_PIX_FMT_HEVC;
+}
+
+
 //======================================================================
 
+/*  The device each camera has found, so that with several cameras each
+    one keeps to its own device, even while it is closed.
+*/
+static Mutex                                gDevicesLock;
+static std::map<string, const V4L2Camera*>  gDevices;       // protected by gDevicesLock
+
+static bool claimDevice(const string& device, const V4L2Camera* owner)
+{
+    Mutex::Autolock lock(gDevicesLock);
+    auto it = gDevices.find(device);
+
+    if (it != gDevices.end()) {
+        return it->second == owner;
+    }
+
+    gDevices[device] = owner;
+    return true;
+}
+
+static void releaseDevice(const string& device, const V4L2Camera* owner)
+{
+    Mutex::Autolock lock(gDevicesLock);
+    auto it = gDevices.find(device);
+
+    if (it != gDevices.end() && it->second == owner) {
+        gDevices.erase(it);
+    }
+}
+
+
+
 V4L2Camera::V4L2Camera ()
-  : haveEnumerated(false),
-    vfd(-1)
+  : vfd(-1),
+    replay(NULL),
+    wakeFd(-1),
+    mjpegBackend(CameraSpec::MJPEG_BUILTIN),
+    bufferCount(NB_BUFFER),
+    lowLatency(false),
+    recordLimit(0),
+    mjpegDecoder(NULL),
+    mFormat(NULL),
+    mDirect(NULL),
+    mHaveSequence(false),
+    mDriverDropped(0),
+    mStaleFrames(0)
 {
+    memset(&mFrameInfo, 0, sizeof(mFrameInfo));
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ALOGE_IF(wakeFd < 0, "V4L2Camera: no eventfd, the frame waits cannot be interrupted: %s", strerror(errno));
+
     videoIn = (struct vdIn *) calloc (1, sizeof (struct vdIn));
+    videoIn->memory = V4L2_MEMORY_MMAP;
+    videoIn->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    resetStats();
 }
 
 
@@ -63,7 +126,16 @@ V4L2Camera::V4L2Camera ()
 V4L2Camera::~V4L2Camera()
 {
     Close();
+    delete mjpegDecoder;
     free(videoIn);
+
+    if (!lastDevice.empty()) {
+        releaseDevice(lastDevice, this);
+    }
+
+    if (wakeFd >= 0) {
+        close(wakeFd);
+    }
 }
 
 
@@ -73,15 +145,34 @@ int V4L2Camera::Open(const CameraSpec& spec)
     /* Close the previous instance, if any */
     Close();
 
-    if (!tryDevices(spec)) {
+    if (!spec.replayFile.empty() ? !openReplay(spec) : !tryDevices(spec)) {
         return -1;
     }
 
-    /*  Enumerate all available frame formats if we already done it.
+    mjpegBackend = spec.mjpegDecoder;
+    bufferCount = spec.bufferCount ? spec.bufferCount : NB_BUFFER;
+    lowLatency = spec.lowLatency;
+    recordFile = spec.recordFile;
+    recordLimit = (size_t)spec.recordLimit << 20;
+    converter_set_threads(spec.converterThreads ? spec.converterThreads : WorkerPool::cpuCount(4));
+
+    /*  Enumerate all available frame formats, unless we already know
+        them for this camera
     */
-    if (!haveEnumerated) {
-        EnumFrameFormats(spec.preferredSize);
-        haveEnumerated = true;
+    FormatCache::setFile(spec.formatCache);
+    string key = FormatCache::deviceKey(lastDevice, videoIn->cap);
+
+    if (key != deviceKey) {
+        if (FormatCache::getModes(key, m_AllFmts)) {
+            ALOGD("Open: using the cached modes of %s", key.c_str());
+        } else {
+            EnumFrameFormats();
+            if (!m_AllFmts.isEmpty()) {
+                FormatCache::putModes(key, m_AllFmts);
+            }
+        }
+        SelectBestFormats(spec.preferredSize);
+        deviceKey = key;
     }
 
     ALOGD("Opened");
@@ -97,21 +188,31 @@ bool V4L2Camera::tryDevices(const CameraSpec& spec)
         the capabilities are in videoIn->cap
     */
 
-    if (!lastDevice.empty() && tryOneDevice(lastDevice)) {
+    bool lastOk = !lastDevice.empty() && !utils::contains(spec.nodevices, lastDevice) &&
+                  (!spec.onlyDevices || utils::contains(spec.devices, lastDevice));
+
+    if (lastOk && tryOneDevice(lastDevice)) {
         return true;
     }
 
     bool ok     = false;
-    auto videos = utils::listVideos();
+    StringVec videos;
+
+    if (spec.onlyDevices) {
+        // A camera with devices of its own looks for nothing else
+        videos = spec.devices;
+    } else {
+        videos = utils::listVideos();
 #if 0
-    for (auto& v : videos) {
-        ALOGD("tryDevices: video %s", v.c_str());
-    }
+        for (auto& v : videos) {
+            ALOGD("tryDevices: video %s", v.c_str());
+        }
 #endif
-    // Import some we are asked to try
-    for (auto& d : spec.devices) {
-        if (!utils::contains(videos, d)) {
-            videos.push_back(d);
+        // Import some we are asked to try
+        for (auto& d : spec.devices) {
+            if (!utils::contains(videos, d)) {
+                videos.push_back(d);
+            }
         }
     }
 
@@ -124,11 +225,21 @@ bool V4L2Camera::tryDevices(const CameraSpec& spec)
             continue;
         }
 
+        // Another camera has it
+        if (!claimDevice(v, this)) {
+            continue;
+        }
+
         if (tryOneDevice(v)) {
             ok = true;
+            if (!lastDevice.empty()) {
+                releaseDevice(lastDevice, this);
+            }
             lastDevice = v;
             break;
         }
+
+        releaseDevice(v, this);
     }
 
     return ok;
@@ -136,6 +247,34 @@ bool V4L2Camera::tryDevices(const CameraSpec& spec)
 
 
 
+/*  Opens a capture file as if it were the camera. It takes no device, so
+    it may be played while another camera has the one that recorded it.
+*/
+bool V4L2Camera::openReplay(const CameraSpec& spec)
+{
+    replay = new FrameReplay();
+    if (replay->open(spec.replayFile, spec.replayRealtime) != NO_ERROR) {
+        delete replay;
+        replay = NULL;
+        return false;
+    }
+
+    vfd = replay->fd();
+    memset(videoIn, 0, sizeof (struct vdIn));
+    videoIn->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(VIDIOC_QUERYCAP, &videoIn->cap);
+
+    if (!lastDevice.empty() && lastDevice != spec.replayFile) {
+        releaseDevice(lastDevice, this);
+    }
+    lastDevice = spec.replayFile;
+
+    ALOGI("%s: Replayed as fd %d", lastDevice.c_str(), vfd);
+    return true;
+}
+
+
+
 bool V4L2Camera::tryOneDevice(const string& device)
 {
     bool ok = false;
@@ -146,11 +285,27 @@ bool V4L2Camera::tryOneDevice(const string& device)
 
         memset(videoIn, 0, sizeof (struct vdIn));
 
-        if (ioctl(vfd, VIDIOC_QUERYCAP, &videoIn->cap) >= 0) {
-            ok = videoIn->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE &&
-                 videoIn->cap.capabilities & V4L2_CAP_STREAMING;
+        if (xioctl(VIDIOC_QUERYCAP, &videoIn->cap) >= 0) {
+            // What this node can do, rather than the whole device, if the driver tells
+            uint32_t caps = (videoIn->cap.capabilities & V4L2_CAP_DEVICE_CAPS) ?
+                videoIn->cap.device_caps : videoIn->cap.capabilities;
+
+            // The SoC ISPs only have the multi-planar API. The single-planar
+            // one is used when there are both.
+            if (caps & V4L2_CAP_VIDEO_CAPTURE) {
+                videoIn->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            } else if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+                videoIn->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+                ALOGI("%s: Multi-planar", device.c_str());
+            }
+
+            ok = videoIn->type != 0 && caps & V4L2_CAP_STREAMING;
             if (!ok) {
                 ALOGW("%s: Doesn't support streaming!", device.c_str());
+            } else if (!hasRawFormat()) {
+                // The H.264 node of a UVC camera, which StreamCapture uses
+                ALOGI("%s: Only has compressed video", device.c_str());
+                ok = false;
             }
         } else {
             ALOGW("%s: Failed to query capabilities (%d: %s)", device.c_str(), errno, strerror(errno));
@@ -168,6 +323,28 @@ bool V4L2Camera::tryOneDevice(const string& device)
 
 
 
+bool V4L2Camera::hasRawFormat() const
+{
+    struct v4l2_fmtdesc fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = videoIn->type;
+
+    // A driver that doesn't list its formats is given the benefit of the doubt
+    bool listed = false;
+
+    while (xioctl(VIDIOC_ENUM_FMT, &fmt) >= 0) {
+        if (!isCompressedVideo(fmt.pixelformat)) {
+            return true;
+        }
+        listed = true;
+        fmt.index++;
+    }
+
+    return !listed;
+}
+
+
+
 void V4L2Camera::Close ()
 {
     /* Release the temporary buffer, if any */
@@ -176,8 +353,13 @@ void V4L2Camera::Close ()
         videoIn->tmpBuffer = NULL;
     }
 
-    /* Close the file descriptor */
-    if (vfd >= 0) {
+    /* Close the file descriptor, which a replay owns */
+    if (replay != NULL) {
+        ALOGD("Closed the replay of %s", lastDevice.c_str());
+        delete replay;
+        replay = NULL;
+        vfd = -1;
+    } else if (vfd >= 0) {
         ALOGD("Closed fd %d", vfd);
         close(vfd);
         vfd = -1;
@@ -186,42 +368,10 @@ void V4L2Camera::Close ()
 
 
 
-int V4L2Camera::Init(int width, int height, int fps)
+int V4L2Camera::Init(int width, int height, int fps, int heldFrames)
 {
     ALOGD("Init %d x %d, %d fps", width, height, fps);
 
-    /* Initialize the capture to the specified width and height */
-    static const struct {
-        int fmt;            /* PixelFormat */
-        int bpp;            /* bytes per pixel */
-        int isplanar;       /* If format is planar or not */
-        int allowscrop;     /* If we support cropping with this pixel format */
-    } pixFmtsOrder[] = {
-        {V4L2_PIX_FMT_YUYV,     2,0,1},
-        {V4L2_PIX_FMT_YVYU,     2,0,1},
-        {V4L2_PIX_FMT_UYVY,     2,0,1},
-        {V4L2_PIX_FMT_YYUV,     2,0,1},
-        {V4L2_PIX_FMT_SPCA501,  2,0,0},
-        {V4L2_PIX_FMT_SPCA505,  2,0,0},
-        {V4L2_PIX_FMT_SPCA508,  2,0,0},
-        {V4L2_PIX_FMT_YUV420,   0,1,0},
-        {V4L2_PIX_FMT_YVU420,   0,1,0},
-        {V4L2_PIX_FMT_NV12,     0,1,0},
-        {V4L2_PIX_FMT_NV21,     0,1,0},
-        {V4L2_PIX_FMT_NV16,     0,1,0},
-        {V4L2_PIX_FMT_NV61,     0,1,0},
-        {V4L2_PIX_FMT_Y41P,     0,0,0},
-        {V4L2_PIX_FMT_SGBRG8,   0,0,0},
-        {V4L2_PIX_FMT_SGRBG8,   0,0,0},
-        {V4L2_PIX_FMT_SBGGR8,   0,0,0},
-        {V4L2_PIX_FMT_SRGGB8,   0,0,0},
-        {V4L2_PIX_FMT_BGR24,    3,0,1},
-        {V4L2_PIX_FMT_RGB24,    3,0,1},
-        {V4L2_PIX_FMT_MJPEG,    0,1,0},
-        {V4L2_PIX_FMT_JPEG,     0,1,0},
-        {V4L2_PIX_FMT_GREY,     1,0,1},
-        {V4L2_PIX_FMT_Y16,      2,0,1},
-    };
 
     int ret;
 
@@ -272,39 +422,61 @@ int V4L2Camera::Init(int width, int height, int fps)
     // Check if we will have to crop the captured image
     bool crop = width != closest.getWidth() || height != closest.getHeight();
 
-    // Iterate through pixel formats from best to worst
-    ret = -1;
-    for (i=0; i < (sizeof(pixFmtsOrder) / sizeof(pixFmtsOrder[0])); i++) {
+    // The format chosen the last time, if it's still one we can use
+    uint32_t cached = FormatCache::getPixelFormat(deviceKey, closest.getSize(), crop);
+    for (i = 0; i < kCaptureFormatCount; i++) {
+        if (kCaptureFormats[i].fourcc == cached && (!crop || kCaptureFormats[i].allowsCrop) &&
+            (kCaptureFormats[i].memPlanes == 1 || isMultiPlanar())) {
+            break;
+        }
+    }
+
+    if (i == kCaptureFormatCount) {
+
+        // Iterate through pixel formats from best to worst
+        ret = -1;
+        for (i=0; i < kCaptureFormatCount; i++) {
 
-        // If we will need to crop, make sure to only select formats we can crop...
-        if (!crop || pixFmtsOrder[i].allowscrop) {
+            // If we will need to crop, make sure to only select formats we can crop...
+            // A buffer for each plane needs the multi-planar API
+            if ((!crop || kCaptureFormats[i].allowsCrop) &&
+                (kCaptureFormats[i].memPlanes == 1 || isMultiPlanar())) {
 
-            memset(&videoIn->format,0,sizeof(videoIn->format));
-            videoIn->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            videoIn->format.fmt.pix.width = closest.getWidth();
-            videoIn->format.fmt.pix.height = closest.getHeight();
-            videoIn->format.fmt.pix.pixelformat = pixFmtsOrder[i].fmt;
+                memset(&videoIn->format,0,sizeof(videoIn->format));
+                videoIn->format.fmt.pix.width = closest.getWidth();
+                videoIn->format.fmt.pix.height = closest.getHeight();
+                videoIn->format.fmt.pix.pixelformat = kCaptureFormats[i].fourcc;
 
-            ret = ioctl(vfd, VIDIOC_TRY_FMT, &videoIn->format);
-            if (ret >= 0 &&
-                videoIn->format.fmt.pix.width ==  (uint)closest.getWidth() &&
-                videoIn->format.fmt.pix.height == (uint)closest.getHeight()) {
-                break;
+                // The driver may give its own format back instead
+                ret = formatIoctl(VIDIOC_TRY_FMT, videoIn->format);
+                if (ret >= 0 &&
+                    videoIn->format.fmt.pix.pixelformat == kCaptureFormats[i].fourcc &&
+                    videoIn->format.fmt.pix.width ==  (uint)closest.getWidth() &&
+                    videoIn->format.fmt.pix.height == (uint)closest.getHeight()) {
+                    break;
+                }
             }
         }
-    }
-    if (ret < 0) {
-        ALOGE("Open: VIDIOC_TRY_FMT Failed: %s", strerror(errno));
-        return ret;
+        if (ret < 0) {
+            ALOGE("Open: VIDIOC_TRY_FMT Failed: %s", strerror(errno));
+            return ret;
+        }
+        if (i == kCaptureFormatCount) {
+            ALOGE("Open: No pixel format for (%d x %d)", closest.getWidth(), closest.getHeight());
+            return -1;
+        }
+
+        FormatCache::putPixelFormat(deviceKey, closest.getSize(), crop, kCaptureFormats[i].fourcc);
+    } else {
+        ALOGD("Using the cached pixel format");
     }
 
     /* Set the format */
     memset(&videoIn->format,0,sizeof(videoIn->format));
-    videoIn->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     videoIn->format.fmt.pix.width = closest.getWidth();
     videoIn->format.fmt.pix.height = closest.getHeight();
-    videoIn->format.fmt.pix.pixelformat = pixFmtsOrder[i].fmt;
-    ret = ioctl(vfd, VIDIOC_S_FMT, &videoIn->format);
+    videoIn->format.fmt.pix.pixelformat = kCaptureFormats[i].fourcc;
+    ret = formatIoctl(VIDIOC_S_FMT, videoIn->format);
     if (ret < 0) {
         ALOGE("Open: VIDIOC_S_FMT Failed: %s", strerror(errno));
         return ret;
@@ -313,13 +485,25 @@ int V4L2Camera::Init(int width, int height, int fps)
 
     /* Query for the effective video format used */
     memset(&videoIn->format,0,sizeof(videoIn->format));
-    videoIn->format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ret = ioctl(vfd, VIDIOC_G_FMT, &videoIn->format);
+    ret = formatIoctl(VIDIOC_G_FMT, videoIn->format);
     if (ret < 0) {
         ALOGE("Open: VIDIOC_G_FMT Failed: %s", strerror(errno));
         return ret;
     }
 
+    /*  How the frames will be converted, looked up once here. Drivers are
+        not supposed to change the pixel format we asked for, but check. */
+    mFormat = findCaptureFormat(videoIn->format.fmt.pix.pixelformat);
+    if (mFormat == NULL) {
+        ALOGE("Open: the driver switched to a pixel format we can't use");
+        return -1;
+    }
+    if (mFormat->memPlanes != videoIn->planeCount) {
+        ALOGE("Open: the driver has %d planes for a format of %d", videoIn->planeCount, mFormat->memPlanes);
+        return -1;
+    }
+    mDirect = find_direct_converter(mFormat->fourcc);
+
     /* Note VIDIOC_S_FMT may change width and height. */
 
     /* Buggy driver paranoia. */
@@ -334,7 +518,7 @@ int V4L2Camera::Init(int width, int height, int fps)
     videoIn->outWidth           = width;
     videoIn->outHeight          = height;
     videoIn->outFrameSize       = width * height << 1; // Calculate the expected output framesize in YUYV
-    videoIn->capBytesPerPixel   = pixFmtsOrder[i].bpp;
+    videoIn->capBytesPerPixel   = mFormat->bytesPerPixel;
 
     /* Now calculate cropping margins, if needed, rounding to even */
     int startX = ((closest.getWidth() - width) >> 1) & (-2);
@@ -361,40 +545,39 @@ int V4L2Camera::Init(int width, int height, int fps)
 
     /* sets video device frame rate */
     memset(&videoIn->params,0,sizeof(videoIn->params));
-    videoIn->params.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    videoIn->params.type = videoIn->type;
     videoIn->params.parm.capture.timeperframe.numerator = 1;
     videoIn->params.parm.capture.timeperframe.denominator = closest.getFps();
 
     /* Set the framerate. If it fails, it wont be fatal */
-    if (ioctl(vfd,VIDIOC_S_PARM,&videoIn->params) < 0) {
+    if (xioctl(VIDIOC_S_PARM,&videoIn->params) < 0) {
         ALOGE("VIDIOC_S_PARM error: Unable to set %d fps", closest.getFps());
     }
 
     /* Gets video device defined frame rate (not real - consider it a maximum value) */
-    if (ioctl(vfd,VIDIOC_G_PARM,&videoIn->params) < 0) {
+    if (xioctl(VIDIOC_G_PARM,&videoIn->params) < 0) {
         ALOGE("VIDIOC_G_PARM - Unable to get timeperframe");
     }
 
-    ALOGI("Actual format: (%d x %d), Fps: %d, pixfmt: '%c%c%c%c', bytesperline: %d",
+    ALOGI("Actual format: (%d x %d), Fps: %d, pixfmt: '%c%c%c%c', bytesperline: %d, planes: %d",
         videoIn->format.fmt.pix.width,
         videoIn->format.fmt.pix.height,
         videoIn->params.parm.capture.timeperframe.denominator,
         videoIn->format.fmt.pix.pixelformat & 0xFF, (videoIn->format.fmt.pix.pixelformat >> 8) & 0xFF,
         (videoIn->format.fmt.pix.pixelformat >> 16) & 0xFF, (videoIn->format.fmt.pix.pixelformat >> 24) & 0xFF,
-        videoIn->format.fmt.pix.bytesperline);
+        videoIn->format.fmt.pix.bytesperline, videoIn->planeCount);
 
     /* Configure JPEG quality, if dealing with those formats */
-    if (videoIn->format.fmt.pix.pixelformat == V4L2_PIX_FMT_JPEG ||
-        videoIn->format.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG) {
+    if (mFormat->layout == LAYOUT_COMPRESSED) {
 
         /* Get the compression format */
-        ioctl(vfd,VIDIOC_G_JPEGCOMP, &videoIn->jpegcomp);
+        xioctl(VIDIOC_G_JPEGCOMP, &videoIn->jpegcomp);
 
         /* Set to maximum */
         videoIn->jpegcomp.quality = 100;
 
         /* Try to set it */
-        if(ioctl(vfd,VIDIOC_S_JPEGCOMP, &videoIn->jpegcomp) >= 0)
+        if(xioctl(VIDIOC_S_JPEGCOMP, &videoIn->jpegcomp) >= 0)
         {
             ALOGE("VIDIOC_S_COMP:");
             if(errno == EINVAL)
@@ -405,7 +588,7 @@ int V4L2Camera::Init(int width, int height, int fps)
         }
 
         /* gets video stream jpeg compression parameters */
-        if(ioctl(vfd,VIDIOC_G_JPEGCOMP, &videoIn->jpegcomp) >= 0) {
+        if(xioctl(VIDIOC_G_JPEGCOMP, &videoIn->jpegcomp) >= 0) {
             ALOGD("VIDIOC_G_COMP:\n");
             ALOGD("    quality:      %i\n", videoIn->jpegcomp.quality);
             ALOGD("    APPn:         %i\n", videoIn->jpegcomp.APPn);
@@ -423,106 +606,78 @@ int V4L2Camera::Init(int width, int height, int fps)
         }
     }
 
-    /* Check if camera can handle NB_BUFFER buffers */
+    /*  Ask for bufferCount buffers. The driver may give us more or fewer,
+        and we use up to MAX_BUFFERS of them.
+    */
+    videoIn->memory = V4L2_MEMORY_MMAP;
     memset(&videoIn->rb,0,sizeof(videoIn->rb));
-    videoIn->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    videoIn->rb.type = videoIn->type;
     videoIn->rb.memory = V4L2_MEMORY_MMAP;
-    videoIn->rb.count = NB_BUFFER;
+    videoIn->rb.count = bufferCount + heldFrames;
 
-    ret = ioctl(vfd, VIDIOC_REQBUFS, &videoIn->rb);
+    ret = xioctl(VIDIOC_REQBUFS, &videoIn->rb);
     if (ret < 0) {
         ALOGE("Init: VIDIOC_REQBUFS failed: %s", strerror(errno));
         return ret;
     }
 
-    for (int i = 0; i < NB_BUFFER; i++) {
+    if (videoIn->rb.count < 1) {
+        ALOGE("Init: the driver gave us no buffers");
+        return -ENOMEM;
+    }
 
-        memset (&videoIn->buf, 0, sizeof (struct v4l2_buffer));
-        videoIn->buf.index = i;
-        videoIn->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        videoIn->buf.memory = V4L2_MEMORY_MMAP;
+    videoIn->bufCount = (videoIn->rb.count < MAX_BUFFERS) ? videoIn->rb.count : MAX_BUFFERS;
+    ALOGD_IF(videoIn->bufCount != bufferCount + heldFrames, "Init: asked for %d buffers, using %d",
+             bufferCount + heldFrames, videoIn->bufCount);
 
-        ret = ioctl (vfd, VIDIOC_QUERYBUF, &videoIn->buf);
-        if (ret < 0) {
-            ALOGE("Init: Unable to query buffer (%s)", strerror(errno));
-            return ret;
+    for (int i = 0; i < videoIn->bufCount; i++) {
+        for (int p = 0; p < VIDEO_MAX_PLANES; p++) {
+            videoIn->dmabuf[i][p] = -1;
         }
+    }
 
-        ALOGD("V4L2Camera::Init: mmap length=%d, offset=%d", videoIn->buf.length, videoIn->buf.m.offset);
-        videoIn->mem[i] = mmap (0,
-                                videoIn->buf.length,
-                                PROT_READ | PROT_WRITE,
-                                MAP_SHARED,
-                                vfd,
-                                videoIn->buf.m.offset);
+    for (int i = 0; i < videoIn->bufCount; i++) {
 
-        if (videoIn->mem[i] == MAP_FAILED) {
-            ALOGE("Init: Unable to map buffer (%s)", strerror(errno));
-            return -1;
+        initBuf(videoIn->buf, videoIn->planes, i);
+
+        ret = xioctl(VIDIOC_QUERYBUF, &videoIn->buf);
+        if (ret < 0) {
+            ALOGE("Init: Unable to query buffer (%s)", strerror(errno));
+            return ret;
         }
 
-        enqueueBuf();
-    }
+        // Each plane is mapped on its own, they may not even be contiguous
+        for (int p = 0; p < videoIn->planeCount; p++) {
+            size_t length = isMultiPlanar() ? videoIn->planes[p].length : videoIn->buf.length;
+            off_t offset = isMultiPlanar() ? videoIn->planes[p].m.mem_offset : videoIn->buf.m.offset;
 
-    // Reserve temporary buffers, if they will be needed
-    size_t tmpbuf_size=0;
-    switch (videoIn->format.fmt.pix.pixelformat)
-    {
-        case V4L2_PIX_FMT_JPEG:
-        case V4L2_PIX_FMT_MJPEG:
-        case V4L2_PIX_FMT_UYVY:
-        case V4L2_PIX_FMT_YVYU:
-        case V4L2_PIX_FMT_YYUV:
-        case V4L2_PIX_FMT_YUV420: // only needs 3/2 bytes per pixel but we alloc 2 bytes per pixel
-        case V4L2_PIX_FMT_YVU420: // only needs 3/2 bytes per pixel but we alloc 2 bytes per pixel
-        case V4L2_PIX_FMT_Y41P:   // only needs 3/2 bytes per pixel but we alloc 2 bytes per pixel
-        case V4L2_PIX_FMT_NV12:
-        case V4L2_PIX_FMT_NV21:
-        case V4L2_PIX_FMT_NV16:
-        case V4L2_PIX_FMT_NV61:
-        case V4L2_PIX_FMT_SPCA501:
-        case V4L2_PIX_FMT_SPCA505:
-        case V4L2_PIX_FMT_SPCA508:
-        case V4L2_PIX_FMT_GREY:
-        case V4L2_PIX_FMT_Y16:
-
-        case V4L2_PIX_FMT_YUYV:
-            //  YUYV doesn't need a temp buffer but we will set it if/when
-            //  video processing disable control is checked (bayer processing).
-            //            (logitech cameras only)
-            break;
+            ALOGD("V4L2Camera::Init: mmap plane %d length=%zu, offset=%ld", p, length, (long)offset);
+            void* mem = xmmap(length, offset);
 
-        case V4L2_PIX_FMT_SGBRG8: //0
-        case V4L2_PIX_FMT_SGRBG8: //1
-        case V4L2_PIX_FMT_SBGGR8: //2
-        case V4L2_PIX_FMT_SRGGB8: //3
-            // Raw 8 bit bayer
-            // when grabbing use:
-            //    bayer_to_rgb24(bayer_data, RGB24_data, width, height, 0..3)
-            //    rgb2yuyv(RGB24_data, pFrameBuffer, width, height)
-
-            // alloc a temp buffer for converting to YUYV
-            // rgb buffer for decoding bayer data
-            tmpbuf_size = videoIn->format.fmt.pix.width * videoIn->format.fmt.pix.height * 3;
-            if (videoIn->tmpBuffer)
-                free(videoIn->tmpBuffer);
-            videoIn->tmpBuffer = (uint8_t*)calloc(1, tmpbuf_size);
-            if (!videoIn->tmpBuffer) {
-                ALOGE("couldn't calloc %lu bytes of memory for frame buffer\n",
-                    (unsigned long) tmpbuf_size);
-                return -ENOMEM;
+            if (mem == MAP_FAILED) {
+                ALOGE("Init: Unable to map buffer (%s)", strerror(errno));
+                return -1;
             }
 
+            videoIn->mem[i][p] = mem;
+            videoIn->memLength[i][p] = length;
+        }
 
-            break;
+        exportBuffer(i);
+        enqueueBuf();
+    }
 
-        case V4L2_PIX_FMT_RGB24: //rgb or bgr (8-8-8)
-        case V4L2_PIX_FMT_BGR24:
-            break;
+    // The decoder and its threads are made once and then kept
+    if (mFormat->layout == LAYOUT_COMPRESSED && mjpegDecoder == NULL) {
+        mjpegDecoder = MjpegDecoder::create(mjpegBackend, WorkerPool::cpuCount(4));
+        if (mjpegDecoder == NULL) {
+            ALOGE("couldn't create the jpeg decoder\n");
+            return -ENOMEM;
+        }
+    }
 
-        default:
-            ALOGE("Should never arrive (1)- exit fatal !!\n");
-            return -1;
+    if (!recordFile.empty()) {
+        startRecording();
     }
 
     return 0;
@@ -531,36 +686,150 @@ int V4L2Camera::Init(int width, int height, int fps)
 void V4L2Camera::Uninit()
 {
     ALOGD("Uninit");
+
+    mRecorder.close();
+    freeBuffers();
+
+    if (videoIn->tmpBuffer)
+        free(videoIn->tmpBuffer);
+    videoIn->tmpBuffer = NULL;
+
+    //ALOGD("Uninit done");
+}
+
+
+
+void V4L2Camera::freeBuffers()
+{
     int ret;
 
-    // Unmapping buffers marks them as no longer in busy.
-    for (int i = 0; i < NB_BUFFER; i++)
-        if (videoIn->mem[i] != NULL) {
-            ret = munmap(videoIn->mem[i], videoIn->buf.length);
-            ALOGE_IF(ret < 0, "Uninit: Unmap failed");
-            videoIn->mem[i] = NULL;
-        }
+    // Unmapping buffers marks them as no longer in busy, once whoever
+    // imported their dma-bufs has let go of them too.
+    // The buffers we were given are not ours to unmap.
+    for (int i = 0; i < MAX_BUFFERS; i++)
+        for (int p = 0; p < VIDEO_MAX_PLANES; p++)
+            if (videoIn->mem[i][p] != NULL) {
+                if (videoIn->memory == V4L2_MEMORY_MMAP) {
+                    ret = xmunmap(videoIn->mem[i][p], videoIn->memLength[i][p]);
+                    ALOGE_IF(ret < 0, "Uninit: Unmap failed");
+
+                    if (videoIn->dmabuf[i][p] >= 0) {
+                        close(videoIn->dmabuf[i][p]);
+                    }
+                }
+                videoIn->mem[i][p] = NULL;
+                videoIn->dmabuf[i][p] = -1;
+            }
+    videoIn->bufCount = 0;
 
     /*  Explicitly release the buffers. This safely
         clears the buffer queue.
     */
     memset(&videoIn->rb,0,sizeof(videoIn->rb));
-    videoIn->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    videoIn->rb.memory = V4L2_MEMORY_MMAP;
+    videoIn->rb.type = videoIn->type;
+    videoIn->rb.memory = videoIn->memory;
     videoIn->rb.count = 0;
 
-    ret = ioctl(vfd, VIDIOC_REQBUFS, &videoIn->rb);
+    ret = xioctl(VIDIOC_REQBUFS, &videoIn->rb);
     if (ret < 0) {
         ALOGE("Uninit: VIDIOC_REQBUFS release failed: %s", strerror(errno));
     }
+}
 
-    if (videoIn->tmpBuffer)
-        free(videoIn->tmpBuffer);
-    videoIn->tmpBuffer = NULL;
 
-    //ALOGD("Uninit done");
+
+status_t V4L2Camera::UseUserBuffers (int memory)
+{
+    ALOGD("UseUserBuffers: %s", memory == V4L2_MEMORY_DMABUF ? "dmabuf" : "userptr");
+
+    if (videoIn->isStreaming) {
+        ALOGE("UseUserBuffers: the camera is streaming");
+        return INVALID_OPERATION;
+    }
+
+    if (videoIn->planeCount > 1) {
+        ALOGE("UseUserBuffers: the frames have a buffer for each plane");
+        return INVALID_OPERATION;
+    }
+
+    // Drop the mmapped buffers that Init() queued, and ask for as many of ours
+    int count = videoIn->bufCount;
+    freeBuffers();
+
+    videoIn->memory = memory;
+    memset(&videoIn->rb,0,sizeof(videoIn->rb));
+    videoIn->rb.type = videoIn->type;
+    videoIn->rb.memory = memory;
+    videoIn->rb.count = count;
+
+    int ret = xioctl(VIDIOC_REQBUFS, &videoIn->rb);
+    if (ret < 0) {
+        ALOGE("UseUserBuffers: VIDIOC_REQBUFS failed: %s", strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    if ((int)videoIn->rb.count != count) {
+        ALOGE("UseUserBuffers: the driver wants %d buffers, not %d", videoIn->rb.count, count);
+        return UNKNOWN_ERROR;
+    }
+
+    videoIn->bufCount = count;
+    return NO_ERROR;
 }
 
+
+
+status_t V4L2Camera::QueueUserBuffer (int index, void* vaddr, int fd, size_t length)
+{
+    if (index < 0 || index >= videoIn->bufCount || videoIn->memory == V4L2_MEMORY_MMAP) {
+        return INVALID_OPERATION;
+    }
+
+    if (length < videoIn->format.fmt.pix.sizeimage) {
+        ALOGE("QueueUserBuffer: buffer of %zu bytes is too small for %u", length, videoIn->format.fmt.pix.sizeimage);
+        return BAD_VALUE;
+    }
+
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    initBuf(buf, planes, index);
+
+    // There is only one plane, UseUserBuffers() made sure
+    if (isMultiPlanar()) {
+        planes[0].length = length;
+        if (videoIn->memory == V4L2_MEMORY_DMABUF) {
+            planes[0].m.fd = fd;
+        } else {
+            planes[0].m.userptr = (unsigned long)vaddr;
+        }
+    } else {
+        buf.length = length;
+        if (videoIn->memory == V4L2_MEMORY_DMABUF) {
+            buf.m.fd = fd;
+        } else {
+            buf.m.userptr = (unsigned long)vaddr;
+        }
+    }
+
+    int ret = xioctl(VIDIOC_QBUF, &buf);
+    if (ret < 0) {
+        ALOGE("QueueUserBuffer: VIDIOC_QBUF Failed: %s", strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    videoIn->mem[index][0] = vaddr;
+    return NO_ERROR;
+}
+
+
+
+int V4L2Camera::getFrameIndex () const
+{
+    return videoIn->buf.index;
+}
+
+
+
 int V4L2Camera::StartStreaming ()
 {
     ALOGD("StartStreaming");
@@ -568,15 +837,36 @@ int V4L2Camera::StartStreaming ()
     int ret;
 
     if (!videoIn->isStreaming) {
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        // Forget the interruptions of the last stream
+        uint64_t count;
+        if (wakeFd >= 0) {
+            while (read(wakeFd, &count, sizeof(count)) > 0) {
+            }
+        }
+
+        /*  Hear about the input changing or ending. Few cameras have such
+            events, so they are just not subscribed if they can't be
+        */
+        static const uint32_t events[] = { V4L2_EVENT_SOURCE_CHANGE, V4L2_EVENT_EOS };
+        for (uint32_t e : events) {
+            struct v4l2_event_subscription sub;
+            memset(&sub, 0, sizeof(sub));
+            sub.type = e;
+            if (xioctl(VIDIOC_SUBSCRIBE_EVENT, &sub) == 0) {
+                ALOGD("StartStreaming: subscribed to event %u", e);
+            }
+        }
 
-        ret = ioctl (vfd, VIDIOC_STREAMON, &type);
+        type = (enum v4l2_buf_type)videoIn->type;
+
+        ret = xioctl(VIDIOC_STREAMON, &type);
         if (ret < 0) {
             ALOGE("StartStreaming: Unable to start capture: %s", strerror(errno));
             return ret;
         }
 
         videoIn->isStreaming = true;
+        mHaveSequence = false;
     }
 
     return 0;
@@ -589,14 +879,19 @@ int V4L2Camera::StopStreaming ()
     int ret;
 
     if (videoIn->isStreaming) {
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        type = (enum v4l2_buf_type)videoIn->type;
 
-        ret = ioctl (vfd, VIDIOC_STREAMOFF, &type);
+        ret = xioctl(VIDIOC_STREAMOFF, &type);
         if (ret < 0) {
             ALOGE("StopStreaming: Unable to stop capture: %s", strerror(errno));
             return ret;
         }
 
+        struct v4l2_event_subscription sub;
+        memset(&sub, 0, sizeof(sub));
+        sub.type = V4L2_EVENT_ALL;
+        xioctl(VIDIOC_UNSUBSCRIBE_EVENT, &sub);
+
         videoIn->isStreaming = false;
     }
 
@@ -624,254 +919,534 @@ int V4L2Camera::getFps() const
 
 
 /* Grab frame in YUYV mode */
-status_t V4L2Camera::GrabRawFrame (void *frameBuffer, int maxSize, nsecs_t timeout)
+status_t V4L2Camera::GrabRawFrame (void *frameBuffer, int maxSize, nsecs_t timeout, FrameInfo* info)
 {
     /*  This can return
             NO_ERROR - data is available
             NOT_ENOUGH_DATA - the frame was empty
             TIMED_OUT - the camera did not return a frame
+            DEAD_OBJECT - the camera has been unplugged
             UNKNOWN_ERROR - some camera problem
     */
 
     LOG_FRAME("V4L2Camera::GrabRawFrame: frameBuffer:%p, len:%d", frameBuffer, maxSize);
-    int status = NO_ERROR;
 
-    status = dequeueBuf(timeout);
+    status_t status = AcquireFrame(timeout, info);
 
     if (status != NO_ERROR) {
         // Failed to dequeue so nothing to enqueue
         return status;
     }
 
+    status = ConvertFrame(frameBuffer, maxSize);
+
+    ReleaseFrame();
+    return status;
+}
+
+
+
+status_t V4L2Camera::AcquireFrame (nsecs_t timeout, FrameInfo* info)
+{
+    int status = dequeueBuf(timeout);
+
+    if (status != NO_ERROR) {
+        return status;
+    }
+
+    /*  In low latency mode we skip to the newest frame. The older ones that
+        are already waiting go straight back to the driver, so the consumers
+        never work through a backlog. An Interrupt() always wins over the
+        stale frame, which then goes back as well.
+    */
+    while (lowLatency && frameWaiting()) {
+        struct v4l2_buffer stale = videoIn->buf;
+        struct v4l2_plane stalePlanes[VIDEO_MAX_PLANES];
+
+        // The planes of buf are in videoIn, where the next frame goes
+        if (isMultiPlanar()) {
+            memcpy(stalePlanes, videoIn->planes, sizeof(stalePlanes));
+            stale.m.planes = stalePlanes;
+        }
+
+        status = dequeueBuf(0);
+        if (status != NO_ERROR) {
+            videoIn->buf = stale;
+            if (isMultiPlanar()) {
+                memcpy(videoIn->planes, stalePlanes, sizeof(stalePlanes));
+                videoIn->buf.m.planes = videoIn->planes;
+            }
+            // It read the wake up, the caller has to see it
+            if (status == WOULD_BLOCK) {
+                enqueueBuf();
+                return WOULD_BLOCK;
+            }
+            break;
+        }
+
+        if (xioctl(VIDIOC_QBUF, &stale) < 0) {
+            ALOGE("AcquireFrame: VIDIOC_QBUF of a stale frame failed");
+        }
+        mStaleFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+
     /*  REVISIT the code flow here is yucky.
         be relevant.
     */
-    if (videoIn->buf.bytesused == 0) {
+    if (frameBytesUsed() == 0) {
         ALOGE("Ignoring empty buffer ...\n");
         enqueueBuf();
         return NOT_ENOUGH_DATA;
     }
 
+    LOG_FRAME("V4L2Camera::AcquireFrame - Got Raw frame (%dx%d) (buf:%d, len:%d)",
+        videoIn->format.fmt.pix.width, videoIn->format.fmt.pix.height,
+        videoIn->buf.index, frameBytesUsed());
+
+    if (info != NULL) {
+        *info = mFrameInfo;
+    }
+
+    return NO_ERROR;
+}
+
+
+
+void V4L2Camera::ReleaseFrame ()
+{
+    enqueueBuf();
+
+    LOG_FRAME("V4L2Camera::ReleaseFrame - Queued buffer");
+}
+
+
+
+int V4L2Camera::HoldFrame ()
+{
+    // The next dequeue writes over videoIn->buf, so only the index is kept
+    return videoIn->buf.index;
+}
+
+
+
+void V4L2Camera::ReturnFrame (int index)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+
+    // On its own buffer, as the capture thread may be dequeueing the next
+    initBuf(buf, planes, index);
+
+    if (xioctl(VIDIOC_QBUF, &buf) < 0) {
+        ALOGE("ReturnFrame: VIDIOC_QBUF of buffer %d failed: %s", index, strerror(errno));
+    }
+
+    LOG_FRAME("V4L2Camera::ReturnFrame - Queued buffer %d", index);
+}
+
+
+
+void V4L2Camera::Interrupt ()
+{
+    uint64_t one = 1;
+
+    if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0) {
+        ALOGE("Interrupt: cannot write the eventfd: %s", strerror(errno));
+    }
+}
+
+
+
+bool V4L2Camera::isPlainYUYV () const
+{
+    return videoIn->format.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV &&
+        videoIn->capCropOffset == 0 &&
+        videoIn->format.fmt.pix.bytesperline == (unsigned)(videoIn->outWidth << 1) &&
+        videoIn->format.fmt.pix.height == (unsigned)videoIn->outHeight;
+}
+
+
+
+uint8_t* V4L2Camera::getYUYVFrame () const
+{
+    if (!isPlainYUYV()) {
+        return NULL;
+    }
+
+    return frameData();
+}
+
+
+
+int V4L2Camera::getFramePlanes (FramePlane* planes) const
+{
+    int index = videoIn->buf.index;
+
+    for (int p = 0; p < videoIn->planeCount; p++) {
+        planes[p].data   = frameData(p);
+        planes[p].fd     = videoIn->dmabuf[index][p];
+        planes[p].offset = isMultiPlanar() ? videoIn->buf.m.planes[p].data_offset : 0;
+        planes[p].length = videoIn->memLength[index][p];
+        planes[p].stride = videoIn->planeStride[p];
+    }
+
+    // Only the packed formats are cropped, they have a single plane
+    planes[0].data   += videoIn->capCropOffset;
+    planes[0].offset += videoIn->capCropOffset;
+
+    return videoIn->planeCount;
+}
+
+
+
+status_t V4L2Camera::ConvertFrameDirect (int dstFmt, uint8_t *dst, int dstStride, int dstHeight, int width, int height)
+{
+    ScopedLatency timer(convertStats());
+
+    // The planes in their own buffers are copied by the generic code below
+    bool separatePlanes = videoIn->planeCount > 1;
+    if (mDirect == NULL && !separatePlanes) {
+        return INVALID_OPERATION;
+    }
+
+    bool compressed = mFormat->layout == LAYOUT_COMPRESSED;
+    if (compressed && frameBytesUsed() <= HEADERFRAME1) {
+        // Prevent crash on empty image
+        ALOGE("Ignoring empty buffer for JPEG ...\n");
+        return UNKNOWN_ERROR;
+    }
+
+    // Never convert more than what was captured
+    if (width > videoIn->outWidth)
+        width = videoIn->outWidth;
+    if (height > videoIn->outHeight)
+        height = videoIn->outHeight;
+
+    if (separatePlanes) {
+        struct yuv420_planes s, d;
+        frameYuvPlanes(s);
+        yuv420_planes_init(&d, dstFmt, dst, dstStride, dstHeight);
+        planar_to_yuv420(&d, &s, mFormat->vsub ? 1 : 2, width, height);
+        return NO_ERROR;
+    }
+
+    uint8_t* src = frameData() + videoIn->capCropOffset;
+
+    if (compressed && mjpegDecoder != NULL) {
+        size_t size = frameBytesUsed() - videoIn->capCropOffset;
+        status_t status;
+
+        do {
+            status = mjpegDecoder->decodeDirect(dstFmt, dst, dstStride, dstHeight, width, height,
+                                                src, size, videoIn->outWidth, videoIn->outHeight);
+        } while (status == INVALID_OPERATION && fallBackToBuiltinDecoder());
+
+        if (status != NO_ERROR) {
+            ALOGE("jpeg decode errors\n");
+            return UNKNOWN_ERROR;
+        }
+        return NO_ERROR;
+    }
+
+    if (mDirect(dstFmt, dst, dstStride, dstHeight, src, videoIn->outWidth, videoIn->outHeight, width, height) < 0) {
+        ALOGE("direct conversion errors\n");
+        return UNKNOWN_ERROR;
+    }
+
+    return NO_ERROR;
+}
+
+
+
+status_t V4L2Camera::ConvertLuma (uint8_t *dst, int dstStride, int width, int height)
+{
+    ScopedLatency timer(convertStats());
+    if (mFormat->lumaStep == 0) {
+        return INVALID_OPERATION;
+    }
+
+    // The planes of the planar formats are as wide as the frame, unless
+    // each is in its own buffer and the driver says how wide
+    int stride = (mFormat->layout == LAYOUT_PACKED) ?
+        (int)videoIn->format.fmt.pix.bytesperline : (int)videoIn->format.fmt.pix.width;
+    if (videoIn->planeCount > 1) {
+        stride = videoIn->planeStride[0];
+    }
+    uint8_t* src = frameData() + videoIn->capCropOffset + mFormat->lumaOffset;
+
+    luma_decimate(dst, dstStride, width, height, src, stride, videoIn->outWidth, videoIn->outHeight, mFormat->lumaStep);
+    return NO_ERROR;
+}
+
+
+
+status_t V4L2Camera::ConvertFrame (void *frameBuffer, int maxSize)
+{
+    ScopedLatency timer(convertStats());
+    status_t status = NO_ERROR;
+
     // Calculate the stride of the output image (YUYV) in bytes
     int strideOut = videoIn->outWidth << 1;
 
     // And the pointer to the start of the image
-    uint8_t* src = (uint8_t*)videoIn->mem[videoIn->buf.index] + videoIn->capCropOffset;
-
-    LOG_FRAME("V4L2Camera::GrabRawFrame - Got Raw frame (%dx%d) (buf:%d @ %p, len:%d)",
-        videoIn->format.fmt.pix.width, videoIn->format.fmt.pix.height,
-        videoIn->buf.index, src, videoIn->buf.bytesused);
+    uint8_t* src = frameData() + videoIn->capCropOffset;
 
     /* Avoid crashing! - Make sure there is enough room in the output buffer! */
     if (maxSize < videoIn->outFrameSize) {
 
-        ALOGE("V4L2Camera::GrabRawFrame: Insufficient space in output buffer: Required: %d, Got %d - DROPPING FRAME",videoIn->outFrameSize,maxSize);
+        ALOGE("V4L2Camera::ConvertFrame: Insufficient space in output buffer: Required: %d, Got %d - DROPPING FRAME",videoIn->outFrameSize,maxSize);
 
     } else {
 
-        switch (videoIn->format.fmt.pix.pixelformat)
-        {
-            case V4L2_PIX_FMT_JPEG:
-            case V4L2_PIX_FMT_MJPEG:
-                if(videoIn->buf.bytesused <= HEADERFRAME1) {
-                    // Prevent crash on empty image
-                    ALOGE("Ignoring empty buffer for JPEG ...\n");
-                    break;
-                }
+        if (videoIn->planeCount > 1) {
+            struct yuv420_planes s;
+            frameYuvPlanes(s);
+            planar_to_yuyv((uint8_t*)frameBuffer, strideOut, &s, mFormat->vsub ? 1 : 2,
+                           videoIn->outWidth, videoIn->outHeight);
 
-                if (utils::jpeg_decode((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight) < 0) {
-                    ALOGE("jpeg decode errors\n");
-                    break;
-                }
-                break;
+        } else if (mFormat->toYUYV != NULL) {
+            mFormat->toYUYV((uint8_t*)frameBuffer, strideOut,
+                            src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
 
-            case V4L2_PIX_FMT_UYVY:
-                uyvy_to_yuyv((uint8_t*)frameBuffer, strideOut,
-                             src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
-                break;
+        } else if (frameBytesUsed() <= HEADERFRAME1) {
+            // Prevent crash on empty image
+            ALOGE("Ignoring empty buffer for JPEG ...\n");
 
-            case V4L2_PIX_FMT_YVYU:
-                yvyu_to_yuyv((uint8_t*)frameBuffer, strideOut,
-                             src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
-                break;
+        } else {
+            size_t size = frameBytesUsed() - videoIn->capCropOffset;
+            status_t ret;
 
-            case V4L2_PIX_FMT_YYUV:
-                yyuv_to_yuyv((uint8_t*)frameBuffer, strideOut,
-                             src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
-                break;
+            do {
+                ret = mjpegDecoder->decode((uint8_t*)frameBuffer, strideOut, src, size, videoIn->outWidth, videoIn->outHeight);
+            } while (ret == INVALID_OPERATION && fallBackToBuiltinDecoder());
 
-            case V4L2_PIX_FMT_YUV420:
-                yuv420_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
+            if (ret != NO_ERROR) {
+                ALOGE("jpeg decode errors\n");
+            }
+        }
 
-            case V4L2_PIX_FMT_YVU420:
-                yvu420_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
+        LOG_FRAME("V4L2Camera::ConvertFrame - Copied frame to destination 0x%p",frameBuffer);
+    }
 
-            case V4L2_PIX_FMT_NV12:
-                nv12_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
+    return status;
+}
 
-            case V4L2_PIX_FMT_NV21:
-                nv21_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
 
-            case V4L2_PIX_FMT_NV16:
-                nv16_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
 
-            case V4L2_PIX_FMT_NV61:
-                nv61_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
+/*  For when the configured decoder turns out not to handle this camera.
+    Returns false if there is nothing else to try.
+*/
+bool V4L2Camera::fallBackToBuiltinDecoder()
+{
+    if (mjpegDecoder->backend() == CameraSpec::MJPEG_BUILTIN) {
+        return false;
+    }
 
-            case V4L2_PIX_FMT_Y41P:
-                y41p_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
+    MjpegDecoder* dec = MjpegDecoder::create(CameraSpec::MJPEG_BUILTIN, WorkerPool::cpuCount(4));
+    if (dec == NULL) {
+        return false;
+    }
 
-            case V4L2_PIX_FMT_GREY:
-                grey_to_yuyv((uint8_t*)frameBuffer, strideOut,
-                            src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
-                break;
+    ALOGW("The %s decoder can't decode this camera's frames, using the builtin one", mjpegDecoder->name());
+    delete mjpegDecoder;
+    mjpegDecoder = dec;
+    return true;
+}
 
-            case V4L2_PIX_FMT_Y16:
-                y16_to_yuyv((uint8_t*)frameBuffer, strideOut,
-                            src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_SPCA501:
-                s501_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_SPCA505:
-                s505_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_SPCA508:
-                s508_to_yuyv((uint8_t*)frameBuffer, strideOut, src, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_YUYV:
-                {
-                    int h;
-                    uint8_t* pdst = (uint8_t*)frameBuffer;
-                    uint8_t* psrc = src;
-                    int ss = videoIn->outWidth << 1;
-                    LOG_FRAME("V4L2Camera::GrabRawFrame - copying out height=%d, bytesperline=%d, strideOut=%d", videoIn->outHeight, videoIn->format.fmt.pix.bytesperline, strideOut);
-                    for (h = 0; h < videoIn->outHeight; h++) {
-                        // Guard against overflowing the buffer
-                        if ((pdst - (uint8_t*)frameBuffer) + ss > maxSize) {
-                            LOG_FRAME("V4L2Camera::GrabRawFrame - buffer would overflow");
-                            break;
-                        }
-                        memcpy(pdst,psrc,ss);
-                        pdst += strideOut;
-                        psrc += videoIn->format.fmt.pix.bytesperline;
-                    }
-                }
-                break;
-
-            case V4L2_PIX_FMT_SGBRG8: //0
-                bayer_to_rgb24 (src,(uint8_t*) videoIn->tmpBuffer, videoIn->outWidth, videoIn->outHeight, 0);
-                rgb_to_yuyv ((uint8_t*) frameBuffer, strideOut,
-                            (uint8_t*)videoIn->tmpBuffer, videoIn->outWidth*3, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_SGRBG8: //1
-                bayer_to_rgb24 (src,(uint8_t*) videoIn->tmpBuffer, videoIn->outWidth, videoIn->outHeight, 1);
-                rgb_to_yuyv ((uint8_t*) frameBuffer, strideOut,
-                            (uint8_t*)videoIn->tmpBuffer, videoIn->outWidth*3, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_SBGGR8: //2
-                bayer_to_rgb24 (src,(uint8_t*) videoIn->tmpBuffer, videoIn->outWidth, videoIn->outHeight, 2);
-                rgb_to_yuyv ((uint8_t*) frameBuffer, strideOut,
-                            (uint8_t*)videoIn->tmpBuffer, videoIn->outWidth*3, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_SRGGB8: //3
-                bayer_to_rgb24 (src,(uint8_t*) videoIn->tmpBuffer, videoIn->outWidth, videoIn->outHeight, 3);
-                rgb_to_yuyv ((uint8_t*) frameBuffer, strideOut,
-                            (uint8_t*)videoIn->tmpBuffer, videoIn->outWidth*3, videoIn->outWidth, videoIn->outHeight);
-                break;
-
-            case V4L2_PIX_FMT_RGB24:
-                rgb_to_yuyv((uint8_t*) frameBuffer, strideOut,
-                            src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
-                break;
 
-            case V4L2_PIX_FMT_BGR24:
-                bgr_to_yuyv((uint8_t*) frameBuffer, strideOut,
-                            src, videoIn->format.fmt.pix.bytesperline, videoIn->outWidth, videoIn->outHeight);
-                break;
 
-            default:
-                ALOGE("error grabbing: unknown format: %i\n", videoIn->format.fmt.pix.pixelformat);
-                break;
+/*  The histogram of the current capture format. The formats that are not
+    in the table yet take a free entry, or the last one over.
+*/
+LatencyHistogram& V4L2Camera::convertStats()
+{
+    uint32_t fourcc = videoIn->format.fmt.pix.pixelformat;
+    int i;
+
+    for (i = 0; i < kConvertStats - 1; i++) {
+        if (mConvertFourcc[i] == fourcc || mConvertFourcc[i] == 0) {
+            break;
         }
+    }
 
-        LOG_FRAME("V4L2Camera::GrabRawFrame - Copied frame to destination 0x%p",frameBuffer);
+    if (mConvertFourcc[i] != fourcc) {
+        mConvertFourcc[i] = fourcc;
+        mConvertTime[i].reset();
     }
 
-    enqueueBuf();
+    return mConvertTime[i];
+}
 
-    LOG_FRAME("V4L2Camera::GrabRawFrame - Queued buffer");
-    return status;
+
+
+void V4L2Camera::dumpStats(String8& out) const
+{
+    mDriverLatency.dump(out, "capture to dequeue");
+    mPollTime.dump(out, "poll wait");
+    mDqbufTime.dump(out, "VIDIOC_DQBUF");
+
+    for (int i = 0; i < kConvertStats && mConvertFourcc[i] != 0; i++) {
+        uint32_t f = mConvertFourcc[i];
+        char name[32];
+
+        snprintf(name, sizeof(name), "convert %c%c%c%c", f & 0xff, (f >> 8) & 0xff, (f >> 16) & 0xff, f >> 24);
+        mConvertTime[i].dump(out, name);
+    }
+}
+
+
+
+void V4L2Camera::resetStats()
+{
+    mDriverDropped = 0;
+    mStaleFrames = 0;
+    mDriverLatency.reset();
+    mPollTime.reset();
+    mDqbufTime.reset();
+
+    for (int i = 0; i < kConvertStats; i++) {
+        mConvertFourcc[i] = 0;
+        mConvertTime[i].reset();
+    }
 }
 
 
 
 status_t V4L2Camera::dequeueBuf(nsecs_t timeout)
 {
-    /*  Wait until a frame is ready. We don't want to risk blocking forever.
-        V4L2 drivers support select().
+    /*  Wait until a frame is ready, Interrupt() is called or the time is
+        up. We don't want to risk blocking forever. V4L2 drivers support
+        poll(), and tell about events with POLLPRI.
     */
     int ret;
 
-    fd_set  readSet;
-    fd_set  writeSet;
-    fd_set  errorSet;
-    timeval tv;
+    struct pollfd fds[2];
+    fds[0].fd     = vfd;
+    fds[0].events = POLLIN | POLLPRI;
+    fds[1].fd     = wakeFd;
+    fds[1].events = POLLIN;
 
-    FD_ZERO(&readSet);
-    FD_ZERO(&writeSet);
-    FD_ZERO(&errorSet);
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t deadline = start + timeout;
+    nsecs_t selected = start;
 
-    FD_SET(vfd, &readSet);
-    FD_SET(vfd, &writeSet);
-    FD_SET(vfd, &errorSet);
+    for (;;) {
+        nsecs_t left = deadline - selected;
+        int ms = left > 0 ? (int)((left + 999999) / 1000000) : 0;
 
-    tv.tv_sec  = timeout / 1000000000;
-    tv.tv_usec = (timeout - tv.tv_sec * 1000000000) / 1000;
+        fds[0].revents = 0;
+        fds[1].revents = 0;
 
-    int e = ::select(vfd + 1, &readSet, &writeSet, &errorSet, &tv);
+        int e = ::poll(fds, wakeFd >= 0 ? 2 : 1, ms);
+        selected = systemTime(SYSTEM_TIME_MONOTONIC);
 
-    if (e < 0) {
-        ALOGE("dequeueBuf: select Failed");
-        return UNKNOWN_ERROR;
-    }
+        if (e < 0 && errno != EINTR) {
+            ALOGE("dequeueBuf: poll Failed: %s", strerror(errno));
+            mPollTime.add(selected - start);
+            return UNKNOWN_ERROR;
+        }
 
-    if (e == 0) {
-        LOG_FRAME("dequeueBuf: timed out");
-        return TIMED_OUT;
-    }
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            read(wakeFd, &count, sizeof(count));
+            LOG_FRAME("dequeueBuf: interrupted");
+            mPollTime.add(selected - start);
+            return WOULD_BLOCK;
+        }
 
-    if (!FD_ISSET(vfd, &readSet)) {
-        ALOGE("dequeueBuf: read fd not set");
-        return UNKNOWN_ERROR;
+        if (fds[0].revents & POLLPRI) {
+            status_t status = dequeueEvents();
+            if (status != NO_ERROR) {
+                mPollTime.add(selected - start);
+                return status;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            break;
+        }
+
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            // There won't be a frame. Either the camera is gone or it is not streaming
+            struct v4l2_capability cap;
+            mPollTime.add(selected - start);
+            if (xioctl(VIDIOC_QUERYCAP, &cap) < 0 && errno == ENODEV) {
+                ALOGI("dequeueBuf: the camera has gone");
+                return DEAD_OBJECT;
+            }
+            ALOGE("dequeueBuf: poll error 0x%x", fds[0].revents);
+            return UNKNOWN_ERROR;
+        }
+
+        if (selected >= deadline) {
+            LOG_FRAME("dequeueBuf: timed out");
+            mPollTime.add(selected - start);
+            return TIMED_OUT;
+        }
     }
 
+    mPollTime.add(selected - start);
+
     // DQ 
-    memset(&videoIn->buf,0,sizeof(videoIn->buf));
-    videoIn->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    videoIn->buf.memory = V4L2_MEMORY_MMAP;
+    initBuf(videoIn->buf, videoIn->planes, 0);
 
-    ret = ioctl(vfd, VIDIOC_DQBUF, &videoIn->buf);
+    ret = xioctl(VIDIOC_DQBUF, &videoIn->buf);
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    mDqbufTime.add(now - selected);
 
     if (ret < 0) {
+        if (errno == ENODEV) {
+            ALOGI("dequeueBuf: the camera has gone");
+            return DEAD_OBJECT;
+        }
         ALOGE("dequeueBuf: VIDIOC_DQBUF Failed");
         return UNKNOWN_ERROR;
     }
 
+    /*  The driver timestamp is when the frame was captured, which is what
+        the encoders want to pace the frames. It is only used if it is on
+        our clock. Some drivers leave it at 0 or take it from the wall clock.
+    */
+    const timeval& t = videoIn->buf.timestamp;
+    nsecs_t captured = s2ns(t.tv_sec) + us2ns(t.tv_usec);
+
+    if ((videoIn->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+        captured > 0 && captured <= now) {
+        mDriverLatency.add(now - captured);
+    } else {
+        captured = now;
+    }
+
+    /*  The sequence goes up by one for each frame the driver captured, so a
+        gap is frames it had no buffer for. Drivers that don't count leave
+        it at 0, which shows no gaps.
+    */
+    uint32_t sequence = videoIn->buf.sequence;
+    uint32_t dropped = 0;
+
+    if (mHaveSequence && sequence != mFrameInfo.sequence) {
+        dropped = sequence - mFrameInfo.sequence - 1;
+        if (dropped > 0x7fffffff) {
+            // Went backwards, the driver must have restarted
+            dropped = 0;
+        }
+    }
+
+    if (dropped != 0) {
+        LOG_FRAME("dequeueBuf: %u frames dropped before %u", dropped, sequence);
+        mDriverDropped.fetch_add(dropped, std::memory_order_relaxed);
+    }
+
+    mFrameInfo.timestamp = captured;
+    mFrameInfo.sequence  = sequence;
+    mFrameInfo.dropped   = dropped;
+    mHaveSequence = true;
+
+    // Every frame the driver gives, including those low latency mode skips
+    if (mRecorder.isOpen()) {
+        mRecorder.add(frameData(0), frameBytesUsed(), sequence, videoIn->buf.flags, captured);
+    }
+
     return NO_ERROR;
 }
 
@@ -879,7 +1454,7 @@ status_t V4L2Camera::dequeueBuf(nsecs_t timeout)
 
 status_t V4L2Camera::enqueueBuf()
 {
-    int ret = ioctl(vfd, VIDIOC_QBUF, &videoIn->buf);
+    int ret = xioctl(VIDIOC_QBUF, &videoIn->buf);
     if (ret < 0) {
         ALOGE("Init: VIDIOC_QBUF Failed");
         return UNKNOWN_ERROR;
@@ -890,6 +1465,260 @@ status_t V4L2Camera::enqueueBuf()
 
 
 
+/*  The device calls, that go to the replay instead when there is one */
+int V4L2Camera::xioctl(unsigned long request, void* arg) const
+{
+    return replay != NULL ? replay->ioctl(request, arg) : ioctl(vfd, request, arg);
+}
+
+
+
+void* V4L2Camera::xmmap(size_t length, off_t offset)
+{
+    if (replay != NULL) {
+        return replay->mmap(length, offset);
+    }
+    return mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, vfd, offset);
+}
+
+
+
+int V4L2Camera::xmunmap(void* mem, size_t length)
+{
+    // The replay frees its buffers with VIDIOC_REQBUFS
+    return replay != NULL ? 0 : munmap(mem, length);
+}
+
+
+
+/*  Starts a new capture file for the stream Init() has set up. The
+    frames are recorded as they are dequeued, so the file has exactly
+    what the driver gave, at the times it gave it.
+*/
+void V4L2Camera::startRecording()
+{
+    if (videoIn->planeCount > 1) {
+        ALOGW("startRecording: the frames have a buffer for each plane, not recording them");
+        return;
+    }
+
+    FrameFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.fourcc         = videoIn->format.fmt.pix.pixelformat;
+    header.width          = videoIn->format.fmt.pix.width;
+    header.height         = videoIn->format.fmt.pix.height;
+    header.bytesperline   = videoIn->format.fmt.pix.bytesperline;
+    header.sizeimage      = videoIn->format.fmt.pix.sizeimage;
+    header.fpsNumerator   = videoIn->params.parm.capture.timeperframe.numerator;
+    header.fpsDenominator = videoIn->params.parm.capture.timeperframe.denominator;
+
+    mRecorder.open(recordFile, recordLimit, header);
+}
+
+
+
+/*  The format ioctls with either API. fmt is always a single-planar format,
+    so the rest of the code doesn't have to care which one the driver has.
+    A multi-planar frame asks for the sum of its planes as sizeimage, and
+    the stride of its first plane as bytesperline.
+*/
+int V4L2Camera::formatIoctl(unsigned long request, struct v4l2_format& fmt)
+{
+    bool keep = request != VIDIOC_TRY_FMT;
+
+    if (!isMultiPlanar()) {
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        int ret = xioctl(request, &fmt);
+        if (ret >= 0 && keep) {
+            videoIn->planeCount = 1;
+            videoIn->planeStride[0] = fmt.fmt.pix.bytesperline;
+        }
+        return ret;
+    }
+
+    struct v4l2_format mp;
+    memset(&mp, 0, sizeof(mp));
+    mp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    mp.fmt.pix_mp.width       = fmt.fmt.pix.width;
+    mp.fmt.pix_mp.height      = fmt.fmt.pix.height;
+    mp.fmt.pix_mp.pixelformat = fmt.fmt.pix.pixelformat;
+    mp.fmt.pix_mp.field       = fmt.fmt.pix.field;
+
+    int ret = xioctl(request, &mp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width        = mp.fmt.pix_mp.width;
+    fmt.fmt.pix.height       = mp.fmt.pix_mp.height;
+    fmt.fmt.pix.pixelformat  = mp.fmt.pix_mp.pixelformat;
+    fmt.fmt.pix.field        = mp.fmt.pix_mp.field;
+    fmt.fmt.pix.colorspace   = mp.fmt.pix_mp.colorspace;
+    fmt.fmt.pix.bytesperline = mp.fmt.pix_mp.plane_fmt[0].bytesperline;
+    fmt.fmt.pix.sizeimage    = 0;
+
+    int count = mp.fmt.pix_mp.num_planes;
+    if (count > VIDEO_MAX_PLANES)
+        count = VIDEO_MAX_PLANES;
+    for (int p = 0; p < count; p++) {
+        fmt.fmt.pix.sizeimage += mp.fmt.pix_mp.plane_fmt[p].sizeimage;
+    }
+
+    if (keep) {
+        videoIn->planeCount = count > 0 ? count : 1;
+        for (int p = 0; p < count; p++) {
+            videoIn->planeStride[p] = mp.fmt.pix_mp.plane_fmt[p].bytesperline;
+        }
+    }
+
+    return ret;
+}
+
+
+
+/*  A buffer of ours, ready for QUERYBUF, QBUF or DQBUF. With the
+    multi-planar API the planes go in planes, that must outlive it.
+*/
+void V4L2Camera::initBuf(struct v4l2_buffer& buf, struct v4l2_plane* planes, int index) const
+{
+    memset(&buf, 0, sizeof(buf));
+    buf.index  = index;
+    buf.type   = videoIn->type;
+    buf.memory = videoIn->memory;
+
+    if (isMultiPlanar()) {
+        memset(planes, 0, sizeof(struct v4l2_plane) * VIDEO_MAX_PLANES);
+        buf.m.planes = planes;
+        buf.length   = videoIn->planeCount;
+    }
+}
+
+
+
+/*  Gets a dma-buf for each plane of a mapped buffer, so the frames can be
+    handed on without a copy. Older kernels and some drivers don't have
+    VIDIOC_EXPBUF, the frames are only copied then.
+*/
+void V4L2Camera::exportBuffer(int index)
+{
+    for (int p = 0; p < videoIn->planeCount; p++) {
+        struct v4l2_exportbuffer expbuf;
+        memset(&expbuf, 0, sizeof(expbuf));
+        expbuf.type  = videoIn->type;
+        expbuf.index = index;
+        expbuf.plane = p;
+        expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+        if (xioctl(VIDIOC_EXPBUF, &expbuf) < 0) {
+            ALOGD_IF(index == 0 && p == 0, "Init: Unable to export the buffers (%s)", strerror(errno));
+            return;
+        }
+
+        videoIn->dmabuf[index][p] = expbuf.fd;
+    }
+}
+
+
+
+/*  Where plane of the dequeued frame starts, skipping whatever the
+    driver put in front of it
+*/
+uint8_t* V4L2Camera::frameData(int plane) const
+{
+    uint8_t* mem = (uint8_t*)videoIn->mem[videoIn->buf.index][plane];
+    if (isMultiPlanar()) {
+        mem += videoIn->buf.m.planes[plane].data_offset;
+    }
+    return mem;
+}
+
+
+
+uint32_t V4L2Camera::frameBytesUsed() const
+{
+    if (!isMultiPlanar()) {
+        return videoIn->buf.bytesused;
+    }
+
+    uint32_t used = 0;
+    for (int p = 0; p < videoIn->planeCount; p++) {
+        used += videoIn->buf.m.planes[p].bytesused - videoIn->buf.m.planes[p].data_offset;
+    }
+    return used;
+}
+
+
+
+/*  The planes of a frame that has a buffer for each of them */
+void V4L2Camera::frameYuvPlanes(struct yuv420_planes& planes) const
+{
+    planes.y       = frameData(0);
+    planes.ystride = videoIn->planeStride[0];
+    planes.cstride = videoIn->planeStride[1];
+
+    if (mFormat->layout == LAYOUT_SEMIPLANAR) {
+        uint8_t* c = frameData(1);
+        planes.u     = mFormat->vFirst ? c + 1 : c;
+        planes.v     = mFormat->vFirst ? c : c + 1;
+        planes.cstep = 2;
+    } else {
+        planes.u     = frameData(mFormat->vFirst ? 2 : 1);
+        planes.v     = frameData(mFormat->vFirst ? 1 : 2);
+        planes.cstep = 1;
+    }
+}
+
+
+
+status_t V4L2Camera::dequeueEvents()
+{
+    // Only called after POLLPRI, so VIDIOC_DQEVENT has an event to return
+    status_t status = NO_ERROR;
+    struct v4l2_event ev;
+
+    do {
+        memset(&ev, 0, sizeof(ev));
+        if (xioctl(VIDIOC_DQEVENT, &ev) < 0) {
+            ALOGE("dequeueEvents: VIDIOC_DQEVENT Failed: %s", strerror(errno));
+            break;
+        }
+
+        switch (ev.type) {
+        case V4L2_EVENT_SOURCE_CHANGE:
+            // The frames no longer have the format we set up for
+            ALOGW("dequeueEvents: the camera source has changed");
+            status = UNKNOWN_ERROR;
+            break;
+
+        case V4L2_EVENT_EOS:
+            ALOGW("dequeueEvents: the camera has no more frames");
+            status = UNKNOWN_ERROR;
+            break;
+
+        default:
+            LOG_FRAME("dequeueEvents: ignoring event %u", ev.type);
+            break;
+        }
+    } while (ev.pending > 0);
+
+    return status;
+}
+
+
+
+bool V4L2Camera::frameWaiting() const
+{
+    struct pollfd p;
+    p.fd      = vfd;
+    p.events  = POLLIN;
+    p.revents = 0;
+
+    return ::poll(&p, 1, 0) > 0 && (p.revents & POLLIN);
+}
+
+
+
 /* enumerate frame intervals (fps)
  * args:
  * pixfmt: v4l2 pixel format that we want to list frame intervals for
@@ -910,7 +1739,7 @@ bool V4L2Camera::EnumFrameIntervals(int pixfmt, int width, int height)
     fival.height = height;
 
     ALOGD("\tTime interval between frame: ");
-    while (ioctl(vfd,VIDIOC_ENUM_FRAMEINTERVALS, &fival) >= 0)
+    while (xioctl(VIDIOC_ENUM_FRAMEINTERVALS, &fival) >= 0)
     {
         fival.index++;
         if (fival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
@@ -955,7 +1784,7 @@ bool V4L2Camera::EnumFrameSizes(int pixfmt)
     memset(&fsize, 0, sizeof(fsize));
     fsize.index = 0;
     fsize.pixel_format = pixfmt;
-    while (ioctl(vfd, VIDIOC_ENUM_FRAMESIZES, &fsize) >= 0) {
+    while (xioctl(VIDIOC_ENUM_FRAMESIZES, &fsize) >= 0) {
         fsize.index++;
         if (fsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
             ALOGD("{ discrete: width = %u, height = %u }",
@@ -1011,13 +1840,13 @@ bool V4L2Camera::EnumFrameSizes(int pixfmt)
 
             fsizeind++;
             struct v4l2_format fmt;
-            fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            memset(&fmt, 0, sizeof(fmt));
             fmt.fmt.pix.width = defMode[i].w;
             fmt.fmt.pix.height = defMode[i].h;
             fmt.fmt.pix.pixelformat = pixfmt;
             fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
-            if (ioctl(vfd,VIDIOC_TRY_FMT, &fmt) >= 0) {
+            if (formatIoctl(VIDIOC_TRY_FMT, fmt) >= 0) {
                 ALOGD("{ ?GSPCA? : width = %u, height = %u }\n", fmt.fmt.pix.width, fmt.fmt.pix.height);
 
                 // Add the mode descriptor
@@ -1029,13 +1858,10 @@ bool V4L2Camera::EnumFrameSizes(int pixfmt)
     return true;
 }
 
-/* enumerate frames (formats, sizes and fps)
- * args:
- * width: current selected width
- * height: current selected height
+/* enumerate frames (formats, sizes and fps) into m_AllFmts
  *
- * returns: pointer to LFormats struct containing list of available frame formats */
-bool V4L2Camera::EnumFrameFormats(const SurfaceSize& preferred)
+ * returns: true */
+bool V4L2Camera::EnumFrameFormats()
 {
     ALOGD("V4L2Camera::EnumFrameFormats");
     struct v4l2_fmtdesc fmt;
@@ -1045,22 +1871,36 @@ bool V4L2Camera::EnumFrameFormats(const SurfaceSize& preferred)
 
     memset(&fmt, 0, sizeof(fmt));
     fmt.index = 0;
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.type = videoIn->type;
 
-    while (ioctl(vfd,VIDIOC_ENUM_FMT, &fmt) >= 0) {
+    while (xioctl(VIDIOC_ENUM_FMT, &fmt) >= 0) {
         fmt.index++;
         ALOGD("{ pixelformat = '%c%c%c%c', description = '%s' }",
                 fmt.pixelformat & 0xFF, (fmt.pixelformat >> 8) & 0xFF,
                 (fmt.pixelformat >> 16) & 0xFF, (fmt.pixelformat >> 24) & 0xFF,
                 fmt.description);
 
+        // Its sizes can't be previewed, only recorded in passthrough mode
+        if (isCompressedVideo(fmt.pixelformat)) {
+            ALOGD("  compressed video, only for recording");
+            continue;
+        }
+
         //enumerate frame sizes for this pixel format
         if (!EnumFrameSizes(fmt.pixelformat)) {
             ALOGE("  Unable to enumerate frame sizes.");
         }
     };
 
-    // Now, select the best preview format and the best PictureFormat
+    return true;
+}
+
+/* select the best preview format and the best picture format from m_AllFmts
+ * args:
+ * preferred: the size to use if there is a mode of it, or 0x0
+ */
+void V4L2Camera::SelectBestFormats(const SurfaceSize& preferred)
+{
     m_BestPreviewFmt = SurfaceDesc();
     m_BestPictureFmt = SurfaceDesc();
 
@@ -1115,8 +1955,6 @@ bool V4L2Camera::EnumFrameFormats(const SurfaceSize& preferred)
             }
         }
     }
-
-    return true;
 }
 
 SortedVector<SurfaceSize> V4L2Camera::getAvailableSizes() const
@@ -9,7 +9,8 @@
 #ifndef _V4L2CAMERA_H
 #define _V4L2CAMERA_H
 
-#define NB_BUFFER 4
+#define NB_BUFFER 4                         // V4L2 buffers, unless camera.cfg says otherwise
+#define MAX_BUFFERS 8                       // the most V4L2 buffers we ask for
 
 #include <binder/MemoryBase.h>
 #include <binder/MemoryHeapBase.h>
@@ -21,6 +22,12 @@
 #include "uvc_compat.h"
 #include "CameraSpec.h"
 #include "SurfaceDesc.h"
+#include "MjpegDecoder.h"
+#include "LatencyHistogram.h"
+#include "FormatTraits.h"
+#include "Converter.h"
+#include "FrameFile.h"
+#include "FrameReplay.h"
 
 namespace android {
 //======================================================================
@@ -29,13 +36,21 @@ static const int MaxPreviewWidth = 1920;    // a hack for certain cameras
 
 struct vdIn {
     struct v4l2_capability cap;
-    struct v4l2_format format;              // Capture format being used
+    struct v4l2_format format;              // Capture format being used, always as a single-planar one
     struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES]; // of buf, with the multi-planar API
     struct v4l2_requestbuffers rb;
     struct v4l2_streamparm params;          // v4l2 stream parameters struct
     struct v4l2_jpegcompression jpegcomp;   // v4l2 jpeg compression settings
 
-    void *mem[NB_BUFFER];
+    void *mem[MAX_BUFFERS][VIDEO_MAX_PLANES];
+    size_t memLength[MAX_BUFFERS][VIDEO_MAX_PLANES];    // of each mmapped plane
+    int dmabuf[MAX_BUFFERS][VIDEO_MAX_PLANES];          // each mmapped plane exported, or -1
+    int bufCount;                           // buffers the driver gave us, in mem
+    int memory;                             // V4L2_MEMORY_* of the buffers in mem
+    uint32_t type;                          // V4L2_BUF_TYPE_VIDEO_CAPTURE or _MPLANE
+    int planeCount;                         // memory planes of each buffer
+    int planeStride[VIDEO_MAX_PLANES];      // bytes per line of each
     bool isStreaming;
 
     void* tmpBuffer;
@@ -49,6 +64,24 @@ struct vdIn {
 };
 
 
+/*  What the driver told about a captured frame */
+struct FrameInfo {
+    nsecs_t  timestamp;                     // SYSTEM_TIME_MONOTONIC time of the capture
+    uint32_t sequence;                      // counted by the driver from STREAMON
+    uint32_t dropped;                       // frames the driver lost just before this one
+};
+
+
+/*  A memory plane of a captured frame */
+struct FramePlane {
+    uint8_t* data;                          // where the CPU can read it
+    int      fd;                            // the dma-buf it was exported as, or -1
+    size_t   offset;                        // of data in the dma-buf
+    size_t   length;                        // bytes of data
+    int      stride;                        // bytes per line
+};
+
+
 //======================================================================
 
 class V4L2Camera {
@@ -60,17 +93,119 @@ public:
     int  Open(const CameraSpec& spec);
     void Close();
 
-    int  Init(int width, int height, int fps);
+    /*  heldFrames is how many more buffers than usual to ask the driver
+        for, so that it is not short of them while frames are held with
+        HoldFrame()
+    */
+    int  Init(int width, int height, int fps, int heldFrames = 0);
     void Uninit();
 
     int StartStreaming ();
     int StopStreaming ();
 
-    /*  @return NO_ERROR  - a frame has been copied
+    /*  info, if given, gets the timestamp and sequence of the frame. The
+        timestamp is when the driver captured it if the driver keeps a
+        monotonic clock, else when it was dequeued.
+        @return NO_ERROR  - a frame has been copied
                 TIMED_OUT - no data is available
-                UNKNOWN_ERROR - some I/O error
+                WOULD_BLOCK - Interrupt() was called
+                DEAD_OBJECT - the camera has been unplugged
+                UNKNOWN_ERROR - some I/O error, or the source changed
+    */
+    status_t GrabRawFrame (void *frameBuffer, int maxSize, nsecs_t timeout, FrameInfo* info = NULL);
+
+    /*  GrabRawFrame() split up for callers that convert each frame to
+        several formats. AcquireFrame() waits for a frame and returns the
+        same codes and info as GrabRawFrame(). The frame stays dequeued
+        until ReleaseFrame() is called.
+    */
+    status_t AcquireFrame (nsecs_t timeout, FrameInfo* info = NULL);
+    void     ReleaseFrame ();
+
+    /*  Gives the acquired frame to another thread instead of back to the
+        driver with ReleaseFrame(). Its buffer, and the planes getFramePlanes()
+        had for it, stay out of the driver until ReturnFrame() is called with
+        the index this returns, which can be from any thread. StopStreaming()
+        takes back the frames still held, they must not be returned after it.
+    */
+    int      HoldFrame ();
+    void     ReturnFrame (int index);
+
+    /*  Makes the wait for a frame return WOULD_BLOCK at once, or the next
+        one if no thread is waiting. StartStreaming() forgets about it. This
+        is the only method that can be called from any thread.
+    */
+    void     Interrupt ();
+
+    /*  Converts the acquired frame to YUYV, as GrabRawFrame() does */
+    status_t ConvertFrame (void *frameBuffer, int maxSize);
+
+    /*  Converts the top left width x height pixels of the acquired frame
+        straight to one of the CONV_DST_* formats, without going through YUYV.
+        @return NO_ERROR  - the frame has been converted
+                INVALID_OPERATION - no direct path from the capture format
+                UNKNOWN_ERROR - the frame could not be decoded
+    */
+    status_t ConvertFrameDirect (int dstFmt, uint8_t *dst, int dstStride, int dstHeight, int width, int height);
+
+    /*  Decimates the luma of the acquired frame to a width x height grey
+        picture, reading the frame as it was captured, without converting it.
+        @return NO_ERROR  - the picture has been made
+                INVALID_OPERATION - the capture format has no luma to sample,
+                                    the frame must be converted and the luma
+                                    taken from the YUYV
     */
-    status_t GrabRawFrame (void *frameBuffer, int maxSize, nsecs_t timeout);
+    status_t ConvertLuma (uint8_t *dst, int dstStride, int width, int height);
+
+    /*  Returns the acquired frame if it already is YUYV with no padding
+        or cropping, so it can be used without any conversion. Else NULL.
+    */
+    uint8_t* getYUYVFrame () const;
+
+    /*  True if the frames are YUYV with no padding or cropping */
+    bool isPlainYUYV () const;
+
+    /*  The memory planes of the acquired frame, one unless it has a buffer
+        for each of its planes, which only the multi-planar API allows.
+        The driver buffers are exported as dma-bufs when it can, so the
+        frame can be given to the GPU, an encoder or the display without a
+        copy. They are only valid until the frame is given back. The first
+        one starts at the cropped frame of getSize(). Returns how many
+        planes there are, up to VIDEO_MAX_PLANES.
+    */
+    int  getFramePlanes (FramePlane* planes) const;
+
+    /*  True if getFramePlanes() has dma-bufs for the frames */
+    bool hasExportedBuffers () const {
+        return videoIn->memory == V4L2_MEMORY_MMAP && videoIn->bufCount > 0 && videoIn->dmabuf[0][0] >= 0;
+    }
+
+    /*  The V4L2_PIX_FMT_* the frames are captured in */
+    uint32_t getPixelFormat () const { return videoIn->format.fmt.pix.pixelformat; }
+
+    /*  True if the camera only has the multi-planar API */
+    bool isMultiPlanar () const { return videoIn->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE; }
+
+    /*  Zero copy capture. UseUserBuffers() is called after Init() and before
+        StartStreaming() and replaces the mmapped driver buffers by as many
+        buffers of our own, with V4L2_MEMORY_USERPTR or V4L2_MEMORY_DMABUF.
+        Each one is then given to the driver with QueueUserBuffer(). vaddr is
+        where the frame can be read by the CPU, fd is only used for dma-bufs.
+        The acquired frame must not be given back with ReleaseFrame(), the
+        caller queues another buffer for the same index in its place.
+    */
+    status_t UseUserBuffers (int memory);
+    status_t QueueUserBuffer (int index, void* vaddr, int fd, size_t length);
+    int      getFrameIndex () const;
+
+    /*  The number of V4L2 buffers Init() got from the driver */
+    int      getBufferCount () const { return videoIn->bufCount; }
+
+    /*  The device node of the camera that was opened last */
+    const std::string& getDevice() const { return lastDevice; }
+
+    /*  Where the camera is plugged in, the same for all its device nodes */
+    const char* getBusInfo() const { return (const char*)videoIn->cap.bus_info; }
 
     void getSize(int& width, int& height) const;
     int  getFps() const;
@@ -80,27 +215,82 @@ public:
     const SurfaceDesc& getBestPreviewFmt() const;
     const SurfaceDesc& getBestPictureFmt() const;
 
+    /*  Appends the time spent waiting for, dequeueing and converting the
+        frames to out, for dumpCamera(). Neither needs the camera to be
+        stopped.
+    */
+    void dumpStats(String8& out) const;
+    void resetStats();
+
+    /*  The frames missing from the driver sequence since resetStats() */
+    uint64_t getDroppedFrames() const { return mDriverDropped.load(std::memory_order_relaxed); }
+
+    /*  The frames given back unused in low latency mode since resetStats() */
+    uint64_t getStaleFrames() const { return mStaleFrames.load(std::memory_order_relaxed); }
+    bool     isLowLatency() const { return lowLatency; }
+
 private:
     bool tryDevices(const CameraSpec& spec);
+    bool openReplay(const CameraSpec& spec);
     bool tryOneDevice(const std::string& device);
+    bool hasRawFormat() const;
     bool EnumFrameIntervals(int pixfmt, int width, int height);
     bool EnumFrameSizes(int pixfmt);
-    bool EnumFrameFormats(const SurfaceSize& preferred);
+    bool EnumFrameFormats();
+    void SelectBestFormats(const SurfaceSize& preferred);
+    int      xioctl(unsigned long request, void* arg) const;
+    void*    xmmap(size_t length, off_t offset);
+    int      xmunmap(void* mem, size_t length);
+    int      formatIoctl(unsigned long request, struct v4l2_format& fmt);
+    void     initBuf(struct v4l2_buffer& buf, struct v4l2_plane* planes, int index) const;
+    void     exportBuffer(int index);
+    uint8_t* frameData(int plane = 0) const;
+    uint32_t frameBytesUsed() const;
+    void     frameYuvPlanes(struct yuv420_planes& planes) const;
     status_t dequeueBuf(nsecs_t timeout);
     status_t enqueueBuf();
+    bool     frameWaiting() const;
+    status_t dequeueEvents();
+    void freeBuffers();
+    void startRecording();
+    bool fallBackToBuiltinDecoder();
+    LatencyHistogram& convertStats();
 
     int saveYUYVtoJPEG(uint8_t* src, uint8_t* dst, int maxsize, int width, int height, int quality);
 
 private:
     std::string  lastDevice;
-    bool         haveEnumerated;
+    std::string  deviceKey;                     // FormatCache key of the modes in m_AllFmts
     struct vdIn* videoIn;
-    int          vfd;
+    int          vfd;                           // the device, or the fd() of replay
+    FrameReplay* replay;                        // the capture file played instead of a device, or NULL
+    int          wakeFd;                        // eventfd for Interrupt()
+    int          mjpegBackend;                  // CameraSpec::MJPEG_*
+    int          bufferCount;                   // V4L2 buffers to ask for
+    bool         lowLatency;                    // only hand out the newest frame
+    std::string  recordFile;                    // to record each stream into, if not empty
+    size_t       recordLimit;                   // bytes it may take
+    FrameFileWriter mRecorder;                  // open while a stream is recorded
+    MjpegDecoder* mjpegDecoder;                 // kept for as long as we are
+    const CaptureFormat* mFormat;               // of the capture format, set by Init()
+    direct_converter mDirect;                   // for the capture format, or NULL
 
     SortedVector<SurfaceDesc> m_AllFmts;        // Available video modes
     SurfaceDesc m_BestPreviewFmt;               // Best preview mode. maximum fps with biggest frame
     SurfaceDesc m_BestPictureFmt;               // Best picture format. maximum size
 
+    FrameInfo    mFrameInfo;                    // of the frame dequeued last
+    bool         mHaveSequence;                 // false until the first frame after STREAMON
+
+    // Only updated by the thread taking the frames
+    static const int kConvertStats = 6;
+    std::atomic<uint64_t> mDriverDropped;
+    std::atomic<uint64_t> mStaleFrames;
+    LatencyHistogram mDriverLatency;
+    LatencyHistogram mPollTime;
+    LatencyHistogram mDqbufTime;
+    uint32_t         mConvertFourcc[kConvertStats]; // capture format of each mConvertTime, 0 for none
+    LatencyHistogram mConvertTime[kConvertStats];   // conversion or decoding of each frame
 };
 
 //======================================================================
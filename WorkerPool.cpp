@@ -0,0 +1,160 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#define LOG_TAG "WorkerPool"
+
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include "WorkerPool.h"
+
+namespace android {
+//======================================================================
+
+WorkerPool::Worker::Worker(WorkerPool* pool, int index) :
+        Thread(false),
+        mPool(pool),
+        mIndex(index)
+{
+}
+
+
+
+bool WorkerPool::Worker::threadLoop()
+{
+    unsigned generation = 0;
+    bool     working    = false;
+
+    while (mPool->waitForWork(generation, working)) {
+        mPool->work(mIndex);
+    }
+
+    return false;
+}
+
+
+
+WorkerPool::WorkerPool(int threads)
+  : mJob(NULL),
+    mCount(0),
+    mNext(0),
+    mGeneration(0),
+    mBusy(0),
+    mExit(false)
+{
+    for (int i = 1; i < threads; i++) {
+        sp<Worker> w = new Worker(this, i);
+
+        if (w->run("CameraWorker", PRIORITY_URGENT_DISPLAY) != NO_ERROR) {
+            ALOGE("WorkerPool: cannot start worker %d", i);
+            break;
+        }
+
+        mWorkers.push_back(w);
+    }
+
+    ALOGD("WorkerPool: %d threads", size());
+}
+
+
+
+WorkerPool::~WorkerPool()
+{
+    {
+        Mutex::Autolock lock(mLock);
+        mExit = true;
+        mWork.broadcast();
+    }
+
+    for (auto& w : mWorkers) {
+        w->requestExitAndWait();
+    }
+}
+
+
+
+int WorkerPool::cpuCount(int max)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) {
+        n = 1;
+    }
+
+    return (n < max) ? (int)n : max;
+}
+
+
+
+void WorkerPool::run(int count, const Job& job)
+{
+    if (mWorkers.empty() || count <= 1) {
+        for (int i = 0; i < count; i++) {
+            job(i, 0);
+        }
+        return;
+    }
+
+    {
+        Mutex::Autolock lock(mLock);
+        mJob   = &job;
+        mCount = count;
+        mNext  = 0;
+        mBusy  = (int)mWorkers.size();
+        mGeneration++;
+        mWork.broadcast();
+    }
+
+    // Take our share
+    work(0);
+
+    Mutex::Autolock lock(mLock);
+    while (mBusy > 0) {
+        mDone.wait(mLock);
+    }
+    mJob = NULL;
+}
+
+
+
+bool WorkerPool::waitForWork(unsigned& generation, bool& working)
+{
+    Mutex::Autolock lock(mLock);
+
+    // Tell run() we are done with the last job
+    if (working && --mBusy == 0) {
+        mDone.signal();
+    }
+    working = false;
+
+    while (generation == mGeneration && !mExit) {
+        mWork.wait(mLock);
+    }
+
+    generation = mGeneration;
+    working = !mExit;
+    return working;
+}
+
+
+
+void WorkerPool::work(int worker)
+{
+    for (;;) {
+        int index = mNext.fetch_add(1);
+
+        if (index >= mCount) {
+            break;
+        }
+
+        (*mJob)(index, worker);
+    }
+}
+
+//======================================================================
+}; // namespace android
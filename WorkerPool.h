@@ -0,0 +1,73 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <utils/threads.h>
+
+namespace android {
+//======================================================================
+
+/*  A few threads that share out the parts of a job with the caller.
+
+    run() calls job(index, worker) once for each index in [0, count). The
+    worker is 0 for the calling thread and 1 .. size()-1 for the others, so
+    the job can keep some scratch memory per worker. run() returns when all
+    the parts are done. Only one thread may call run() at a time.
+*/
+class WorkerPool
+{
+public:
+    typedef std::function<void(int index, int worker)> Job;
+
+    /*  threads counts the caller, so 1 makes no threads at all */
+    explicit WorkerPool(int threads);
+    ~WorkerPool();
+
+    int  size() const { return (int)mWorkers.size() + 1; }
+    void run(int count, const Job& job);
+
+    /*  The number of online CPUs, capped to max */
+    static int cpuCount(int max);
+
+private:
+    class Worker : public Thread
+    {
+        WorkerPool* mPool;
+        int         mIndex;
+
+    public:
+        Worker(WorkerPool* pool, int index);
+        virtual bool threadLoop();
+    };
+
+    void work(int worker);
+    bool waitForWork(unsigned& generation, bool& working);
+
+    std::vector< sp<Worker> > mWorkers;
+
+    const Job*          mJob;
+    int                 mCount;
+    std::atomic<int>    mNext;
+
+    Mutex               mLock;
+    Condition           mWork;
+    Condition           mDone;
+    unsigned            mGeneration;        // protected by mLock
+    int                 mBusy;              // protected by mLock
+    bool                mExit;              // protected by mLock
+};
+
+//======================================================================
+}; // namespace android
+
+#endif
@@ -0,0 +1,545 @@
+/*
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ */
+
+/*  Times the frame converters, the JPEG encoder and the builtin MJPEG
+    decoder away from any camera, for every SIMD backend the CPU has and
+    several thread counts. Each result is also compared to the one of the
+    plain C converters on one thread, which must be byte for byte the same.
+
+    converter_bench [-s SIZES] [-f FILTER] [-t SECONDS] [-T THREADS] [-r WxH:FILE]... [-p FILE]...
+        -s  comma separated sizes, 480p 720p 1080p 5mp or WxH. Defaults to all four
+            and 637x479, which no vector loop fits, for the tails behind them
+        -f  only run the converters whose name contains FILTER
+        -t  how long to run each measurement, 0.2 s by default
+        -T  comma separated thread counts, 1,2,4 by default
+        -r  a recorded frame to use instead of the synthetic one for its size.
+            .jpg and .mjpg files are MJPEG frames, the others raw YUYV
+        -p  a capture file recorded with the record line of camera.cfg. Its
+            frames, in whatever format the camera sent, are converted one
+            after the other as the capture thread of the HAL does, to YUYV
+            and on to RGB for the preview window. Its size is added if it
+            is not one of the sizes
+
+    The MB/s count the bytes read, which for the decoders and the capture
+    files is the size of the compressed or captured frame. The sizes of recorded frames are starred.
+    Exits with 1 if any result differs from the C one.
+*/
+
+#define LOG_TAG "ConverterBench"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <utils/Timers.h>
+
+#include <deque>
+
+#include "Converter.h"
+#include "FormatTraits.h"
+#include "FrameFile.h"
+#include "Utils.h"
+#include "WorkerPool.h"
+
+using namespace std;
+using namespace android;
+
+namespace {
+
+/*  The frames of one size. src holds the input of any converter and dst
+    is big enough for any output.
+*/
+struct Frames {
+    int             width;
+    int             height;
+    vector<uint8_t> yuyv;
+    vector<uint8_t> src;
+    vector<uint8_t> dst;
+    vector<uint8_t> jpeg;
+    bool            recordedYUYV = false;
+    bool            recordedJpeg = false;
+    const FrameFileReader* replay = NULL;  // a capture file of this size, if any
+};
+
+struct Run {
+    Frames&             f;
+    utils::jpeg_decoder* decoder;  // with the thread count being measured
+    size_t              next;       // the frame of the capture file to convert next
+    int                 size;       // of the JPEG, for the encoder
+};
+
+struct Case {
+    const char* name;
+    double      srcBytesPerPixel;    // for the MB/s
+    bool        fromYUYV;           // the input is the YUYV frame, else random bytes
+    void        (*run)(Run& r);
+};
+
+#define W   r.f.width
+#define H   r.f.height
+#define SRC r.f.src.data()
+#define DST r.f.dst.data()
+
+// The rgb converters with the BT.709 limited range tables, through a
+// scaler that has nothing to scale
+void bt709(Run& r, int dstFmt, int bytesPerPixel)
+{
+    static struct yuyv_scaler* scaler = NULL;
+
+    if (scaler == NULL) {
+        scaler = yuyv_scaler_create();
+        yuyv_scaler_set_colorspace(scaler, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+    }
+    yuyv_scaler_run(scaler, dstFmt, DST, W * bytesPerPixel, H, W, H, SRC, W * 2, W, H);
+}
+
+// The next frame of the capture file to YUYV, as V4L2Camera converts it
+void replayFrame(Run& r, uint8_t* yuyv)
+{
+    const FrameFileReader& file = *r.f.replay;
+    size_t i = r.next++ % file.count();
+    const CaptureFormat* fmt = findCaptureFormat(file.header().fourcc);
+
+    if (fmt->layout == LAYOUT_COMPRESSED) {
+        utils::jpeg_decoder_decode(r.decoder, yuyv, W * 2, file.data(i), W, H);
+    } else {
+        fmt->toYUYV(yuyv, W * 2, file.data(i), file.header().bytesperline, W, H);
+    }
+}
+
+// The ones to YUYV write W * 2 bytes lines, the others get W bytes per
+// pixel lines, which fits all of them. yuyv_to_bgr24 has always written 4
+// bytes a pixel, so it gets the lines of the 32 bit ones.
+const Case kCases[] = {
+    { "yuyv_to_yvu420sp", 2, true, [](Run& r) { yuyv_to_yvu420sp(DST, W, H, SRC, W * 2, W, H); } },
+    { "yuyv_to_yvu420p",  2, true, [](Run& r) { yuyv_to_yvu420p(DST, W, H, SRC, W * 2, W, H); } },
+    { "yuyv_to_yuv420p",  2, true, [](Run& r) { yuyv_to_yuv420p(DST, W, H, SRC, W * 2, W, H); } },
+    { "yuyv_to_yvu422p",  2, true, [](Run& r) { yuyv_to_yvu422p(DST, W, H, SRC, W * 2, W, H); } },
+    { "yuyv_to_rgb565",   2, true, [](Run& r) { yuyv_to_rgb565(SRC, W * 2, DST, W * 2, W, H); } },
+    { "yuyv_to_rgb24",    2, true, [](Run& r) { yuyv_to_rgb24(SRC, W * 2, DST, W * 3, W, H); } },
+    { "yuyv_to_rgb32",    2, true, [](Run& r) { yuyv_to_rgb32(SRC, W * 2, DST, W * 4, W, H); } },
+    { "yuyv_to_bgr24",    2, true, [](Run& r) { yuyv_to_bgr24(SRC, W * 2, DST, W * 4, W, H); } },
+    { "yuyv_to_bgr32",    2, true, [](Run& r) { yuyv_to_bgr32(SRC, W * 2, DST, W * 4, W, H); } },
+    { "yuyv_to_rgb565_709", 2, true, [](Run& r) { bt709(r, SCALE_DST_RGB565, 2); } },
+    { "yuyv_to_rgb32_709", 2, true, [](Run& r) { bt709(r, SCALE_DST_RGB32, 4); } },
+    { "yuv420_to_yuyv",   1.5, false, [](Run& r) { yuv420_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "yvu420_to_yuyv",   1.5, false, [](Run& r) { yvu420_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "nv12_to_yuyv",     1.5, false, [](Run& r) { nv12_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "nv21_to_yuyv",     1.5, false, [](Run& r) { nv21_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "nv16_to_yuyv",     2, false, [](Run& r) { nv16_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "nv61_to_yuyv",     2, false, [](Run& r) { nv61_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "y16_to_yuyv",      2, false, [](Run& r) { y16_to_yuyv(DST, W * 2, SRC, W * 2, W, H); } },
+    { "yyuv_to_yuyv",     2, false, [](Run& r) { yyuv_to_yuyv(DST, W * 2, SRC, W * 2, W, H); } },
+    { "uyvy_to_yuyv",     2, false, [](Run& r) { uyvy_to_yuyv(DST, W * 2, SRC, W * 2, W, H); } },
+    { "yvyu_to_yuyv",     2, false, [](Run& r) { yvyu_to_yuyv(DST, W * 2, SRC, W * 2, W, H); } },
+    { "y41p_to_yuyv",     1.5, false, [](Run& r) { y41p_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "grey_to_yuyv",     1, false, [](Run& r) { grey_to_yuyv(DST, W * 2, SRC, W, W, H); } },
+    { "s501_to_yuyv",     1.5, false, [](Run& r) { s501_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "s505_to_yuyv",     1.5, false, [](Run& r) { s505_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "s508_to_yuyv",     1.5, false, [](Run& r) { s508_to_yuyv(DST, W * 2, SRC, W, H); } },
+    { "bayer_to_rgb24",   1, false, [](Run& r) { bayer_to_rgb24(SRC, DST, W, H, 0); } },
+    { "bayer_to_yuyv",    1, false, [](Run& r) { bayer_to_yuyv(DST, W * 2, SRC, W, W, H, 0); } },
+    { "rgb_to_yuyv",      3, false, [](Run& r) { rgb_to_yuyv(DST, W * 2, SRC, W * 3, W, H); } },
+    { "bgr_to_yuyv",      3, false, [](Run& r) { bgr_to_yuyv(DST, W * 2, SRC, W * 3, W, H); } },
+    { "yuyv_scale_half",  2, true, [](Run& r) { yuyv_scale(DST, W, W / 2, H / 2, SRC, W * 2, W, H); } },
+    { "yuyv_luma_320x240", 2, false, [](Run& r) { luma_decimate(DST, 320, 320, 240, SRC, W * 2, W, H, 2); } },
+    { "yuyv_to_jpeg",     2, true, [](Run& r) { r.size = yuyv_to_jpeg(SRC, DST, r.f.dst.size(), W, H, W * 2, 80); } },
+    { "jpeg_decode",      0, false, [](Run& r) {
+        utils::jpeg_decoder_decode(r.decoder, DST, W * 2, r.f.jpeg.data(), W, H);
+    } },
+    { "jpeg_decode_yuv420", 0, false, [](Run& r) {
+        struct yuv420_planes p;
+        yuv420_planes_init(&p, CONV_DST_YVU420SP, DST, W, H);
+        utils::jpeg_decoder_decode_yuv420(r.decoder, &p, W, H, r.f.jpeg.data(), W, H);
+    } },
+    { "replay_to_yuyv",   0, false, [](Run& r) { replayFrame(r, DST); } },
+    { "replay_to_rgb32",  0, false, [](Run& r) {
+        replayFrame(r, SRC);
+        yuyv_to_rgb32(SRC, W * 2, DST, W * 4, W, H);
+    } },
+};
+
+#undef W
+#undef H
+#undef SRC
+#undef DST
+
+bool isJpegCase(const Case& c)
+{
+    return strncmp(c.name, "jpeg_decode", 11) == 0;
+}
+
+bool isReplayCase(const Case& c)
+{
+    return strncmp(c.name, "replay_", 7) == 0;
+}
+
+bool isCompressedReplay(const Frames& f)
+{
+    return f.replay != NULL && findCaptureFormat(f.replay->header().fourcc)->layout == LAYOUT_COMPRESSED;
+}
+
+
+
+/*  Smooth gradients with some noise, so that the JPEG frames are about
+    the size a camera makes
+*/
+void makeSyntheticYUYV(Frames& f)
+{
+    f.yuyv.resize((size_t)f.width * f.height * 2);
+    uint32_t seed = 1;
+
+    for (int y = 0; y < f.height; y++) {
+        uint8_t* p = &f.yuyv[(size_t)y * f.width * 2];
+        for (int x = 0; x < f.width; x += 2) {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) & 15;
+            p[0] = (x * 255 / f.width + noise) & 0xff;
+            p[1] = (y * 255 / f.height) & 0xff;
+            p[2] = (x * 255 / f.width + (noise >> 1)) & 0xff;
+            p[3] = ((x + y) * 127 / (f.width + f.height) + 64) & 0xff;
+            p += 4;
+        }
+    }
+}
+
+
+
+bool parseSize(const string& s, int& w, int& h)
+{
+    if (s == "480p") { w = 640;  h = 480;  return true; }
+    if (s == "720p") { w = 1280; h = 720;  return true; }
+    if (s == "1080p") { w = 1920; h = 1080; return true; }
+    if (s == "5mp")  { w = 2592; h = 1944; return true; }
+    return sscanf(s.c_str(), "%dx%d", &w, &h) == 2 && w > 0 && h > 0;
+}
+
+
+
+vector<string> splitCommas(const string& s)
+{
+    vector<string> out;
+    size_t start = 0;
+
+    while (start <= s.size()) {
+        size_t end = s.find(',', start);
+        if (end == string::npos) {
+            end = s.size();
+        }
+        if (end > start) {
+            out.push_back(s.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return out;
+}
+
+
+
+/*  utils::readFile() is for text, this reads the whole of a binary file */
+bool readFrame(const string& path, vector<uint8_t>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        return false;
+    }
+
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+
+    bool ok = !ferror(f) && !data.empty();
+    fclose(f);
+    return ok;
+}
+
+
+
+bool loadRecorded(const string& arg, vector<Frames>& frames)
+{
+    size_t colon = arg.find(':');
+    int w, h;
+
+    if (colon == string::npos || !parseSize(arg.substr(0, colon), w, h)) {
+        fprintf(stderr, "bad recorded frame '%s', it should be WxH:FILE\n", arg.c_str());
+        return false;
+    }
+
+    string path = arg.substr(colon + 1);
+    vector<uint8_t> data;
+    if (!readFrame(path, data)) {
+        fprintf(stderr, "cannot read %s\n", path.c_str());
+        return false;
+    }
+
+    for (auto& f : frames) {
+        if (f.width != w || f.height != h) {
+            continue;
+        }
+
+        bool jpeg = path.size() > 4 && (path.compare(path.size() - 4, 4, ".jpg") == 0 ||
+                                        (path.size() > 5 && path.compare(path.size() - 5, 5, ".mjpg") == 0));
+        if (jpeg) {
+            f.jpeg.swap(data);
+            f.recordedJpeg = true;
+        } else if (data.size() >= f.yuyv.size()) {
+            memcpy(f.yuyv.data(), data.data(), f.yuyv.size());
+            f.recordedYUYV = true;
+        } else {
+            fprintf(stderr, "%s is too small for a %dx%d YUYV frame\n", path.c_str(), w, h);
+            return false;
+        }
+        return true;
+    }
+
+    fprintf(stderr, "%s is for %dx%d, which is not one of the sizes\n", path.c_str(), w, h);
+    return false;
+}
+
+
+
+bool loadReplay(const string& path, vector<Frames>& frames, deque<FrameFileReader>& files)
+{
+    files.emplace_back();
+    FrameFileReader& file = files.back();
+
+    if (file.open(path) != NO_ERROR) {
+        fprintf(stderr, "cannot read the capture file %s\n", path.c_str());
+        return false;
+    }
+
+    const FrameFileHeader& h = file.header();
+    const CaptureFormat* fmt = findCaptureFormat(h.fourcc);
+    if (fmt == NULL || (fmt->toYUYV == NULL && fmt->layout != LAYOUT_COMPRESSED)) {
+        fprintf(stderr, "%s has frames in '%.4s', which can't be converted\n", path.c_str(), (const char*)&h.fourcc);
+        return false;
+    }
+
+    for (auto& f : frames) {
+        if (f.width == (int)h.width && f.height == (int)h.height) {
+            if (f.replay != NULL) {
+                fprintf(stderr, "%s is for %ux%u, which already has a capture file\n", path.c_str(), h.width, h.height);
+                return false;
+            }
+            f.replay = &file;
+            return true;
+        }
+    }
+
+    Frames f;
+    f.width = h.width;
+    f.height = h.height;
+    makeSyntheticYUYV(f);
+    f.replay = &file;
+    frames.push_back(f);
+    return true;
+}
+
+
+
+/*  Runs c until seconds have passed, and at least 3 times. Returns the
+    time of one run.
+*/
+nsecs_t measure(const Case& c, Run& r, double seconds)
+{
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t end = start + (nsecs_t)(seconds * 1e9);
+    nsecs_t now;
+    int runs = 0;
+
+    do {
+        c.run(r);
+        runs++;
+        now = systemTime(SYSTEM_TIME_MONOTONIC);
+    } while (runs < 3 || now < end);
+
+    return (now - start) / runs;
+}
+
+} // namespace
+
+
+
+int main(int argc, char** argv)
+{
+    vector<string> sizes = { "480p", "720p", "1080p", "5mp", "637x479" };
+    vector<int> threadCounts = { 1, 2, 4 };
+    vector<string> recorded;
+    vector<string> replays;
+    const char* filter = NULL;
+    double seconds = 0.2;
+
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        bool more = i + 1 < argc;
+
+        if (a == "-s" && more) {
+            sizes = splitCommas(argv[++i]);
+        } else if (a == "-f" && more) {
+            filter = argv[++i];
+        } else if (a == "-t" && more) {
+            seconds = atof(argv[++i]);
+        } else if (a == "-T" && more) {
+            threadCounts.clear();
+            for (auto& t : splitCommas(argv[++i])) {
+                if (atoi(t.c_str()) > 0) {
+                    threadCounts.push_back(atoi(t.c_str()));
+                }
+            }
+        } else if (a == "-r" && more) {
+            recorded.push_back(argv[++i]);
+        } else if (a == "-p" && more) {
+            replays.push_back(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [-s SIZES] [-f FILTER] [-t SECONDS] [-T THREADS] [-r WxH:FILE]... [-p FILE]...\n", argv[0]);
+            return 2;
+        }
+    }
+
+    vector<Frames> frames;
+    for (auto& s : sizes) {
+        Frames f;
+        if (!parseSize(s, f.width, f.height)) {
+            fprintf(stderr, "bad size '%s'\n", s.c_str());
+            return 2;
+        }
+        makeSyntheticYUYV(f);
+        frames.push_back(f);
+    }
+
+    for (auto& r : recorded) {
+        if (!loadRecorded(r, frames)) {
+            return 2;
+        }
+    }
+
+    deque<FrameFileReader> files;
+    for (auto& p : replays) {
+        if (!loadReplay(p, frames, files)) {
+            return 2;
+        }
+    }
+
+    vector<int> backends;
+    for (int b = CONVERTER_C; b <= CONVERTER_AVX2; b++) {
+        if (converter_set_backend(b) == 0) {
+            backends.push_back(b);
+        }
+    }
+
+    printf("%d CPUs\n", WorkerPool::cpuCount(64));
+    printf("%-10s %-20s %-5s %7s %10s %9s %8s  %s\n",
+           "size", "converter", "simd", "threads", "ms/frame", "MB/s", "ns/px", "exact");
+
+    int mismatches = 0;
+
+    for (auto& f : frames) {
+        size_t pixels = (size_t)f.width * f.height;
+        vector<uint8_t> random(pixels * 4);
+        uint32_t seed = 7;
+
+        for (auto& b : random) {
+            seed = seed * 1103515245 + 12345;
+            b = seed >> 24;
+        }
+
+        f.dst.resize(pixels * 4 + 4096);
+
+        if (!f.recordedJpeg) {
+            f.jpeg.resize(pixels * 2);
+            int size = yuyv_to_jpeg(f.yuyv.data(), f.jpeg.data(), f.jpeg.size(), f.width, f.height, f.width * 2, 80);
+            f.jpeg.resize(size > 0 ? size : 0);
+        }
+
+        char sizeName[32];
+        snprintf(sizeName, sizeof(sizeName), "%dx%d%s", f.width, f.height,
+                 f.recordedYUYV || f.recordedJpeg || f.replay != NULL ? "*" : "");
+
+        for (auto& c : kCases) {
+            if (filter != NULL && strstr(c.name, filter) == NULL) {
+                continue;
+            }
+            if (isJpegCase(c) && f.jpeg.empty()) {
+                continue;
+            }
+            if (isReplayCase(c) && f.replay == NULL) {
+                continue;
+            }
+
+            const vector<uint8_t>& input = c.fromYUYV ? f.yuyv : random;
+            f.src.assign(input.begin(), input.end());
+            f.src.resize(pixels * 4);
+
+            // The input of the decoders is the compressed frame, and that
+            // of the capture files their frames as captured
+            double srcBytes = isJpegCase(c) ? f.jpeg.size() : c.srcBytesPerPixel * pixels;
+            if (isReplayCase(c)) {
+                srcBytes = 0;
+                for (size_t i = 0; i < f.replay->count(); i++) {
+                    srcBytes += f.replay->record(i).bytesused;
+                }
+                srcBytes /= f.replay->count();
+            }
+            bool decodes = isJpegCase(c) || (isReplayCase(c) && isCompressedReplay(f));
+            vector<uint8_t> reference;
+
+            for (int b : backends) {
+                converter_set_backend(b);
+
+                for (int t : threadCounts) {
+                    converter_set_threads(t);
+                    Run r = { f, decodes ? utils::jpeg_decoder_create(t) : NULL, 0, -1 };
+
+                    memset(f.dst.data(), 0, f.dst.size());
+                    nsecs_t time = measure(c, r, seconds);
+
+                    // Which frame a capture file was left at depends on the
+                    // runs, the first one is compared
+                    if (isReplayCase(c)) {
+                        r.next = 0;
+                        c.run(r);
+                    }
+
+                    // The encoder in stripes leaves its working in the rest
+                    if (r.size >= 0) {
+                        memset(f.dst.data() + r.size, 0, f.dst.size() - r.size);
+                    }
+
+                    const char* exact = "ref";
+                    if (reference.empty()) {
+                        reference = f.dst;
+                    } else if (f.dst == reference) {
+                        exact = "yes";
+                    } else {
+                        exact = "NO";
+                        mismatches++;
+                    }
+
+                    printf("%-10s %-20s %-5s %7d %10.3f %9.1f %8.2f  %s\n",
+                           sizeName, c.name, converter_backend_name(b), converter_get_threads(),
+                           time / 1e6, srcBytes / (time / 1e9) / 1e6, (double)time / pixels, exact);
+
+                    if (r.decoder != NULL) {
+                        utils::jpeg_decoder_destroy(r.decoder);
+                    }
+                }
+            }
+        }
+    }
+
+    converter_set_threads(1);
+
+    if (mismatches != 0) {
+        printf("%d results differ from the C converters\n", mismatches);
+        return 1;
+    }
+    return 0;
+}
@@ -122,4 +122,51 @@ struct v4l2_frmivalenum {
 #define VIDIOC_ENUM_FRAMEINTERVALS	_IOWR('V', 75, struct v4l2_frmivalenum)
 #endif
 
+#ifndef V4L2_MEMORY_DMABUF
+
+/*
+ * Importing buffers as dma-buf file descriptors
+ *
+ * Included in Linux 3.8
+ */
+#define V4L2_MEMORY_DMABUF		4
+#endif
+
+#ifndef V4L2_CAP_VIDEO_M2M
+
+/*
+ * Memory to memory devices, such as hardware codecs
+ *
+ * Included in Linux 3.3
+ */
+#define V4L2_CAP_VIDEO_M2M_MPLANE	0x00004000
+#define V4L2_CAP_VIDEO_M2M		0x00008000
+#endif
+
+#ifndef V4L2_CAP_DEVICE_CAPS
+#define V4L2_CAP_DEVICE_CAPS		0x80000000
+#endif
+
+#ifndef V4L2_EVENT_SOURCE_CHANGE
+
+/*
+ * The resolution or standard of the input changed
+ *
+ * Included in Linux 3.16
+ */
+#define V4L2_EVENT_SOURCE_CHANGE	5
+#endif
+
+#ifndef V4L2_BUF_FLAG_TIMESTAMP_MASK
+
+/*
+ * The clock the buffer timestamps are taken from
+ *
+ * Included in Linux 3.9
+ */
+#define V4L2_BUF_FLAG_TIMESTAMP_MASK		0x0000e000
+#define V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN		0x00000000
+#define V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC	0x00002000
+#endif
+
 #endif /* _UVC_COMPAT_H */
@@ -93,6 +93,23 @@
 #define V4L2_PIX_FMT_NV61  v4l2_fourcc('N','V','6','1')   /* YUV 4:2:2 Planar (v/u) interleaved */
 #endif
 
+/* The same, with a buffer for each plane. Only through the multi-planar API */
+#ifndef V4L2_PIX_FMT_NV12M
+#define V4L2_PIX_FMT_NV12M   v4l2_fourcc('N','M','1','2')   /* NV12 with its Y and UV planes apart */
+#endif
+
+#ifndef V4L2_PIX_FMT_NV21M
+#define V4L2_PIX_FMT_NV21M   v4l2_fourcc('N','M','2','1')   /* NV21 with its Y and VU planes apart */
+#endif
+
+#ifndef V4L2_PIX_FMT_YUV420M
+#define V4L2_PIX_FMT_YUV420M v4l2_fourcc('Y','M','1','2')   /* YUV420 with its 3 planes apart */
+#endif
+
+#ifndef V4L2_PIX_FMT_YVU420M
+#define V4L2_PIX_FMT_YVU420M v4l2_fourcc('Y','M','2','1')   /* YVU420 with its 3 planes apart */
+#endif
+
 #ifndef V4L2_PIX_FMT_Y41P
 #define V4L2_PIX_FMT_Y41P  v4l2_fourcc('Y','4','1','P')    /* YUV 4:1:1          */
 #endif
@@ -141,4 +158,13 @@
 #define V4L2_PIX_FMT_RGB24   v4l2_fourcc('R', 'G', 'B', '3') /* 24  RGB-8-8-8    */
 #endif
 
+/* Compressed video. Only ever recorded as it is, never decoded */
+#ifndef V4L2_PIX_FMT_H264
+#define V4L2_PIX_FMT_H264    v4l2_fourcc('H', '2', '6', '4') /* H264 with start codes */
+#endif
+
+#ifndef V4L2_PIX_FMT_HEVC
+#define V4L2_PIX_FMT_HEVC    v4l2_fourcc('H', 'E', 'V', 'C') /* HEVC with start codes */
+#endif
+
 #endif